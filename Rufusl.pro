@@ -15,10 +15,15 @@ CONFIG += c++11 O3
 
 QMAKE_CFLAGS_WARN_ON = -Wno-sign-compare
 
-LIBS += -L/lib -lparted
+LIBS += -L/lib -lparted -lpthread -lz -llzma -lzstd -lssl -lcrypto
+
+# "qmake CONFIG+=trace" builds in the tracing, see linux/trace.h
+
+trace: DEFINES += RUFUSL_TRACE
 
 SOURCES += main.cpp\
         ui/rufuswindow.cpp \
+    log.cpp \
     ui/log.cpp \
     ui/about.cpp \
     ui/devicecombobox.cpp \
@@ -29,11 +34,30 @@ SOURCES += main.cpp\
     linux/mounting.c \
     linux/partition.c \
     linux/fat32.c \
-    iso.c
+    linux/fattree.c \
+    linux/exfat.c \
+    linux/fatcache.c \
+    linux/taskgraph.c \
+    linux/copy.c \
+    linux/ioqueue.c \
+    linux/image.c \
+    linux/http.c \
+    linux/httpcache.c \
+    linux/delta.c \
+    linux/decomp.c \
+    linux/fanout.c \
+    linux/blkdev.c \
+    linux/flush.c \
+    linux/trace.c \
+    linux/verify.c \
+    linux/sparse.c \
+    iso.c \
+    isofs.c
 
 
 HEADERS  += ui/rufuswindow.h \
     log.h \
+    ui/log.h \
     ui/about.h \
     ui/devicecombobox.h \
     rufusworker.h \
@@ -43,8 +67,26 @@ HEADERS  += ui/rufuswindow.h \
     linux/mounting.h \
     linux/partition.h \
     linux/fat32.h \
+    linux/fattree.h \
+    linux/exfat.h \
+    linux/fatcache.h \
+    linux/taskgraph.h \
+    linux/copy.h \
+    linux/ioqueue.h \
+    linux/image.h \
+    linux/http.h \
+    linux/httpcache.h \
+    linux/delta.h \
+    linux/decomp.h \
+    linux/fanout.h \
+    linux/blkdev.h \
+    linux/flush.h \
+    linux/trace.h \
+    linux/verify.h \
+    linux/sparse.h \
     definitions.h \
     iso.h \
+    isofs.h \
     rufusl.h
 
 FORMS    += ui/rufuswindow.ui \
@@ -53,3 +95,23 @@ FORMS    += ui/rufuswindow.ui \
     ui/errordialog.ui
 
 DISTFILES +=
+
+# The tools below get built with tracing when this is
+
+trace: SUB_CONFIG = CONFIG+=trace
+
+# "make bench" builds the engine benchmarks in bench/, which
+# need neither Qt nor a display
+
+bench.target = bench
+bench.commands = $(MKDIR) $$OUT_PWD/bench && cd $$OUT_PWD/bench && \
+    $$QMAKE_QMAKE $$SUB_CONFIG $$PWD/bench/bench.pro && $(MAKE)
+QMAKE_EXTRA_TARGETS += bench
+
+# "make cli" builds rufusl-cli in cli/, the same jobs from the
+# command line or queued with its daemon, with QtCore only
+
+cli.target = cli
+cli.commands = $(MKDIR) $$OUT_PWD/cli && cd $$OUT_PWD/cli && \
+    $$QMAKE_QMAKE $$SUB_CONFIG $$PWD/cli/cli.pro && $(MAKE)
+QMAKE_EXTRA_TARGETS += cli
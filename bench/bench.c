@@ -0,0 +1,822 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/loop.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "definitions.h"
+#include "linux/blkdev.h"
+#include "linux/copy.h"
+#include "linux/fat32.h"
+#include "linux/fattree.h"
+#include "linux/flush.h"
+#include "linux/image.h"
+#include "linux/mounting.h"
+#include "linux/partition.h"
+#include "iso.h"
+
+/* Runs the engines behind the GUI against a scratch device
+   and prints one JSON object per line on stdout: a header
+   describing the setup, then one line per case. Everything on
+   the device is lost. */
+
+#define BENCH_RUNS 5
+#define BENCH_RUNS_MAX 1000
+#define BENCH_TREE_MB 64
+#define BENCH_LOOP_MB 512
+#define BENCH_LABEL "BENCH"
+
+#define BENCH_DIR_FILES 100
+#define BENCH_SMALL_MIN (4 << 10)
+#define BENCH_SMALL_MAX (64 << 10)
+#define BENCH_MEDIUM_MIN (1 << 20)
+#define BENCH_MEDIUM_MAX (8 << 20)
+#define BENCH_FILL_SIZE (1 << 20)
+
+#define BENCH_LAT_OPS 4096
+#define BENCH_LAT_READ 4096
+#define BENCH_LAT_WRITE (1 << 20)
+
+typedef struct bench_io {
+  uint64_t syscr;
+  uint64_t syscw;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
+} bench_io_t;
+
+typedef struct bench {
+  const char *device;
+  const char *dir;
+  const char *tree;
+  const char *iso;
+  const char *dest;
+  const char *backend;
+  uint64_t loop_size;
+  uint64_t tree_size;
+  int runs;
+  int threads;
+  int depth;
+  int direct;
+  int zeros;
+  uint8_t cluster_size;
+
+  char device_path[PATH_MAX];
+  uint32_t device_fd;
+  uint64_t device_size;
+  char scratch[PATH_MAX];
+  char src[PATH_MAX];
+  char dst[PATH_MAX];
+  char image[PATH_MAX];
+  copy_list_t list;
+  iso_manifest_t manifest;
+  uint8_t *fill;
+} bench_t;
+
+/* prepare() runs before every run and is not timed. run()
+   says how many bytes and files one run moved, which is what
+   the rates are worked out from. */
+
+typedef struct bench_case {
+  const char *name;
+  int (*prepare)(bench_t *b);
+  int (*run)(bench_t *b, uint64_t *bytes, uint64_t *files);
+} bench_case_t;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Counters of the whole process, the worker threads of the
+   engines included */
+
+static int io_read(bench_io_t *io) {
+  char key[32];
+  unsigned long long value;
+  FILE *f = fopen("/proc/self/io", "r");
+
+  memset(io, 0, sizeof(*io));
+
+  if (f == NULL) return -1;
+
+  while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2) {
+    if (strcmp(key, "syscr") == 0) io->syscr = value;
+    if (strcmp(key, "syscw") == 0) io->syscw = value;
+    if (strcmp(key, "read_bytes") == 0) io->read_bytes = value;
+    if (strcmp(key, "write_bytes") == 0) io->write_bytes = value;
+  }
+
+  fclose(f);
+
+  return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Nearest rank on a sorted array */
+
+static double percentile(const double *sorted, int n, int p) {
+  int rank = (p * n + 99) / 100;
+
+  if (rank < 1) rank = 1;
+  if (rank > n) rank = n;
+
+  return sorted[rank - 1];
+}
+
+static void print_percentiles(double *samples, int n, double scale,
+                              const char *unit) {
+  qsort(samples, n, sizeof(double), compare_double);
+
+  printf("\"min_%s\":%.3f,\"p50_%s\":%.3f,\"p90_%s\":%.3f,"
+         "\"p99_%s\":%.3f,\"max_%s\":%.3f",
+         unit, samples[0] * scale, unit, percentile(samples, n, 50) * scale,
+         unit, percentile(samples, n, 90) * scale, unit,
+         percentile(samples, n, 99) * scale, unit, samples[n - 1] * scale);
+}
+
+static uint64_t xorshift(uint64_t *state) {
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+
+  return *state = x;
+}
+
+static uint64_t pick_size(uint64_t *state, uint64_t min, uint64_t max) {
+  return min + xorshift(state) % (max - min + 1);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type,
+                        struct FTW *ftw) {
+  (void)st;
+  (void)type;
+  (void)ftw;
+
+  if (remove(path) < 0 && errno != ENOENT) {
+    r_printf("Removing %s failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int remove_tree(const char *path) {
+  if (access(path, F_OK) < 0) return 0;
+
+  return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Every run starts out reading from the disk, not from what
+   the last run left in the page cache */
+
+static int drop_entry(const char *path, const struct stat *st, int type,
+                      struct FTW *ftw) {
+  (void)st;
+  (void)ftw;
+
+  if (type != FTW_F) return 0;
+
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return 0;
+
+  fdatasync(fd);
+  fadvise_drop(fd, 0, 0);
+  close(fd);
+
+  return 0;
+}
+
+static int drop_tree(const char *path) {
+  return nftw(path, drop_entry, 16, FTW_PHYS);
+}
+
+static int write_file(bench_t *b, const char *path, uint64_t size,
+                      uint64_t *state) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0) {
+    r_printf("Creating %s failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  /* Shift the pattern per file, so no two files are the same */
+
+  uint64_t skew = xorshift(state) % BENCH_FILL_SIZE;
+
+  while (size > 0) {
+    size_t len = BENCH_FILL_SIZE - skew;
+
+    if (len > size) len = size;
+
+    if (write(fd, b->fill + skew, len) != (ssize_t)len) {
+      r_printf("Writing %s failed: %s\n", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+    size -= len;
+    skew = 0;
+  }
+
+  close(fd);
+
+  return 0;
+}
+
+/* Directories of BENCH_DIR_FILES small files each, every
+   other one with a name that needs a long name entry */
+
+static int write_small(bench_t *b, const char *root, uint64_t budget,
+                       uint64_t *state) {
+  char path[PATH_MAX];
+  uint32_t n = 0;
+
+  while (budget > 0) {
+    uint64_t size = pick_size(state, BENCH_SMALL_MIN, BENCH_SMALL_MAX);
+
+    if (size > budget) size = budget;
+
+    if (n % BENCH_DIR_FILES == 0) {
+      snprintf(path, sizeof(path), "%s/d%04u", root, n / BENCH_DIR_FILES);
+
+      if (mkdir(path, 0755) < 0 && errno != EEXIST) return -1;
+    }
+
+    snprintf(path, sizeof(path),
+             n % 2 ? "%s/d%04u/small file %05u.dat" : "%s/d%04u/F%05u.BIN",
+             root, n / BENCH_DIR_FILES, n);
+
+    if (write_file(b, path, size, state) < 0) return -1;
+
+    budget -= size;
+    n++;
+  }
+
+  return 0;
+}
+
+static int write_medium(bench_t *b, const char *root, uint64_t budget,
+                        uint64_t *state) {
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/medium", root);
+
+  if (mkdir(path, 0755) < 0 && errno != EEXIST) return -1;
+
+  for (uint32_t n = 0; budget > 0; n++) {
+    uint64_t size = pick_size(state, BENCH_MEDIUM_MIN, BENCH_MEDIUM_MAX);
+
+    if (size > budget) size = budget;
+
+    snprintf(path, sizeof(path), "%s/medium/part%03u.img", root, n);
+
+    if (write_file(b, path, size, state) < 0) return -1;
+
+    budget -= size;
+  }
+
+  return 0;
+}
+
+/* small: only small files, huge: a single file, mixed: half
+   the bytes in one file, a quarter each in medium and small
+   ones, which is roughly what an installer image looks like */
+
+static int make_tree(bench_t *b) {
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  char path[PATH_MAX];
+  uint64_t size = b->tree_size;
+
+  if (mkdir(b->src, 0755) < 0) {
+    r_printf("Creating %s failed: %s\n", b->src, strerror(errno));
+    return -1;
+  }
+
+  if (strcmp(b->tree, "small") == 0) return write_small(b, b->src, size, &state);
+
+  snprintf(path, sizeof(path), "%s/huge.bin", b->src);
+
+  if (strcmp(b->tree, "huge") == 0) return write_file(b, path, size, &state);
+
+  if (write_file(b, path, size / 2, &state) < 0 ||
+      write_medium(b, b->src, size / 4, &state) < 0)
+    return -1;
+
+  return write_small(b, b->src, size - size / 2 - size / 4, &state);
+}
+
+/* A loop device on a file in the scratch directory. The file
+   is unlinked right away and the device clears itself on the
+   last close, so nothing is left behind however the bench
+   ends. */
+
+static int loop_attach(bench_t *b) {
+  char backing[PATH_MAX];
+  struct loop_info64 info;
+  int ctl, file_fd, dev_fd = -1;
+
+  snprintf(backing, sizeof(backing), "%s/loop.img", b->scratch);
+
+  if ((file_fd = open(backing, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 ||
+      ftruncate(file_fd, b->loop_size) < 0) {
+    r_printf("Creating %s failed: %s\n", backing, strerror(errno));
+    if (file_fd >= 0) close(file_fd);
+    return -1;
+  }
+
+  unlink(backing);
+
+  if ((ctl = open("/dev/loop-control", O_RDWR)) < 0) {
+    r_printf("Opening loop control failed: %s\n", strerror(errno));
+    close(file_fd);
+    return -1;
+  }
+
+  /* Someone else can grab the free device in between */
+
+  for (int tries = 0; tries < 8 && dev_fd < 0; tries++) {
+    int n = ioctl(ctl, LOOP_CTL_GET_FREE);
+
+    if (n < 0) break;
+
+    snprintf(b->device_path, sizeof(b->device_path), "/dev/loop%d", n);
+
+    if ((dev_fd = open(b->device_path, O_RDWR)) < 0) break;
+
+    if (ioctl(dev_fd, LOOP_SET_FD, file_fd) < 0) {
+      close(dev_fd);
+      dev_fd = -1;
+      if (errno != EBUSY) break;
+    }
+  }
+
+  close(ctl);
+  close(file_fd);
+
+  if (dev_fd < 0) {
+    r_printf("Setting up a loop device failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  memset(&info, 0, sizeof(info));
+  info.lo_flags = LO_FLAGS_AUTOCLEAR;
+
+  if (ioctl(dev_fd, LOOP_SET_STATUS64, &info) < 0) {
+    r_printf("Loop autoclear failed: %s\n", strerror(errno));
+  }
+
+  b->device_fd = dev_fd;
+
+  return 0;
+}
+
+static int device_open(bench_t *b) {
+  if (b->device == NULL) return loop_attach(b);
+
+  snprintf(b->device_path, sizeof(b->device_path), "%s", b->device);
+
+  int fd = open(b->device, O_RDWR | O_EXCL);
+
+  if (fd < 0) {
+    r_printf("Opening %s failed: %s\n", b->device, strerror(errno));
+    return -1;
+  }
+
+  b->device_fd = fd;
+
+  return 0;
+}
+
+static int prepare_device(bench_t *b) {
+  return flush_device(b->device_fd);
+}
+
+static int prepare_copy(bench_t *b) {
+  if (remove_tree(b->dst) < 0) return -1;
+
+  if (mkdir(b->dst, 0755) < 0) {
+    r_printf("Creating %s failed: %s\n", b->dst, strerror(errno));
+    return -1;
+  }
+
+  return drop_tree(b->src);
+}
+
+static int run_copy(bench_t *b, uint64_t *bytes, uint64_t *files) {
+  *bytes = b->list.total_bytes;
+  *files = b->list.file_count;
+
+  return recursive_copy(b->src, b->dst, &b->list, b->threads, b->depth);
+}
+
+static int prepare_fattree(bench_t *b) {
+  if (drop_tree(b->src) < 0) return -1;
+
+  return prepare_device(b);
+}
+
+static int run_fattree(bench_t *b, uint64_t *bytes, uint64_t *files) {
+  *bytes = b->list.total_bytes;
+  *files = b->list.file_count;
+
+  return fat32_write_tree(&b->device_fd, b->cluster_size, 0, BENCH_LABEL,
+                          &b->list, -1, b->src, b->depth, NULL, NULL);
+}
+
+static int prepare_image(bench_t *b) {
+  int fd = open(b->image, O_RDONLY);
+
+  if (fd >= 0) {
+    fadvise_drop(fd, 0, 0);
+    close(fd);
+  }
+
+  return prepare_device(b);
+}
+
+static int run_image(bench_t *b, uint64_t *bytes, uint64_t *files) {
+  *bytes = b->tree_size;
+  *files = 0;
+
+  return write_image(b->image, &b->device_fd, b->direct, b->depth, NULL, b->zeros);
+}
+
+static int run_wipe(bench_t *b, uint64_t *bytes, uint64_t *files) {
+  *bytes = b->device_size;
+  *files = 0;
+
+  return full_wipe(&b->device_fd, b->depth);
+}
+
+static int run_format(bench_t *b, uint64_t *bytes, uint64_t *files) {
+  *bytes = 0;
+  *files = 0;
+
+  return format_fat32(&b->device_fd, b->cluster_size, 0, BENCH_LABEL);
+}
+
+static int run_scan(bench_t *b, uint64_t *bytes, uint64_t *files) {
+  if (iso_scan_image(b->iso, &b->manifest) < 0) return -1;
+
+  *bytes = 0;
+  *files = b->manifest.list.file_count;
+
+  return 0;
+}
+
+static const bench_case_t cases[] = {
+    {"copy", prepare_copy, run_copy},
+    {"fattree", prepare_fattree, run_fattree},
+    {"image", prepare_image, run_image},
+    {"wipe", prepare_device, run_wipe},
+    {"format", prepare_device, run_format},
+    {"scan", NULL, run_scan},
+};
+
+#define CASE_COUNT (int)(sizeof(cases) / sizeof(cases[0]))
+
+static void print_error(const char *name, const char *reason) {
+  printf("{\"case\":\"%s\",\"error\":\"%s\"}\n", name, reason);
+  fflush(stdout);
+}
+
+static int run_case(bench_t *b, const bench_case_t *c) {
+  double secs[BENCH_RUNS_MAX];
+  double total = 0;
+  uint64_t bytes = 0, files = 0;
+  bench_io_t io = {0, 0, 0, 0};
+
+  if (c->run == run_scan && b->iso == NULL) {
+    print_error(c->name, "no image, pass one with -i");
+    return 0;
+  }
+
+  for (int i = 0; i < b->runs; i++) {
+    bench_io_t before, after;
+
+    if (c->prepare != NULL && c->prepare(b) < 0) {
+      print_error(c->name, "prepare failed");
+      return -1;
+    }
+
+    io_read(&before);
+
+    double start = now();
+
+    if (c->run(b, &bytes, &files) < 0) {
+      print_error(c->name, "run failed");
+      return -1;
+    }
+
+    secs[i] = now() - start;
+    total += secs[i];
+
+    io_read(&after);
+
+    io.syscr += after.syscr - before.syscr;
+    io.syscw += after.syscw - before.syscw;
+    io.read_bytes += after.read_bytes - before.read_bytes;
+    io.write_bytes += after.write_bytes - before.write_bytes;
+  }
+
+  /* Rates come from the mean, the spread is in the
+     percentiles. Counters are per run. */
+
+  double mean = total / b->runs;
+
+  printf("{\"case\":\"%s\",\"runs\":%d,\"bytes\":%llu,\"files\":%llu,"
+         "\"mb_s\":%.2f,\"files_s\":%.1f,",
+         c->name, b->runs, (unsigned long long)bytes,
+         (unsigned long long)files, mean > 0 ? bytes / mean / 1e6 : 0,
+         mean > 0 ? files / mean : 0);
+  print_percentiles(secs, b->runs, 1e3, "ms");
+  printf(",\"syscr\":%llu,\"syscw\":%llu,\"read_bytes\":%llu,"
+         "\"write_bytes\":%llu}\n",
+         (unsigned long long)(io.syscr / b->runs),
+         (unsigned long long)(io.syscw / b->runs),
+         (unsigned long long)(io.read_bytes / b->runs),
+         (unsigned long long)(io.write_bytes / b->runs));
+  fflush(stdout);
+
+  return 0;
+}
+
+/* Latency of single requests straight to the device: random
+   small reads and sequential large writes, both O_DIRECT so
+   the page cache is out of the picture */
+
+static int run_lat_one(bench_t *b, int fd, int writing, size_t len,
+                       double *samples) {
+  uint64_t state = 0x2545f4914f6cdd1dULL;
+  uint64_t blocks = b->device_size / len;
+  double total = 0;
+  void *buf;
+
+  if (blocks == 0 || posix_memalign(&buf, 4096, len) != 0) return -1;
+
+  memcpy(buf, b->fill, len < BENCH_FILL_SIZE ? len : BENCH_FILL_SIZE);
+
+  for (int i = 0; i < BENCH_LAT_OPS; i++) {
+    uint64_t off = (writing ? i % blocks : xorshift(&state) % blocks) * len;
+    double start = now();
+    ssize_t ret = writing ? pwrite(fd, buf, len, off) : pread(fd, buf, len, off);
+
+    samples[i] = now() - start;
+    total += samples[i];
+
+    if (ret != (ssize_t)len) {
+      free(buf);
+      return -1;
+    }
+  }
+
+  free(buf);
+
+  printf("{\"case\":\"%s\",\"ops\":%d,\"bytes\":%zu,\"iops\":%.0f,"
+         "\"mb_s\":%.2f,",
+         writing ? "lat-write" : "lat-read", BENCH_LAT_OPS, len,
+         BENCH_LAT_OPS / total, BENCH_LAT_OPS * (double)len / total / 1e6);
+  print_percentiles(samples, BENCH_LAT_OPS, 1e6, "us");
+  printf("}\n");
+  fflush(stdout);
+
+  return 0;
+}
+
+static int run_lat(bench_t *b) {
+  static double samples[BENCH_LAT_OPS];
+  char path[64];
+  int ret = 0;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%u", b->device_fd);
+
+  int fd = open(path, O_RDWR | O_DIRECT);
+
+  if (fd < 0) {
+    print_error("lat", "no O_DIRECT on this device");
+    return 0;
+  }
+
+  if (run_lat_one(b, fd, 0, BENCH_LAT_READ, samples) < 0) {
+    print_error("lat-read", "read failed");
+    ret = -1;
+  }
+
+  if (run_lat_one(b, fd, 1, BENCH_LAT_WRITE, samples) < 0) {
+    print_error("lat-write", "write failed");
+    ret = -1;
+  }
+
+  close(fd);
+
+  return ret;
+}
+
+static int setup(bench_t *b) {
+  uint64_t state = 0xda942042e4dd58b5ULL;
+
+  snprintf(b->scratch, sizeof(b->scratch), "%s/rufusl-bench.XXXXXX", b->dir);
+
+  if (mkdtemp(b->scratch) == NULL) {
+    r_printf("Creating scratch directory failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  snprintf(b->src, sizeof(b->src), "%s/src", b->scratch);
+  snprintf(b->image, sizeof(b->image), "%s/image.bin", b->scratch);
+
+  if (b->dest != NULL) {
+    snprintf(b->dst, sizeof(b->dst), "%s/rufusl-bench", b->dest);
+  } else {
+    snprintf(b->dst, sizeof(b->dst), "%s/dst", b->scratch);
+  }
+
+  if ((b->fill = malloc(BENCH_FILL_SIZE)) == NULL) return -1;
+
+  for (size_t i = 0; i < BENCH_FILL_SIZE; i += sizeof(uint64_t)) {
+    uint64_t word = xorshift(&state);
+    memcpy(b->fill + i, &word, sizeof(word));
+  }
+
+  if (device_open(b) < 0) return -1;
+
+  blk_profile_t profile;
+
+  if (b->depth == 0) {
+    b->depth = blk_profile(b->device_fd, &profile) == 0 ? profile.depth : 1;
+  }
+
+  if (blk_size(b->device_fd, &b->device_size) < 0) {
+    r_printf("Failed to get device size: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (b->tree_size > b->device_size) b->tree_size = b->device_size;
+
+  if (make_tree(b) < 0 || write_file(b, b->image, b->tree_size, &state) < 0)
+    return -1;
+
+  return build_copy_list(b->src, &b->list);
+}
+
+static void teardown(bench_t *b) {
+  if (b->dest != NULL) remove_tree(b->dst);
+  if (b->scratch[0] != '\0') remove_tree(b->scratch);
+  if (b->device_fd != (uint32_t)-1) close(b->device_fd);
+
+  copy_list_free(&b->list);
+  iso_manifest_free(&b->manifest);
+  free(b->fill);
+}
+
+static int known_case(const char *name) {
+  for (int i = 0; i < CASE_COUNT; i++) {
+    if (strcmp(name, cases[i].name) == 0) return 1;
+  }
+
+  return strcmp(name, "lat") == 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options] [case...]\n"
+          "Cases: copy fattree image wipe format scan lat (default: all)\n"
+          "  -d dev      block device to use, e.g. /dev/ram0 or /dev/nullb0\n"
+          "  -l MiB      size of the loop device made otherwise (%d)\n"
+          "  -D dir      scratch directory (/tmp)\n"
+          "  -m dir      copy into dir instead of the scratch directory\n"
+          "  -t tree     small, huge or mixed (mixed)\n"
+          "  -s MiB      size of the tree and the image (%d)\n"
+          "  -n runs     runs per case (%d)\n"
+          "  -j threads  copy threads (%d)\n"
+          "  -q depth    queue depth (from the device)\n"
+          "  -b backend  first copy backend\n"
+          "  -c size     cluster size index, as in definitions.h (%d)\n"
+          "  -i iso      image for the scan case\n"
+          "  -o          write the image with O_DIRECT\n"
+          "  -z          zero the blocks the image write skips\n"
+          "  -v          engine log on stderr, twice for verbose\n"
+          "Everything on the device is lost.\n",
+          name, BENCH_LOOP_MB, BENCH_TREE_MB, BENCH_RUNS, COPY_THREADS_DEFAULT,
+          BS_4096B);
+}
+
+int main(int argc, char **argv) {
+  bench_t b;
+  int verbose = -1;
+  int ret = 0;
+  int opt;
+
+  memset(&b, 0, sizeof(b));
+  b.dir = "/tmp";
+  b.tree = "mixed";
+  b.loop_size = (uint64_t)BENCH_LOOP_MB << 20;
+  b.tree_size = (uint64_t)BENCH_TREE_MB << 20;
+  b.runs = BENCH_RUNS;
+  b.threads = COPY_THREADS_DEFAULT;
+  b.depth = 0;
+  b.cluster_size = BS_4096B;
+  b.device_fd = (uint32_t)-1;
+  copy_list_init(&b.list);
+  iso_manifest_init(&b.manifest);
+
+  while ((opt = getopt(argc, argv, "d:l:D:m:t:s:n:j:q:b:c:i:ovz")) != -1) {
+    switch (opt) {
+      case 'd': b.device = optarg; break;
+      case 'l': b.loop_size = strtoull(optarg, NULL, 10) << 20; break;
+      case 'D': b.dir = optarg; break;
+      case 'm': b.dest = optarg; break;
+      case 't': b.tree = optarg; break;
+      case 's': b.tree_size = strtoull(optarg, NULL, 10) << 20; break;
+      case 'n': b.runs = atoi(optarg); break;
+      case 'j': b.threads = atoi(optarg); break;
+      case 'q': b.depth = atoi(optarg); break;
+      case 'b': b.backend = optarg; break;
+      case 'c': b.cluster_size = atoi(optarg); break;
+      case 'i': b.iso = optarg; break;
+      case 'o': b.direct = 1; break;
+      case 'z': b.zeros = 1; break;
+      case 'v': verbose = verbose < 0 ? LOG_LEVEL_INFO : LOG_LEVEL_VERBOSE; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+
+  if (b.runs < 1 || b.runs > BENCH_RUNS_MAX || b.tree_size == 0 ||
+      (strcmp(b.tree, "small") && strcmp(b.tree, "huge") &&
+       strcmp(b.tree, "mixed"))) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  for (int j = optind; j < argc; j++) {
+    if (!known_case(argv[j])) {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  set_log_level(verbose);
+
+  if (b.backend != NULL && copy_set_backend(b.backend) < 0) {
+    fprintf(stderr, "Unknown copy backend: %s\n", b.backend);
+    return 2;
+  }
+
+  if (setup(&b) < 0) {
+    fprintf(stderr, "Setting up the bench failed\n");
+    teardown(&b);
+    return 1;
+  }
+
+  printf("{\"bench\":\"rufusl\",\"device\":\"%s\",\"device_bytes\":%llu,"
+         "\"tree\":\"%s\",\"tree_bytes\":%llu,\"files\":%u,\"runs\":%d,"
+         "\"threads\":%d,\"depth\":%d,\"backend\":\"%s\",\"direct\":%d}\n",
+         b.device_path, (unsigned long long)b.device_size, b.tree,
+         (unsigned long long)b.list.total_bytes, b.list.file_count, b.runs,
+         b.threads, b.depth, b.backend ? b.backend : "default", b.direct);
+  fflush(stdout);
+
+  for (int i = 0; i < CASE_COUNT; i++) {
+    int wanted = optind == argc;
+
+    for (int j = optind; j < argc; j++) {
+      if (strcmp(argv[j], cases[i].name) == 0) wanted = 1;
+    }
+
+    if (wanted && run_case(&b, &cases[i]) < 0) ret = 1;
+  }
+
+  int lat = optind == argc;
+
+  for (int j = optind; j < argc; j++) {
+    if (strcmp(argv[j], "lat") == 0) lat = 1;
+  }
+
+  if (lat && run_lat(&b) < 0) ret = 1;
+
+  teardown(&b);
+
+  return ret;
+}
@@ -0,0 +1,43 @@
+#-------------------------------------------------
+#
+# Benchmarks for the engines, without any Qt.
+# Built from Rufusl.pro with "make bench".
+#
+#-------------------------------------------------
+
+TARGET = rufusl-bench
+TEMPLATE = app
+
+CONFIG += console O3
+CONFIG -= qt app_bundle
+
+QMAKE_CFLAGS += -std=gnu11
+QMAKE_CFLAGS_WARN_ON = -Wno-sign-compare
+
+INCLUDEPATH += .. ../linux
+
+LIBS += -L/lib -lparted -lpthread -lz -llzma -lzstd -lssl -lcrypto
+
+# "qmake CONFIG+=trace" builds in the tracing, see linux/trace.h
+
+trace: DEFINES += RUFUSL_TRACE
+
+SOURCES += bench.c \
+    benchlog.c \
+    ../linux/mounting.c \
+    ../linux/partition.c \
+    ../linux/fat32.c \
+    ../linux/fattree.c \
+    ../linux/copy.c \
+    ../linux/ioqueue.c \
+    ../linux/image.c \
+    ../linux/http.c \
+    ../linux/httpcache.c \
+    ../linux/decomp.c \
+    ../linux/blkdev.c \
+    ../linux/flush.c \
+    ../linux/trace.c \
+    ../linux/verify.c \
+    ../linux/sparse.c \
+    ../iso.c \
+    ../isofs.c
@@ -0,0 +1,67 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../log.h"
+
+/* The engines log through log.h, which hands everything to
+   the sink of the front end. The bench has no front end, so this
+   sends everything below the level to stderr and keeps stdout
+   for the results. The progress calls have nothing to drive
+   and do nothing. */
+
+static int log_level = -1;
+
+void r_printf(const char *format, ...) {
+  va_list args;
+
+  if (log_level < LOG_LEVEL_INFO) return;
+
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+void r_log(int level, const char *format, ...) {
+  va_list args;
+
+  if (level > log_level) return;
+
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+}
+
+void set_log_level(int level) { log_level = level; }
+
+int log_enabled(int level) { return level <= log_level; }
+
+void set_progress_bar(int va) { (void)va; }
+
+void add_progress_bar(int va) { (void)va; }
+
+void set_ticker(const char *text) { (void)text; }
+
+void progress_begin(int total_weight) { (void)total_weight; }
+
+void progress_phase(const char *name, int weight) {
+  (void)name;
+  (void)weight;
+}
+
+void progress_bytes(uint64_t done, uint64_t total) {
+  (void)done;
+  (void)total;
+}
+
+void progress_end(void) {}
+
+void log_set_sink(const log_sink_t *sink) { (void)sink; }
+
+void log_drain(void) {}
+
+/* Nothing stops a bench run half way */
+
+void job_cancel(int on) { (void)on; }
+
+int job_cancelled(void) { return 0; }
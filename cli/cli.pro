@@ -0,0 +1,59 @@
+#-------------------------------------------------
+#
+# The engines behind a command line and a daemon,
+# without the GUI. Built from Rufusl.pro with "make cli".
+#
+#-------------------------------------------------
+
+QT = core
+
+TARGET = rufusl-cli
+TEMPLATE = app
+
+CONFIG += console c++11 O3
+CONFIG -= app_bundle
+
+QMAKE_CFLAGS += -std=gnu11
+QMAKE_CFLAGS_WARN_ON = -Wno-sign-compare
+
+INCLUDEPATH += .. ../linux
+
+LIBS += -L/lib -lparted -lpthread -lz -llzma -lzstd -lssl -lcrypto
+
+# "qmake CONFIG+=trace" builds in the tracing, see linux/trace.h
+
+trace: DEFINES += RUFUSL_TRACE
+
+SOURCES += main.cpp \
+    job.cpp \
+    daemon.cpp \
+    ../log.cpp \
+    ../rufusworker.cpp \
+    ../linux/devices.c \
+    ../linux/mounting.c \
+    ../linux/partition.c \
+    ../linux/fat32.c \
+    ../linux/fattree.c \
+    ../linux/exfat.c \
+    ../linux/fatcache.c \
+    ../linux/taskgraph.c \
+    ../linux/copy.c \
+    ../linux/ioqueue.c \
+    ../linux/image.c \
+    ../linux/http.c \
+    ../linux/httpcache.c \
+    ../linux/delta.c \
+    ../linux/decomp.c \
+    ../linux/fanout.c \
+    ../linux/blkdev.c \
+    ../linux/flush.c \
+    ../linux/trace.c \
+    ../linux/verify.c \
+    ../linux/sparse.c \
+    ../iso.c \
+    ../isofs.c
+
+HEADERS += job.h \
+    daemon.h \
+    ../log.h \
+    ../rufusworker.h
@@ -0,0 +1,659 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "log.h"
+
+extern "C" {
+#include "linux/blkdev.h"
+#include "linux/devices.h"
+#include "linux/http.h"
+#include "linux/mounting.h"
+}
+
+#define DAEMON_CLIENT_TIMEOUT 5
+#define PIPE_MESSAGE_MAX 1024
+
+#define STATE_QUEUED 0
+#define STATE_RUNNING 1
+#define STATE_DONE 2
+#define STATE_FAILED 3
+#define STATE_CANCELLED 4
+
+/* Exit status of a job child, 0 being done */
+
+#define EXIT_FAILED 1
+#define EXIT_CANCELLED 2
+
+static const char *state_names[] = { "queued", "running", "done", "failed", "cancelled" };
+
+typedef struct daemon_job {
+    int id;
+    int state;
+    int cancel;
+    cli_job_t job;
+    uint8_t major;
+    uint8_t minor;
+    char hub[PATH_MAX];
+    pid_t pid;
+    int pipe_fd;
+    int progress;
+    char ticker[64];
+    double rate;
+    char buf[DAEMON_LINE_MAX];
+    size_t len;
+} daemon_job_t;
+
+typedef struct daemon_client {
+    int fd;
+    time_t since;
+    char buf[DAEMON_LINE_MAX];
+    size_t len;
+} daemon_client_t;
+
+static daemon_job_t jobs[DAEMON_JOBS_MAX];
+static int job_count = 0;
+static int next_id = 1;
+
+static daemon_client_t clients[DAEMON_CLIENTS_MAX];
+static int client_count = 0;
+
+static int listen_fd = -1;
+
+static volatile sig_atomic_t stop_asked = 0;
+
+static void on_stop(int sig) {
+    (void) sig;
+    stop_asked = 1;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* ---- The job's side of the pipe ----
+
+   Each message is one write of whole lines, well below
+   PIPE_BUF, so those from the worker threads never mix. */
+
+static void pipe_send(void *ctx, char kind, const char *text) {
+    char buf[PIPE_MESSAGE_MAX];
+    size_t len = 0;
+
+    for (const char *p = text; *p != 0x00 && len + 3 < sizeof(buf);) {
+        const char *end = strchr(p, '\n');
+        size_t n = end != NULL ? (size_t) (end - p) : strlen(p);
+
+        if (n > sizeof(buf) - len - 3) n = sizeof(buf) - len - 3;
+
+        buf[len++] = kind;
+        memcpy(buf + len, p, n);
+        len += n;
+        buf[len++] = '\n';
+
+        p += n;
+        if (*p == '\n') p++;
+    }
+
+    write_all((int) (intptr_t) ctx, buf, len);
+}
+
+static void pipe_line(void *ctx, const char *text) {
+    pipe_send(ctx, 'L', text);
+}
+
+static void pipe_progress(void *ctx, int value) {
+    char text[16];
+
+    snprintf(text, sizeof(text), "%d", value);
+    pipe_send(ctx, 'P', text);
+}
+
+static void pipe_ticker(void *ctx, const char *text) {
+    pipe_send(ctx, 'T', text);
+}
+
+static void pipe_rate(void *ctx, double now, double avg, int eta) {
+    char text[64];
+
+    (void) now;
+
+    snprintf(text, sizeof(text), "%.1f %d", avg, eta);
+    pipe_send(ctx, 'R', text);
+}
+
+/* In the forked process: nothing of the daemon's is needed
+   but the pipe, and the temp nodes and mount points get the
+   job's id so they are its own */
+
+static void run_child(daemon_job_t *j, int fd) {
+    char tag[16];
+
+    close(listen_fd);
+
+    for (int i = 0; i < client_count; i++) close(clients[i].fd);
+
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].state == STATE_RUNNING && &jobs[i] != j) close(jobs[i].pipe_fd);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    snprintf(tag, sizeof(tag), "%d", j->id);
+    temp_paths_tag(tag);
+
+    log_sink_t sink = { pipe_line, pipe_progress, pipe_ticker, pipe_rate, (void *) (intptr_t) fd };
+
+    log_set_sink(&sink);
+
+    int ret = job_run(&j->job);
+
+    _exit(ret == JOB_CANCELLED ? EXIT_CANCELLED : ret < 0 ? EXIT_FAILED : 0);
+}
+
+static void start_job(daemon_job_t *j) {
+    int fds[2];
+
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "[%d] No pipe: %s\n", j->id, strerror(errno));
+        j->state = STATE_FAILED;
+        return;
+    }
+
+    if ((j->pid = fork()) < 0) {
+        fprintf(stderr, "[%d] Could not fork: %s\n", j->id, strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        j->state = STATE_FAILED;
+        return;
+    }
+
+    if (j->pid == 0) {
+        close(fds[0]);
+        run_child(j, fds[1]);
+    }
+
+    close(fds[1]);
+
+    j->pipe_fd = fds[0];
+    j->state = STATE_RUNNING;
+    j->len = 0;
+
+    fprintf(stderr, "[%d] Started on %s\n", j->id, j->job.device);
+}
+
+/* ---- Scheduling ---- */
+
+static int conflicts(const daemon_job_t *a, const daemon_job_t *b) {
+    if (a->major == b->major && a->minor == b->minor) return 1;
+
+    return a->hub[0] != 0x00 && strcmp(a->hub, b->hub) == 0;
+}
+
+/* Jobs start in the order they came in. One that has to wait
+   also holds back later ones for the same stick or hub, so a
+   busy hub can not starve it. */
+
+static void schedule(void) {
+    int running = 0;
+
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].state == STATE_RUNNING) running++;
+    }
+
+    for (int i = 0; i < job_count && running < DAEMON_RUNNING_MAX; i++) {
+        daemon_job_t *j = &jobs[i];
+        int blocked = 0;
+
+        if (j->state != STATE_QUEUED) continue;
+
+        for (int k = 0; k < i && !blocked; k++) {
+            int busy = jobs[k].state == STATE_RUNNING || jobs[k].state == STATE_QUEUED;
+
+            blocked = busy && conflicts(j, &jobs[k]);
+        }
+
+        for (int k = i + 1; k < job_count && !blocked; k++) {
+            blocked = jobs[k].state == STATE_RUNNING && conflicts(j, &jobs[k]);
+        }
+
+        if (blocked) continue;
+
+        start_job(j);
+
+        if (j->state == STATE_RUNNING) running++;
+    }
+}
+
+/* ---- What comes back from the jobs ---- */
+
+static void job_message(daemon_job_t *j, const char *line) {
+    switch (line[0]) {
+    case 'L':
+        fprintf(stderr, "[%d] %s\n", j->id, line + 1);
+        break;
+    case 'P':
+        j->progress = atoi(line + 1);
+        break;
+    case 'T':
+        snprintf(j->ticker, sizeof(j->ticker), "%s", line + 1);
+        break;
+    case 'R':
+        j->rate = strtod(line + 1, NULL);
+        break;
+    }
+}
+
+static void job_finished(daemon_job_t *j) {
+    int status = 0;
+
+    close(j->pipe_fd);
+    while (waitpid(j->pid, &status, 0) < 0 && errno == EINTR);
+
+    /* Only a child that says it stopped early was cancelled, a
+       cancel that came after the last block leaves a done job */
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        j->state = STATE_DONE;
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_CANCELLED) {
+        j->state = STATE_CANCELLED;
+    } else {
+        j->state = j->cancel && WIFSIGNALED(status) ? STATE_CANCELLED : STATE_FAILED;
+    }
+
+    j->rate = 0;
+
+    fprintf(stderr, "[%d] %s\n", j->id, state_names[j->state]);
+}
+
+static void job_read(daemon_job_t *j) {
+    ssize_t n = read(j->pipe_fd, j->buf + j->len, sizeof(j->buf) - j->len - 1);
+
+    if (n < 0 && errno == EINTR) return;
+
+    if (n <= 0) {
+        job_finished(j);
+        return;
+    }
+
+    j->len += n;
+    j->buf[j->len] = 0x00;
+
+    char *line = j->buf;
+    char *end;
+
+    while ((end = strchr(line, '\n')) != NULL) {
+        *end = 0x00;
+        job_message(j, line);
+        line = end + 1;
+    }
+
+    /* A line longer than the buffer gets cut */
+
+    j->len = j->buf + j->len - line;
+
+    if (j->len == sizeof(j->buf) - 1) j->len = 0;
+
+    memmove(j->buf, line, j->len);
+}
+
+/* ---- Requests ---- */
+
+/* A full table makes room by forgetting the oldest job that
+   is over */
+
+static daemon_job_t *job_slot(void) {
+    if (job_count == DAEMON_JOBS_MAX) {
+        int i;
+
+        for (i = 0; i < job_count; i++) {
+            if (jobs[i].state >= STATE_DONE) break;
+        }
+
+        if (i == job_count) return NULL;
+
+        memmove(&jobs[i], &jobs[i + 1], (job_count - i - 1) * sizeof(jobs[0]));
+        job_count--;
+    }
+
+    daemon_job_t *j = &jobs[job_count++];
+
+    memset(j, 0, sizeof(*j));
+    j->id = next_id++;
+    j->pipe_fd = -1;
+
+    return j;
+}
+
+/* A URL is not asked for here, the poll loop would wait on the
+   server. The job child finds out and fails with the reason. */
+
+static int image_readable(const char *image) {
+    if (http_is_url(image)) return 1;
+
+    return image[0] == '/' && access(image, R_OK) == 0;
+}
+
+static void request_job(int fd, char *args) {
+    char *argv[JOB_ARGS_MAX + 1];
+    char reply[512];
+    char error[256];
+    int argc = 0;
+    cli_job_t job;
+    Device device;
+
+    argv[argc++] = (char *) "JOB";
+
+    for (char *arg = strtok(args, "\t"); arg != NULL && argc < JOB_ARGS_MAX; arg = strtok(NULL, "\t")) {
+        argv[argc++] = arg;
+    }
+
+    argv[argc] = NULL;
+
+    memset(&device, 0, sizeof(device));
+
+    if (job_parse(argc, argv, &job, error, sizeof(error)) < 0) {
+        snprintf(reply, sizeof(reply), "ERR %s\n", error);
+    } else if (!image_readable(job.image)) {
+        snprintf(reply, sizeof(reply), "ERR Can not read %s\n", job.image);
+    } else if (probe_device(job.device, &device) != 1) {
+        snprintf(reply, sizeof(reply), "ERR %s is not a removable USB disk\n", job.device);
+    } else {
+        daemon_job_t *j = job_slot();
+
+        if (j == NULL) {
+            snprintf(reply, sizeof(reply), "ERR Queue full\n");
+        } else {
+            j->job = job;
+            j->major = device.major;
+            j->minor = device.minor;
+            j->state = STATE_QUEUED;
+            snprintf(j->ticker, sizeof(j->ticker), "Queued");
+
+            if (blk_usb_hub(device.major, device.minor, j->hub, sizeof(j->hub)) < 0) j->hub[0] = 0x00;
+
+            snprintf(reply, sizeof(reply), "OK %d\n", j->id);
+            fprintf(stderr, "[%d] Queued %s for %s\n", j->id, job.image, job.device);
+        }
+    }
+
+    write_all(fd, reply, strlen(reply));
+}
+
+static void request_status(int fd) {
+    char line[PATH_MAX + 256];
+
+    for (int i = 0; i < job_count; i++) {
+        daemon_job_t *j = &jobs[i];
+
+        snprintf(line, sizeof(line), "%d\t%s\t%s\t%d%%\t%.1f MB/s\t%s\t%s\n", j->id,
+                 state_names[j->state], j->job.device, j->progress, j->rate, j->ticker, j->job.image);
+
+        if (write_all(fd, line, strlen(line)) < 0) return;
+    }
+
+    write_all(fd, ".\n", 2);
+}
+
+static void request_cancel(int fd, int id) {
+    const char *reply = "ERR No such job\n";
+
+    for (int i = 0; i < job_count; i++) {
+        daemon_job_t *j = &jobs[i];
+
+        if (j->id != id) continue;
+
+        if (j->state == STATE_QUEUED) {
+            j->state = STATE_CANCELLED;
+            reply = "OK\n";
+        } else if (j->state == STATE_RUNNING) {
+            j->cancel = 1;
+            kill(j->pid, SIGTERM);
+            reply = "OK\n";
+        } else {
+            reply = "ERR Job is over\n";
+        }
+    }
+
+    write_all(fd, reply, strlen(reply));
+}
+
+static void request(int fd, char *line) {
+    if (strncmp(line, "JOB\t", 4) == 0) {
+        request_job(fd, line + 4);
+    } else if (strcmp(line, "STATUS") == 0) {
+        request_status(fd);
+    } else if (strncmp(line, "CANCEL\t", 7) == 0) {
+        request_cancel(fd, atoi(line + 7));
+    } else {
+        write_all(fd, "ERR Unknown request\n", 20);
+    }
+}
+
+static void client_drop(int i) {
+    close(clients[i].fd);
+    clients[i] = clients[--client_count];
+}
+
+/* Returns 1 when the client is done with */
+
+static int client_read(daemon_client_t *c) {
+    ssize_t n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len - 1);
+    char *end;
+
+    if (n < 0 && errno == EINTR) return 0;
+    if (n <= 0) return 1;
+
+    c->len += n;
+    c->buf[c->len] = 0x00;
+
+    if ((end = strchr(c->buf, '\n')) == NULL) {
+        if (c->len < sizeof(c->buf) - 1) return 0;
+
+        write_all(c->fd, "ERR Request too long\n", 21);
+        return 1;
+    }
+
+    *end = 0x00;
+    request(c->fd, c->buf);
+
+    return 1;
+}
+
+static void client_accept(void) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0) return;
+
+    if (client_count == DAEMON_CLIENTS_MAX) {
+        write_all(fd, "ERR Busy\n", 9);
+        close(fd);
+        return;
+    }
+
+    clients[client_count].fd = fd;
+    clients[client_count].since = time(NULL);
+    clients[client_count].len = 0;
+    client_count++;
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    /* Only root writes sticks, so only root gets to ask */
+
+    unlink(path);
+    mode_t mask = umask(077);
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, DAEMON_CLIENTS_MAX) < 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+        umask(mask);
+        close(listen_fd);
+        return -1;
+    }
+
+    umask(mask);
+
+    return 0;
+}
+
+int daemon_serve(const char *socket_path) {
+    struct pollfd fds[1 + DAEMON_CLIENTS_MAX + DAEMON_JOBS_MAX];
+    daemon_job_t *polled[DAEMON_JOBS_MAX];
+    struct sigaction sa;
+
+    if (listen_on(socket_path) < 0) return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Listening on %s\n", socket_path);
+
+    while (!stop_asked) {
+        int n = 0, running = 0;
+
+        fds[n].fd = listen_fd;
+        fds[n++].events = POLLIN;
+
+        for (int i = 0; i < client_count; i++) {
+            fds[n].fd = clients[i].fd;
+            fds[n++].events = POLLIN;
+        }
+
+        for (int i = 0; i < job_count; i++) {
+            if (jobs[i].state != STATE_RUNNING) continue;
+
+            polled[running++] = &jobs[i];
+            fds[n].fd = jobs[i].pipe_fd;
+            fds[n++].events = POLLIN;
+        }
+
+        if (poll(fds, n, DAEMON_TICK_MS) < 0) {
+            if (errno == EINTR) continue;
+
+            perror("poll");
+            break;
+        }
+
+        for (int i = 0; i < running; i++) {
+            if (fds[1 + client_count + i].revents != 0) job_read(polled[i]);
+        }
+
+        /* Backwards, a dropped client takes the place of the last */
+
+        time_t now = time(NULL);
+
+        for (int i = client_count - 1; i >= 0; i--) {
+            if (fds[1 + i].revents != 0 ? client_read(&clients[i]) : now - clients[i].since > DAEMON_CLIENT_TIMEOUT) {
+                client_drop(i);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) client_accept();
+
+        schedule();
+    }
+
+    /* Running jobs are asked to stop, an incremental write can
+       pick up from where it was next time */
+
+    fprintf(stderr, "Stopping\n");
+
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].state != STATE_RUNNING) continue;
+
+        jobs[i].cancel = 1;
+        kill(jobs[i].pid, SIGTERM);
+    }
+
+    for (int i = 0; i < job_count; i++) {
+        while (jobs[i].state == STATE_RUNNING) job_read(&jobs[i]);
+    }
+
+    while (client_count > 0) client_drop(client_count - 1);
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    return 0;
+}
+
+/* ---- Client ---- */
+
+int daemon_request(const char *socket_path, const char *request) {
+    struct sockaddr_un addr;
+    char buf[4096];
+    ssize_t n;
+    int fd, ret = 0, first = 1;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Could not reach the daemon on %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    if (write_all(fd, request, strlen(request)) < 0 || write_all(fd, "\n", 1) < 0) {
+        perror("write");
+        close(fd);
+        return -1;
+    }
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        if (n < 0) continue;
+
+        if (first && n >= 3 && strncmp(buf, "ERR", 3) == 0) ret = -1;
+
+        first = 0;
+        fwrite(buf, 1, n, stdout);
+    }
+
+    close(fd);
+
+    return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "job.h"
+
+#define DAEMON_SOCKET "/run/rufusl.sock"
+#define DAEMON_JOBS_MAX 64
+#define DAEMON_RUNNING_MAX 8
+#define DAEMON_CLIENTS_MAX 16
+#define DAEMON_LINE_MAX 8192
+#define DAEMON_TICK_MS 1000
+
+/* Jobs come in over a unix socket, one request per connection
+   with the answer sent back before it is closed:
+
+     JOB <arguments>   queue a job, "OK <id>" or "ERR <why>"
+     STATUS            one line per job, then "."
+     CANCEL <id>       drop a queued job or stop a running one
+
+   with the arguments separated by tabs, as job_format() makes
+   them. Queued jobs start in order, as long as no running job
+   writes to the same stick or to one on the same USB hub, which
+   would share its bandwidth. Every job runs in a process of its
+   own that sends its log and progress back through a pipe. */
+
+int daemon_serve(const char *socket_path);
+
+/* Client side, for the command line */
+
+int daemon_request(const char *socket_path, const char *request);
+
+#endif // DAEMON_H
@@ -0,0 +1,220 @@
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <QString>
+
+#include "job.h"
+#include "rufusworker.h"
+#include "log.h"
+#include "definitions.h"
+
+extern "C" {
+#include "linux/copy.h"
+#include "linux/devices.h"
+#include "iso.h"
+}
+
+#define JOB_DRAIN_MS 50
+
+static volatile sig_atomic_t stop_asked = 0;
+
+static void on_stop(int sig) {
+    (void) sig;
+    stop_asked = 1;
+}
+
+void job_usage(void) {
+    fprintf(stderr,
+            "  -d          the image is a raw DD image\n"
+            "  -t table    mbr or gpt (mbr)\n"
+            "  -c size     cluster size index, as in definitions.h (%d)\n"
+            "  -w          wipe the whole stick first\n"
+            "  -V          read everything back\n"
+            "  -z          write zero blocks of a DD image too\n"
+            "  -i          only write what changed since the last DD write\n"
+            "  -C          go through the FAT32 image cache\n"
+            "  -H          keep images off a URL in the download cache\n"
+            "  -P          time a rewrite of 8 MiB in the middle of the stick\n"
+            "  -j threads  copy threads (%d)\n"
+            "  -q depth    queue depth (from the device)\n",
+            BS_4096B, COPY_THREADS_DEFAULT);
+}
+
+int job_parse(int argc, char **argv, cli_job_t *job, char *error, size_t size) {
+
+    int opt;
+
+    memset(job, 0, sizeof(*job));
+    job->partition_scheme = TB_MBR;
+    job->cluster_size = BS_4096B;
+    job->full_format = 1;
+    job->copy_threads = COPY_THREADS_DEFAULT;
+
+    /* The daemon parses one job after the other */
+
+    optind = 0;
+    opterr = 0;
+
+    while ((opt = getopt(argc, argv, "+dt:c:wVziCHPj:q:")) != -1) {
+        switch (opt) {
+        case 'd': job->dd = 1; break;
+        case 't':
+            if (strcmp(optarg, "mbr") == 0) {
+                job->partition_scheme = TB_MBR;
+            } else if (strcmp(optarg, "gpt") == 0) {
+                job->partition_scheme = TB_GPT;
+            } else {
+                snprintf(error, size, "Unknown partition table: %s", optarg);
+                return -1;
+            }
+            break;
+        case 'c': job->cluster_size = atoi(optarg); break;
+        case 'w': job->full_format = 0; break;
+        case 'V': job->verify = 1; break;
+        case 'z': job->zeros = 1; break;
+        case 'i': job->incremental = 1; break;
+        case 'C': job->fat_cache = 1; break;
+        case 'H': job->http_cache = 1; break;
+        case 'P': job->probe_speed = 1; break;
+        case 'j': job->copy_threads = atoi(optarg); break;
+        case 'q': job->io_depth = atoi(optarg); break;
+        default:
+            snprintf(error, size, "Unknown option or missing value: -%c", optopt);
+            return -1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        snprintf(error, size, "Need a device and an image");
+        return -1;
+    }
+
+    if (job->cluster_size < BS_512B || job->cluster_size > BS_32768B ||
+        job->copy_threads < 1 || job->io_depth < 0) {
+        snprintf(error, size, "Cluster size, threads or depth out of range");
+        return -1;
+    }
+
+    /* Like the window, sdb rather than /dev/sdb */
+
+    const char *device = argv[optind];
+
+    if (strncmp(device, "/dev/", 5) == 0) device += 5;
+
+    if (strlen(device) >= sizeof(job->device) || strlen(argv[optind + 1]) >= sizeof(job->image)) {
+        snprintf(error, size, "Device or image name too long");
+        return -1;
+    }
+
+    strcpy(job->device, device);
+    strcpy(job->image, argv[optind + 1]);
+
+    return 0;
+}
+
+int job_format(const cli_job_t *job, char *buf, size_t size) {
+
+    int len = snprintf(buf, size, "%s-t\t%s\t-c\t%d\t-j\t%d\t-q\t%d\t%s%s%s%s%s%s%s%s\t%s",
+                       job->dd ? "-d\t" : "",
+                       job->partition_scheme == TB_GPT ? "gpt" : "mbr",
+                       job->cluster_size, job->copy_threads, job->io_depth,
+                       job->full_format ? "" : "-w\t",
+                       job->verify ? "-V\t" : "",
+                       job->zeros ? "-z\t" : "",
+                       job->incremental ? "-i\t" : "",
+                       job->fat_cache ? "-C\t" : "",
+                       job->http_cache ? "-H\t" : "",
+                       job->probe_speed ? "-P\t" : "",
+                       job->device, job->image);
+
+    return len < 0 || (size_t) len >= size ? -1 : 0;
+}
+
+/* Runs one worker on its own thread like the window does, and
+   feeds the log to the sink until it is done */
+
+static int run_worker(RufusWorker *worker) {
+
+    int cancelled = 0;
+
+    worker->start();
+
+    while (!worker->wait(JOB_DRAIN_MS)) {
+        if (stop_asked && !cancelled) {
+            r_printf("Stopping...\n");
+            worker->cancel();
+            cancelled = 1;
+        }
+
+        log_drain();
+    }
+
+    log_drain();
+
+    /* The worker keeps cancelled only when the job stopped
+       before the end, a stop that came too late changes nothing */
+
+    if (worker->cancelled) return JOB_CANCELLED;
+
+    return worker->failed ? -1 : 0;
+}
+
+int job_run(const cli_job_t *job) {
+
+    struct sigaction sa;
+    Device device;
+    iso_manifest_t manifest;
+    QString path(job->image);
+    int ret;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    memset(&device, 0, sizeof(device));
+
+    if (probe_device(job->device, &device) != 1) {
+        r_printf("%s is not a removable USB disk\n", job->device);
+        log_drain();
+        return -1;
+    }
+
+    iso_manifest_init(&manifest);
+
+    /* An ISO gets scanned first like it does in the window, a
+       scan that fails only means the copy walks it itself */
+
+    if (!job->dd) {
+        RufusWorker scan(NULL, 0xFF, 0xFF, 0xFF, 0xFF, &path, JOB_SCAN);
+
+        scan.manifest = &manifest;
+        run_worker(&scan);
+    }
+
+    RufusWorker worker(&device, job->partition_scheme, FS_FAT32, job->cluster_size,
+                       job->full_format, &path, job->dd ? JOB_DD : JOB_COPY);
+
+    worker.manifest = job->dd ? NULL : &manifest;
+    worker.copy_threads = job->copy_threads;
+    worker.io_depth = job->io_depth;
+    worker.verify = job->verify;
+    worker.zeros = job->zeros;
+    worker.incremental = job->incremental;
+    worker.fat_cache = job->fat_cache;
+    worker.http_cache = job->http_cache;
+    worker.probe_speed = job->probe_speed;
+
+    if (stop_asked) {
+        ret = JOB_CANCELLED;
+    } else {
+        ret = run_worker(&worker);
+    }
+
+    iso_manifest_free(&manifest);
+
+    return ret;
+}
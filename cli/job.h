@@ -0,0 +1,54 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define JOB_ARGS_MAX 32
+
+/* job_run() for a job that SIGINT or SIGTERM stopped early,
+   one that got to the end anyway returns 0 */
+
+#define JOB_CANCELLED 1
+
+/* One write, as given on the command line or sent to the
+   daemon. The fields are the same knobs the window has. */
+
+typedef struct cli_job {
+    char device[16];
+    char image[PATH_MAX];
+    int dd;
+    int partition_scheme;
+    int cluster_size;
+    int full_format;
+    int verify;
+    int zeros;
+    int incremental;
+    int fat_cache;
+    int http_cache;
+    int probe_speed;
+    int copy_threads;
+    int io_depth;
+} cli_job_t;
+
+/* Options and the two arguments, device and image, with
+   argv[0] being the command. Errors go to stderr for the
+   command line and into error for the daemon. */
+
+int job_parse(int argc, char **argv, cli_job_t *job, char *error, size_t size);
+
+/* The same job as tab separated arguments for job_parse() */
+
+int job_format(const cli_job_t *job, char *buf, size_t size);
+
+/* Runs the job with whatever sink the caller set, draining
+   the log from this thread. SIGINT and SIGTERM ask the job to
+   stop. Returns 0 when it went fine, JOB_CANCELLED when it
+   was stopped and -1 when it failed. */
+
+int job_run(const cli_job_t *job);
+
+void job_usage(void);
+
+#endif // JOB_H
@@ -0,0 +1,178 @@
+#include <limits.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "job.h"
+#include "daemon.h"
+#include "log.h"
+
+extern "C" {
+#include "linux/http.h"
+}
+
+/* The engines without the window: one write right here, or
+   jobs handed to a daemon that runs them side by side. Needs
+   root just like the window does. */
+
+typedef struct term {
+    std::mutex lock;
+    int tty;
+    int progress;
+    char ticker[64];
+    double rate;
+    int eta;
+} term_t;
+
+static term_t term;
+
+/* Called with the lock held */
+
+static void term_status(void) {
+    if (!term.tty) return;
+
+    fprintf(stderr, "\r\033[K%3d%% %s", term.progress, term.ticker);
+
+    if (term.rate > 0) fprintf(stderr, " %.1f MB/s", term.rate);
+    if (term.eta >= 0) fprintf(stderr, " ETA %d:%02d", term.eta / 60, term.eta % 60);
+
+    fflush(stderr);
+}
+
+static void term_line(void *ctx, const char *text) {
+    std::lock_guard<std::mutex> hold(term.lock);
+
+    (void) ctx;
+
+    if (term.tty) fputs("\r\033[K", stderr);
+
+    fputs(text, stderr);
+    term_status();
+}
+
+static void term_progress(void *ctx, int value) {
+    std::lock_guard<std::mutex> hold(term.lock);
+
+    (void) ctx;
+
+    term.progress = value;
+    term_status();
+}
+
+/* Without a terminal to redraw, the tickers get a line in
+   the log, so they stay in order with the rest of it */
+
+static void term_ticker(void *ctx, const char *text) {
+    std::lock_guard<std::mutex> hold(term.lock);
+
+    (void) ctx;
+
+    snprintf(term.ticker, sizeof(term.ticker), "%s", text);
+
+    if (!term.tty) r_printf("== %s\n", text);
+
+    term_status();
+}
+
+static void term_rate(void *ctx, double now, double avg, int eta) {
+    std::lock_guard<std::mutex> hold(term.lock);
+
+    (void) ctx;
+    (void) now;
+
+    term.rate = avg;
+    term.eta = eta;
+    term_status();
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s write [options] device image\n"
+            "       %s submit [options] device image\n"
+            "       %s status\n"
+            "       %s cancel id\n"
+            "       %s daemon\n"
+            "write runs the job here, submit queues it with the daemon.\n"
+            "The image is a file or an http:// or https:// URL.\n"
+            "Options:\n",
+            name, name, name, name, name);
+    job_usage();
+    fprintf(stderr,
+            "The daemon listens on %s, or on RUFUSL_SOCKET.\n"
+            "Everything on the device is lost.\n",
+            DAEMON_SOCKET);
+}
+
+int main(int argc, char **argv) {
+
+    const char *socket_path = getenv("RUFUSL_SOCKET");
+    char error[256];
+    char request[DAEMON_LINE_MAX];
+    cli_job_t job;
+
+    if (socket_path == NULL) socket_path = DAEMON_SOCKET;
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const char *command = argv[1];
+
+    if (strcmp(command, "daemon") == 0 && argc == 2) return daemon_serve(socket_path) < 0 ? 1 : 0;
+    if (strcmp(command, "status") == 0 && argc == 2) return daemon_request(socket_path, "STATUS") < 0 ? 1 : 0;
+
+    if (strcmp(command, "cancel") == 0 && argc == 3) {
+        snprintf(request, sizeof(request), "CANCEL\t%d", atoi(argv[2]));
+        return daemon_request(socket_path, request) < 0 ? 1 : 0;
+    }
+
+    if (strcmp(command, "write") != 0 && strcmp(command, "submit") != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (job_parse(argc - 1, argv + 1, &job, error, sizeof(error)) < 0) {
+        fprintf(stderr, "%s\n", error);
+        usage(argv[0]);
+        return 2;
+    }
+
+    /* The daemon has a working directory of its own */
+
+    char image[PATH_MAX];
+
+    if (!http_is_url(job.image)) {
+        if (realpath(job.image, image) == NULL) {
+            perror(job.image);
+            return 1;
+        }
+
+        snprintf(job.image, sizeof(job.image), "%s", image);
+    }
+
+    if (strcmp(command, "submit") == 0) {
+        int len = snprintf(request, sizeof(request), "JOB\t");
+
+        if (job_format(&job, request + len, sizeof(request) - len) < 0) {
+            fprintf(stderr, "Job too long to submit\n");
+            return 2;
+        }
+
+        return daemon_request(socket_path, request) < 0 ? 1 : 0;
+    }
+
+    log_sink_t sink = { term_line, term_progress, term_ticker, term_rate, NULL };
+
+    term.tty = isatty(STDERR_FILENO);
+    term.eta = -1;
+    log_set_sink(&sink);
+
+    int ret = job_run(&job);
+
+    if (term.tty) fputs("\n", stderr);
+
+    return ret == 0 ? 0 : 1;
+}
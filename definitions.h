@@ -3,9 +3,11 @@
 
 #define FS_FAT32 0
 #define FS_NTFS 1
+#define FS_EXFAT 2
 
 #define FS_FAT32_LABEL "FAT32"
 #define FS_NTFS_LABEL "NTFS"
+#define FS_EXFAT_LABEL "exFAT"
 
 #define BS_512B 0
 #define BS_1024B 1
@@ -37,11 +39,13 @@
 
 #define MOUNT_FAT32 "vfat"
 #define MOUNT_NTFS "ntfs"
+#define MOUNT_EXFAT "exfat"
 #define MOUNT_ISO9660 "iso9660"
 #define MOUNT_UDF "udf"
 
 #define JOB_SCAN 1
 #define JOB_COPY 2
+#define JOB_DD 3
 
 #endif // DEFINITIONS
 
@@ -1,107 +1,387 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include <errno.h>
-#include <ftw.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "iso.h"
+#include "isofs.h"
 #include "log.h"
 #include "definitions.h"
 #include "rufusl.h"
+#include "linux/mounting.h"
+#include "linux/http.h"
 
 static char* dest = "/mnt/temp";
 static iso_info_t info;
+static RUFUS_IMG_REPORT img_report;
+
+/* Everything the scan looks for. Names are lowercase and
+   have no leading slash. MARK_PATH entries have to match
+   the whole path, MARK_NAME entries only its last part. */
+
+#define MARK_NAME 0
+#define MARK_PATH 1
+
+enum marker_kind {
+    MK_EFI,
+    MK_BOOTMGR,
+    MK_GRLDR,
+    MK_LDLINUX,
+    MK_SYSLINUX_CFG,
+    MK_ARCH_CFG,
+    MK_ISOLINUX_BIN,
+    MK_GRUB_DIR,
+    MK_GRUB_CFG,
+    MK_GRUB_NORMAL,
+    MK_WIM,
+    MK_PE,
+    MK_REACTOS,
+    MK_KOLIBRI,
+    MK_AUTORUN,
+    MK_OLD_C32
+};
+
+typedef struct marker {
+    const char *name;
+    uint8_t kind;
+    uint8_t scope;
+    uint8_t arg;
+} marker_t;
+
+static const marker_t markers[] = {
+    { "efi/boot/bootia32.efi",        MK_EFI,          MARK_PATH, 0 },
+    { "efi/boot/bootia64.efi",        MK_EFI,          MARK_PATH, 1 },
+    { "efi/boot/bootx64.efi",         MK_EFI,          MARK_PATH, 2 },
+    { "efi/boot/bootarm.efi",         MK_EFI,          MARK_PATH, 3 },
+    { "efi/boot/bootaa64.efi",        MK_EFI,          MARK_PATH, 4 },
+    { "efi/boot/bootebc.efi",         MK_EFI,          MARK_PATH, 5 },
+    { "bootmgr",                      MK_BOOTMGR,      MARK_PATH, 0 },
+    { "bootmgr.efi",                  MK_BOOTMGR,      MARK_PATH, 1 },
+    { "grldr",                        MK_GRLDR,        MARK_PATH, 0 },
+    { "ldlinux.sys",                  MK_LDLINUX,      MARK_NAME, 0 },
+    { "ldlinux.c32",                  MK_LDLINUX,      MARK_NAME, 1 },
+    { "isolinux.cfg",                 MK_SYSLINUX_CFG, MARK_NAME, 0 },
+    { "syslinux.cfg",                 MK_SYSLINUX_CFG, MARK_NAME, 0 },
+    { "extlinux.conf",                MK_SYSLINUX_CFG, MARK_NAME, 0 },
+    { "archiso_sys32.cfg",            MK_ARCH_CFG,     MARK_NAME, 0 },
+    { "archiso_sys64.cfg",            MK_ARCH_CFG,     MARK_NAME, 0 },
+    { "isolinux.bin",                 MK_ISOLINUX_BIN, MARK_NAME, 0 },
+    { "boot.bin",                     MK_ISOLINUX_BIN, MARK_NAME, 0 },
+    { "boot/grub/i386-pc",            MK_GRUB_DIR,     MARK_PATH, 0 },
+    { "grub.cfg",                     MK_GRUB_CFG,     MARK_NAME, 0 },
+    { "boot/grub/i386-pc/normal.mod", MK_GRUB_NORMAL,  MARK_PATH, 0 },
+    { "sources/install.wim",          MK_WIM,          MARK_PATH, 0 },
+    { "sources/install.swm",          MK_WIM,          MARK_PATH, 0 },
+    { "i386/ntdetect.com",            MK_PE,           MARK_PATH, 0x01 },
+    { "i386/setupldr.bin",            MK_PE,           MARK_PATH, 0x02 },
+    { "i386/txtsetup.sif",            MK_PE,           MARK_PATH, 0x04 },
+    { "minint/ntdetect.com",          MK_PE,           MARK_PATH, 0x08 },
+    { "minint/setupldr.bin",          MK_PE,           MARK_PATH, 0x10 },
+    { "minint/txtsetup.sif",          MK_PE,           MARK_PATH, 0x20 },
+    { "setupldr.sys",                 MK_REACTOS,      MARK_NAME, 0 },
+    { "kolibri.img",                  MK_KOLIBRI,      MARK_PATH, 0 },
+    { "autorun.inf",                  MK_AUTORUN,      MARK_PATH, 0 },
+    { "menu.c32",                     MK_OLD_C32,      MARK_NAME, 0 },
+    { "vesamenu.c32",                 MK_OLD_C32,      MARK_NAME, 1 }
+};
+
+#define NB_MARKERS (sizeof(markers) / sizeof(markers[0]))
+
+/* Open addressing table over the FNV-1a hash of each marker,
+   with the scope folded in. It is filled once and is sparse
+   enough that a lookup almost never probes a second slot. */
+
+#define MARKER_SLOTS 128
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+#define WINPE_I386 0x07
+#define WINPE_MININT 0x38
+
+#define SL_VERSION_MAX (256 * 1024)
+#define GRUB_VERSION_MAX (1024 * 1024)
+
+static uint8_t marker_slot[MARKER_SLOTS];
+static uint32_t marker_hash[MARKER_SLOTS];
+static int markers_ready = 0;
+
+static uint32_t scope_hash(uint32_t hash, uint8_t scope) {
+    return hash ^ (scope * 0x9E3779B9u);
+}
+
+static void build_markers(void) {
+
+    for (uint32_t i = 0; i < NB_MARKERS; i++) {
+        uint32_t hash = FNV_BASIS;
+
+        for (const char *p = markers[i].name; *p; p++) {
+            hash = (hash ^ (uint8_t) *p) * FNV_PRIME;
+        }
+
+        hash = scope_hash(hash, markers[i].scope);
 
-static const char* bootmgr_efi_name = "bootmgr.efi";
-static const char* grldr_name = "grldr";
-static const char* ldlinux_name = "ldlinux.sys";
-static const char* ldlinux_c32 = "ldlinux.c32";
+        uint32_t slot = hash & (MARKER_SLOTS - 1);
 
-static const char* efi[] = { "efi/boot/bootia32.efi",
-                             "efi/boot/bootia64.efi",
-                             "efi/boot/bootx64.efi",
-                             "efi/boot/bootarm.efi",
-                             "efi/boot/bootaa64.efi",
-                             "efi/boot/bootebc.efi" };
+        while (marker_slot[slot] != 0) slot = (slot + 1) & (MARKER_SLOTS - 1);
 
-static const char* windows_wim[] = { "/sources/install.wim",
-                                     "/sources/install.swm" };
+        marker_slot[slot] = i + 1;
+        marker_hash[slot] = hash;
+    }
 
-static const char* grub_dirname = "/boot/grub/i386-pc";
-static const char* grub_cfg = "grub.cfg";
-static const char* syslinux_cfg[] = { "isolinux.cfg", "syslinux.cfg", "extlinux.conf" };
-static const char* arch_cfg[] = { "archiso_sys32.cfg", "archiso_sys64.cfg" };
-static const char* isolinux_tmp = ".\\isolinux.tmp";
-static const char* isolinux_bin[] = { "isolinux.bin", "boot.bin" };
-static const char* pe_dirname[] = { "/i386", "/minint" };
-static const char* pe_file[] = { "ntdetect.com", "setupldr.bin", "txtsetup.sif" };
-static const char* reactos_name = "setupldr.sys";
-static const char* kolibri_name = "kolibri.img";
-static const char* autorun_name = "autorun.inf";
+    markers_ready = 1;
+}
 
-int compare_string(const char *a, const char *b) {
+static const marker_t *find_marker(uint32_t hash, uint8_t scope, const char *name) {
 
-    uint32_t len = strlen(a);
+    hash = scope_hash(hash, scope);
 
-    if (len != strlen(b)) return -1;
+    for (uint32_t slot = hash & (MARKER_SLOTS - 1); marker_slot[slot] != 0;
+         slot = (slot + 1) & (MARKER_SLOTS - 1)) {
+        const marker_t *m = &markers[marker_slot[slot] - 1];
 
-    for (int i = 0; i < len; i++) {
-        if (*(a+i) != *(b+i)) return -1;
+        if (marker_hash[slot] == hash && m->scope == scope && strcmp(m->name, name) == 0) {
+            return m;
+        }
     }
 
-    return 0;
+    return NULL;
+}
+
+/* Where to get the contents of a file from, either the image
+   itself through isofs or a file under the mount point */
+
+static int path_read(void *ctx, void *buf, size_t len, uint64_t offset) {
+
+    int fd = open((const char *) ctx, O_RDONLY);
+
+    if (fd < 0) return -1;
+
+    ssize_t ret = pread(fd, buf, len, offset);
+
+    close(fd);
+
+    return ret == (ssize_t) len ? 0 : -1;
+}
+
+static char *read_head(isofs_read_t reader, void *ctx, uint64_t offset,
+                       uint64_t size, size_t limit, size_t *len) {
+
+    char *buf;
+
+    if (reader == NULL || size == 0) return NULL;
+
+    *len = size < limit ? size : limit;
+
+    if ((buf = malloc(*len + 1)) == NULL) return NULL;
+
+    if (reader(ctx, buf, *len, offset) < 0) {
+        free(buf);
+        return NULL;
+    }
+
+    buf[*len] = 0x00;
+
+    return buf;
+}
+
+/* The banner isolinux.bin and ldlinux.sys print, something
+   like "ISOLINUX 6.03 20171017 ETCD ..." */
+
+static void syslinux_version(isofs_read_t reader, void *ctx, uint64_t offset,
+                             uint64_t size) {
+
+    size_t len;
+    char *buf = read_head(reader, ctx, offset, size, SL_VERSION_MAX, &len);
+
+    if (buf == NULL) return;
+
+    for (size_t i = 3; i + 6 < len; i++) {
+        if (memcmp(buf + i, "LINUX ", 6) != 0) continue;
+
+        if (memcmp(buf + i - 3, "ISO", 3) != 0 && memcmp(buf + i - 3, "SYS", 3) != 0 &&
+            memcmp(buf + i - 3, "EXT", 3) != 0 && memcmp(buf + i - 3, "PXE", 3) != 0) {
+            continue;
+        }
+
+        unsigned int major, minor;
+        int used;
+
+        if (sscanf(buf + i + 6, "%u.%u%n", &major, &minor, &used) != 2 || major > 255 || minor > 255) {
+            continue;
+        }
+
+        const char *ext = buf + i + 6 + used;
+        size_t ext_len = 0;
+
+        while (ext_len < sizeof(img_report.sl_version_ext) - 1 && isgraph((uint8_t) ext[ext_len])) ext_len++;
+
+        img_report.sl_version = (major << 8) | minor;
+        snprintf(img_report.sl_version_str, sizeof(img_report.sl_version_str), "%u.%02u", major, minor);
+        memcpy(img_report.sl_version_ext, ext, ext_len);
+        img_report.sl_version_ext[ext_len] = 0x00;
+        break;
+    }
 
+    free(buf);
 }
 
-int iso_scan(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+/* normal.mod has the "GRUB  version %s" format string, and
+   the version it gets filled in with right after it */
 
-  /* Allocate new array and copy fpath into it because
-     nftw() has an assertion if fpath has been changed. */
+static void grub_version(isofs_read_t reader, void *ctx, uint64_t offset, uint64_t size) {
 
-  char buf[strlen(fpath) + 1];
-  memcpy(buf, fpath, strlen(fpath) + 1);
+    static const char grub_version_str[] = "GRUB  version %s";
+    size_t len;
+    char *buf = read_head(reader, ctx, offset, size, GRUB_VERSION_MAX, &len);
 
-  /* Get length of path where the loop device is mounted */
+    if (buf == NULL) return;
 
-  uint32_t a_len = strlen(TEMP_DIR_ISO);
+    for (size_t i = 0; i + sizeof(grub_version_str) < len; i++) {
+        if (memcmp(buf + i, grub_version_str, sizeof(grub_version_str)) == 0) {
+            snprintf(img_report.grub2_version, sizeof(img_report.grub2_version), "%s",
+                     buf + i + sizeof(grub_version_str));
+            break;
+        }
+    }
+
+    free(buf);
+}
+
+static void mark(const marker_t *m, const char *path, uint8_t is_dir, uint64_t size,
+                 isofs_read_t reader, void *ctx, uint64_t offset) {
+
+    /* Only the grub directory is interesting as a directory */
+
+    if (is_dir != (m->kind == MK_GRUB_DIR)) return;
+
+    switch (m->kind) {
+    case MK_EFI:
+        img_report.has_efi |= 1 << m->arg;
+        info.has_uefi = 1;
+        break;
+    case MK_BOOTMGR:
+        img_report.has_bootmgr = TRUE;
+        info.has_windows = 1;
+        break;
+    case MK_GRLDR:
+        img_report.has_grub4dos = TRUE;
+        break;
+    case MK_LDLINUX:
+        info.has_syslinux = 1;
+        if (m->arg == 0 && img_report.sl_version == 0) syslinux_version(reader, ctx, offset, size);
+        break;
+    case MK_SYSLINUX_CFG:
+        info.has_syslinux = 1;
+        if (strncasecmp(path, "efi/", 4) == 0) img_report.has_efi_syslinux = TRUE;
+
+        /* The shallowest config is the one that gets used */
+
+        if (img_report.cfg_path[0] == 0x00 || strlen(path) + 1 < strlen(img_report.cfg_path)) {
+            snprintf(img_report.cfg_path, sizeof(img_report.cfg_path), "/%s", path);
+        }
+        break;
+    case MK_ARCH_CFG:
+        info.has_arch = 1;
+        break;
+    case MK_ISOLINUX_BIN:
+        if (img_report.sl_version == 0) syslinux_version(reader, ctx, offset, size);
+        break;
+    case MK_GRUB_DIR:
+        img_report.has_grub2 = TRUE;
+        info.has_grub = 1;
+        break;
+    case MK_GRUB_CFG:
+        info.has_grub = 1;
+        break;
+    case MK_GRUB_NORMAL:
+        grub_version(reader, ctx, offset, size);
+        break;
+    case MK_WIM:
+        info.has_windows = 1;
+        snprintf(img_report.install_wim_path, sizeof(img_report.install_wim_path), "/%s", path);
+        break;
+    case MK_PE:
+        img_report.winpe |= m->arg;
+        if (m->arg & WINPE_MININT) img_report.uses_minint = TRUE;
+        break;
+    case MK_REACTOS:
+        snprintf(img_report.reactos_path, sizeof(img_report.reactos_path), "/%s", path);
+        break;
+    case MK_KOLIBRI:
+        img_report.has_kolibrios = TRUE;
+        break;
+    case MK_AUTORUN:
+        img_report.has_autorun = TRUE;
+        info.has_autorun = 1;
+        break;
+    case MK_OLD_C32:
+        img_report.has_old_c32[m->arg] = TRUE;
+        break;
+    }
+}
+
+/* Checks for one file or directory of the image, path is
+   relative to its root and has no leading slash. The path
+   gets lowercased and hashed as a whole and from its last
+   slash on in the same loop, so the cost does not depend
+   on how many markers there are. */
+
+static void scan_path(const char *path, uint8_t is_dir, uint64_t size,
+                      isofs_read_t reader, void *ctx, uint64_t offset) {
+
+    char lower[PATH_MAX];
+    uint32_t path_hash = FNV_BASIS;
+    uint32_t name_hash = FNV_BASIS;
+    size_t len = 0, name_start = 0;
+
+    for (const char *p = path; *p && len < sizeof(lower) - 1; p++) {
+        uint8_t c = tolower((uint8_t) *p);
 
-  /* Trim soure path. Write each char from (buf + a_len + 1) to buf. */
+        lower[len++] = c;
+        path_hash = (path_hash ^ c) * FNV_PRIME;
 
-  uint32_t i = a_len + 1;
-  uint32_t j = 0;
+        if (c == '/') {
+            name_start = len;
+            name_hash = FNV_BASIS;
+        } else {
+            name_hash = (name_hash ^ c) * FNV_PRIME;
+        }
+    }
 
-  for (; j < sizeof(buf) - a_len; i++) {
-    buf[j] = *(buf + i);
-    j++;
-  }
+    lower[len] = 0x00;
 
-  buf[j] = 0x00; /* Null-terminate the string. Now we have a relative path */
+    if (len == 0) return;
 
+    if (!is_dir) {
+        img_report.projected_size += size;
 
-  if (buf == NULL || strlen(buf) <= 0) return 0;
+        if (size >= FAT32_MAX) {
+            info.has_4gb = 1;
+            img_report.has_4GB_file = TRUE;
+        }
+    }
 
-  if (sb->st_size > FAT32_MAX) {
-      info.has_4gb = 1;
-  }
+    if (len - name_start > 64) img_report.has_long_filename = TRUE;
 
-  for(int i = 0; i < strlen(buf); i++){
-    *(buf + i) = tolower(*(buf + i));
-  }
+    const marker_t *m = find_marker(path_hash, MARK_PATH, lower);
 
-  for (int i = 0; i < 5; i++) {
-      if (compare_string(buf, efi[i]) == 0) {
-          info.has_uefi = 1;
-      }
-  }
+    if (m != NULL) mark(m, path, is_dir, size, reader, ctx, offset);
 
-  return 0;
+    if ((m = find_marker(name_hash, MARK_NAME, lower + name_start)) != NULL) {
+        mark(m, path, is_dir, size, reader, ctx, offset);
+    }
 }
 
-int recursive_iso_scan(uint32_t *loop_fd) {
+static void reset_info(void) {
 
     info.has_syslinux = 0;
     info.has_grub = 0;
@@ -111,13 +391,222 @@ int recursive_iso_scan(uint32_t *loop_fd) {
     info.has_autorun = 0;
     info.has_4gb = 0;
 
+    memset(info.label, 0, sizeof(info.label));
+    memset(&img_report, 0, sizeof(img_report));
+
+    img_report.is_iso = TRUE;
+
+    if (!markers_ready) build_markers();
+}
+
+static void log_report(void) {
+
+    if (img_report.sl_version != 0) {
+        r_printf(" * Detected Syslinux version: %s%s (from '%s')\n", img_report.sl_version_str,
+                 img_report.sl_version_ext, img_report.cfg_path);
+    } else if (info.has_syslinux) {
+        r_printf(" * Uses Syslinux (unknown version)\n");
+    }
+
+    if (img_report.has_grub2) {
+        r_printf(" * Detected Grub version: %s\n",
+                 img_report.grub2_version[0] ? img_report.grub2_version : "unknown");
+    }
+
+    if (img_report.has_grub4dos) r_printf(" * Uses Grub4DOS\n");
+    if (info.has_uefi) r_printf(" * Uses EFI\n");
+    if (img_report.has_bootmgr) r_printf(" * Uses Bootmgr\n");
+    if (img_report.install_wim_path[0]) r_printf(" * Has %s\n", img_report.install_wim_path);
+
+    if ((img_report.winpe & WINPE_I386) == WINPE_I386 || (img_report.winpe & WINPE_MININT) == WINPE_MININT) {
+        r_printf(" * Uses WinPE%s\n", img_report.uses_minint ? " (with /minint)" : "");
+    }
+
+    if (img_report.reactos_path[0]) r_printf(" * Uses ReactOS: %s\n", img_report.reactos_path);
+    if (img_report.has_kolibrios) r_printf(" * Uses KolibriOS\n");
+    if (info.has_arch) r_printf(" * Uses Arch Linux config\n");
+    if (img_report.has_autorun) r_printf(" * Has autorun.inf\n");
+    if (img_report.has_4GB_file) r_printf(" * Has a >4GB file\n");
+    if (img_report.has_long_filename) r_printf(" * Has long filenames\n");
+}
+
+const RUFUS_IMG_REPORT *iso_report(void) {
+    return &img_report;
+}
+
+void iso_manifest_init(iso_manifest_t *manifest) {
+
+    manifest->valid = 0;
+    manifest->from_image = 0;
+    manifest->has_4gb = 0;
+    manifest->isopath[0] = 0x00;
+    copy_list_init(&manifest->list);
+}
+
+void iso_manifest_free(iso_manifest_t *manifest) {
+
+    copy_list_free(&manifest->list);
+    iso_manifest_init(manifest);
+}
+
+/* Stamp the manifest with what the image looked like when
+   it was scanned, so a copy can tell if it is still good */
+
+/* An image off a URL has no inode, the server's say on its
+   version stands in for the mtime */
+
+static int image_stat(const char *isopath, uint64_t *size, struct timespec *mtime) {
+
+    struct stat st;
+
+    if (http_is_url(isopath)) return http_stat(isopath, size, mtime);
+
+    if (stat(isopath, &st) < 0) return -1;
+
+    *size = st.st_size;
+    *mtime = st.st_mtim;
+
+    return 0;
+}
+
+static int manifest_stamp(iso_manifest_t *manifest, const char *isopath) {
+
+    if (strlen(isopath) >= sizeof(manifest->isopath) ||
+        image_stat(isopath, &manifest->size, &manifest->mtime) < 0) return -1;
+
+    strcpy(manifest->isopath, isopath);
+
+    return 0;
+}
+
+int iso_manifest_valid(const iso_manifest_t *manifest, const char *isopath) {
+
+    uint64_t size;
+    struct timespec mtime;
+
+    if (manifest == NULL || !manifest->valid || strcmp(manifest->isopath, isopath) != 0) return 0;
+
+    if (image_stat(isopath, &size, &mtime) < 0) return 0;
+
+    return size == manifest->size &&
+           mtime.tv_sec == manifest->mtime.tv_sec &&
+           mtime.tv_nsec == manifest->mtime.tv_nsec;
+}
+
+/* Whether every file can be read from the image at its
+   offset in one piece, without going through a mount */
+
+int iso_manifest_direct(const iso_manifest_t *manifest) {
+
+    if (!manifest->valid || !manifest->from_image) return 0;
+
+    for (uint32_t i = 0; i < manifest->list.count; i++) {
+        if (manifest->list.entries[i].fragmented) return 0;
+    }
+
+    return 1;
+}
+
+/* Hand the list over to the manifest, or drop it when the
+   caller did not ask for one */
+
+static void keep_list(iso_manifest_t *manifest, const char *isopath, copy_list_t *list) {
+
+    if (manifest == NULL) {
+        copy_list_free(list);
+        return;
+    }
+
+    iso_manifest_free(manifest);
+
+    if (manifest_stamp(manifest, isopath) < 0) {
+        copy_list_free(list);
+        return;
+    }
+
+    manifest->list = *list;
+    manifest->valid = 1;
+    manifest->has_4gb = info.has_4gb;
+
+    copy_list_init(list);
+}
+
+/* Scan the image without mounting it, the file system
+   gets read straight from the file. Falls back to nothing,
+   so the caller can still try recursive_iso_scan(). */
+
+int iso_scan_image(const char *isopath, iso_manifest_t *manifest) {
+
+    isofs_t fs;
+    copy_list_t list;
+
+    reset_info();
+
+    if (manifest != NULL) iso_manifest_free(manifest);
+
+    if (isofs_open(&fs, isopath) < 0) return -1;
+
+    copy_list_init(&list);
+
+    if (isofs_list(&fs, &list) < 0) {
+        r_printf("Failed to read the %s file system\n", isofs_type_name(&fs));
+        copy_list_free(&list);
+        isofs_close(&fs);
+        return -1;
+    }
+
+    /* Copies then read the image front to back, rather than
+       jumping around in directory order */
+
+    if (copy_list_sort_extents(&list) < 0) {
+        r_printf("Could not sort files by extent, keeping directory order\n");
+    }
+
+    for(int i = 0; i < sizeof(info.label) - 1 && fs.label[i]; i++){
+      info.label[i] = toupper(fs.label[i]);
+    }
+
+    snprintf(img_report.label, sizeof(img_report.label), "%s", fs.label);
+
+    r_printf(" * Label: %s\n", info.label);
+    r_printf(" * File system: %s, %u files, %llu bytes\n", isofs_type_name(&fs),
+             list.file_count, (unsigned long long) list.total_bytes);
+
+    for (uint32_t i = 0; i < list.count; i++) {
+        copy_entry_t *e = &list.entries[i];
+
+        scan_path(e->path, e->is_dir, e->size, e->fragmented ? NULL : fs.read, fs.ctx, e->offset);
+    }
+
+    log_report();
+
+    isofs_close(&fs);
+    keep_list(manifest, isopath, &list);
+
+    if (manifest != NULL) manifest->from_image = manifest->valid;
+
+    set_ticker("READY");
+
+    return 0;
+}
+
+/* Same as iso_scan_image(), but for an image that the kernel
+   already mounted at TEMP_DIR_ISO */
+
+int recursive_iso_scan(const char *isopath, uint32_t *loop_fd, iso_manifest_t *manifest) {
+
+    char full[PATH_MAX];
+    copy_list_t list;
+
+    reset_info();
+
+    if (manifest != NULL) iso_manifest_free(manifest);
+
     if (lseek(*loop_fd, (off_t) LABEL_OFFSET, SEEK_SET) < 0) {
         r_printf("Falied to seek file: %s\n", strerror(errno));
         return -1;
     }
 
-    memset(info.label, 0, 11);
-
     if (read(*loop_fd, info.label, (size_t) 11) < 0) {
         r_printf("Error reading label from ISO: %s\n", strerror(errno));
     }
@@ -126,14 +615,28 @@ int recursive_iso_scan(uint32_t *loop_fd) {
       info.label[i] = toupper(info.label[i]);
     }
 
+    snprintf(img_report.label, sizeof(img_report.label), "%s", info.label);
+
     r_printf(" * Label: %s\n", info.label);
 
-    nftw(TEMP_DIR_ISO, iso_scan, 4, 0);
+    copy_list_init(&list);
 
-    if (info.has_uefi) {
-        r_printf(" * Uses EFI\n");
+    if (build_copy_list(TEMP_DIR_ISO, &list) < 0) {
+        copy_list_free(&list);
+        return -1;
     }
 
+    for (uint32_t i = 0; i < list.count; i++) {
+        copy_entry_t *e = &list.entries[i];
+
+        snprintf(full, sizeof(full), "%s/%s", TEMP_DIR_ISO, e->path);
+        scan_path(e->path, e->is_dir, e->size, path_read, full, 0);
+    }
+
+    log_report();
+
+    keep_list(manifest, isopath, &list);
+
     if (lseek(*loop_fd, (off_t) 0, SEEK_SET) < 0) {
         r_printf("Falied to seek file: %s\n", strerror(errno));
         return -1;
@@ -141,4 +644,5 @@ int recursive_iso_scan(uint32_t *loop_fd) {
 
     set_ticker("READY");
 
+    return 0;
 }
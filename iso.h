@@ -1,12 +1,15 @@
 #ifndef ISO_H
 #define ISO_H
 
+#include <limits.h>
 #include <stdint.h>
+#include <time.h>
+
 #include "rufusl.h"
+#include "linux/copy.h"
 
 #define LABEL_OFFSET 0x8028
 #define FAT32_MAX 4294967296LL
-#define TEMP_DIR_ISO "/mnt/rufus_isofs"
 
 typedef struct iso_info {
 
@@ -18,7 +21,7 @@ typedef struct iso_info {
     uint8_t has_autorun;
     uint8_t has_4gb;
 
-    char label[11];
+    char label[12];
 
 } iso_info_t;
 
@@ -56,6 +59,31 @@ typedef struct {
 } RUFUS_IMG_REPORT;
 
 
-int recursive_iso_scan(uint32_t *loop_fds);
+/* What one scan found in the image, kept around so the copy
+   job does not have to walk the image again. Only good while
+   the image keeps the size and mtime it had back then.
+   from_image says the offsets in the list point into the
+   image file itself rather than being left at zero. */
+
+/* has_4gb is set when a file is too big for FAT32 */
+
+typedef struct iso_manifest {
+    uint8_t valid;
+    uint8_t from_image;
+    uint8_t has_4gb;
+    char isopath[PATH_MAX];
+    uint64_t size;
+    struct timespec mtime;
+    copy_list_t list;
+} iso_manifest_t;
+
+void iso_manifest_init(iso_manifest_t *manifest);
+void iso_manifest_free(iso_manifest_t *manifest);
+int iso_manifest_valid(const iso_manifest_t *manifest, const char *isopath);
+int iso_manifest_direct(const iso_manifest_t *manifest);
+
+int recursive_iso_scan(const char *isopath, uint32_t *loop_fds, iso_manifest_t *manifest);
+int iso_scan_image(const char *isopath, iso_manifest_t *manifest);
+const RUFUS_IMG_REPORT *iso_report(void);
 
 #endif // ISO_H
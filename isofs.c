@@ -0,0 +1,860 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "isofs.h"
+#include "log.h"
+#include "linux/http.h"
+
+/* A reader for the file systems found on install media, so the
+   image can be listed without root, a loop device or a mount.
+   Only the metadata gets read: the volume descriptors, the
+   directories and, for UDF, one file entry per file. */
+
+#define VD_START 16
+#define VD_MAX 64
+#define MAX_DEPTH 64
+#define MAX_DIR_SIZE (64 << 20)
+#define MAX_CE_HOPS 16
+#define MAX_NAME 1024
+
+#define ISO_FLAG_DIR 0x02
+#define ISO_FLAG_ASSOC 0x04
+#define ISO_FLAG_MULTI 0x80
+
+#define UDF_AVDP_SECTOR 256
+#define UDF_TAG_PD 5
+#define UDF_TAG_LVD 6
+#define UDF_TAG_TD 8
+#define UDF_TAG_AVDP 2
+#define UDF_TAG_FSD 256
+#define UDF_TAG_FID 257
+#define UDF_TAG_FE 261
+#define UDF_TAG_EFE 266
+
+#define UDF_FILETYPE_DIR 4
+#define UDF_AD_SHORT 0
+#define UDF_AD_LONG 1
+#define UDF_AD_EMBEDDED 3
+
+#define UDF_FID_DIR 0x02
+#define UDF_FID_DELETED 0x04
+#define UDF_FID_PARENT 0x08
+
+static const char *type_names[] = {"ISO9660", "Joliet", "Rock Ridge", "UDF"};
+
+typedef struct udf_file {
+  int is_dir;
+  uint64_t size;
+  uint64_t offset;
+  int fragmented;
+  int ad_type;
+  const uint8_t *ad;
+  uint32_t ad_len;
+} udf_file_t;
+
+/* Multi-extent ISO9660 files come as several records with
+   the same name, this collects them into one entry */
+
+typedef struct iso_multi {
+  int active;
+  char path[PATH_MAX];
+  uint64_t size;
+  uint64_t offset;
+  uint64_t next;
+  int fragmented;
+} iso_multi_t;
+
+static uint16_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+
+static uint32_t le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t le64(const uint8_t *p) {
+  return le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static int file_read(void *ctx, void *buf, size_t len, uint64_t offset) {
+  int fd = *(int *)ctx;
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t ret = pread(fd, (char *)buf + done, len - done, offset + done);
+
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    if (ret == 0) {
+      errno = EIO;
+      return -1;
+    }
+
+    done += ret;
+  }
+
+  return 0;
+}
+
+static int rd(isofs_t *fs, void *buf, size_t len, uint64_t offset) {
+  if (fs->read(fs->ctx, buf, len, offset) < 0) {
+    r_printf("Failed to read image at %llu: %s\n",
+             (unsigned long long)offset, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ---- Names ---- */
+
+static size_t put_utf8(char *out, size_t pos, size_t size, uint32_t c) {
+  char tmp[4];
+  size_t n;
+
+  if (c < 0x80) {
+    tmp[0] = c;
+    n = 1;
+  } else if (c < 0x800) {
+    tmp[0] = 0xC0 | (c >> 6);
+    tmp[1] = 0x80 | (c & 0x3F);
+    n = 2;
+  } else if (c < 0x10000) {
+    tmp[0] = 0xE0 | (c >> 12);
+    tmp[1] = 0x80 | ((c >> 6) & 0x3F);
+    tmp[2] = 0x80 | (c & 0x3F);
+    n = 3;
+  } else {
+    tmp[0] = 0xF0 | (c >> 18);
+    tmp[1] = 0x80 | ((c >> 12) & 0x3F);
+    tmp[2] = 0x80 | ((c >> 6) & 0x3F);
+    tmp[3] = 0x80 | (c & 0x3F);
+    n = 4;
+  }
+
+  if (pos + n >= size) return pos;
+
+  memcpy(out + pos, tmp, n);
+
+  return pos + n;
+}
+
+static void ucs2_to_utf8(const uint8_t *src, size_t len, char *out,
+                         size_t size) {
+  size_t pos = 0;
+
+  for (size_t i = 0; i + 1 < len; i += 2) {
+    uint32_t c = (src[i] << 8) | src[i + 1];
+
+    if (c >= 0xD800 && c < 0xDC00 && i + 3 < len) {
+      uint32_t low = (src[i + 2] << 8) | src[i + 3];
+      c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+      i += 2;
+    }
+
+    pos = put_utf8(out, pos, size, c);
+  }
+
+  out[pos] = 0x00;
+}
+
+/* OSTA CS0, the one character set UDF uses: a compression id
+   followed by either 8 or 16 bit characters */
+
+static void cs0_to_utf8(const uint8_t *src, size_t len, char *out,
+                        size_t size) {
+  out[0] = 0x00;
+
+  if (len < 1) return;
+
+  if (src[0] == 16) {
+    ucs2_to_utf8(src + 1, len - 1, out, size);
+    return;
+  }
+
+  size_t pos = 0;
+
+  for (size_t i = 1; i < len; i++) pos = put_utf8(out, pos, size, src[i]);
+
+  out[pos] = 0x00;
+}
+
+static void dstring_to_utf8(const uint8_t *src, size_t field, char *out,
+                            size_t size) {
+  size_t used = src[field - 1];
+
+  if (used > field - 1) used = field - 1;
+
+  cs0_to_utf8(src, used, out, size);
+}
+
+/* What Linux shows for a plain ISO9660 name: no ";1" version,
+   no trailing dot and all lowercase */
+
+static void plain_name(const uint8_t *src, size_t len, char *out,
+                       size_t size) {
+  size_t i;
+
+  for (i = 0; i < len && i < size - 1 && src[i] != ';'; i++) {
+    out[i] = tolower(src[i]);
+  }
+
+  out[i] = 0x00;
+
+  if (i > 0 && out[i - 1] == '.') out[i - 1] = 0x00;
+}
+
+static void strip_version(char *name) {
+  char *semi = strrchr(name, ';');
+
+  if (semi != NULL) *semi = 0x00;
+}
+
+/* Never let a name from the image climb out of the
+   destination directory */
+
+static int valid_name(const char *name) {
+  if (name[0] == 0x00 || strchr(name, '/') != NULL) return 0;
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+
+  return 1;
+}
+
+static int join(char *out, size_t size, const char *dir, const char *name) {
+  int len = dir[0] ? snprintf(out, size, "%s/%s", dir, name)
+                   : snprintf(out, size, "%s", name);
+
+  if (len < 0 || (size_t)len >= size) {
+    r_printf("Path too long in image: %s/%s\n", dir, name);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ---- Rock Ridge ---- */
+
+static int rr_parse(isofs_t *fs, const uint8_t *su, int len, char *name,
+                    size_t size, int *relocated, uint32_t *child) {
+  uint8_t *area = NULL;
+  size_t pos = 0;
+  int got_name = 0;
+  int hops = 0;
+
+  for (;;) {
+    uint32_t ce_block = 0, ce_offset = 0, ce_len = 0;
+    int i = 0;
+
+    while (i + 4 <= len) {
+      const uint8_t *e = su + i;
+      int elen = e[2];
+
+      if (elen < 4 || i + elen > len) break;
+
+      if (e[0] == 'N' && e[1] == 'M' && elen >= 5) {
+        /* Flags 0x02 and 0x04 are "." and "..", skip those */
+
+        if (!(e[4] & 0x06)) {
+          for (int j = 5; j < elen && pos < size - 1; j++) name[pos++] = e[j];
+          got_name = 1;
+        }
+      } else if (e[0] == 'C' && e[1] == 'E' && elen >= 28) {
+        ce_block = le32(e + 4);
+        ce_offset = le32(e + 12);
+        ce_len = le32(e + 20);
+      } else if (e[0] == 'R' && e[1] == 'E') {
+        *relocated = 1;
+      } else if (e[0] == 'C' && e[1] == 'L' && elen >= 12) {
+        *child = le32(e + 4);
+      } else if (e[0] == 'S' && e[1] == 'T') {
+        break;
+      }
+
+      i += elen;
+    }
+
+    if (ce_len == 0 || ce_len > ISOFS_SECTOR || hops++ >= MAX_CE_HOPS) break;
+
+    /* The entries continue in a separate area */
+
+    free(area);
+
+    if ((area = malloc(ce_len)) == NULL ||
+        rd(fs, area, ce_len,
+           (uint64_t)ce_block * ISOFS_SECTOR + ce_offset) < 0)
+      break;
+
+    su = area;
+    len = ce_len;
+  }
+
+  free(area);
+  name[pos] = 0x00;
+
+  return got_name;
+}
+
+/* ---- ISO9660 ---- */
+
+static int record_name(isofs_t *fs, const uint8_t *rec, char *name,
+                       size_t size, int *relocated, uint32_t *child) {
+  int name_len = rec[32];
+
+  *relocated = 0;
+  *child = 0;
+
+  if (fs->type == ISOFS_ROCKRIDGE) {
+    int su_start = 33 + name_len + ((name_len & 1) ? 0 : 1) + fs->susp_skip;
+
+    if (su_start < rec[0] &&
+        rr_parse(fs, rec + su_start, rec[0] - su_start, name, size, relocated,
+                 child))
+      return 0;
+  }
+
+  if (fs->type == ISOFS_JOLIET) {
+    ucs2_to_utf8(rec + 33, name_len, name, size);
+    strip_version(name);
+  } else {
+    plain_name(rec + 33, name_len, name, size);
+  }
+
+  return 0;
+}
+
+static int emit_multi(iso_multi_t *multi, copy_list_t *list) {
+  copy_entry_t *entry;
+
+  if (!multi->active) return 0;
+
+  multi->active = 0;
+
+  if ((entry = copy_list_add(list, multi->path, multi->size, 0)) == NULL)
+    return -1;
+
+  entry->offset = multi->offset;
+  entry->fragmented = multi->fragmented;
+
+  return 0;
+}
+
+static int iso_walk(isofs_t *fs, uint32_t extent, uint32_t size,
+                    const char *path, int depth, copy_list_t *list) {
+  char name[MAX_NAME];
+  char full[PATH_MAX];
+  iso_multi_t multi;
+  uint8_t *dir;
+  uint32_t pos = 0;
+  int ret = -1;
+
+  if (depth > MAX_DEPTH || size > MAX_DIR_SIZE) {
+    r_printf("Directory %s is too deep or too large\n", path);
+    return -1;
+  }
+
+  if ((dir = malloc(size)) == NULL) return -1;
+
+  if (rd(fs, dir, size, (uint64_t)extent * ISOFS_SECTOR) < 0) goto out;
+
+  multi.active = 0;
+
+  while (pos < size) {
+    const uint8_t *rec = dir + pos;
+    int rec_len = rec[0];
+
+    /* Records never cross a sector, a zero length means
+       the rest of this one is padding */
+
+    if (rec_len == 0) {
+      pos = (pos / ISOFS_SECTOR + 1) * ISOFS_SECTOR;
+      continue;
+    }
+
+    if (rec_len < 34 || pos + rec_len > size || 33 + rec[32] > rec_len) break;
+
+    pos += rec_len;
+
+    uint8_t flags = rec[25];
+
+    if (rec[32] == 1 && (rec[33] == 0 || rec[33] == 1)) continue;
+    if (flags & ISO_FLAG_ASSOC) continue;
+
+    int relocated;
+    uint32_t child;
+
+    record_name(fs, rec, name, sizeof(name), &relocated, &child);
+
+    if (relocated || !valid_name(name)) continue;
+    if (join(full, sizeof(full), path, name) < 0) goto out;
+
+    uint64_t start = (uint64_t)(le32(rec + 2) + rec[1]) * ISOFS_SECTOR;
+    uint32_t data_len = le32(rec + 10);
+
+    if (child != 0) {
+      /* Rock Ridge moved this directory elsewhere to get
+         around the depth limit, its "." record has the size */
+
+      uint8_t dot[ISOFS_SECTOR];
+
+      if (rd(fs, dot, sizeof(dot), (uint64_t)child * ISOFS_SECTOR) < 0)
+        goto out;
+
+      start = (uint64_t)child * ISOFS_SECTOR;
+      data_len = le32(dot + 10);
+      flags |= ISO_FLAG_DIR;
+    }
+
+    if (multi.active && strcmp(multi.path, full) != 0 && emit_multi(&multi, list) < 0)
+      goto out;
+
+    if (flags & ISO_FLAG_DIR) {
+      if (copy_list_add(list, full, 0, 1) == NULL) goto out;
+      if (iso_walk(fs, start / ISOFS_SECTOR, data_len, full, depth + 1,
+                   list) < 0)
+        goto out;
+      continue;
+    }
+
+    if (!multi.active) {
+      multi.active = 1;
+      memcpy(multi.path, full, sizeof(full));
+      multi.size = 0;
+      multi.offset = start;
+      multi.next = start;
+      multi.fragmented = 0;
+    }
+
+    if (start != multi.next) multi.fragmented = 1;
+
+    multi.size += data_len;
+    multi.next = start + data_len;
+
+    if (!(flags & ISO_FLAG_MULTI) && emit_multi(&multi, list) < 0) goto out;
+  }
+
+  if (emit_multi(&multi, list) < 0) goto out;
+
+  ret = 0;
+
+out:
+  free(dir);
+  return ret;
+}
+
+/* Rock Ridge announces itself with an SP entry in the
+   "." record of the root directory */
+
+static int detect_rock_ridge(isofs_t *fs) {
+  uint8_t sector[ISOFS_SECTOR];
+  const uint8_t *rec = sector;
+
+  if (rd(fs, sector, sizeof(sector),
+         (uint64_t)le32(fs->root_record + 2) * ISOFS_SECTOR) < 0)
+    return 0;
+
+  int su = 33 + rec[32] + ((rec[32] & 1) ? 0 : 1);
+
+  if (rec[0] < su + 7) return 0;
+
+  const uint8_t *e = rec + su;
+
+  if (e[0] == 'S' && e[1] == 'P' && e[4] == 0xBE && e[5] == 0xEF) {
+    fs->susp_skip = e[6];
+    return 1;
+  }
+
+  return 0;
+}
+
+/* ---- UDF ---- */
+
+static int udf_load(isofs_t *fs, const uint8_t *icb, uint8_t *block,
+                    udf_file_t *file) {
+  uint32_t lbn = le32(icb + 4);
+  uint64_t position = ((uint64_t)fs->partition_start + lbn) * fs->block_size;
+  uint32_t base, ea_len, ad_len;
+
+  if (rd(fs, block, fs->block_size, position) < 0) return -1;
+
+  switch (le16(block)) {
+    case UDF_TAG_FE:
+      ea_len = le32(block + 168);
+      ad_len = le32(block + 172);
+      base = 176;
+      break;
+    case UDF_TAG_EFE:
+      ea_len = le32(block + 208);
+      ad_len = le32(block + 212);
+      base = 216;
+      break;
+    default:
+      r_printf("Not a UDF file entry at block %u\n", lbn);
+      return -1;
+  }
+
+  /* Both lengths are the image's, added up in 32 bits they
+     could wrap */
+
+  if ((uint64_t)base + ea_len + ad_len > fs->block_size) return -1;
+
+  file->is_dir = block[16 + 11] == UDF_FILETYPE_DIR;
+  file->ad_type = le16(block + 16 + 18) & 0x07;
+  file->size = le64(block + 56);
+  file->ad = block + base + ea_len;
+  file->ad_len = ad_len;
+  file->offset = 0;
+  file->fragmented = 0;
+
+  if (file->ad_type == UDF_AD_EMBEDDED) {
+    file->offset = position + base + ea_len;
+    return 0;
+  }
+
+  if (file->ad_type != UDF_AD_SHORT && file->ad_type != UDF_AD_LONG) {
+    file->fragmented = 1;
+    return 0;
+  }
+
+  uint32_t step = file->ad_type == UDF_AD_SHORT ? 8 : 16;
+  uint64_t next = 0;
+
+  for (uint32_t i = 0; i + step <= ad_len; i += step) {
+    uint32_t len = le32(file->ad + i) & 0x3FFFFFFF;
+    uint32_t type = le32(file->ad + i) >> 30;
+    uint64_t phys = ((uint64_t)fs->partition_start + le32(file->ad + i + 4)) *
+                    fs->block_size;
+
+    if (len == 0) break;
+
+    /* Continuations of the descriptor list are not followed */
+
+    if (type == 3) {
+      file->fragmented = 1;
+      break;
+    }
+
+    if (i == 0) {
+      file->offset = phys;
+    } else if (phys != next || type != 0) {
+      file->fragmented = 1;
+    }
+
+    next = phys + (len + fs->block_size - 1) / fs->block_size * fs->block_size;
+  }
+
+  return 0;
+}
+
+static int udf_read_data(isofs_t *fs, const udf_file_t *file, uint8_t *out) {
+  if (file->ad_type == UDF_AD_EMBEDDED) {
+    if (file->size > file->ad_len) return -1;
+    memcpy(out, file->ad, file->size);
+    return 0;
+  }
+
+  if (file->ad_type != UDF_AD_SHORT && file->ad_type != UDF_AD_LONG) {
+    r_printf("Unsupported UDF allocation type %d\n", file->ad_type);
+    return -1;
+  }
+
+  uint32_t step = file->ad_type == UDF_AD_SHORT ? 8 : 16;
+  uint64_t done = 0;
+
+  for (uint32_t i = 0; i + step <= file->ad_len && done < file->size;
+       i += step) {
+    uint64_t len = le32(file->ad + i) & 0x3FFFFFFF;
+    uint32_t type = le32(file->ad + i) >> 30;
+    uint64_t phys = ((uint64_t)fs->partition_start + le32(file->ad + i + 4)) *
+                    fs->block_size;
+
+    if (len == 0 || type == 3) break;
+    if (len > file->size - done) len = file->size - done;
+
+    if (type == 0) {
+      if (rd(fs, out + done, len, phys) < 0) return -1;
+    } else {
+      memset(out + done, 0, len);
+    }
+
+    done += len;
+  }
+
+  return done == file->size ? 0 : -1;
+}
+
+static int udf_walk(isofs_t *fs, const uint8_t *icb, const char *path,
+                    int depth, copy_list_t *list) {
+  char name[MAX_NAME];
+  char full[PATH_MAX];
+  udf_file_t dir, file;
+  uint8_t *dir_block, *block, *data = NULL;
+  int ret = -1;
+
+  if (depth > MAX_DEPTH) {
+    r_printf("Directory %s is too deep\n", path);
+    return -1;
+  }
+
+  dir_block = malloc(fs->block_size);
+  block = malloc(fs->block_size);
+
+  if (dir_block == NULL || block == NULL) goto out;
+  if (udf_load(fs, icb, dir_block, &dir) < 0) goto out;
+
+  if (!dir.is_dir || dir.size > MAX_DIR_SIZE) {
+    r_printf("Bad UDF directory %s\n", path);
+    goto out;
+  }
+
+  if ((data = malloc(dir.size + 1)) == NULL) goto out;
+  if (udf_read_data(fs, &dir, data) < 0) goto out;
+
+  for (uint64_t pos = 0; pos + 38 <= dir.size;) {
+    const uint8_t *fid = data + pos;
+    uint8_t chars = fid[18];
+    uint8_t name_len = fid[19];
+    uint16_t iu_len = le16(fid + 36);
+
+    if (le16(fid) != UDF_TAG_FID || pos + 38 + iu_len + name_len > dir.size)
+      break;
+
+    pos += (38 + iu_len + name_len + 3) & ~3;
+
+    if (chars & (UDF_FID_PARENT | UDF_FID_DELETED) || name_len == 0) continue;
+
+    cs0_to_utf8(fid + 38 + iu_len, name_len, name, sizeof(name));
+
+    if (!valid_name(name)) continue;
+    if (join(full, sizeof(full), path, name) < 0) goto out;
+    if (udf_load(fs, fid + 20, block, &file) < 0) goto out;
+
+    if (file.is_dir) {
+      if (copy_list_add(list, full, 0, 1) == NULL) goto out;
+      if (udf_walk(fs, fid + 20, full, depth + 1, list) < 0) goto out;
+      continue;
+    }
+
+    copy_entry_t *entry = copy_list_add(list, full, file.size, 0);
+
+    if (entry == NULL) goto out;
+
+    entry->offset = file.offset;
+    entry->fragmented = file.fragmented;
+  }
+
+  ret = 0;
+
+out:
+  free(data);
+  free(block);
+  free(dir_block);
+  return ret;
+}
+
+static int udf_open(isofs_t *fs) {
+  uint8_t sector[ISOFS_SECTOR];
+  uint8_t fsd_ad[16];
+  int found_pd = 0, found_lvd = 0;
+
+  if (rd(fs, sector, sizeof(sector),
+         (uint64_t)UDF_AVDP_SECTOR * ISOFS_SECTOR) < 0 ||
+      le16(sector) != UDF_TAG_AVDP)
+    return -1;
+
+  uint32_t vds_len = le32(sector + 16) / ISOFS_SECTOR;
+  uint32_t vds_loc = le32(sector + 20);
+
+  if (vds_len > VD_MAX) vds_len = VD_MAX;
+
+  for (uint32_t i = 0; i < vds_len; i++) {
+    if (rd(fs, sector, sizeof(sector),
+           (uint64_t)(vds_loc + i) * ISOFS_SECTOR) < 0)
+      return -1;
+
+    uint16_t tag = le16(sector);
+
+    if (tag == UDF_TAG_TD) break;
+
+    if (tag == UDF_TAG_PD) {
+      fs->partition_start = le32(sector + 188);
+      found_pd = 1;
+    } else if (tag == UDF_TAG_LVD) {
+      fs->block_size = le32(sector + 212);
+      memcpy(fsd_ad, sector + 248, sizeof(fsd_ad));
+      dstring_to_utf8(sector + 84, 128, fs->label, sizeof(fs->label));
+
+      /* Only plain type 1 maps, sparable and metadata
+         partitions are left to the kernel */
+
+      if (le32(sector + 268) < 1 || sector[440] != 1) {
+        r_printf("UDF partition map type %d is not supported\n", sector[440]);
+        return -1;
+      }
+
+      found_lvd = 1;
+    }
+  }
+
+  if (!found_pd || !found_lvd || fs->block_size < 512 ||
+      fs->block_size > ISOFS_SECTOR * 2)
+    return -1;
+
+  uint8_t *fsd = malloc(fs->block_size);
+
+  if (fsd == NULL) return -1;
+
+  if (rd(fs, fsd, fs->block_size,
+         ((uint64_t)fs->partition_start + le32(fsd_ad + 4)) * fs->block_size) <
+          0 ||
+      le16(fsd) != UDF_TAG_FSD) {
+    free(fsd);
+    return -1;
+  }
+
+  memcpy(fs->root_icb, fsd + 400, sizeof(fs->root_icb));
+  free(fsd);
+
+  return 0;
+}
+
+/* ---- Front end ---- */
+
+static void trim_label(char *label) {
+  size_t len = strlen(label);
+
+  while (len > 0 && label[len - 1] == ' ') label[--len] = 0x00;
+}
+
+int isofs_open_reader(isofs_t *fs, isofs_read_t read, void *ctx) {
+  uint8_t sector[ISOFS_SECTOR];
+  int has_pvd = 0, has_nsr = 0;
+
+  fs->read = read;
+  fs->ctx = ctx;
+  fs->has_joliet = 0;
+  fs->susp_skip = 0;
+  fs->label[0] = 0x00;
+
+  /* The volume descriptors start at sector 16, and for bridge
+     media the UDF recognition sequence follows right after.
+     The volume label at LABEL_OFFSET is part of the first one. */
+
+  for (int i = VD_START; i < VD_START + VD_MAX; i++) {
+    if (fs->read(fs->ctx, sector, sizeof(sector),
+                 (uint64_t)i * ISOFS_SECTOR) < 0)
+      break;
+
+    if (memcmp(sector + 1, "CD001", 5) == 0) {
+      if (sector[0] == 1 && !has_pvd) {
+        memcpy(fs->root_record, sector + 156, 34);
+        memcpy(fs->label, sector + 40, 32);
+        fs->label[32] = 0x00;
+        trim_label(fs->label);
+        has_pvd = 1;
+      } else if (sector[0] == 2 && sector[88] == 0x25 && sector[89] == 0x2F &&
+                 (sector[90] == 0x40 || sector[90] == 0x43 ||
+                  sector[90] == 0x45)) {
+        memcpy(fs->joliet_record, sector + 156, 34);
+        fs->has_joliet = 1;
+      }
+    } else if (memcmp(sector + 1, "NSR02", 5) == 0 ||
+               memcmp(sector + 1, "NSR03", 5) == 0) {
+      has_nsr = 1;
+    } else if (memcmp(sector + 1, "TEA01", 5) == 0) {
+      break;
+    } else if (memcmp(sector + 1, "BEA01", 5) != 0) {
+      break;
+    }
+  }
+
+  /* Same order the kernel mounts in: UDF, then Rock Ridge,
+     then Joliet, then plain ISO9660 */
+
+  if (has_nsr) {
+    char label[33];
+
+    memcpy(label, fs->label, sizeof(label));
+
+    if (udf_open(fs) == 0) {
+      fs->type = ISOFS_UDF;
+      if (fs->label[0] == 0x00) memcpy(fs->label, label, sizeof(label));
+      return 0;
+    }
+
+    memcpy(fs->label, label, sizeof(label));
+  }
+
+  if (!has_pvd) {
+    r_printf("Not an ISO9660 or UDF image\n");
+    return -1;
+  }
+
+  if (detect_rock_ridge(fs)) {
+    fs->type = ISOFS_ROCKRIDGE;
+  } else if (fs->has_joliet) {
+    fs->type = ISOFS_JOLIET;
+  } else {
+    fs->type = ISOFS_PLAIN;
+  }
+
+  return 0;
+}
+
+int isofs_open(isofs_t *fs, const char *path) {
+  /* Off a URL only what the walk reads gets fetched */
+
+  if (http_is_url(path)) {
+    http_source_t *s = http_open(path);
+
+    fs->fd = -1;
+
+    if (s == NULL) return -1;
+
+    if (isofs_open_reader(fs, http_read, s) < 0) {
+      http_close(s);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if ((fs->fd = open(path, O_RDONLY)) < 0) {
+    r_printf("Opening image failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (isofs_open_reader(fs, file_read, &fs->fd) < 0) {
+    close(fs->fd);
+    fs->fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+int isofs_list(isofs_t *fs, copy_list_t *list) {
+  if (fs->type == ISOFS_UDF) return udf_walk(fs, fs->root_icb, "", 0, list);
+
+  const uint8_t *root =
+      fs->type == ISOFS_JOLIET ? fs->joliet_record : fs->root_record;
+
+  return iso_walk(fs, le32(root + 2), le32(root + 10), "", 0, list);
+}
+
+void isofs_close(isofs_t *fs) {
+  if (fs->read == file_read && fs->fd >= 0) close(fs->fd);
+  if (fs->read == http_read) http_close((http_source_t *)fs->ctx);
+
+  fs->fd = -1;
+}
+
+const char *isofs_type_name(const isofs_t *fs) { return type_names[fs->type]; }
@@ -0,0 +1,49 @@
+#ifndef ISOFS_H
+#define ISOFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "linux/copy.h"
+
+#define ISOFS_SECTOR 2048
+
+#define ISOFS_PLAIN 0
+#define ISOFS_JOLIET 1
+#define ISOFS_ROCKRIDGE 2
+#define ISOFS_UDF 3
+
+/* Reads len bytes at offset of the image into buf, returns
+   0 only if all of them could be read */
+
+typedef int (*isofs_read_t)(void *ctx, void *buf, size_t len,
+                            uint64_t offset);
+
+typedef struct isofs {
+  isofs_read_t read;
+  void *ctx;
+  int fd;
+  int type;
+  char label[128];
+
+  /* ISO9660 */
+
+  uint8_t root_record[34];
+  uint8_t joliet_record[34];
+  int has_joliet;
+  int susp_skip;
+
+  /* UDF */
+
+  uint32_t block_size;
+  uint32_t partition_start;
+  uint8_t root_icb[16];
+} isofs_t;
+
+int isofs_open(isofs_t *fs, const char *path);
+int isofs_open_reader(isofs_t *fs, isofs_read_t read, void *ctx);
+int isofs_list(isofs_t *fs, copy_list_t *list);
+void isofs_close(isofs_t *fs);
+const char *isofs_type_name(const isofs_t *fs);
+
+#endif // ISOFS_H
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blkdev.h"
+
+#define SYSFS_DEV_DIR "/sys/dev/block/%u:%u"
+#define SYSFS_DEV_QUEUE "/sys/dev/block/%u:%u/queue/%s"
+#define SYSFS_PART_QUEUE "/sys/dev/block/%u:%u/../queue/%s"
+
+int blk_size(int fd, uint64_t *size) {
+  struct stat st;
+
+  if (ioctl(fd, BLKGETSIZE64, size) == 0) return 0;
+
+  /* Not a block device, a plain image file works too */
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+
+  *size = (uint64_t)st.st_size;
+
+  return 0;
+}
+
+static int read_number(const char *path, uint64_t *value) {
+  char buf[32];
+  int file_fd;
+  ssize_t len;
+
+  if ((file_fd = open(path, O_RDONLY)) < 0) return -1;
+
+  len = read(file_fd, buf, sizeof(buf) - 1);
+  close(file_fd);
+
+  if (len <= 0) return -1;
+
+  buf[len] = 0x00;
+  *value = strtoull(buf, NULL, 10);
+
+  return 0;
+}
+
+/* Read one number from the queue directory of a device.
+   Partitions have no queue of their own, so look at the parent
+   disk for those. */
+
+static int read_dev_attr(unsigned int maj, unsigned int min, const char *attr,
+                         uint64_t *value) {
+  char path[128];
+
+  snprintf(path, sizeof(path), SYSFS_DEV_QUEUE, maj, min, attr);
+
+  if (read_number(path, value) == 0) return 0;
+
+  snprintf(path, sizeof(path), SYSFS_PART_QUEUE, maj, min, attr);
+
+  return read_number(path, value);
+}
+
+static int read_queue_attr(int fd, const char *attr, uint64_t *value) {
+  struct stat st;
+
+  if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode)) return -1;
+
+  return read_dev_attr(major(st.st_rdev), minor(st.st_rdev), attr, value);
+}
+
+int blk_discard_supported(int fd) {
+  uint64_t max_bytes;
+
+  if (read_queue_attr(fd, "discard_max_bytes", &max_bytes) < 0) return 0;
+
+  return max_bytes > 0;
+}
+
+int blk_write_zeroes_supported(int fd) {
+  uint64_t max_bytes;
+
+  if (read_queue_attr(fd, "write_zeroes_max_bytes", &max_bytes) < 0) return 0;
+
+  return max_bytes > 0;
+}
+
+int blk_discard(int fd, uint64_t offset, uint64_t len, int secure) {
+  uint64_t range[2] = {offset, len};
+
+  return ioctl(fd, secure ? BLKSECDISCARD : BLKDISCARD, &range);
+}
+
+int blk_zeroout(int fd, uint64_t offset, uint64_t len) {
+  uint64_t range[2] = {offset, len};
+
+  return ioctl(fd, BLKZEROOUT, &range);
+}
+
+/* Make a range read back as zeros, letting the device do it
+   when it can. Block devices take BLKZEROOUT, image files and
+   newer kernels take FALLOC_FL_ZERO_RANGE, and everything else
+   gets large aligned writes of zeros. */
+
+int blk_zero_range(int fd, uint64_t offset, uint64_t len) {
+  void *zeros;
+  int ret = 0;
+
+  if (len == 0) return 0;
+
+  if (blk_zeroout(fd, offset, len) == 0) return 0;
+
+  if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) ==
+      0)
+    return 0;
+
+  if (posix_memalign(&zeros, 4096, BLK_ZERO_BLOCK_SIZE) != 0) return -1;
+
+  memset(zeros, 0x00, BLK_ZERO_BLOCK_SIZE);
+
+  while (len > 0) {
+    size_t chunk = len < BLK_ZERO_BLOCK_SIZE ? len : BLK_ZERO_BLOCK_SIZE;
+    ssize_t done = pwrite(fd, zeros, chunk, offset);
+
+    if (done < 0 && errno == EINTR) continue;
+
+    if (done <= 0) {
+      ret = -1;
+      break;
+    }
+
+    offset += done;
+    len -= done;
+  }
+
+  free(zeros);
+
+  return ret;
+}
+
+/* What the layout should be aligned to so that no write straddles
+   an erase block. Few sticks report their erase block size, most
+   say 512 or nothing at all, so anything below BLK_ALIGN_MIN is
+   ignored in favour of a guess from the size: 1 MiB below 4 GiB,
+   4 MiB below 32 GiB and 8 MiB above that. */
+
+uint64_t blk_alignment(int fd) {
+  static const char *attrs[] = {"optimal_io_size", "minimum_io_size",
+                                "discard_granularity"};
+  uint64_t align = 0;
+  uint64_t size = 0;
+  uint64_t value;
+
+  for (size_t i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+    if (read_queue_attr(fd, attrs[i], &value) < 0) continue;
+    if (value > align && (value & (value - 1)) == 0) align = value;
+  }
+
+  if (align > BLK_ALIGN_MAX) align = BLK_ALIGN_MAX;
+
+  blk_size(fd, &size);
+
+  if (align < BLK_ALIGN_MIN) {
+    if (size < BLK_ALIGN_MID_SIZE) {
+      align = BLK_ALIGN_MIN;
+    } else if (size < BLK_ALIGN_BIG_SIZE) {
+      align = 4 << 20;
+    } else {
+      align = 8 << 20;
+    }
+  }
+
+  /* Never spend more than a 64th of a small device on padding */
+
+  while (align > BLK_ALIGN_MIN && align * 64 > size) align >>= 1;
+
+  return align;
+}
+
+/* The USB device a disk hangs off is the first directory
+   above it in sysfs that has an idVendor file */
+
+static int usb_device_dir(unsigned int maj, unsigned int min, char *dir) {
+  char link[64];
+  char path[PATH_MAX + 16];
+
+  snprintf(link, sizeof(link), SYSFS_DEV_DIR, maj, min);
+
+  if (realpath(link, dir) == NULL) return -1;
+
+  for (char *slash = strrchr(dir, '/'); slash != NULL && slash != dir;
+       slash = strrchr(dir, '/')) {
+    *slash = 0x00;
+
+    snprintf(path, sizeof(path), "%s/idVendor", dir);
+
+    if (access(path, F_OK) == 0) return 0;
+  }
+
+  return -1;
+}
+
+/* Its speed file has the link in Mbit/s */
+
+static uint32_t usb_speed(unsigned int maj, unsigned int min) {
+  char dir[PATH_MAX];
+  char path[PATH_MAX + 16];
+  char buf[16];
+  int file_fd;
+  ssize_t len;
+
+  if (usb_device_dir(maj, min, dir) < 0) return 0;
+
+  snprintf(path, sizeof(path), "%s/speed", dir);
+
+  if ((file_fd = open(path, O_RDONLY)) < 0) return 0;
+
+  len = read(file_fd, buf, sizeof(buf) - 1);
+  close(file_fd);
+
+  if (len <= 0) return 0;
+
+  buf[len] = 0x00;
+
+  /* Low speed devices say 1.5 */
+
+  return (uint32_t)(strtod(buf, NULL) + 0.5);
+}
+
+int blk_usb_hub(unsigned int maj, unsigned int min, char *hub, size_t size) {
+  char dir[PATH_MAX];
+  char *slash;
+
+  if (usb_device_dir(maj, min, dir) < 0 || (slash = strrchr(dir, '/')) == NULL) return -1;
+
+  *slash = 0x00;
+  snprintf(hub, size, "%s", dir);
+
+  return 0;
+}
+
+/* idVendor:idProduct and the serial the stick reports. Vendor
+   and model from the SCSI side are the same for every stick of
+   a batch, the serial is what tells them apart. */
+
+int blk_usb_serial(unsigned int maj, unsigned int min, char *serial, size_t size) {
+  char dir[PATH_MAX];
+  char path[PATH_MAX + 16];
+  char ids[2][8];
+  char buf[128];
+  const char *names[] = {"idVendor", "idProduct", "serial"};
+  int file_fd;
+  ssize_t len;
+
+  if (usb_device_dir(maj, min, dir) < 0) return -1;
+
+  for (int i = 0; i < 3; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+
+    if ((file_fd = open(path, O_RDONLY)) < 0) return -1;
+
+    len = read(file_fd, buf, sizeof(buf) - 1);
+    close(file_fd);
+
+    if (len <= 0) return -1;
+
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' ')) len--;
+
+    if (len == 0) return -1;
+
+    buf[len] = 0x00;
+
+    if (i < 2) snprintf(ids[i], sizeof(ids[i]), "%s", buf);
+  }
+
+  snprintf(serial, size, "%s:%s %s", ids[0], ids[1], buf);
+
+  return 0;
+}
+
+/* The USB link is what limits most sticks, so it decides how
+   big and how many requests to have in flight: USB 2 gains
+   nothing from a deep queue, it only adds latency, while USB 3
+   and internal devices need one to stay busy. A chunk gets
+   split into requests of max_sectors_kb, and those have to fit
+   into the nr_requests the queue holds. */
+
+int blk_profile_dev(unsigned int maj, unsigned int min, blk_profile_t *profile) {
+  uint64_t value;
+
+  memset(profile, 0, sizeof(*profile));
+
+  if (read_dev_attr(maj, min, "logical_block_size", &value) < 0) return -1;
+
+  profile->logical_block = value;
+  profile->physical_block = value;
+
+  if (read_dev_attr(maj, min, "physical_block_size", &value) == 0)
+    profile->physical_block = value;
+  if (read_dev_attr(maj, min, "optimal_io_size", &value) == 0)
+    profile->optimal_io = value;
+  if (read_dev_attr(maj, min, "max_sectors_kb", &value) == 0)
+    profile->max_sectors_kb = value;
+  if (read_dev_attr(maj, min, "nr_requests", &value) == 0)
+    profile->nr_requests = value;
+  if (read_dev_attr(maj, min, "rotational", &value) == 0)
+    profile->rotational = value != 0;
+  if (read_dev_attr(maj, min, "discard_max_bytes", &value) == 0)
+    profile->discard = value != 0;
+
+  profile->usb_speed = usb_speed(maj, min);
+
+  if (profile->usb_speed > 0 && profile->usb_speed <= BLK_USB2_SPEED) {
+    profile->chunk = BLK_CHUNK_MIN;
+    profile->depth = BLK_DEPTH_USB2;
+  } else {
+    profile->chunk = BLK_CHUNK_MAX;
+    profile->depth = profile->rotational ? BLK_DEPTH_ROTATIONAL : BLK_DEPTH_FAST;
+  }
+
+  /* Mbit/s to MB/s, less what the protocol eats */
+
+  profile->est_speed = profile->usb_speed * BLK_USB_EFFICIENCY / 800;
+
+  /* A device that knows its optimal size gets it, as long as
+     it is a sane power of two */
+
+  if (profile->optimal_io > profile->chunk &&
+      profile->optimal_io <= BLK_CHUNK_MAX &&
+      (profile->optimal_io & (profile->optimal_io - 1)) == 0)
+    profile->chunk = profile->optimal_io;
+
+  if (profile->max_sectors_kb > 0 && profile->nr_requests > 0) {
+    uint32_t request = profile->max_sectors_kb << 10;
+    uint32_t split = (profile->chunk + request - 1) / request;
+
+    while (profile->depth > 1 && profile->depth * split > profile->nr_requests)
+      profile->depth--;
+  }
+
+  return 0;
+}
+
+int blk_profile(int fd, blk_profile_t *profile) {
+  struct stat st;
+
+  if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode)) return -1;
+
+  return blk_profile_dev(major(st.st_rdev), minor(st.st_rdev), profile);
+}
+
+size_t blk_chunk(int fd, size_t fallback) {
+  blk_profile_t profile;
+
+  if (blk_profile(fd, &profile) < 0) return fallback;
+
+  return profile.chunk;
+}
+
+/* Time writing back what is already in the middle of the
+   device, so that nothing on it changes. O_DIRECT on both
+   ends keeps the page cache out of the number. */
+
+uint64_t blk_probe_speed(int fd) {
+  char path[64];
+  uint64_t size;
+  struct timespec start, end;
+  void *buffer;
+  uint64_t speed = 0;
+  int direct_fd;
+
+  if (blk_size(fd, &size) < 0 || size < 2 * BLK_PROBE_SIZE) return 0;
+
+  /* Leave the first and the last parts, where the partition
+     tables are, alone */
+
+  uint64_t offset = (size / 2) & ~((uint64_t)BLK_ALIGN_MIN - 1);
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+  if ((direct_fd = open(path, O_RDWR | O_DIRECT)) < 0) return 0;
+
+  if (posix_memalign(&buffer, 4096, BLK_PROBE_SIZE) != 0) {
+    close(direct_fd);
+    return 0;
+  }
+
+  if (pread(direct_fd, buffer, BLK_PROBE_SIZE, offset) == BLK_PROBE_SIZE) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (pwrite(direct_fd, buffer, BLK_PROBE_SIZE, offset) == BLK_PROBE_SIZE &&
+        fdatasync(direct_fd) == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                    end.tv_nsec - start.tv_nsec;
+
+      if (ns > 0) speed = BLK_PROBE_SIZE * 1000000000ULL / ns;
+    }
+  }
+
+  free(buffer);
+  close(direct_fd);
+
+  return speed;
+}
@@ -0,0 +1,67 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLK_ALIGN_MIN (1 << 20)
+#define BLK_ALIGN_MAX (16 << 20)
+#define BLK_ALIGN_MID_SIZE (4ULL << 30)
+#define BLK_ALIGN_BIG_SIZE (32ULL << 30)
+#define BLK_ZERO_BLOCK_SIZE (4 << 20)
+
+#define BLK_CHUNK_MIN (1 << 20)
+#define BLK_CHUNK_MAX (4 << 20)
+#define BLK_DEPTH_USB2 2
+#define BLK_DEPTH_ROTATIONAL 4
+#define BLK_DEPTH_FAST 8
+#define BLK_USB2_SPEED 480
+#define BLK_USB_EFFICIENCY 60
+#define BLK_PROBE_SIZE (8 << 20)
+
+/* What sysfs says about a device, and the I/O shape picked
+   from that: chunk is the size of each request and depth how
+   many of them are in flight. usb_speed is the link in Mbit/s
+   and est_speed what that link gives in practice in MB/s, both
+   0 when the device is not on USB. */
+
+typedef struct blk_profile {
+  uint32_t logical_block;
+  uint32_t physical_block;
+  uint32_t optimal_io;
+  uint32_t max_sectors_kb;
+  uint32_t nr_requests;
+  uint8_t rotational;
+  uint8_t discard;
+  uint32_t usb_speed;
+  uint32_t est_speed;
+  uint32_t chunk;
+  uint32_t depth;
+} blk_profile_t;
+
+int blk_size(int fd, uint64_t *size);
+int blk_discard_supported(int fd);
+int blk_write_zeroes_supported(int fd);
+int blk_discard(int fd, uint64_t offset, uint64_t len, int secure);
+int blk_zeroout(int fd, uint64_t offset, uint64_t len);
+int blk_zero_range(int fd, uint64_t offset, uint64_t len);
+uint64_t blk_alignment(int fd);
+
+int blk_profile_dev(unsigned int maj, unsigned int min, blk_profile_t *profile);
+int blk_profile(int fd, blk_profile_t *profile);
+size_t blk_chunk(int fd, size_t fallback);
+uint64_t blk_probe_speed(int fd);
+
+/* The sysfs directory of the hub or root port a USB disk is
+   plugged into, sticks on the same one share its bandwidth.
+   Returns -1 for disks that are not on USB. */
+
+int blk_usb_hub(unsigned int maj, unsigned int min, char *hub, size_t size);
+
+/* "vendor:product serial" of the USB device a disk is on, the
+   one thing that tells identical sticks apart. Returns -1 for
+   disks that are not on USB or have no serial. */
+
+int blk_usb_serial(unsigned int maj, unsigned int min, char *serial, size_t size);
+
+#endif // BLKDEV_H
@@ -0,0 +1,760 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "copy.h"
+#include "ioqueue.h"
+#include "flush.h"
+#include "trace.h"
+
+#define COPY_BUF_SIZE (1 << 20)
+#define COPY_CHUNK (64 << 20)
+#define COPY_QUEUE_MIN (8 << 20)
+#define PROGRESS_INTERVAL_MS 100
+#define COPY_SYNC_BYTES (4 * WRITEBACK_WINDOW)
+
+/* Data path backends, fastest first. A job starts on the
+   first one and steps down for good the first time the
+   kernel refuses one for the given pair of filesystems. */
+
+enum {
+  BACKEND_COPY_FILE_RANGE,
+  BACKEND_SENDFILE,
+  BACKEND_SPLICE,
+  BACKEND_READ_WRITE,
+  BACKEND_COUNT
+};
+
+static const char *backend_names[BACKEND_COUNT] = {
+    "copy_file_range", "sendfile", "splice", "read/write"};
+
+static int first_backend = BACKEND_COPY_FILE_RANGE;
+static int backend_forced = 0;
+
+/* nftw() has no user pointer, so the list being built
+   lives here for the duration of build_copy_list() */
+
+static copy_list_t *scan_list;
+static size_t scan_root_len;
+
+typedef struct copy_job {
+  const char *src;
+  const char *dest;
+  const copy_list_t *list;
+  unsigned int depth;
+  atomic_uint next;
+  atomic_uint files_done;
+  atomic_ullong bytes_done;
+  atomic_int running;
+  atomic_int failed;
+  atomic_int backend;
+  atomic_uint backend_files[BACKEND_COUNT];
+  atomic_uint queued_files;
+  atomic_int queue_logged;
+} copy_job_t;
+
+/* Scratch space owned by a single worker, set up lazily
+   because the zero-copy backends need none of it */
+
+typedef struct copy_worker {
+  copy_job_t *job;
+  char *buf;
+  int pipe_fds[2];
+  ioqueue_t *queue;
+} copy_worker_t;
+
+void copy_list_init(copy_list_t *list) { memset(list, 0, sizeof(*list)); }
+
+copy_entry_t *copy_list_add(copy_list_t *list, const char *path,
+                            uint64_t size, uint8_t is_dir) {
+  if (list->count == list->capacity) {
+    uint32_t capacity = list->capacity ? list->capacity * 2 : 256;
+    copy_entry_t *entries =
+        realloc(list->entries, capacity * sizeof(copy_entry_t));
+
+    if (entries == NULL) {
+      r_printf("Out of memory while building file list\n");
+      return NULL;
+    }
+
+    list->entries = entries;
+    list->capacity = capacity;
+  }
+
+  copy_entry_t *entry = &list->entries[list->count];
+
+  if ((entry->path = strdup(path)) == NULL) {
+    r_printf("Out of memory while building file list\n");
+    return NULL;
+  }
+
+  entry->size = is_dir ? 0 : size;
+  entry->offset = 0;
+  entry->is_dir = is_dir;
+  entry->fragmented = 0;
+
+  list->count++;
+
+  if (!is_dir) {
+    list->file_count++;
+    list->total_bytes += size;
+  }
+
+  return entry;
+}
+
+void copy_list_free(copy_list_t *list) {
+  for (uint32_t i = 0; i < list->count; i++) {
+    free(list->entries[i].path);
+  }
+
+  free(list->entries);
+  copy_list_init(list);
+}
+
+/* Directories keep their place ahead of every file, files
+   go by where their data starts and then by where they were */
+
+static int extent_compare(const void *a, const void *b, void *arg) {
+  const copy_entry_t *entries = (const copy_entry_t *)arg;
+  uint32_t i = *(const uint32_t *)a;
+  uint32_t j = *(const uint32_t *)b;
+  const copy_entry_t *x = &entries[i];
+  const copy_entry_t *y = &entries[j];
+
+  if (x->is_dir != y->is_dir) return x->is_dir ? -1 : 1;
+
+  if (!x->is_dir && x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+
+  return (i > j) - (i < j);
+}
+
+int copy_list_sort_extents(copy_list_t *list) {
+  uint32_t *order;
+  copy_entry_t *sorted;
+
+  if (list->count < 2) return 0;
+
+  order = malloc(list->count * sizeof(*order));
+  sorted = malloc(list->count * sizeof(*sorted));
+
+  if (order == NULL || sorted == NULL) {
+    free(order);
+    free(sorted);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < list->count; i++) order[i] = i;
+
+  qsort_r(order, list->count, sizeof(*order), extent_compare, list->entries);
+
+  for (uint32_t i = 0; i < list->count; i++) sorted[i] = list->entries[order[i]];
+
+  free(list->entries);
+  free(order);
+
+  list->entries = sorted;
+  list->capacity = list->count;
+
+  return 0;
+}
+
+static int list_callback(const char *fpath, const struct stat *sb,
+                         int typeflag, struct FTW *ftwbuf) {
+  (void)ftwbuf;
+
+  /* Turn the absolute path into one relative to the source root */
+
+  const char *rel = fpath + scan_root_len;
+
+  while (*rel == '/') rel++;
+
+  if (*rel == 0x00) return 0; /* The root itself */
+
+  if (copy_list_add(scan_list, rel, (uint64_t)sb->st_size,
+                    typeflag == FTW_D) == NULL)
+    return -1;
+
+  return 0;
+}
+
+int build_copy_list(const char *src, copy_list_t *list) {
+  scan_list = list;
+  scan_root_len = strlen(src);
+
+  /* nftw() walks pre-order, so every directory lands in
+     the list before anything inside of it */
+
+  if (nftw(src, list_callback, 4, 0) < 0) {
+    r_printf("Failed to walk %s: %s\n", src, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int join_path(char *buf, size_t size, const char *root,
+                     const char *rel) {
+  size_t len = strlen(root);
+  const char *sep = (len > 0 && root[len - 1] == '/') ? "" : "/";
+
+  if (snprintf(buf, size, "%s%s%s", root, sep, rel) >= (int)size) {
+    r_printf("Path too long: %s%s%s\n", root, sep, rel);
+    return -1;
+  }
+
+  return 0;
+}
+
+static ssize_t backend_copy_file_range(copy_worker_t *w, int in, int out,
+                                       off_t off) {
+  off_t off_in = off;
+  off_t off_out = off;
+
+  (void)w;
+
+  return copy_file_range(in, &off_in, out, &off_out, COPY_CHUNK, 0);
+}
+
+static ssize_t backend_sendfile(copy_worker_t *w, int in, int out, off_t off) {
+  off_t off_in = off;
+
+  (void)w;
+
+  /* sendfile() writes at the file position of out */
+
+  if (lseek(out, off, SEEK_SET) < 0) return -1;
+
+  return sendfile(out, in, &off_in, COPY_CHUNK);
+}
+
+static ssize_t backend_splice(copy_worker_t *w, int in, int out, off_t off) {
+  off_t off_in = off;
+  off_t off_out = off;
+  ssize_t len, done = 0;
+
+  if (w->pipe_fds[0] < 0 && pipe(w->pipe_fds) < 0) return -1;
+
+  if ((len = splice(in, &off_in, w->pipe_fds[1], NULL, COPY_CHUNK,
+                    SPLICE_F_MOVE)) <= 0)
+    return len;
+
+  /* Everything that went into the pipe has to come out
+     again, or the next file would start with stale data */
+
+  while (done < len) {
+    ssize_t ret = splice(w->pipe_fds[0], NULL, out, &off_out, len - done,
+                         SPLICE_F_MOVE);
+
+    if (ret <= 0) {
+      close(w->pipe_fds[0]);
+      close(w->pipe_fds[1]);
+      w->pipe_fds[0] = w->pipe_fds[1] = -1;
+      if (ret == 0) errno = EIO;
+      return -1;
+    }
+
+    done += ret;
+  }
+
+  return done;
+}
+
+static ssize_t backend_read_write(copy_worker_t *w, int in, int out,
+                                  off_t off) {
+  ssize_t len, done = 0;
+
+  if (w->buf == NULL && (w->buf = malloc(COPY_BUF_SIZE)) == NULL) return -1;
+
+  TRACE_NOW(read_traced);
+
+  if ((len = pread(in, w->buf, COPY_BUF_SIZE, off)) <= 0) return len;
+
+  TRACE_SPAN(TRACE_READ, "pread", read_traced);
+
+  while (done < len) {
+    TRACE_NOW(traced);
+
+    ssize_t ret = pwrite(out, w->buf + done, len - done, off + done);
+
+    if (ret < 0) return -1;
+
+    TRACE_SPAN(TRACE_WRITE, "pwrite", traced);
+
+    done += ret;
+  }
+
+  return done;
+}
+
+static ssize_t run_backend(copy_worker_t *w, int backend, int in, int out,
+                           off_t off) {
+  ssize_t ret;
+
+  /* The in-kernel copies read and write in one call, they
+     count as writes */
+
+  TRACE_NOW(traced);
+
+  switch (backend) {
+    case BACKEND_COPY_FILE_RANGE:
+      ret = backend_copy_file_range(w, in, out, off);
+      break;
+    case BACKEND_SENDFILE:
+      ret = backend_sendfile(w, in, out, off);
+      break;
+    case BACKEND_SPLICE:
+      ret = backend_splice(w, in, out, off);
+      break;
+    default:
+      return backend_read_write(w, in, out, off);
+  }
+
+  TRACE_SPAN(TRACE_WRITE, backend_names[backend], traced);
+
+  return ret;
+}
+
+/* Errors that mean "not for this pair of files" rather
+   than "the device is broken" */
+
+static int backend_refused(int err) {
+  return err == EXDEV || err == EINVAL || err == ENOSYS ||
+         err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Big files the kernel will not copy by itself go through
+   the worker's I/O queue, so that the stick always has several
+   requests to chew on. Only copy_file_range() is tried before
+   it: once that is refused, as it is from an ISO 9660 or UDF
+   mount to FAT32, sendfile() and splice() would still work but
+   keep a single chunk in flight. Small files stay on them. */
+
+static int copy_queued(copy_worker_t *w, int in, int out, uint64_t size,
+                       writeback_t *wb) {
+  copy_job_t *job = w->job;
+
+  if (w->queue == NULL) {
+    if ((w->queue = ioqueue_new(job->depth, IOQ_BLOCK_DEFAULT)) == NULL)
+      return -1;
+
+    if (atomic_exchange(&job->queue_logged, 1) == 0) {
+      r_printf("Large files use the %s queue, depth %u\n",
+               ioqueue_backend_name(w->queue), ioqueue_depth(w->queue));
+    }
+  }
+
+  /* Hand the file over in slices, so the byte count the
+     progress bar looks at moves while a big file copies */
+
+  uint64_t base = ioqueue_completed(w->queue);
+  uint64_t reported = 0;
+  uint64_t off = 0;
+
+  while (off < size) {
+    uint64_t len = size - off < COPY_CHUNK ? size - off : COPY_CHUNK;
+
+    if (job_cancelled()) {
+      ioqueue_drain(w->queue);
+      errno = ECANCELED;
+      return -1;
+    }
+
+    if (ioqueue_copy(w->queue, in, out, off, len) < 0) {
+      ioqueue_drain(w->queue);
+      return -1;
+    }
+
+    off += len;
+
+    uint64_t done = ioqueue_completed(w->queue) - base;
+
+    atomic_fetch_add(&job->bytes_done, done - reported);
+    fadvise_drop(in, reported, done - reported);
+    writeback_advance(wb, done);
+    reported = done;
+  }
+
+  if (ioqueue_drain(w->queue) < 0) return -1;
+
+  atomic_fetch_add(&job->bytes_done, ioqueue_completed(w->queue) - base - reported);
+  atomic_fetch_add(&job->queued_files, 1);
+
+  return 0;
+}
+
+/* Both ends stream: the source is dropped from the cache as
+   soon as it is copied, the destination once it is clean */
+
+static int copy_data(copy_worker_t *w, int in, int out, uint64_t size) {
+  copy_job_t *job = w->job;
+  int backend = atomic_load(&job->backend);
+  int try_queue = job->depth > 1 && size >= COPY_QUEUE_MIN && !backend_forced;
+  off_t off = 0;
+  ssize_t ret;
+  writeback_t wb;
+
+  fadvise_stream(in);
+  writeback_init(&wb, out, 0);
+
+  for (;;) {
+    if (try_queue && off == 0 && backend != BACKEND_COPY_FILE_RANGE) {
+      int queued = copy_queued(w, in, out, size, &wb);
+
+      if (queued == 0) writeback_tail(&wb, size);
+
+      /* Only fall back to the job's backend when the queue
+         could not even be set up */
+
+      if (queued == 0 || w->queue != NULL) return queued;
+
+      try_queue = 0;
+    }
+
+    if (job_cancelled()) {
+      errno = ECANCELED;
+      return -1;
+    }
+
+    if ((ret = run_backend(w, backend, in, out, off)) == 0) break;
+
+    if (ret > 0) {
+      fadvise_drop(in, off, ret);
+      off += ret;
+      atomic_fetch_add(&job->bytes_done, ret);
+      writeback_advance(&wb, off);
+      continue;
+    }
+
+    if (off > 0 || backend == BACKEND_READ_WRITE || !backend_refused(errno))
+      return -1;
+
+    /* Only the thread that actually demotes the job logs it */
+
+    int expected = backend;
+
+    if (atomic_compare_exchange_strong(&job->backend, &expected,
+                                       backend + 1)) {
+      r_printf("Copy backend %s refused (%s), falling back to %s\n",
+               backend_names[backend], strerror(errno),
+               backend_names[backend + 1]);
+    }
+
+    backend++;
+  }
+
+  atomic_fetch_add(&job->backend_files[backend], 1);
+  writeback_tail(&wb, off);
+
+  return 0;
+}
+
+static int copy_one(copy_worker_t *w, const char *src_path,
+                    const char *dest_path, uint64_t size) {
+  int inputFd, outputFd, openFlags;
+  mode_t filePerms;
+
+  TRACE_NOW(open_traced);
+
+  inputFd = open(src_path, O_RDONLY);
+
+  if (inputFd == -1) {
+    r_printf("Error: %s: %s\n", src_path, strerror(errno));
+    return -1;
+  }
+
+  TRACE_SPAN(TRACE_OPEN, "open", open_traced);
+
+  openFlags = O_CREAT | O_WRONLY;
+  filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+  TRACE_NOW(create_traced);
+
+  outputFd = open(dest_path, openFlags, filePerms);
+
+  if (outputFd == -1) {
+    r_printf("Error: %s: %s\n", dest_path, strerror(errno));
+    close(inputFd);
+    return -1;
+  }
+
+  TRACE_SPAN(TRACE_OPEN, "create", create_traced);
+
+  if (copy_data(w, inputFd, outputFd, size) < 0) {
+    if (errno != ECANCELED) r_printf("Error: %s: %s\n", dest_path, strerror(errno));
+    close(outputFd);
+    close(inputFd);
+    return -1;
+  }
+
+  if (close(outputFd) == -1) {
+    r_printf("Error: %s\n", strerror(errno));
+    close(inputFd);
+    return -1;
+  }
+  if (close(inputFd) == -1) {
+    r_printf("Error: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Get the start of the file that gets handed out next into
+   the page cache while this one is being written, so the
+   source sees one stream instead of a read after each write */
+
+static void prefetch_next(copy_job_t *job) {
+  char path[PATH_MAX];
+  uint32_t i = atomic_load(&job->next);
+
+  for (; i < job->list->count && job->list->entries[i].is_dir; i++)
+    ;
+
+  if (i >= job->list->count) return;
+
+  const copy_entry_t *entry = &job->list->entries[i];
+
+  if (entry->size == 0 ||
+      join_path(path, sizeof(path), job->src, entry->path) < 0)
+    return;
+
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return;
+
+  posix_fadvise(fd, 0,
+                entry->size < COPY_READAHEAD_MAX ? entry->size
+                                                 : COPY_READAHEAD_MAX,
+                POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+static void *copy_worker(void *arg) {
+  copy_job_t *job = (copy_job_t *)arg;
+  copy_worker_t w = {job, NULL, {-1, -1}, NULL};
+
+  char src_path[PATH_MAX];
+  char dest_path[PATH_MAX];
+
+  while (!atomic_load(&job->failed)) {
+    if (job_cancelled()) {
+      atomic_store(&job->failed, 1);
+      break;
+    }
+
+    /* Files are handed out one at a time, so a huge file
+       only ever ties up one worker */
+
+    uint32_t i = atomic_fetch_add(&job->next, 1);
+
+    if (i >= job->list->count) break;
+
+    const copy_entry_t *entry = &job->list->entries[i];
+
+    if (entry->is_dir) continue;
+
+    if (join_path(src_path, sizeof(src_path), job->src, entry->path) < 0 ||
+        join_path(dest_path, sizeof(dest_path), job->dest, entry->path) < 0) {
+      atomic_store(&job->failed, 1);
+      break;
+    }
+
+    r_log(LOG_LEVEL_VERBOSE, "Extracting: %s\n", dest_path);
+
+    prefetch_next(job);
+
+    TRACE_NOW(traced);
+
+    if (copy_one(&w, src_path, dest_path, entry->size) < 0) {
+      atomic_store(&job->failed, 1);
+      break;
+    }
+
+    TRACE_SPAN(TRACE_FILE, entry->path, traced);
+
+    atomic_fetch_add(&job->files_done, 1);
+  }
+
+  if (w.pipe_fds[0] >= 0) {
+    close(w.pipe_fds[0]);
+    close(w.pipe_fds[1]);
+  }
+
+  free(w.buf);
+  ioqueue_free(w.queue);
+
+  atomic_fetch_sub(&job->running, 1);
+
+  return NULL;
+}
+
+int copy_set_backend(const char *name) {
+  if (name == NULL) {
+    first_backend = BACKEND_COPY_FILE_RANGE;
+    backend_forced = 0;
+    return 0;
+  }
+
+  for (int i = 0; i < BACKEND_COUNT; i++) {
+    if (strcmp(name, backend_names[i]) == 0) {
+      first_backend = i;
+      backend_forced = 1;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+int copy_files(const char *src, const char *dest, const copy_list_t *list,
+               int threads, int depth) {
+  char dest_path[PATH_MAX];
+  pthread_t workers[COPY_THREADS_MAX];
+  int started = 0;
+
+  copy_job_t job;
+
+  job.src = src;
+  job.dest = dest;
+  job.list = list;
+  job.depth = depth > 0 ? depth : 1;
+  atomic_init(&job.next, 0);
+  atomic_init(&job.files_done, 0);
+  atomic_init(&job.bytes_done, 0);
+  atomic_init(&job.running, 0);
+  atomic_init(&job.failed, 0);
+  atomic_init(&job.backend, first_backend);
+  atomic_init(&job.queued_files, 0);
+  atomic_init(&job.queue_logged, 0);
+
+  for (int i = 0; i < BACKEND_COUNT; i++) {
+    atomic_init(&job.backend_files[i], 0);
+  }
+
+  /* Create the whole directory tree up front so that the
+     workers never race each other on a missing parent */
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    if (!list->entries[i].is_dir) continue;
+
+    if (join_path(dest_path, sizeof(dest_path), dest, list->entries[i].path) <
+        0)
+      return -1;
+
+    TRACE_NOW(traced);
+
+    if (mkdir(dest_path, 0700) < 0 && errno != EEXIST) {
+      r_printf("Error creating %s: %s\n", dest_path, strerror(errno));
+      return -1;
+    }
+
+    TRACE_SPAN(TRACE_MKDIR, "mkdir", traced);
+  }
+
+  if (threads < 1) threads = 1;
+  if (threads > COPY_THREADS_MAX) threads = COPY_THREADS_MAX;
+  if (threads > (int)list->file_count) threads = list->file_count;
+
+  r_printf("Copying %u files using %d threads, backend: %s\n",
+           list->file_count, threads, backend_names[first_backend]);
+
+  for (int i = 0; i < threads; i++) {
+    atomic_fetch_add(&job.running, 1);
+
+    if (pthread_create(&workers[i], NULL, copy_worker, &job) != 0) {
+      atomic_fetch_sub(&job.running, 1);
+      r_printf("WARNING: Could only start %d copy threads\n", started);
+      break;
+    }
+
+    started++;
+  }
+
+  /* No threads at all, do the work on this one */
+
+  if (started == 0 && list->file_count > 0) {
+    atomic_fetch_add(&job.running, 1);
+    copy_worker(&job);
+  }
+
+  /* Progress is only ever reported from here, the workers
+     just bump the counters */
+
+  struct timespec interval = {0, PROGRESS_INTERVAL_MS * 1000000L};
+  uint64_t synced = 0;
+
+  while (atomic_load(&job.running) > 0) {
+    nanosleep(&interval, NULL);
+
+    /* Push the destination out every COPY_SYNC_BYTES, so the
+       page cache never holds more than about that much of it,
+       and only count what made it to the device */
+
+    uint64_t done = atomic_load(&job.bytes_done);
+
+    if (done - synced >= COPY_SYNC_BYTES) {
+      flush_fs(dest);
+      synced = done;
+    }
+
+    /* By bytes when the list knows how many there are, a
+       single big file would stall a file based bar */
+
+    if (list->total_bytes > 0) {
+      progress_bytes(synced, list->total_bytes);
+    } else if (list->file_count > 0) {
+      set_progress_bar(
+          (int)(atomic_load(&job.files_done) * 100.0f / list->file_count));
+    }
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  if (flush_fs(dest) < 0) {
+    r_printf("Failed to flush %s: %s\n", dest, strerror(errno));
+    atomic_store(&job.failed, 1);
+  }
+
+  if (list->total_bytes > 0) {
+    progress_bytes(atomic_load(&job.bytes_done), list->total_bytes);
+  }
+
+  for (int i = 0; i < BACKEND_COUNT; i++) {
+    unsigned int files = atomic_load(&job.backend_files[i]);
+    if (files > 0) r_printf(" * %s: %u files\n", backend_names[i], files);
+  }
+
+  if (atomic_load(&job.queued_files) > 0) {
+    r_printf(" * queued: %u files\n", atomic_load(&job.queued_files));
+  }
+
+  if (atomic_load(&job.failed)) {
+    if (job_cancelled()) {
+      r_printf("Copy cancelled after %u of %u files\n",
+               atomic_load(&job.files_done), list->file_count);
+    }
+
+    return -1;
+  }
+
+  set_progress_bar(100);
+
+  return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdint.h>
+
+#define COPY_THREADS_DEFAULT 4
+#define COPY_THREADS_MAX 32
+#define COPY_READAHEAD_MAX (8 << 20)
+
+/* One entry of the list of things to copy. Paths are relative
+   to the source root and carry no leading slash, so the same
+   list can be replayed against any destination. When the list
+   comes straight from the image, offset is where the data of
+   the file starts inside of it, and fragmented says it does
+   not continue in one piece from there. */
+
+typedef struct copy_entry {
+  char *path;
+  uint64_t size;
+  uint64_t offset;
+  uint8_t is_dir;
+  uint8_t fragmented;
+} copy_entry_t;
+
+typedef struct copy_list {
+  copy_entry_t *entries;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t file_count;
+  uint64_t total_bytes;
+} copy_list_t;
+
+void copy_list_init(copy_list_t *list);
+copy_entry_t *copy_list_add(copy_list_t *list, const char *path,
+                            uint64_t size, uint8_t is_dir);
+void copy_list_free(copy_list_t *list);
+
+/* Put the files in the order their data sits in the image,
+   after all of the directories, which keep their order so that
+   a parent still comes before anything in it. Only useful when
+   the offsets came from the image. */
+
+int copy_list_sort_extents(copy_list_t *list);
+
+/* Make new jobs start on the named backend instead of the
+   fastest one, NULL goes back to the default. Falling back from
+   there still works as usual, but big files no longer go
+   through the I/O queue in place of read/write, so what runs
+   is the backend that was named. Returns -1 for an unknown
+   name. */
+
+int copy_set_backend(const char *name);
+
+int build_copy_list(const char *src, copy_list_t *list);
+int copy_files(const char *src, const char *dest, const copy_list_t *list,
+               int threads, int depth);
+
+#endif // COPY_H
@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <lzma.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include "../log.h"
+#include "decomp.h"
+#include "flush.h"
+
+static const uint8_t gzip_magic[] = {0x1f, 0x8b};
+static const uint8_t xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+static const uint8_t zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+/* The compressed side is read in DECOMP_INPUT_SIZE steps
+   and dropped from the cache as soon as it is decoded */
+
+struct decomp {
+  int format;
+  int fd;
+  decomp_read_t read;
+  void *ctx;
+  uint8_t *in;
+  size_t in_len;
+  size_t in_pos;
+  uint64_t in_off;
+  int in_eof;
+  int ended;
+  z_stream gz;
+  lzma_stream xz;
+  ZSTD_DStream *zstd;
+};
+
+int decomp_probe(int fd) {
+  uint8_t head[8];
+  ssize_t len = pread(fd, head, sizeof(head), 0);
+
+  return len > 0 ? decomp_probe_buf(head, len) : DECOMP_NONE;
+}
+
+int decomp_probe_buf(const void *head, size_t len) {
+  if (len >= sizeof(xz_magic) &&
+      memcmp(head, xz_magic, sizeof(xz_magic)) == 0)
+    return DECOMP_XZ;
+
+  if (len >= sizeof(zstd_magic) &&
+      memcmp(head, zstd_magic, sizeof(zstd_magic)) == 0)
+    return DECOMP_ZSTD;
+
+  if (len >= sizeof(gzip_magic) &&
+      memcmp(head, gzip_magic, sizeof(gzip_magic)) == 0)
+    return DECOMP_GZIP;
+
+  return DECOMP_NONE;
+}
+
+const char *decomp_name(int format) {
+  switch (format) {
+    case DECOMP_GZIP:
+      return "gzip";
+    case DECOMP_XZ:
+      return "xz";
+    case DECOMP_ZSTD:
+      return "zstd";
+    default:
+      return "raw";
+  }
+}
+
+static int open_xz(decomp_t *d) {
+  lzma_mt mt;
+  lzma_ret ret;
+
+  memset(&mt, 0, sizeof(mt));
+  mt.flags = LZMA_CONCATENATED;
+  mt.threads = lzma_cputhreads();
+  mt.memlimit_threading = DECOMP_MEMLIMIT;
+  mt.memlimit_stop = UINT64_MAX;
+
+  if (mt.threads < 1) mt.threads = 1;
+
+  d->xz = (lzma_stream)LZMA_STREAM_INIT;
+
+  /* Images written without blocks still decode, just on one
+     thread, the decoder falls back by itself */
+
+  if ((ret = lzma_stream_decoder_mt(&d->xz, &mt)) != LZMA_OK) {
+    r_printf("Failed to set up the xz decoder (%d)\n", (int)ret);
+    return -1;
+  }
+
+  r_log(LOG_LEVEL_VERBOSE, "xz: up to %u threads\n", mt.threads);
+
+  return 0;
+}
+
+static ssize_t file_read(void *ctx, void *buf, size_t len, uint64_t offset) {
+  ssize_t ret;
+
+  do {
+    ret = pread(*(int *)ctx, buf, len, offset);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+static decomp_t *decomp_open(int fd, decomp_read_t read, void *ctx,
+                             int format) {
+  decomp_t *d = (decomp_t *)calloc(1, sizeof(decomp_t));
+
+  if (d == NULL) return NULL;
+
+  d->format = format;
+  d->fd = fd;
+  d->read = read;
+  d->ctx = ctx != NULL ? ctx : &d->fd;
+
+  if ((d->in = (uint8_t *)malloc(DECOMP_INPUT_SIZE)) == NULL) {
+    free(d);
+    return NULL;
+  }
+
+  int ret = -1;
+
+  switch (format) {
+    case DECOMP_NONE:
+      ret = fd < 0 ? 0 : -1;
+      break;
+    case DECOMP_GZIP:
+      /* 16 + MAX_WBITS takes the gzip header and trailer */
+
+      ret = inflateInit2(&d->gz, 16 + MAX_WBITS) == Z_OK ? 0 : -1;
+      break;
+    case DECOMP_XZ:
+      ret = open_xz(d);
+      break;
+    case DECOMP_ZSTD:
+      if ((d->zstd = ZSTD_createDStream()) != NULL &&
+          !ZSTD_isError(ZSTD_initDStream(d->zstd)))
+        ret = 0;
+      break;
+  }
+
+  if (ret < 0) {
+    r_printf("Failed to set up the %s decoder\n", decomp_name(format));
+    decomp_free(d);
+    return NULL;
+  }
+
+  if (fd >= 0) fadvise_stream(fd);
+
+  return d;
+}
+
+decomp_t *decomp_new(int fd, int format) {
+  return decomp_open(fd, file_read, NULL, format);
+}
+
+decomp_t *decomp_new_reader(decomp_read_t read, void *ctx, int format) {
+  return decomp_open(-1, read, ctx, format);
+}
+
+void decomp_free(decomp_t *d) {
+  if (d == NULL) return;
+
+  switch (d->format) {
+    case DECOMP_GZIP:
+      inflateEnd(&d->gz);
+      break;
+    case DECOMP_XZ:
+      lzma_end(&d->xz);
+      break;
+    case DECOMP_ZSTD:
+      ZSTD_freeDStream(d->zstd);
+      break;
+  }
+
+  if (d->fd >= 0) fadvise_drop(d->fd, 0, 0);
+  free(d->in);
+  free(d);
+}
+
+uint64_t decomp_consumed(const decomp_t *d) {
+  return d->in_off - (d->in_len - d->in_pos);
+}
+
+/* Top up the input once the decoder used all of it */
+
+static int refill(decomp_t *d) {
+  if (d->in_pos < d->in_len || d->in_eof) return 0;
+
+  if (d->fd >= 0) fadvise_drop(d->fd, d->in_off - d->in_len, d->in_len);
+
+  ssize_t len = d->read(d->ctx, d->in, DECOMP_INPUT_SIZE, d->in_off);
+
+  if (len < 0) {
+    r_printf("Reading the image failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  d->in_len = len;
+  d->in_pos = 0;
+  d->in_off += len;
+  d->in_eof = len == 0;
+
+  return 0;
+}
+
+/* One decoder step into out, returning how much it made */
+
+static ssize_t step(decomp_t *d, uint8_t *out, size_t len) {
+  switch (d->format) {
+    case DECOMP_GZIP: {
+      /* A member ended but there is more, that is a
+         concatenated gzip (pigz and friends make these) */
+
+      if (d->ended) {
+        if (d->in_pos == d->in_len) return 0;
+        if (inflateReset(&d->gz) != Z_OK) return -1;
+        d->ended = 0;
+      }
+
+      d->gz.next_in = d->in + d->in_pos;
+      d->gz.avail_in = d->in_len - d->in_pos;
+      d->gz.next_out = out;
+      d->gz.avail_out = len;
+
+      int ret = inflate(&d->gz, Z_NO_FLUSH);
+
+      d->in_pos = d->in_len - d->gz.avail_in;
+
+      if (ret == Z_STREAM_END) {
+        d->ended = 1;
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        r_printf("Broken gzip stream: %s\n", d->gz.msg ? d->gz.msg : "?");
+        return -1;
+      }
+
+      return len - d->gz.avail_out;
+    }
+    case DECOMP_XZ: {
+      d->xz.next_in = d->in + d->in_pos;
+      d->xz.avail_in = d->in_len - d->in_pos;
+      d->xz.next_out = out;
+      d->xz.avail_out = len;
+
+      lzma_ret ret = lzma_code(&d->xz, d->in_eof ? LZMA_FINISH : LZMA_RUN);
+
+      d->in_pos = d->in_len - d->xz.avail_in;
+
+      /* With all input given, no progress means the file is
+         cut short */
+
+      if (ret == LZMA_STREAM_END) {
+        d->ended = 1;
+      } else if (ret == LZMA_BUF_ERROR) {
+        r_printf("The xz stream ends early, the image is cut short\n");
+        return -1;
+      } else if (ret != LZMA_OK) {
+        r_printf("Broken xz stream (%d)\n", (int)ret);
+        return -1;
+      }
+
+      return len - d->xz.avail_out;
+    }
+    case DECOMP_ZSTD: {
+      /* Between frames with no input left, that is the end */
+
+      if (d->ended && d->in_pos == d->in_len) return 0;
+
+      ZSTD_inBuffer in = {d->in, d->in_len, d->in_pos};
+      ZSTD_outBuffer o = {out, len, 0};
+      size_t ret = ZSTD_decompressStream(d->zstd, &o, &in);
+
+      d->in_pos = in.pos;
+
+      if (ZSTD_isError(ret)) {
+        r_printf("Broken zstd stream: %s\n", ZSTD_getErrorName(ret));
+        return -1;
+      }
+
+      /* 0 means a frame is complete, another may follow */
+
+      d->ended = ret == 0;
+
+      return o.pos;
+    }
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+ssize_t decomp_read(decomp_t *d, void *buf, size_t len) {
+  uint8_t *out = (uint8_t *)buf;
+  size_t done = 0;
+
+  /* Nothing to decode, straight into buf */
+
+  if (d->format == DECOMP_NONE) {
+    while (done < len) {
+      ssize_t got = d->read(d->ctx, out + done, len - done, d->in_off);
+
+      if (got < 0) return -1;
+      if (got == 0) break;
+
+      done += got;
+      d->in_off += got;
+    }
+
+    return done;
+  }
+
+  while (done < len) {
+    if (refill(d) < 0) return -1;
+
+    if (d->format == DECOMP_XZ && d->ended) break;
+
+    ssize_t got = step(d, out + done, len - done);
+
+    if (got < 0) return -1;
+
+    done += got;
+
+    /* gzip and zstd can still hold output after the last of
+       the input went in, they are done once nothing comes */
+
+    if (got == 0 && d->format != DECOMP_XZ && d->in_pos == d->in_len &&
+        d->in_eof)
+      break;
+  }
+
+  if (done < len && !d->ended) {
+    r_printf("The %s stream ends early, the image is cut short\n",
+             decomp_name(d->format));
+    return -1;
+  }
+
+  return done;
+}
@@ -0,0 +1,54 @@
+#ifndef DECOMP_H
+#define DECOMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DECOMP_NONE 0
+#define DECOMP_GZIP 1
+#define DECOMP_XZ 2
+#define DECOMP_ZSTD 3
+
+#define DECOMP_INPUT_SIZE (1 << 20)
+#define DECOMP_MEMLIMIT (512 << 20)
+
+/* Raw images mostly come compressed. These decode them on
+   the fly, so a .img.xz goes to the stick without ever being
+   unpacked to disk. The format is told from the first bytes,
+   not the name. xz decodes its blocks on every CPU when the
+   image was made with blocks (xz -T), gzip and zstd streams
+   only decode in order and get one thread. Memory use stays
+   within DECOMP_MEMLIMIT whatever the image size. */
+
+typedef struct decomp decomp_t;
+
+/* Reads up to len bytes of the compressed stream at offset,
+   which only ever goes forward, 0 at its end */
+
+typedef ssize_t (*decomp_read_t)(void *ctx, void *buf, size_t len,
+                                 uint64_t offset);
+
+int decomp_probe(int fd);
+int decomp_probe_buf(const void *head, size_t len);
+const char *decomp_name(int format);
+
+decomp_t *decomp_new(int fd, int format);
+void decomp_free(decomp_t *d);
+
+/* The same from something that is not a file. DECOMP_NONE is
+   taken too and passes the stream through as it is. */
+
+decomp_t *decomp_new_reader(decomp_read_t read, void *ctx, int format);
+
+/* Fills buf completely unless the stream ends first, returns
+   how much it filled, 0 at the end and -1 on a broken stream */
+
+ssize_t decomp_read(decomp_t *d, void *buf, size_t len);
+
+/* How far into the compressed file the decoder got, for
+   progress when the decoded size is not known up front */
+
+uint64_t decomp_consumed(const decomp_t *d);
+
+#endif // DECOMP_H
@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "blkdev.h"
+#include "decomp.h"
+#include "delta.h"
+#include "flush.h"
+#include "image.h"
+
+#define SECTOR_SIZE 512
+#define PROGRESS_INTERVAL_MS 100
+
+static const char hashes_magic[8] = {'R', 'U', 'F', 'C', 'R', 'C', '0', '1'};
+static const char resume_magic[8] = {'R', 'U', 'F', 'R', 'E', 'S', '0', '1'};
+
+/* Both files start with what they belong to, a stale one for
+   an older build of the image is ignored */
+
+typedef struct delta_header {
+  char magic[8];
+  uint32_t chunk_size;
+  uint32_t count;
+  uint64_t image_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} delta_header_t;
+
+typedef struct delta_resume {
+  delta_header_t header;
+  uint64_t device_size;
+  uint32_t next;
+  char device_id[DELTA_ID_SIZE];
+} delta_resume_t;
+
+/* Chunks are handed out in order from next, and settled ones
+   move the watermark up. Everything below the watermark is on
+   the device, so that is what a checkpoint can promise. */
+
+typedef struct delta {
+  int image_fd;
+  int device_fd;
+  int direct_fd;
+  uint64_t image_size;
+  uint32_t count;
+  uint32_t *hashes;
+  uint8_t *known;
+  uint8_t *settled;
+  verify_t *verify;
+  const volatile int *cancel;
+
+  pthread_mutex_t lock;
+  uint32_t watermark;
+
+  atomic_uint next;
+  atomic_uint changed;
+  atomic_int running;
+  atomic_int failed;
+  atomic_int stop;
+  atomic_ullong bytes_done;
+} delta_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_header(delta_header_t *h, const char *magic,
+                        const struct stat *st, uint32_t count) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, magic, sizeof(h->magic));
+  h->chunk_size = DELTA_CHUNK_SIZE;
+  h->count = count;
+  h->image_size = (uint64_t)st->st_size;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static int read_exact(int fd, void *buf, size_t len) {
+  uint8_t *p = (uint8_t *)buf;
+
+  while (len > 0) {
+    ssize_t ret = read(fd, p, len);
+
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+
+    p += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+static int write_exact(int fd, const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+
+  while (len > 0) {
+    ssize_t ret = write(fd, p, len);
+
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+
+    p += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+/* Written to a temporary name and renamed over, so a crash
+   leaves either the old file or the new one */
+
+static int save_file(const char *path, const void *head, size_t head_len,
+                     const void *body, size_t body_len) {
+  char tmp[PATH_MAX];
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return -1;
+
+  if (write_exact(fd, head, head_len) < 0 ||
+      write_exact(fd, body, body_len) < 0 || fdatasync(fd) < 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+
+  close(fd);
+
+  if (rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int load_hashes(const char *path, const struct stat *st,
+                       uint32_t *hashes, uint32_t count) {
+  delta_header_t want, have;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0) return -1;
+
+  fill_header(&want, hashes_magic, st, count);
+
+  int ret = read_exact(fd, &have, sizeof(have)) == 0 &&
+                    memcmp(&want, &have, sizeof(want)) == 0 &&
+                    read_exact(fd, hashes, count * sizeof(uint32_t)) == 0
+                ? 0
+                : -1;
+
+  close(fd);
+
+  return ret;
+}
+
+static int load_resume(const char *path, const struct stat *st, uint32_t count,
+                       uint64_t device_size, const char *device_id) {
+  delta_resume_t want, have;
+  int fd;
+
+  if (device_id == NULL || (fd = open(path, O_RDONLY)) < 0) return 0;
+
+  memset(&want, 0, sizeof(want));
+  fill_header(&want.header, resume_magic, st, count);
+
+  int ok = read_exact(fd, &have, sizeof(have)) == 0 &&
+           memcmp(&want.header, &have.header, sizeof(want.header)) == 0 &&
+           have.device_size == device_size && have.next <= count &&
+           strncmp(have.device_id, device_id, DELTA_ID_SIZE) == 0;
+
+  close(fd);
+
+  return ok ? (int)have.next : 0;
+}
+
+/* Only what is synced goes into the checkpoint */
+
+static void checkpoint(delta_t *d, const char *path, const struct stat *st,
+                       uint64_t device_size, const char *device_id,
+                       uint32_t next) {
+  delta_resume_t r;
+
+  if (device_id == NULL || fdatasync(d->device_fd) < 0) return;
+
+  memset(&r, 0, sizeof(r));
+  fill_header(&r.header, resume_magic, st, d->count);
+  r.device_size = device_size;
+  r.next = next;
+  snprintf(r.device_id, sizeof(r.device_id), "%s", device_id);
+
+  if (save_file(path, &r, sizeof(r), NULL, 0) < 0) {
+    r_log(LOG_LEVEL_VERBOSE, "Could not save checkpoint %s: %s\n", path,
+          strerror(errno));
+  }
+}
+
+/* <image>.<device_id>.rufusl-resume, with everything in the
+   ID that does not belong in a file name made a '_' */
+
+static void resume_name(char *path, size_t size, const char *image_path,
+                        const char *device_id) {
+  char id[DELTA_ID_SIZE];
+  size_t i;
+
+  for (i = 0; device_id[i] != 0x00 && i < sizeof(id) - 1; i++) {
+    char c = device_id[i];
+
+    id[i] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                    (c >= '0' && c <= '9') || c == '-' || c == '.'
+                ? c
+                : '_';
+  }
+
+  id[i] = 0x00;
+
+  snprintf(path, size, "%s.%s" DELTA_RESUME_SUFFIX, image_path, id);
+}
+
+static ssize_t pread_full(int fd, uint8_t *buf, size_t len, uint64_t off) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t ret = pread(fd, buf + done, len - done, off + done);
+
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) return -1;
+    if (ret == 0) break;
+
+    done += ret;
+  }
+
+  return done;
+}
+
+static int pwrite_full(int fd, const uint8_t *buf, size_t len, uint64_t off) {
+  while (len > 0) {
+    ssize_t ret = pwrite(fd, buf, len, off);
+
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+
+    buf += ret;
+    len -= ret;
+    off += ret;
+  }
+
+  return 0;
+}
+
+/* One chunk: hash what the image has (unless the cache knew
+   it already), read what the device has, and only write when
+   the two differ. With both sides in hand they are compared
+   byte for byte. */
+
+static int do_chunk(delta_t *d, uint32_t i, uint8_t *img, uint8_t *dev) {
+  uint64_t off = (uint64_t)i * DELTA_CHUNK_SIZE;
+  size_t len = d->image_size - off < DELTA_CHUNK_SIZE ? d->image_size - off
+                                                      : DELTA_CHUNK_SIZE;
+  size_t rlen = (len + SECTOR_SIZE - 1) & ~(size_t)(SECTOR_SIZE - 1);
+  int have_img = 0;
+  int differ;
+
+  if (!d->known[i]) {
+    if (pread_full(d->image_fd, img, len, off) != (ssize_t)len) return -1;
+
+    d->hashes[i] = crc32c(0, img, len);
+    d->known[i] = 1;
+    have_img = 1;
+  }
+
+  int fd = d->direct_fd >= 0 ? d->direct_fd : d->device_fd;
+
+  if (pread_full(fd, dev, rlen, off) < (ssize_t)len) return -1;
+
+  if (have_img) {
+    differ = memcmp(img, dev, len) != 0;
+  } else {
+    differ = crc32c(0, dev, len) != d->hashes[i];
+  }
+
+  if (differ) {
+    if (!have_img && pread_full(d->image_fd, img, len, off) != (ssize_t)len)
+      return -1;
+
+    /* O_DIRECT wants whole sectors, the ragged end of the
+       image goes through the plain fd */
+
+    size_t aligned = d->direct_fd >= 0 ? len & ~(size_t)(SECTOR_SIZE - 1) : 0;
+
+    if (pwrite_full(d->direct_fd, img, aligned, off) < 0 ||
+        pwrite_full(d->device_fd, img + aligned, len - aligned, off + aligned) < 0)
+      return -1;
+
+    atomic_fetch_add(&d->changed, 1);
+  }
+
+  verify_add_crc(d->verify, d->hashes[i], len, off);
+  atomic_fetch_add(&d->bytes_done, len);
+
+  return 0;
+}
+
+static void *delta_worker(void *arg) {
+  delta_t *d = (delta_t *)arg;
+  void *img = NULL, *dev = NULL;
+
+  if (posix_memalign(&img, 4096, DELTA_CHUNK_SIZE) != 0 ||
+      posix_memalign(&dev, 4096, DELTA_CHUNK_SIZE) != 0) {
+    atomic_store(&d->failed, ENOMEM);
+    goto out;
+  }
+
+  while (!atomic_load(&d->stop)) {
+    uint32_t i = atomic_fetch_add(&d->next, 1);
+
+    if (i >= d->count) break;
+
+    if (do_chunk(d, i, (uint8_t *)img, (uint8_t *)dev) < 0) {
+      atomic_store(&d->failed, errno ? errno : EIO);
+      atomic_store(&d->stop, 1);
+      break;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    d->settled[i] = 1;
+    while (d->watermark < d->count && d->settled[d->watermark]) d->watermark++;
+    pthread_mutex_unlock(&d->lock);
+  }
+
+out:
+  free(dev);
+  free(img);
+  atomic_fetch_sub(&d->running, 1);
+
+  return NULL;
+}
+
+static uint32_t watermark(delta_t *d) {
+  pthread_mutex_lock(&d->lock);
+  uint32_t w = d->watermark;
+  pthread_mutex_unlock(&d->lock);
+
+  return w;
+}
+
+int write_image_delta(const char *image_path, const uint32_t *device_fd,
+                      const char *device_id, unsigned int depth,
+                      verify_t *verify, const volatile int *cancel) {
+  struct timespec interval = {0, PROGRESS_INTERVAL_MS * 1000000L};
+  char hashes_path[PATH_MAX];
+  char resume_path[PATH_MAX];
+  pthread_t threads[DELTA_THREADS];
+  struct stat st;
+  uint64_t device_size;
+  delta_t d;
+  int started = 0;
+  int ret = -1;
+
+  r_printf("Using image: %s, rewriting only what changed\n", image_path);
+
+  memset(&d, 0, sizeof(d));
+  d.device_fd = *device_fd;
+  d.direct_fd = -1;
+  d.verify = verify;
+  d.cancel = cancel;
+
+  if ((d.image_fd = open(image_path, O_RDONLY)) < 0) {
+    r_printf("Opening image failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (decomp_probe(d.image_fd) != DECOMP_NONE) {
+    r_printf("Compressed images can not be compared in place, writing all of it\n");
+    close(d.image_fd);
+    return write_image(image_path, device_fd, 1, depth, verify, 0);
+  }
+
+  if (fstat(d.image_fd, &st) < 0 || blk_size(d.device_fd, &device_size) < 0) {
+    r_printf("Failed to get image or device size: %s\n", strerror(errno));
+    close(d.image_fd);
+    return -1;
+  }
+
+  d.image_size = (uint64_t)st.st_size;
+
+  if (d.image_size > device_size) {
+    r_printf("Image is %llu bytes but the device only holds %llu bytes!\n",
+             (unsigned long long)d.image_size, (unsigned long long)device_size);
+    close(d.image_fd);
+    return -1;
+  }
+
+  d.count = (d.image_size + DELTA_CHUNK_SIZE - 1) / DELTA_CHUNK_SIZE;
+
+  snprintf(hashes_path, sizeof(hashes_path), "%s" DELTA_HASHES_SUFFIX, image_path);
+
+  if (device_id != NULL) {
+    resume_name(resume_path, sizeof(resume_path), image_path, device_id);
+  } else {
+    resume_path[0] = 0x00;
+    r_printf("Device has no serial, a stopped run will start over\n");
+  }
+
+  d.hashes = (uint32_t *)calloc(d.count ? d.count : 1, sizeof(uint32_t));
+  d.known = (uint8_t *)calloc(d.count ? d.count : 1, 1);
+  d.settled = (uint8_t *)calloc(d.count ? d.count : 1, 1);
+
+  if (d.hashes == NULL || d.known == NULL || d.settled == NULL) {
+    r_printf("Out of memory for %u chunk hashes\n", d.count);
+    goto out;
+  }
+
+  int cached = load_hashes(hashes_path, &st, d.hashes, d.count) == 0;
+
+  if (cached) {
+    memset(d.known, 1, d.count);
+    r_printf("Image hashes from %s\n", hashes_path);
+  }
+
+  uint32_t first = load_resume(resume_path, &st, d.count, device_size, device_id);
+
+  if (first > 0) {
+    r_printf("Resuming at byte %llu\n",
+             (unsigned long long)first * DELTA_CHUNK_SIZE);
+  }
+
+  /* The chunks before the checkpoint are not compared again,
+     but they are still verified. Without the hashes of a whole
+     run to go by, those come from the image. */
+
+  uint8_t *buf = NULL;
+
+  if (first > 0 && !cached && (buf = (uint8_t *)malloc(DELTA_CHUNK_SIZE)) == NULL) {
+    r_printf("Out of memory for hashing the image\n");
+    goto out;
+  }
+
+  for (uint32_t i = 0; i < first; i++) {
+    uint64_t off = (uint64_t)i * DELTA_CHUNK_SIZE;
+    uint64_t len = d.image_size - off < DELTA_CHUNK_SIZE ? d.image_size - off
+                                                         : DELTA_CHUNK_SIZE;
+
+    if (!cached) {
+      if (pread_full(d.image_fd, buf, len, off) != (ssize_t)len) {
+        r_printf("Reading image at byte %llu failed: %s\n",
+                 (unsigned long long)off, strerror(errno));
+        free(buf);
+        goto out;
+      }
+
+      d.hashes[i] = crc32c(0, buf, len);
+      d.known[i] = 1;
+    }
+
+    d.settled[i] = 1;
+    verify_add_crc(verify, d.hashes[i], len, off);
+  }
+
+  free(buf);
+
+  d.watermark = first;
+  atomic_init(&d.next, first);
+  atomic_init(&d.changed, 0);
+  atomic_init(&d.failed, 0);
+  atomic_init(&d.stop, 0);
+  atomic_init(&d.bytes_done, (uint64_t)first * DELTA_CHUNK_SIZE);
+  atomic_init(&d.running, DELTA_THREADS);
+  pthread_mutex_init(&d.lock, NULL);
+
+  char path[64];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", d.device_fd);
+  d.direct_fd = open(path, O_RDWR | O_DIRECT);
+
+  fadvise_stream(d.image_fd);
+
+  double start = now();
+
+  for (int i = 0; i < DELTA_THREADS; i++) {
+    if (pthread_create(&threads[i], NULL, delta_worker, &d) != 0) {
+      atomic_fetch_sub(&d.running, DELTA_THREADS - i);
+      break;
+    }
+
+    started++;
+  }
+
+  if (started == 0) {
+    r_printf("Could not start comparing threads\n");
+    pthread_mutex_destroy(&d.lock);
+    goto out;
+  }
+
+  uint32_t saved = first;
+
+  while (atomic_load(&d.running) > 0) {
+    nanosleep(&interval, NULL);
+
+    if (cancel != NULL && __atomic_load_n(cancel, __ATOMIC_RELAXED))
+      atomic_store(&d.stop, 1);
+
+    uint32_t w = watermark(&d);
+
+    if (w >= saved + DELTA_CHECKPOINT_CHUNKS && w < d.count) {
+      checkpoint(&d, resume_path, &st, device_size, device_id, w);
+      saved = w;
+    }
+
+    uint64_t done = atomic_load(&d.bytes_done);
+
+    progress_bytes(done < d.image_size ? done : d.image_size, d.image_size);
+  }
+
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&d.lock);
+
+  uint32_t changed = atomic_load(&d.changed);
+  uint32_t w = d.watermark;
+  int failed = atomic_load(&d.failed);
+
+  /* Save the hashes as soon as all of them are known, even
+     a stopped run leaves them for the next one */
+
+  if (!cached && memchr(d.known, 0, d.count) == NULL) {
+    delta_header_t h;
+
+    fill_header(&h, hashes_magic, &st, d.count);
+
+    if (save_file(hashes_path, &h, sizeof(h), d.hashes,
+                  d.count * sizeof(uint32_t)) < 0) {
+      r_log(LOG_LEVEL_VERBOSE, "Could not save image hashes %s: %s\n",
+            hashes_path, strerror(errno));
+    }
+  }
+
+  if (failed != 0 || w < d.count) {
+    checkpoint(&d, resume_path, &st, device_size, device_id, w);
+
+    if (failed != 0) {
+      r_printf("Incremental write failed near byte %llu: %s\n",
+               (unsigned long long)w * DELTA_CHUNK_SIZE, strerror(failed));
+      goto out;
+    }
+
+    r_printf("Stopped at byte %llu, %u chunks rewritten%s\n",
+             (unsigned long long)w * DELTA_CHUNK_SIZE, changed,
+             device_id != NULL ? ", run again to resume" : "");
+    ret = DELTA_CANCELLED;
+    goto out;
+  }
+
+  if (device_id != NULL) unlink(resume_path);
+
+  if (flush_device(d.device_fd) < 0) {
+    r_printf("Failed to flush device: %s\n", strerror(errno));
+    goto out;
+  }
+
+  double elapsed = now() - start;
+
+  r_printf("%u of %u chunks differed, wrote %llu of %llu bytes in %.1lf s\n",
+           changed, d.count - first,
+           (unsigned long long)changed * DELTA_CHUNK_SIZE,
+           (unsigned long long)d.image_size, elapsed);
+
+  set_progress_bar(100);
+
+  if (changed > 0 && ioctl(d.device_fd, BLKRRPART) < 0) {
+    r_printf("WARNING: Could not re-read partition table: %s\n",
+             strerror(errno));
+  }
+
+  ret = DELTA_DONE;
+
+out:
+  if (d.direct_fd >= 0) close(d.direct_fd);
+
+  fadvise_drop(d.image_fd, 0, 0);
+  close(d.image_fd);
+  free(d.settled);
+  free(d.known);
+  free(d.hashes);
+
+  return ret;
+}
@@ -0,0 +1,43 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+#include "verify.h"
+
+#define DELTA_CHUNK_SIZE VERIFY_BLOCK_SIZE
+#define DELTA_THREADS 4
+#define DELTA_CHECKPOINT_CHUNKS 256
+#define DELTA_ID_SIZE 128
+
+#define DELTA_HASHES_SUFFIX ".rufusl-crc"
+#define DELTA_RESUME_SUFFIX ".rufusl-resume"
+
+#define DELTA_DONE 0
+#define DELTA_CANCELLED 1
+
+/* Rewrite a stick that already holds an older build of the
+   same image. The image and the device are both hashed chunk
+   by chunk, on several threads, and only the chunks that differ
+   are written. The image hashes are kept next to the image in
+   <image>.rufusl-crc, so the next run only has to read the
+   device.
+
+   Every DELTA_CHECKPOINT_CHUNKS chunks that are settled, the
+   device is synced and <image>.<device_id>.rufusl-resume records
+   how far it got. device_id has to be unique to the stick, see
+   blk_usb_serial(), and NULL when there is nothing unique to go
+   by: then nothing is saved or resumed. Setting *cancel stops
+   the write at the next chunk, and a later run on the same
+   image and device picks up from the checkpoint.
+
+   Compressed images have no chunks to compare up front and
+   are written in full by write_image(). With verify set, every
+   chunk is hashed for verify_device(). Returns DELTA_DONE,
+   DELTA_CANCELLED or -1. */
+
+int write_image_delta(const char *image_path, const uint32_t *device_fd,
+                      const char *device_id, unsigned int depth,
+                      verify_t *verify, const volatile int *cancel);
+
+#endif // DELTA_H
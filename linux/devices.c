@@ -8,6 +8,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 #include "devices.h"
 
@@ -20,162 +22,170 @@
 #define REMOVABLE '1'
 #define SCSI_DEVICE '8'
 #define MAX_DEVICES 32
+#define UEVENT_KERNEL_GROUP 1
 
-int scan_devices(Device *dev, int array_size, uint8_t *discovered) {
-
-    DIR *dp;
-    struct dirent *ep;
-    char major[10];
-    char minor[10];
-    int i, j, len;
-    char devfile[150];
-    int index = 0;
+/* Fill in one Device from its sysfs directory. Returns 1 for
+   a removable SCSI disk, 0 for anything else and -1 if it could
+   not be read. dev only gets touched for the 1 case. */
 
-    dp = opendir("/sys/block/");
+int probe_device(const char *name, Device *dev) {
 
-  if (dp != NULL) {
+    char path[150];
+    char buf[150];
+    unsigned int major, minor;
 
-    while ((ep = readdir(dp))) {
+    if (strlen(name) >= sizeof(dev->device)) return 0;
 
-        if (ep->d_name[0] == '.') continue;
+    /* One read of SYSFS_BLOCK_DEVFILE gives both the major,
+       which tells if it is an SCSI (USB) device, and the minor */
 
-        /* Wipe the buffer becuase of the loop,
-           construct the path to SYSFS_BLOCK_DEVFILE
-           and read the SYSFS_BLOCK_DEVFILE
-           into the buffer */
+    if (snprintf(path, sizeof(path), SYSFS_BLOCK_DEVFILE, name) < 0) return -1;
+    if (buffread(buf, sizeof(buf), path) < 0) return -1;
+    if (sscanf(buf, "%u:%u", &major, &minor) != 2) return -1;
 
-        memset(devfile, 0, sizeof(devfile));
-        if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_DEVFILE, ep->d_name)) < 0) return -1;
-        if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
+    if (*buf != SCSI_DEVICE) return 0;
 
-        /* Check if the SYSFS_BLOCK_DEVFILE's
-           major in the buffer indicates that it is
-           an SCSI (USB) device */
+    if (snprintf(path, sizeof(path), SYSFS_BLOCK_REMOVABLE, name) < 0) return -1;
+    if (buffread(buf, sizeof(buf), path) < 0) return -1;
 
-        if (*devfile == SCSI_DEVICE) {
+    if (*buf != REMOVABLE) return 0;
 
-            /* Wipe the buffer clean, format the
-               path to SYSFS_BLOCK_REMOVABLE and
-               read SYSFS_BLOCK_REMOVABLE into the
-               buffer */
+    strcpy(dev->device, name);
+    dev->major = (uint8_t) major;
+    dev->minor = (uint8_t) minor;
 
-            memset(devfile, 0, sizeof(devfile));
-            if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_REMOVABLE , ep->d_name)) < 0) return -1;
-            if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
+    /* Vendor and model come with trailing whitespace and a
+       newline, trim those */
 
-            /* Check if SYSFS_BLOCK_REMOVABLE in
-               the buffer indidcates that the SCSI
-               device is removable */
+    if (snprintf(path, sizeof(path), SYSFS_BLOCK_VENDOR, name) < 0) return -1;
+    if (buffread(dev->vendor, sizeof(dev->vendor), path) < 0) return -1;
+    trimwhitespace(dev->vendor);
 
-            if (*devfile == REMOVABLE) {
+    if (snprintf(path, sizeof(path), SYSFS_BLOCK_MODEL, name) < 0) return -1;
+    if (buffread(dev->model, sizeof(dev->model), path) < 0) return -1;
+    trimwhitespace(dev->model);
 
-                /* Copy the current device sysfs
-                   name into the indexth
-                   Device struct */
+    if (snprintf(path, sizeof(path), SYSFS_BLOCK_SIZE, name) < 0) return -1;
+    if (buffread(buf, sizeof(buf), path) < 0) return -1;
+    dev->capacity = strtoull(buf, NULL, 10);
 
-                if (strcpy((*(dev + index)).device, ep->d_name) == NULL) continue;
+    /* Block sizes, queue limits and the USB link, for tuning
+       the writes later on. A device without them still works,
+       it just gets the defaults. */
 
-                /* Wipe the buffer clean, and format
-                   the path to SYSFS_BLOCK_VENDOR, then
-                   read from SYSFS_BLOCK_VENDOR and write
-                   into indexth Device struct vendor name, then
-                   trim all trailing and leading whitespaces
-                   including the newline character */
+    blk_profile_dev(major, minor, &dev->profile);
 
-                memset(devfile, 0, sizeof(devfile));
-                if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_VENDOR , ep->d_name)) < 0) return -1;
-                if (buffread((*(dev + index)).vendor, sizeof((*(dev + index)).vendor), devfile) < 0) return -1;
-                trimwhitespace((*(dev + index)).vendor);
+    return 1;
+}
 
-                /* Wipe the buffer clean, and format
-                   the path to SYSFS_BLOCK_MODEL, then
-                   read from SYSFS_BLOCK_MODEL and write
-                   into indexth Device struct model name, then
-                   trim all trailing and leading whitespaces
-                   including the newline character */
+int scan_devices(Device *dev, int array_size, uint8_t *discovered) {
 
-                memset(devfile, 0, sizeof(devfile));
-                if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_MODEL , ep->d_name)) < 0) return -1;
-                if (buffread((*(dev + index)).model, sizeof((*(dev + index)).model), devfile) < 0) return -1;
-                trimwhitespace((*(dev + index)).model);
+    DIR *dp;
+    struct dirent *ep;
+    int index = 0;
 
-                /* Wipe the buffer clean, and format
-                   the path to SYSFS_BLOCK_SIZE, then
-                   read from SYSFS_BLOCK_SIZE and write into
-                   the buffer, then convert the buffer string
-                   it to an unsigned 64-bit integer ignoring
-                   all garbage that strtol may produce, and
-                   assign it to the Device struct capacity
-                   property */
+    dp = opendir("/sys/block/");
 
-                memset(devfile, 0, sizeof(devfile));
-                if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_SIZE , ep->d_name)) < 0) return -1;
-                if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
-                (*(dev + index)).capacity = strtol(devfile, NULL, 10);
+  if (dp != NULL) {
 
+    while ((ep = readdir(dp))) {
 
-                /* Read devfile again to populate struct */
+        if (ep->d_name[0] == '.') continue;
 
-                memset(devfile, 0, sizeof(devfile));
-                if ((snprintf(devfile, sizeof(devfile), SYSFS_BLOCK_DEVFILE , ep->d_name)) < 0) return -1;
-                if (buffread(devfile, sizeof(devfile), devfile) < 0) return -1;
+        /* Skip whatever is not a removable SCSI disk or
+           could not be read */
 
-                /* Wipe buffer */
+        if (probe_device(ep->d_name, dev + index) != 1) continue;
 
-                memset(minor, 0, sizeof(minor));
-                memset(major, 0, sizeof(major));
+        /* Increment number of discovered
+           devices and the index of the current
+           Device struct in the array */
 
-                len = strlen(devfile);
+        (*discovered)++;
+        index++;
 
-                /* Write digits up to ":" to buffer */
+        /* If there is more device in /sys/block than
+           there is Device struct members, break the loop
+           ignoring the other members */
 
-                for (i = 0; i < len; i++) {
-                    if (devfile[i] == ':') break;
-                    major[i] = devfile[i];
-                }
+        if (index >= array_size) break;
+    }
 
-                /* Skip ":" char */
+    closedir(dp);
 
-                i++;
+  } else {
+    perror("Couldn't open the directory");
+  }
 
-                /* Read after ":" into buffer */
 
-                for (j = 0;i < len; i++) {
-                    if (devfile[i] == '\n') break;
-                    minor[j] = devfile[i];
-                    j++;
-                }
+  return (*discovered) == 0 ? -1 : 0;
+}
 
-                /* Cover buffer to long and cast long to short */
+/* Listen for the kernel's own uevents, the ones udev would
+   act on. The socket does not block, so it can be read from
+   whenever the event loop says there is something. */
 
-                (*(dev + index)).minor = (uint8_t) strtol(minor, NULL, 10);
-                (*(dev + index)).major = (uint8_t) strtol(major, NULL, 10);
+int uevent_open(void) {
 
-                /* Increment number of discovered
-                   devices and the index of the current
-                   Device struct in the array */
+    struct sockaddr_nl addr;
+    int fd;
 
-                (*discovered)++;
-                index++;
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                NETLINK_KOBJECT_UEVENT);
 
-                /* If there is more device in /sys/block than
-                   there is Device struct members, break the loop
-                   ignoring the other members */
+    if (fd < 0) return -1;
 
-                if (index >= array_size) break;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = UEVENT_KERNEL_GROUP;
 
-        }
-      }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
     }
 
-    closedir(dp);
+    return fd;
+}
 
-  } else {
-    perror("Couldn't open the directory");
-  }
+/* Read one uevent. Returns 1 when it is about a whole block
+   device, 0 for any other event, and -1 once there is nothing
+   left to read (errno EAGAIN) or on errors. The message is a
+   header line followed by NUL separated KEY=value pairs. */
 
+int uevent_read(int fd, uevent_t *ev) {
 
-  return (*discovered) == 0 ? -1 : 0;
+    char buf[UEVENT_BUFFER_SIZE];
+    struct sockaddr_nl addr;
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr msg;
+    int block = 0, disk = 0;
+    ssize_t len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if ((len = recvmsg(fd, &msg, 0)) < 0) return -1;
+
+    /* Only trust what the kernel itself sent */
+
+    if (addr.nl_pid != 0) return 0;
+
+    buf[len] = 0x00;
+    memset(ev, 0, sizeof(*ev));
+
+    for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+        if (strcmp(p, "ACTION=add") == 0) ev->action = UEVENT_ADD;
+        else if (strcmp(p, "ACTION=remove") == 0) ev->action = UEVENT_REMOVE;
+        else if (strcmp(p, "ACTION=change") == 0) ev->action = UEVENT_CHANGE;
+        else if (strcmp(p, "SUBSYSTEM=block") == 0) block = 1;
+        else if (strcmp(p, "DEVTYPE=disk") == 0) disk = 1;
+        else if (strncmp(p, "DEVNAME=", 8) == 0) snprintf(ev->name, sizeof(ev->name), "%s", p + 8);
+    }
+
+    return block && disk && ev->action != 0 && ev->name[0] != 0x00;
 }
 
 void trimwhitespace(char *str) {
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "blkdev.h"
+
 typedef struct DEVICE {
   char device[4];
   char model[255];
@@ -10,9 +12,23 @@ typedef struct DEVICE {
   uint64_t capacity;
   uint8_t minor;
   uint8_t major;
+  blk_profile_t profile;
 } Device;
 
+#define UEVENT_ADD 1
+#define UEVENT_REMOVE 2
+#define UEVENT_CHANGE 3
+#define UEVENT_BUFFER_SIZE 8192
+
+typedef struct uevent {
+  int action;
+  char name[32];
+} uevent_t;
+
 int scan_devices(struct DEVICE *dev, int array_size, uint8_t *discovered);
+int probe_device(const char *name, struct DEVICE *dev);
+int uevent_open(void);
+int uevent_read(int fd, uevent_t *ev);
 void trimwhitespace(char *str);
 int buffread(char *buf, int sizeofbuf, char *path);
 
@@ -0,0 +1,864 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "definitions.h"
+#include "exfat.h"
+#include "fattree.h"
+#include "blkdev.h"
+#include "flush.h"
+
+#define SECTOR_SIZE 512
+#define BOOT_SECTORS 12
+#define DIRENT_SIZE 32
+#define NAME_CHARS 15
+#define LABEL_CHARS 11
+#define UPCASE_CHARS 0x10000
+
+#define ENTRY_BITMAP 0x81
+#define ENTRY_UPCASE 0x82
+#define ENTRY_LABEL 0x83
+#define ENTRY_FILE 0x85
+#define ENTRY_STREAM 0xC0
+#define ENTRY_NAME 0xC1
+#define ROOT_SPECIALS 3
+
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+
+#define FLAG_ALLOCATED 0x01
+#define FLAG_NO_FAT_CHAIN 0x02
+
+#define FAT_MEDIA 0xFFFFFFF8
+#define FAT_EOC 0xFFFFFFFF
+
+#define NO_NODE UINT32_MAX
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+/* Node 0 is the root, node i + 1 is entry i of the list */
+
+typedef struct exfat_node {
+  const copy_entry_t *entry;
+  uint32_t parent;
+  uint32_t first_child;
+  uint32_t last_child;
+  uint32_t next_sibling;
+  uint32_t cluster;
+  uint32_t clusters;
+  uint32_t slots;
+  uint16_t hash;
+  uint8_t name_len;
+  uint8_t is_dir;
+} exfat_node_t;
+
+typedef struct exfat_tree {
+  exfat_node_t *nodes;
+  uint32_t count;
+  uint32_t cluster_bytes;
+  uint32_t *dirs;
+  uint32_t *names;
+  uint32_t mask;
+  uint16_t *upcase;
+  uint32_t stamp;
+} exfat_tree_t;
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v & 0xFFFF);
+  put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+  put32(p, v & 0xFFFFFFFF);
+  put32(p + 4, v >> 32);
+}
+
+static uint32_t fnv(const void *data, size_t len, uint32_t hash) {
+  const uint8_t *p = (const uint8_t *)data;
+
+  for (size_t i = 0; i < len; i++) hash = (hash ^ p[i]) * FNV_PRIME;
+
+  return hash;
+}
+
+static const char *base_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+
+  return slash ? slash + 1 : path;
+}
+
+/* The checksums exFAT uses everywhere: rotate right by one,
+   then add the next byte */
+
+static uint16_t sum16(uint16_t sum, uint8_t byte) {
+  return ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + byte;
+}
+
+static uint32_t sum32(uint32_t sum, uint8_t byte) {
+  return ((sum & 1) ? 0x80000000u : 0) + (sum >> 1) + byte;
+}
+
+/* ---- Geometry ---- */
+
+static uint64_t round_up(uint64_t v, uint64_t to) {
+  return (v + to - 1) / to * to;
+}
+
+int exfat_geometry(const uint32_t *part_fd, uint8_t cluster_size,
+                   uint64_t align, exfat_geometry_t *geo) {
+  uint64_t bytes;
+  blk_profile_t profile;
+
+  if (blk_size(*part_fd, &bytes) < 0) {
+    r_printf("Failed to get the partition size: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (bytes < EXFAT_VOLUME_MIN) {
+    r_printf("ERROR: Volume is too small!\n");
+    return -1;
+  }
+
+  geo->vol_len = bytes / SECTOR_SIZE;
+
+  if (cluster_size <= BS_32768B) {
+    geo->cluster_shift = cluster_size;
+  } else {
+    r_printf("Autosetting cluster size.\n");
+
+    /* Files are one run of clusters each, however big they
+       are, so large clusters buy nothing for the big ones. They
+       keep the bitmap and FAT small on big sticks, small ones
+       keep the slack down on the many small files of an ISO. */
+
+    if (bytes < EXFAT_SMALL_VOLUME) {
+      geo->cluster_shift = 3;
+    } else if (bytes < EXFAT_MID_VOLUME) {
+      geo->cluster_shift = 6;
+    } else {
+      geo->cluster_shift = 8;
+    }
+
+    /* Never below the physical block, same as FAT32 */
+
+    if (blk_profile(*part_fd, &profile) == 0) {
+      while ((SECTOR_SIZE << geo->cluster_shift) < profile.physical_block &&
+             geo->cluster_shift < EXFAT_CLUSTER_SHIFT_MAX)
+        geo->cluster_shift++;
+    }
+  }
+
+  /* The FAT and the cluster heap both start on an erase block,
+     which with power of two clusters puts every cluster on a
+     block boundary too. The boot regions sit in front of the
+     FAT, in the first block. */
+
+  align = (align != 0 ? align : blk_alignment(*part_fd)) / SECTOR_SIZE;
+
+  for (;;) {
+    uint64_t fat_offset = round_up(EXFAT_FAT_OFFSET_MIN, align);
+    uint64_t clusters = (geo->vol_len - fat_offset) >> geo->cluster_shift;
+    uint64_t fat_len = round_up(((clusters + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE,
+                                align);
+    uint64_t heap_offset = round_up(fat_offset + fat_len, align);
+
+    /* Too small for that to be worth it, go back to the plain
+       layout */
+
+    if (align > 1 && heap_offset > geo->vol_len / 2) {
+      align = 1;
+      continue;
+    }
+
+    if (heap_offset >= geo->vol_len) {
+      r_printf("ERROR: Volume is too small!\n");
+      return -1;
+    }
+
+    clusters = (geo->vol_len - heap_offset) >> geo->cluster_shift;
+
+    if (clusters > EXFAT_CLUSTERS_MAX || heap_offset > UINT32_MAX) {
+      r_printf("Volume too big for exFAT with %u byte clusters\n",
+               SECTOR_SIZE << geo->cluster_shift);
+      return -1;
+    }
+
+    geo->fat_offset = fat_offset;
+    geo->fat_len = fat_len;
+    geo->heap_offset = heap_offset;
+    geo->clusters = clusters;
+    break;
+  }
+
+  r_printf("exFAT layout: %llu KiB alignment, FAT at sector %u, heap at "
+           "sector %u, %u clusters of %u bytes\n",
+           (unsigned long long)align / 2, geo->fat_offset, geo->heap_offset,
+           geo->clusters, SECTOR_SIZE << geo->cluster_shift);
+
+  return 0;
+}
+
+/* ---- Up-case table ---- */
+
+/* What names are compared and hashed with: ASCII, Latin-1,
+   Latin Extended-A, Greek, Cyrillic and the full width Latin
+   letters. Everything else stays as it is. */
+
+static uint16_t upcase_char(uint32_t c) {
+  if (c >= 'a' && c <= 'z') return c - 32;
+  if (c >= 0xE0 && c <= 0xFE && c != 0xF7) return c - 32;
+  if (c == 0xFF) return 0x178;
+
+  if (c >= 0x100 && c <= 0x17F) {
+    if (c == 0x131 || c == 0x138 || c == 0x149 || c == 0x17F) return c;
+
+    /* Capitals are on the even code points, except for these
+       two blocks where they are on the odd ones */
+
+    if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E))
+      return (c & 1) ? c : c - 1;
+
+    return (c & 1) ? c - 1 : c;
+  }
+
+  if ((c >= 0x3B1 && c <= 0x3C1) || (c >= 0x3C3 && c <= 0x3CB)) return c - 32;
+  if (c >= 0x430 && c <= 0x44F) return c - 32;
+  if (c >= 0x450 && c <= 0x45F) return c - 80;
+  if (c >= 0xFF41 && c <= 0xFF5A) return c - 32;
+
+  return c;
+}
+
+/* The table as stored, with every run of characters that map
+   to themselves compressed into 0xFFFF and the run length.
+   Returns the number of entries. */
+
+static uint32_t upcase_table(const uint16_t *map, uint16_t *out) {
+  uint32_t n = 0;
+
+  for (uint32_t c = 0; c < UPCASE_CHARS;) {
+    uint32_t run = 0;
+
+    while (c + run < UPCASE_CHARS && map[c + run] == c + run) run++;
+
+    if (run == 0) {
+      out[n++] = map[c++];
+    } else {
+      out[n++] = 0xFFFF;
+      out[n++] = run;
+      c += run;
+    }
+  }
+
+  return n;
+}
+
+/* ---- Names ---- */
+
+static int node_units(const exfat_tree_t *t, uint32_t node, uint16_t *units,
+                      int upcased) {
+  int len = fattree_utf16(base_name(t->nodes[node].entry->path), units);
+
+  for (int i = 0; upcased && i < len; i++) units[i] = t->upcase[units[i]];
+
+  return len;
+}
+
+static uint16_t name_hash(const uint16_t *units, int len) {
+  uint16_t hash = 0;
+
+  for (int i = 0; i < len; i++) {
+    hash = sum16(hash, units[i] & 0xFF);
+    hash = sum16(hash, units[i] >> 8);
+  }
+
+  return hash;
+}
+
+/* exFAT keeps the case of a name but compares without it, so
+   two names in a directory that only differ in case would
+   make one of the files unreachable */
+
+static int name_node(exfat_tree_t *t, uint32_t node) {
+  exfat_node_t *n = &t->nodes[node];
+  const char *path = n->entry->path;
+  uint16_t units[FATTREE_NAME_MAX];
+  uint16_t other[FATTREE_NAME_MAX];
+  int len = node_units(t, node, units, 0);
+
+  if (len <= 0) {
+    r_printf("Name too long for exFAT: %s\n", path);
+    return -1;
+  }
+
+  for (int i = 0; i < len; i++) {
+    if (units[i] < 0x20 || (units[i] < 0x80 && strchr("\"*/:<>?\\|", units[i]))) {
+      r_printf("Name not allowed on exFAT: %s\n", path);
+      return -1;
+    }
+
+    units[i] = t->upcase[units[i]];
+  }
+
+  n->name_len = len;
+  n->hash = name_hash(units, len);
+
+  uint32_t slot =
+      fnv(units, len * sizeof(uint16_t), fnv(&n->parent, sizeof(n->parent), FNV_BASIS)) &
+      t->mask;
+
+  for (; t->names[slot] != NO_NODE; slot = (slot + 1) & t->mask) {
+    const exfat_node_t *o = &t->nodes[t->names[slot]];
+
+    if (o->parent != n->parent || o->name_len != len || o->hash != n->hash)
+      continue;
+
+    node_units(t, t->names[slot], other, 1);
+
+    if (memcmp(other, units, len * sizeof(uint16_t)) == 0) {
+      r_printf("%s and %s only differ in case, exFAT cannot hold both\n",
+               o->entry->path, path);
+      return -1;
+    }
+  }
+
+  t->names[slot] = node;
+
+  return 0;
+}
+
+/* ---- Layout ---- */
+
+static const char *node_path(const exfat_tree_t *t, uint32_t node) {
+  return node == 0 ? "" : t->nodes[node].entry->path;
+}
+
+static void dir_insert(exfat_tree_t *t, uint32_t node) {
+  const char *path = node_path(t, node);
+  uint32_t slot = fnv(path, strlen(path), FNV_BASIS) & t->mask;
+
+  while (t->dirs[slot] != NO_NODE) slot = (slot + 1) & t->mask;
+
+  t->dirs[slot] = node;
+}
+
+static uint32_t dir_find(const exfat_tree_t *t, const char *path, size_t len) {
+  uint32_t slot = fnv(path, len, FNV_BASIS) & t->mask;
+
+  for (; t->dirs[slot] != NO_NODE; slot = (slot + 1) & t->mask) {
+    const char *other = node_path(t, t->dirs[slot]);
+
+    if (strlen(other) == len && memcmp(other, path, len) == 0)
+      return t->dirs[slot];
+  }
+
+  return NO_NODE;
+}
+
+static int build_tree(exfat_tree_t *t, const copy_list_t *list) {
+  t->nodes[0].entry = NULL;
+  t->nodes[0].parent = NO_NODE;
+  t->nodes[0].is_dir = 1;
+  t->nodes[0].first_child = t->nodes[0].last_child = NO_NODE;
+  t->nodes[0].slots = ROOT_SPECIALS;
+
+  dir_insert(t, 0);
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    exfat_node_t *n = &t->nodes[i + 1];
+    const char *path = list->entries[i].path;
+    const char *name = base_name(path);
+
+    n->entry = &list->entries[i];
+    n->is_dir = list->entries[i].is_dir;
+    n->first_child = n->last_child = n->next_sibling = NO_NODE;
+    n->parent = dir_find(t, path, name == path ? 0 : (size_t)(name - path - 1));
+
+    /* Lists are pre-order, so the parent is always known */
+
+    if (n->parent == NO_NODE) {
+      r_printf("Parent of %s is not in the list\n", path);
+      return -1;
+    }
+
+    if (name_node(t, i + 1) < 0) return -1;
+
+    exfat_node_t *parent = &t->nodes[n->parent];
+
+    if (parent->last_child == NO_NODE) {
+      parent->first_child = i + 1;
+    } else {
+      t->nodes[parent->last_child].next_sibling = i + 1;
+    }
+
+    parent->last_child = i + 1;
+    parent->slots += 2 + (n->name_len + NAME_CHARS - 1) / NAME_CHARS;
+
+    if ((uint64_t)parent->slots * DIRENT_SIZE > EXFAT_DIR_MAX_BYTES) {
+      r_printf("Too many entries in %s\n", node_path(t, n->parent));
+      return -1;
+    }
+
+    if (n->is_dir) dir_insert(t, i + 1);
+  }
+
+  return 0;
+}
+
+static uint32_t clusters_for(const exfat_tree_t *t, uint64_t bytes) {
+  return (bytes + t->cluster_bytes - 1) / t->cluster_bytes;
+}
+
+/* Directories from first on, root first, then the files, each
+   in list order. Returns the first cluster after everything,
+   dirs_end the first one after the directories. */
+
+static uint64_t allocate(exfat_tree_t *t, uint32_t first, uint32_t *dirs_end) {
+  uint64_t next = first;
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t i = 0; i < t->count; i++) {
+      exfat_node_t *n = &t->nodes[i];
+
+      if (n->is_dir != (pass == 0)) continue;
+
+      uint64_t bytes = n->is_dir ? (uint64_t)n->slots * DIRENT_SIZE
+                                 : n->entry->size;
+      uint64_t clusters = (bytes + t->cluster_bytes - 1) / t->cluster_bytes;
+
+      if (n->is_dir && clusters == 0) clusters = 1;
+
+      /* Too big to fit anyway, the caller finds out from the
+         total */
+
+      if (next + clusters > EXFAT_CLUSTERS_MAX) return UINT64_MAX;
+
+      n->clusters = clusters;
+      n->cluster = clusters ? next : 0;
+      next += clusters;
+    }
+
+    if (pass == 0) *dirs_end = next;
+  }
+
+  return next;
+}
+
+/* ---- Directory contents ---- */
+
+/* A file or directory is a set of entries: the file entry,
+   the stream extension with where its data is, and the name 15
+   characters at a time. The checksum covers the whole set. */
+
+static uint8_t *put_set(const exfat_tree_t *t, uint8_t *p, uint32_t node) {
+  const exfat_node_t *n = &t->nodes[node];
+  uint16_t units[FATTREE_NAME_MAX];
+  int len = node_units(t, node, units, 0);
+  int names = (len + NAME_CHARS - 1) / NAME_CHARS;
+  uint64_t size = n->is_dir ? (uint64_t)n->clusters * t->cluster_bytes
+                            : n->entry->size;
+  uint8_t *set = p;
+  uint16_t sum = 0;
+
+  p[0] = ENTRY_FILE;
+  p[1] = 1 + names;
+  put16(p + 4, n->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE);
+  put32(p + 8, t->stamp);
+  put32(p + 12, t->stamp);
+  put32(p + 16, t->stamp);
+  p += DIRENT_SIZE;
+
+  /* Directories keep a FAT chain, files are contiguous */
+
+  p[0] = ENTRY_STREAM;
+  p[1] = FLAG_ALLOCATED | (n->is_dir || n->clusters == 0 ? 0 : FLAG_NO_FAT_CHAIN);
+  p[3] = len;
+  put16(p + 4, n->hash);
+  put64(p + 8, size);
+  put32(p + 20, n->cluster);
+  put64(p + 24, size);
+  p += DIRENT_SIZE;
+
+  for (int i = 0; i < names; i++, p += DIRENT_SIZE) {
+    p[0] = ENTRY_NAME;
+
+    for (int k = 0; k < NAME_CHARS && i * NAME_CHARS + k < len; k++)
+      put16(p + 2 + 2 * k, units[i * NAME_CHARS + k]);
+  }
+
+  for (uint8_t *b = set; b < p; b++) {
+    if (b - set == 2 || b - set == 3) continue;
+    sum = sum16(sum, *b);
+  }
+
+  put16(set + 2, sum);
+
+  return p;
+}
+
+static void fill_dir(const exfat_tree_t *t, uint32_t dir, uint8_t *p) {
+  if (dir == 0) p += ROOT_SPECIALS * DIRENT_SIZE;
+
+  for (uint32_t c = t->nodes[dir].first_child; c != NO_NODE;
+       c = t->nodes[c].next_sibling)
+    p = put_set(t, p, c);
+}
+
+/* The root starts with the volume label, the allocation bitmap
+   and the up-case table */
+
+static void put_root(uint8_t *p, const char *label, uint32_t bitmap_cluster,
+                     uint64_t bitmap_bytes, uint32_t upcase_cluster,
+                     uint64_t upcase_bytes, uint32_t upcase_sum) {
+  uint16_t units[FATTREE_NAME_MAX];
+  int len = fattree_utf16(label, units);
+
+  if (len > LABEL_CHARS) {
+    r_printf("WARNING: Label is larger than allowed 11 chars. Will truncate.\n");
+    len = LABEL_CHARS;
+  }
+
+  p[0] = ENTRY_LABEL;
+  p[1] = len < 0 ? 0 : len;
+
+  for (int i = 0; i < len; i++) put16(p + 2 + 2 * i, units[i]);
+
+  p += DIRENT_SIZE;
+  p[0] = ENTRY_BITMAP;
+  put32(p + 20, bitmap_cluster);
+  put64(p + 24, bitmap_bytes);
+
+  p += DIRENT_SIZE;
+  p[0] = ENTRY_UPCASE;
+  put32(p + 4, upcase_sum);
+  put32(p + 20, upcase_cluster);
+  put64(p + 24, upcase_bytes);
+}
+
+/* ---- Output ---- */
+
+static int write_full(int fd, const uint8_t *buf, uint64_t len, uint64_t off) {
+  while (len > 0) {
+    ssize_t ret = pwrite(fd, buf, len, off);
+
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    buf += ret;
+    len -= ret;
+    off += ret;
+  }
+
+  return 0;
+}
+
+/* Same idea as the FAT32 boot sector, only a handful of fields
+   depend on the volume, the rest is constant. No boot code
+   either, the jump lands on an empty one.
+
+    Legend:
+
+      0 JumpBoot EB 76 90
+      3 FileSystemName "EXFAT   "
+     11 MustBeZero, where the BPB of FAT32 would be
+     64 PartitionOffset = 0, ignored - uint64_t
+     72 VolumeLength - populated - uint64_t
+     80 FatOffset - populated - uint32_t
+     84 FatLength - populated - uint32_t
+     88 ClusterHeapOffset - populated - uint32_t
+     92 ClusterCount - populated - uint32_t
+     96 FirstClusterOfRootDirectory - populated - uint32_t
+    100 VolumeSerialNumber - populated - uint32_t
+    104 FileSystemRevision = 1.00 - uint16_t
+    106 VolumeFlags = 0, not in the checksum - uint16_t
+    108 BytesPerSectorShift = 9 - uint8_t
+    109 SectorsPerClusterShift - populated - uint8_t
+    110 NumberOfFats = 1 - uint8_t
+    111 DriveSelect = 0x80 - uint8_t
+    112 PercentInUse - populated, not in the checksum - uint8_t
+    113 Reserved
+    120 BootCode, left blank
+    510 BootSignature
+    512 Total
+
+   Sectors 1 to 8 are empty extended boot sectors, 9 and 10
+   are left zero and 11 repeats the checksum of the others. */
+
+static const uint8_t exfat_boot[120] = {
+
+  /*   0 */ 0xEB, 0x76, 0x90,
+  /*   3 */ 0x45, 0x58, 0x46, 0x41, 0x54, 0x20, 0x20, 0x20,
+  /*  11 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /*  64 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /*  72 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /*  80 */ 0x00, 0x00, 0x00, 0x00,
+  /*  84 */ 0x00, 0x00, 0x00, 0x00,
+  /*  88 */ 0x00, 0x00, 0x00, 0x00,
+  /*  92 */ 0x00, 0x00, 0x00, 0x00,
+  /*  96 */ 0x00, 0x00, 0x00, 0x00,
+  /* 100 */ 0x00, 0x00, 0x00, 0x00,
+  /* 104 */ 0x00, 0x01,
+  /* 106 */ 0x00, 0x00,
+  /* 108 */ 0x09,
+  /* 109 */ 0x00,
+  /* 110 */ 0x01,
+  /* 111 */ 0x80,
+  /* 112 */ 0x00,
+  /* 113 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  /* 120 Boot code follows */
+
+};
+
+static int write_boot(int fd, const exfat_geometry_t *geo, uint32_t root,
+                      uint32_t used) {
+  uint8_t region[BOOT_SECTORS * SECTOR_SIZE];
+  uint32_t sum = 0;
+
+  memset(region, 0, sizeof(region));
+  memcpy(region, exfat_boot, sizeof(exfat_boot));
+
+  put64(region + 72, geo->vol_len);
+  put32(region + 80, geo->fat_offset);
+  put32(region + 84, geo->fat_len);
+  put32(region + 88, geo->heap_offset);
+  put32(region + 92, geo->clusters);
+  put32(region + 96, root);
+  put32(region + 100, (uint32_t)time(NULL));
+  region[109] = geo->cluster_shift;
+  region[112] = (uint64_t)used * 100 / geo->clusters;
+
+  for (int s = 0; s < 9; s++) {
+    region[s * SECTOR_SIZE + 510] = 0x55;
+    region[s * SECTOR_SIZE + 511] = 0xAA;
+  }
+
+  for (int i = 0; i < 11 * SECTOR_SIZE; i++) {
+    if (i == 106 || i == 107 || i == 112) continue;
+    sum = sum32(sum, region[i]);
+  }
+
+  for (int i = 0; i < SECTOR_SIZE; i += 4) put32(region + 11 * SECTOR_SIZE + i, sum);
+
+  if (write_full(fd, region, sizeof(region), 0) < 0 ||
+      write_full(fd, region, sizeof(region), sizeof(region)) < 0) {
+    r_printf("Failed to write the exFAT boot region: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static void put_chain(uint8_t *fat, uint32_t first, uint32_t count) {
+  for (uint32_t k = 0; k < count; k++)
+    put32(fat + (uint64_t)(first + k) * 4, k + 1 < count ? first + k + 1 : FAT_EOC);
+}
+
+/* Only the bitmap, the up-case table and the directories have
+   chains, which all sit in front of dirs_end. The rest of the
+   FAT gets cleared so nothing that was there before looks like
+   a chain. */
+
+static int write_fat(const exfat_tree_t *t, int fd, const exfat_geometry_t *geo,
+                     uint32_t bitmap_clusters, uint32_t upcase_clusters,
+                     uint32_t dirs_end, verify_t *verify) {
+  uint64_t start = (uint64_t)geo->fat_offset * SECTOR_SIZE;
+  uint64_t bytes = (uint64_t)geo->fat_len * SECTOR_SIZE;
+  uint64_t head = round_up((uint64_t)dirs_end * 4, SECTOR_SIZE);
+  uint8_t *fat = calloc(1, head);
+  int ret = 0;
+
+  if (fat == NULL) return -1;
+
+  put32(fat, FAT_MEDIA);
+  put32(fat + 4, FAT_EOC);
+  put_chain(fat, 2, bitmap_clusters);
+  put_chain(fat, 2 + bitmap_clusters, upcase_clusters);
+
+  for (uint32_t i = 0; i < t->count; i++) {
+    if (t->nodes[i].is_dir) put_chain(fat, t->nodes[i].cluster, t->nodes[i].clusters);
+  }
+
+  if ((ret = write_full(fd, fat, head, start)) == 0) {
+    verify_add(verify, fat, head, start);
+    verify_name(verify, start, head, "the FAT");
+  }
+
+  if (ret == 0 && bytes > head) ret = blk_zero_range(fd, start + head, bytes - head);
+
+  free(fat);
+
+  return ret;
+}
+
+int exfat_write_tree(const uint32_t *part_fd, uint8_t cluster_size,
+                     uint64_t align, char *label,
+                     const copy_list_t *list, int image_fd, const char *root,
+                     unsigned int depth, verify_t *verify, uint64_t *meta_end) {
+  exfat_geometry_t geo;
+  exfat_tree_t t;
+  uint16_t *table = NULL;
+  uint64_t *out_at = NULL;
+  uint8_t *meta = NULL;
+  uint32_t slots = 1;
+  uint32_t dirs_end;
+  int ret = -1;
+
+  if (exfat_geometry(part_fd, cluster_size, align, &geo) < 0) return -1;
+
+  while (slots < 2 * (list->count + 1)) slots <<= 1;
+
+  memset(&t, 0, sizeof(t));
+  t.count = list->count + 1;
+  t.cluster_bytes = SECTOR_SIZE << geo.cluster_shift;
+  t.mask = slots - 1;
+  t.nodes = calloc(t.count, sizeof(exfat_node_t));
+  t.dirs = malloc(slots * sizeof(uint32_t));
+  t.names = malloc(slots * sizeof(uint32_t));
+  t.upcase = malloc(UPCASE_CHARS * sizeof(uint16_t));
+  table = malloc(2 * UPCASE_CHARS * sizeof(uint16_t));
+  out_at = malloc((list->count + 1) * sizeof(uint64_t));
+
+  if (t.nodes == NULL || t.dirs == NULL || t.names == NULL || t.upcase == NULL ||
+      table == NULL || out_at == NULL) {
+    r_printf("Out of memory building the exFAT tree\n");
+    goto out;
+  }
+
+  for (uint32_t i = 0; i < slots; i++) t.dirs[i] = t.names[i] = NO_NODE;
+
+  for (uint32_t c = 0; c < UPCASE_CHARS; c++) t.upcase[c] = upcase_char(c);
+
+  uint32_t table_len = upcase_table(t.upcase, table);
+
+  time_t now = time(NULL);
+  struct tm tm;
+
+  localtime_r(&now, &tm);
+  t.stamp = (uint32_t)(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday) << 16 |
+            (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+
+  if (build_tree(&t, list) < 0) goto out;
+
+  /* Bitmap, up-case table, directories and then the files, all
+     back to back from the start of the heap */
+
+  uint64_t bitmap_bytes = ((uint64_t)geo.clusters + 7) / 8;
+  uint64_t upcase_bytes = (uint64_t)table_len * sizeof(uint16_t);
+  uint32_t bitmap_clusters = clusters_for(&t, bitmap_bytes);
+  uint32_t upcase_clusters = clusters_for(&t, upcase_bytes);
+  uint64_t next = allocate(&t, 2 + bitmap_clusters + upcase_clusters, &dirs_end);
+
+  if (next == UINT64_MAX || next - 2 > geo.clusters) {
+    r_printf("Files need more than the %u clusters the partition has\n",
+             geo.clusters);
+    goto out;
+  }
+
+  uint32_t used = next - 2;
+  uint64_t heap = (uint64_t)geo.heap_offset * SECTOR_SIZE;
+  uint64_t meta_bytes = (uint64_t)(dirs_end - 2) * t.cluster_bytes;
+
+  r_printf("exFAT tree: %u entries, %u metadata and %u file clusters of %u "
+           "bytes\n",
+           list->count, dirs_end - 2, used - (dirs_end - 2), t.cluster_bytes);
+
+  if ((meta = calloc(1, meta_bytes)) == NULL) {
+    r_printf("Out of memory building the exFAT tree\n");
+    goto out;
+  }
+
+  /* Everything in use is one run from cluster 2 */
+
+  memset(meta, 0xFF, used / 8);
+  if (used % 8) meta[used / 8] = (1 << (used % 8)) - 1;
+
+  uint8_t *up = meta + (uint64_t)bitmap_clusters * t.cluster_bytes;
+  uint32_t upcase_sum = 0;
+
+  for (uint32_t i = 0; i < table_len; i++) put16(up + 2 * i, table[i]);
+  for (uint64_t i = 0; i < upcase_bytes; i++) upcase_sum = sum32(upcase_sum, up[i]);
+
+  for (uint32_t i = 0; i < t.count; i++) {
+    if (!t.nodes[i].is_dir) continue;
+
+    fill_dir(&t, i, meta + (uint64_t)(t.nodes[i].cluster - 2) * t.cluster_bytes);
+  }
+
+  put_root(meta + (uint64_t)(t.nodes[0].cluster - 2) * t.cluster_bytes,
+           label ? label : "", 2, bitmap_bytes, 2 + bitmap_clusters,
+           upcase_bytes, upcase_sum);
+
+  if (write_boot(*part_fd, &geo, t.nodes[0].cluster, used) < 0) goto out;
+
+  /* The metadata goes out in one aligned piece from the start
+     of the heap, bitmap first */
+
+  if (write_fat(&t, *part_fd, &geo, bitmap_clusters, upcase_clusters, dirs_end,
+                verify) < 0 ||
+      write_full(*part_fd, meta, meta_bytes, heap) < 0) {
+    r_printf("Failed to write exFAT metadata: %s\n", strerror(errno));
+    goto out;
+  }
+
+  verify_add(verify, meta, meta_bytes, heap);
+  verify_name(verify, heap, meta_bytes, "the bitmap and directories");
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    out_at[i] = heap + (uint64_t)(t.nodes[i + 1].cluster - 2) * t.cluster_bytes;
+  }
+
+  if (list->total_bytes > 0 &&
+      fattree_write_files(*part_fd, list, out_at, heap + meta_bytes, image_fd,
+                          root, depth, verify) < 0)
+    goto out;
+
+  if (flush_device(*part_fd) < 0) {
+    r_printf("Failed to flush partition: %s\n", strerror(errno));
+    goto out;
+  }
+
+  fadvise_drop(*part_fd, 0, 0);
+
+  if (meta_end != NULL) *meta_end = heap + meta_bytes;
+
+  ret = 0;
+
+out:
+  free(meta);
+  free(out_at);
+  free(table);
+  free(t.upcase);
+  free(t.names);
+  free(t.dirs);
+  free(t.nodes);
+
+  return ret;
+}
+
+int format_exfat(const uint32_t *part_fd, uint8_t cluster_size, uint64_t align,
+                 char *label) {
+  copy_list_t list;
+
+  copy_list_init(&list);
+
+  return exfat_write_tree(part_fd, cluster_size, align, label, &list, -1, "", 1,
+                          NULL, NULL);
+}
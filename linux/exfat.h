@@ -0,0 +1,57 @@
+#ifndef EXFAT_H
+#define EXFAT_H
+
+#include <stdint.h>
+
+#include "copy.h"
+#include "verify.h"
+
+#define EXFAT_FAT_OFFSET_MIN 24
+#define EXFAT_CLUSTER_SHIFT_MAX 16
+#define EXFAT_CLUSTERS_MAX 0xFFFFFFF5u
+#define EXFAT_DIR_MAX_BYTES (256 << 20)
+#define EXFAT_VOLUME_MIN (1 << 20)
+#define EXFAT_CLUSTER_AUTO 0xFF
+
+/* Auto cluster sizes, below each volume size */
+
+#define EXFAT_SMALL_VOLUME (256ULL << 20)
+#define EXFAT_MID_VOLUME (32ULL << 30)
+
+/* In sectors, except for cluster_shift, which is sectors per
+   cluster as a power of two */
+
+typedef struct exfat_geometry {
+  uint64_t vol_len;
+  uint32_t fat_offset;
+  uint32_t fat_len;
+  uint32_t heap_offset;
+  uint32_t clusters;
+  uint8_t cluster_shift;
+} exfat_geometry_t;
+
+/* cluster_size is one of the BS_* sizes, EXFAT_CLUSTER_AUTO
+   or anything else picks one from the size of the partition.
+   align is the one the partition was laid out with, 0 takes
+   it from part_fd, like fat32_geometry() */
+
+int exfat_geometry(const uint32_t *part_fd, uint8_t cluster_size,
+                   uint64_t align, exfat_geometry_t *geo);
+
+/* An empty exFAT file system: boot regions, FAT, allocation
+   bitmap, up-case table and root directory */
+
+int format_exfat(const uint32_t *part_fd, uint8_t cluster_size, uint64_t align,
+                 char *label);
+
+/* Like fat32_write_tree(), for trees with files of 4 GiB and
+   more. Every directory and file is one run of clusters, so
+   files need no FAT chain at all, only the bitmap says they are
+   there. */
+
+int exfat_write_tree(const uint32_t *part_fd, uint8_t cluster_size,
+                     uint64_t align, char *label,
+                     const copy_list_t *list, int image_fd, const char *root,
+                     unsigned int depth, verify_t *verify, uint64_t *meta_end);
+
+#endif // EXFAT_H
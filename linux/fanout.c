@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "blkdev.h"
+#include "decomp.h"
+#include "flush.h"
+#include "fanout.h"
+
+#define SECTOR_SIZE 512
+#define REPORT_STEP 10
+
+/* Blocks live in a ring of FANOUT_WINDOW slots. refs is how
+   many live writers still have to write a slot, the reader
+   only refills it once that is back to zero. */
+
+typedef struct fanout_block {
+  void *data;
+  size_t len;
+  int refs;
+} fanout_block_t;
+
+typedef struct fanout {
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t freed;
+  fanout_block_t blocks[FANOUT_WINDOW];
+  uint64_t produced;
+  int done;
+  int live;
+  int finished;
+  int direct;
+} fanout_t;
+
+typedef struct fanout_writer {
+  fanout_t *fanout;
+  fanout_target_t *target;
+  pthread_t thread;
+  int started;
+} fanout_writer_t;
+
+static int write_full(int fd, const uint8_t *buf, size_t len, uint64_t off) {
+  while (len > 0) {
+    ssize_t ret = pwrite(fd, buf, len, off);
+
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) return -1;
+
+    buf += ret;
+    len -= ret;
+    off += ret;
+  }
+
+  return 0;
+}
+
+static ssize_t read_full(int fd, uint8_t *buf, size_t len, uint64_t off) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t ret = pread(fd, buf + done, len - done, off + done);
+
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret < 0) return -1;
+    if (ret == 0) break;
+
+    done += ret;
+  }
+
+  return done;
+}
+
+/* Drop a writer that failed. Every block it was still counted
+   in gets released, so the reader does not wait on it again. */
+
+static void writer_fail(fanout_writer_t *w, uint64_t seq) {
+  fanout_t *f = w->fanout;
+
+  pthread_mutex_lock(&f->lock);
+
+  w->target->failed = 1;
+  w->target->error = errno;
+
+  for (; seq < f->produced; seq++) f->blocks[seq % FANOUT_WINDOW].refs--;
+
+  f->live--;
+  pthread_cond_broadcast(&f->freed);
+  pthread_mutex_unlock(&f->lock);
+}
+
+static void *writer_main(void *arg) {
+  fanout_writer_t *w = (fanout_writer_t *)arg;
+  fanout_t *f = w->fanout;
+  fanout_target_t *t = w->target;
+  int out_fd = t->fd;
+  char path[64];
+  writeback_t wb;
+
+  if (f->direct) {
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", t->fd);
+
+    if ((out_fd = open(path, O_WRONLY | O_DIRECT)) < 0) out_fd = t->fd;
+  }
+
+  writeback_init(&wb, out_fd, 0);
+
+  for (uint64_t seq = 0;; seq++) {
+    pthread_mutex_lock(&f->lock);
+
+    while (seq >= f->produced && !f->done) pthread_cond_wait(&f->filled, &f->lock);
+
+    if (seq >= f->produced) {
+      pthread_mutex_unlock(&f->lock);
+      break;
+    }
+
+    fanout_block_t *block = &f->blocks[seq % FANOUT_WINDOW];
+
+    pthread_mutex_unlock(&f->lock);
+
+    /* O_DIRECT wants whole sectors, a ragged tail goes
+       through the plain fd */
+
+    uint64_t off = seq * FANOUT_BLOCK_SIZE;
+    size_t aligned = block->len;
+
+    if (out_fd != t->fd) aligned -= block->len % SECTOR_SIZE;
+
+    if (write_full(out_fd, block->data, aligned, off) < 0 ||
+        write_full(t->fd, (uint8_t *)block->data + aligned,
+                   block->len - aligned, off + aligned) < 0) {
+      writer_fail(w, seq);
+      break;
+    }
+
+    uint64_t synced = writeback_advance(&wb, off + block->len);
+
+    pthread_mutex_lock(&f->lock);
+
+    t->written += block->len;
+    t->synced = synced;
+
+    if (--block->refs == 0) pthread_cond_broadcast(&f->freed);
+
+    pthread_mutex_unlock(&f->lock);
+  }
+
+  if (out_fd != t->fd) close(out_fd);
+
+  if (!t->failed && flush_device(t->fd) < 0) writer_fail(w, UINT64_MAX);
+
+  fadvise_drop(t->fd, 0, 0);
+
+  pthread_mutex_lock(&f->lock);
+  if (!t->failed) t->synced = t->written;
+  f->finished++;
+  pthread_cond_broadcast(&f->freed);
+  pthread_mutex_unlock(&f->lock);
+
+  return NULL;
+}
+
+/* Overall progress is the sum of what is on each stick,
+   each one gets a log line every REPORT_STEP percent. Called
+   with the lock held. Without a size, a compressed image,
+   the reader reports how far the decoder got instead. */
+
+static void report(fanout_target_t *targets, int count, int *steps,
+                   uint64_t image_size) {
+  uint64_t sum = 0;
+
+  if (image_size == 0) return;
+
+  for (int i = 0; i < count; i++) {
+    int step = image_size ? targets[i].synced * 100 / image_size : 100;
+
+    sum += targets[i].synced;
+
+    if (!targets[i].failed && step / REPORT_STEP > steps[i]) {
+      steps[i] = step / REPORT_STEP;
+      r_log(LOG_LEVEL_VERBOSE, "* %s: %d%%\n", targets[i].name, step);
+    }
+  }
+
+  progress_bytes(sum, image_size * count);
+}
+
+static int fanout_write(const char *image_path, uint64_t head,
+                        fanout_target_t *targets, int count, int direct,
+                        verify_t *verify) {
+  fanout_writer_t writers[FANOUT_TARGETS_MAX];
+  int steps[FANOUT_TARGETS_MAX];
+  struct stat st;
+  fanout_t f;
+  decomp_t *decoder = NULL;
+  int image_fd;
+  int ok = 0;
+  int ret = 0;
+
+  if (count < 1 || count > FANOUT_TARGETS_MAX) {
+    r_printf("Can not write to %d devices at once\n", count);
+    return -1;
+  }
+
+  r_printf("Using image: %s for %d devices\n", image_path, count);
+
+  if ((image_fd = open(image_path, O_RDONLY)) < 0 || fstat(image_fd, &st) < 0) {
+    r_printf("Opening image failed: %s\n", strerror(errno));
+    if (image_fd >= 0) close(image_fd);
+    return -1;
+  }
+
+  uint64_t image_size = (uint64_t)st.st_size;
+  int format = decomp_probe(image_fd);
+
+  if (head > 0 && head < image_size) image_size = head;
+
+  uint64_t file_size = image_size;
+
+  /* A compressed image is decoded once for all targets, its
+     real size is only known once it ran through */
+
+  if (format != DECOMP_NONE) {
+    r_printf("Image is %s compressed, decoding it on the way\n",
+             decomp_name(format));
+
+    if ((decoder = decomp_new(image_fd, format)) == NULL) {
+      close(image_fd);
+      return -1;
+    }
+
+    image_size = 0;
+  }
+
+  fadvise_stream(image_fd);
+
+  memset(&f, 0, sizeof(f));
+  pthread_mutex_init(&f.lock, NULL);
+  pthread_cond_init(&f.filled, NULL);
+  pthread_cond_init(&f.freed, NULL);
+  f.direct = direct;
+
+  for (int i = 0; i < FANOUT_WINDOW; i++) {
+    if (posix_memalign(&f.blocks[i].data, 4096, FANOUT_BLOCK_SIZE) != 0) {
+      r_printf("Out of memory for the image buffers\n");
+      ret = -1;
+      goto out;
+    }
+  }
+
+  /* A stick that is too small is failed up front, the
+     others go ahead without it */
+
+  for (int i = 0; i < count; i++) {
+    uint64_t device_size;
+
+    targets[i].written = 0;
+    targets[i].synced = 0;
+    steps[i] = 0;
+
+    writers[i].fanout = &f;
+    writers[i].target = &targets[i];
+    writers[i].started = 0;
+
+    if (targets[i].failed) continue;
+
+    if (blk_size(targets[i].fd, &device_size) < 0 || device_size < image_size) {
+      r_printf("* %s: too small for the image, skipping\n", targets[i].name);
+      targets[i].failed = 1;
+      targets[i].error = ENOSPC;
+      continue;
+    }
+
+    f.live++;
+
+    if (pthread_create(&writers[i].thread, NULL, writer_main, &writers[i]) != 0) {
+      r_printf("* %s: could not start writer\n", targets[i].name);
+      targets[i].failed = 1;
+      targets[i].error = errno;
+      f.live--;
+      continue;
+    }
+
+    writers[i].started = 1;
+  }
+
+  int started = f.live;
+
+  r_printf("Writing %llu %sbytes to %d devices (%s, %d x %d MiB window)\n",
+           (unsigned long long)file_size, decoder ? "compressed " : "", started,
+           direct ? "O_DIRECT" : "buffered", FANOUT_WINDOW,
+           FANOUT_BLOCK_SIZE >> 20);
+
+  for (uint64_t seq = 0;; seq++) {
+    fanout_block_t *block = &f.blocks[seq % FANOUT_WINDOW];
+
+    pthread_mutex_lock(&f.lock);
+
+    while (f.live > 0 && block->refs > 0) pthread_cond_wait(&f.freed, &f.lock);
+
+    report(targets, count, steps, decoder ? 0 : image_size);
+
+    int live = f.live;
+
+    pthread_mutex_unlock(&f.lock);
+
+    if (live == 0) break;
+
+    if (job_cancelled()) {
+      r_printf("Cancelled, stopping every device\n");
+      ret = -1;
+      break;
+    }
+
+    ssize_t len;
+
+    if (decoder != NULL) {
+      len = decomp_read(decoder, block->data, FANOUT_BLOCK_SIZE);
+      progress_bytes(decomp_consumed(decoder), file_size);
+    } else {
+      uint64_t at = seq * FANOUT_BLOCK_SIZE;
+      size_t want = image_size - at < FANOUT_BLOCK_SIZE ? image_size - at
+                                                         : FANOUT_BLOCK_SIZE;
+
+      len = at < image_size ? read_full(image_fd, block->data, want, at) : 0;
+      if (len < 0) r_printf("Reading the image failed: %s\n", strerror(errno));
+    }
+
+    if (len < 0) {
+      ret = -1;
+      break;
+    }
+
+    if (len == 0) break;
+
+    /* The block has its own copy now, the image is never read
+       twice */
+
+    if (decoder == NULL) fadvise_drop(image_fd, seq * FANOUT_BLOCK_SIZE, len);
+    else image_size += len;
+
+    verify_add(verify, block->data, len, seq * FANOUT_BLOCK_SIZE);
+
+    pthread_mutex_lock(&f.lock);
+    block->len = len;
+    block->refs = f.live;
+    f.produced = seq + 1;
+    pthread_cond_broadcast(&f.filled);
+    pthread_mutex_unlock(&f.lock);
+  }
+
+  /* Wait for the tails and the flushes, still showing how
+     far each stick got */
+
+  pthread_mutex_lock(&f.lock);
+
+  f.done = 1;
+  pthread_cond_broadcast(&f.filled);
+
+  while (f.finished < started) {
+    pthread_cond_wait(&f.freed, &f.lock);
+    report(targets, count, steps, decoder ? 0 : image_size);
+  }
+
+  pthread_mutex_unlock(&f.lock);
+
+  for (int i = 0; i < count; i++) {
+    if (writers[i].started) pthread_join(writers[i].thread, NULL);
+  }
+
+  for (int i = 0; i < count; i++) {
+    fanout_target_t *t = &targets[i];
+
+    if (!t->failed && (ret < 0 || t->written != image_size)) {
+      t->failed = 1;
+      t->error = job_cancelled() ? ECANCELED : EIO;
+    }
+
+    if (t->failed) {
+      r_printf("* %s: FAILED after %llu bytes: %s\n", t->name,
+               (unsigned long long)t->written, strerror(t->error));
+      continue;
+    }
+
+    /* The hashes came off the shared blocks, every stick is
+       read back against the same set */
+
+    if (verify != NULL && verify_device(t->fd, verify) != 0) {
+      r_printf("* %s: FAILED verification\n", t->name);
+      t->failed = 1;
+      t->error = EIO;
+      continue;
+    }
+
+    if (ioctl(t->fd, BLKRRPART) < 0) {
+      r_printf("* %s: could not re-read partition table: %s\n", t->name,
+               strerror(errno));
+    }
+
+    r_printf("* %s: OK\n", t->name);
+    ok++;
+  }
+
+  r_printf("%d of %d devices written\n", ok, count);
+
+out:
+  for (int i = 0; i < FANOUT_WINDOW; i++) free(f.blocks[i].data);
+
+  pthread_cond_destroy(&f.freed);
+  pthread_cond_destroy(&f.filled);
+  pthread_mutex_destroy(&f.lock);
+  decomp_free(decoder);
+  close(image_fd);
+
+  return ret < 0 ? -1 : ok;
+}
+
+int write_image_multi(const char *image_path, fanout_target_t *targets,
+                      int count, int direct, verify_t *verify) {
+  return fanout_write(image_path, 0, targets, count, direct, verify);
+}
+
+int write_image_multi_head(const char *image_path, uint64_t len,
+                           fanout_target_t *targets, int count, int direct,
+                           verify_t *verify) {
+  return fanout_write(image_path, len, targets, count, direct, verify);
+}
@@ -0,0 +1,46 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdint.h>
+
+#include "verify.h"
+
+#define FANOUT_BLOCK_SIZE (4 << 20)
+#define FANOUT_WINDOW 16
+#define FANOUT_TARGETS_MAX 32
+
+/* One device of a multi-target write. The caller fills in
+   name and fd and clears failed and error, the rest is filled
+   in while writing. A target that fails is dropped without
+   holding up the others, one the caller already failed is
+   skipped. */
+
+typedef struct fanout_target {
+  char name[16];
+  int fd;
+  uint64_t written;
+  uint64_t synced;
+  int failed;
+  int error;
+} fanout_target_t;
+
+/* Read the image once and write it to every target at the
+   same time. Each block is shared between all targets and
+   freed once the last of them wrote it, so the fastest stick
+   can get at most FANOUT_WINDOW blocks ahead of the slowest.
+   With verify set, each block is hashed once as it is read and
+   every target is read back against it before it is counted.
+   Returns how many targets got the whole image, -1 if the
+   image itself could not be read. */
+
+int write_image_multi(const char *image_path, fanout_target_t *targets,
+                      int count, int direct, verify_t *verify);
+
+/* The same for the first len bytes of an uncompressed image,
+   the rest of every device is left as it is */
+
+int write_image_multi_head(const char *image_path, uint64_t len,
+                           fanout_target_t *targets, int count, int direct,
+                           verify_t *verify);
+
+#endif // FANOUT_H
@@ -30,19 +30,157 @@
 #include <string.h>
 
 #include "fat32.h"
+#include "blkdev.h"
+#include "flush.h"
 #include "log.h"
 #include "definitions.h"
 
-int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
+/* Everything about the layout that follows from the size of
+   the partition and the cluster size that was asked for */
+
+int fat32_geometry(const uint32_t *part_fd, uint8_t cluster_size, uint64_t align,
+                   fat32_geometry_t *geo) {
+
+    uint16_t BPB_ResvdSecCnt = 32;
+
+    uint8_t BPB_SecPerClus;
+    uint64_t DskSize;
+
+    const uint8_t BPB_NumFATs = 2;
+
+    if (ioctl(*part_fd, BLKGETSIZE, &DskSize) < 0) {
+        perror("ioctl");
+        return -1;
+    }
+
+    if (DskSize > UINT32_MAX - 1) {
+        r_printf("Volume to big for FAT32!\n");
+        return -1;
+    }
+
+    switch (cluster_size) {
+      case BS_512B:
+        BPB_SecPerClus = 1;
+        break;
+      case BS_1024B:
+        BPB_SecPerClus = 2;
+        break;
+      case BS_2048B:
+        BPB_SecPerClus = 4;
+        break;
+      case BS_4096B:
+        BPB_SecPerClus = 8;
+        break;
+      case BS_8192B:
+        BPB_SecPerClus = 16;
+        break;
+      case BS_16384B:
+        BPB_SecPerClus = 32;
+        break;
+      case BS_32768B:
+        BPB_SecPerClus = 64;
+        break;
+      default:
+
+        r_printf("Autosetting cluster size.\n");
+
+        if (DskSize < 66600) {
+          r_printf("ERROR: Volume is too small!\n");
+          return -1;
+        } else if (DskSize < 532480) {
+          BPB_SecPerClus = 1;
+        } else if (DskSize < 16777216) {
+          BPB_SecPerClus = 8;
+        } else if (DskSize < 33554432) {
+          BPB_SecPerClus = 16;
+        } else if (DskSize < 67108864) {
+          BPB_SecPerClus = 32;
+        } else if (DskSize < 0xFFFFFFFF) {
+          BPB_SecPerClus = 64;
+        }
+
+        /* Never below the physical block, or every cluster write
+           on a 4K sector stick turns into a read-modify-write */
+
+        blk_profile_t profile;
+
+        if (blk_profile(*part_fd, &profile) == 0 &&
+            BPB_SecPerClus * 512 < profile.physical_block &&
+            profile.physical_block <= 32768) {
+          BPB_SecPerClus = profile.physical_block / 512;
+        }
+
+    }
+
+    uint32_t BPB_TotSec32 = (uint32_t) DskSize; /* Transition to 32-bit */
+    uint32_t BPB_FATSz32;
+
+    /* The partition starts on an erase block, so the reserved
+       sectors fill up the first block and the FATs get padded to
+       whole blocks. That puts both FATs and the first cluster on
+       block boundaries too, and with power of two clusters every
+       cluster after it. */
+
+    uint32_t Align = (align != 0 ? align : blk_alignment(*part_fd)) / 512;
+
+    /* A bigger block than the reserved sector count can hold
+       still lines up with every 16 MiB, a tiny one gets the
+       usual 32 sectors, which it divides */
+
+    if (Align > FAT32_ALIGN_MAX) Align = FAT32_ALIGN_MAX;
+    if (Align == 0) Align = 1;
+
+    BPB_ResvdSecCnt = Align < 32 ? 32 : Align;
+
+    /* This snippet of code is from the FAT32 specification */
+
+    uint32_t TmpVal1 = BPB_TotSec32 - BPB_ResvdSecCnt;
+    uint32_t TmpVal2 = (256 * BPB_SecPerClus) + BPB_NumFATs;
+    TmpVal2 = TmpVal2 / 2;
+    BPB_FATSz32 = (TmpVal1 + (TmpVal2 - 1)) / TmpVal2;
+    BPB_FATSz32 = (BPB_FATSz32 + Align - 1) / Align * Align;
+
+    /* Too small for that to be worth it, go back to the plain
+       layout */
+
+    if (BPB_ResvdSecCnt + BPB_NumFATs * BPB_FATSz32 > BPB_TotSec32 / 2) {
+        Align = 1;
+        BPB_ResvdSecCnt = 32;
+        TmpVal1 = BPB_TotSec32 - BPB_ResvdSecCnt;
+        BPB_FATSz32 = (TmpVal1 + (TmpVal2 - 1)) / TmpVal2;
+    }
+
+    r_printf("FAT32 layout: %u KiB alignment, %u reserved sectors, FATs at "
+             "sector %u and %u, data at sector %u\n", Align / 2, BPB_ResvdSecCnt,
+             BPB_ResvdSecCnt, BPB_ResvdSecCnt + BPB_FATSz32,
+             BPB_ResvdSecCnt + BPB_NumFATs * BPB_FATSz32);
+
+    geo->tot_sec = BPB_TotSec32;
+    geo->fat_sz = BPB_FATSz32;
+    geo->resvd = BPB_ResvdSecCnt;
+    geo->hidden = (uint32_t) (align / 512);
+    geo->num_fats = BPB_NumFATs;
+    geo->sec_per_clus = BPB_SecPerClus;
+    geo->clusters = (BPB_TotSec32 - BPB_ResvdSecCnt - BPB_NumFATs * BPB_FATSz32) / BPB_SecPerClus;
+
+    return 0;
+}
+
+/* Write the boot sectors and FSInfo, both copies. used is how
+   many clusters are taken, so FSInfo gets a real free count and
+   next free hint instead of the "unknown" 0xFFFFFFFF. */
+
+int fat32_write_boot(const uint32_t *part_fd, const fat32_geometry_t *geo, char *label,
+                     uint32_t used) {
+
 
     /* This portion declares the FAT32 BPB. Why I did it this way is because
      * constructing a BPB on-the-fly is redundant as most of the fields in the
      * BPB are constants for FAT32, and only a couple of bytes (around 20) need
      * actual modifying to construct a valid FAT32 file system that mounts fine
-     * on Windows and passes fsck.fat with one error, and that is that the FSInfo
-     * field is left uninitialized, but that is the way Windows 7 leaves it and
-     * when the fs gets mounted on Linux it gets initialized. After an initial
-     * mount on Linux, fsck.fat reports no errors on the fs. Also, all bootable
+     * on Windows and passes fsck.fat. The FSInfo free count and next free
+     * hint get filled in from the number of clusters the caller says are in
+     * use, instead of being left at "unknown" like Windows 7 does. Also, all bootable
      * and executable code is left blank, so if someone boots from this partition
      * by accident, they will not get a message. FAT32 partitions are not bootable
      * directly from the code in the BPB.
@@ -53,7 +191,7 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
      *   3 OEM String: RUFUSL
      *  11 BPB_BytsPerSec = 512B constant for compat - uint16_t
      *  13 BPB_SecPerClus - Empty for populating - char
-     *  14 BPB_RsvdSecCnt = 32 constant for FAT32 - uint16_t
+     *  14 BPB_RsvdSecCnt = fills the first erase block, 32 at least - uint16_t
      *  16 BPB_NumFATs - Constant 2 per FAT32 spec - uint8_t
      *  17 BPB_RootEntCnt = 0 for FAT32 - uint16_t
      *  19 BPB_TotSec16 = 0 for FAT32 - uint16_t
@@ -61,7 +199,7 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
      *  22 BPB_FATSz16 = 0 for FAT32 - uint16_t
      *  24 BPB_SecPerTrk = Obsolete - uint16_t
      *  26 BPB_NumHeads = Obsolete - uint16_t
-     *  28 BPB_HiddSec = Obsolete - uint32_t
+     *  28 BPB_HiddSec = Sectors before the partition - uint32_t
      *  32 BPB_TotSec32 - Empty for populating - uint32_t
      *  36 BPB_FATSz32 - Empty for populating - uint32_t
      *  40 BPB_ExtFlags = 0 - No special flags - uint16_t
@@ -186,8 +324,8 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
              0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
              0x00, 0x00, 0x00, 0x00, /* Empty space */
    /* 484 */ 0x72, 0x72, 0x41, 0x61, /* FSI_StrucSig */
-   /* 488 */ 0xFF, 0xFF, 0xFF, 0xFF, /* FSI_Free_Count - Not known - Windows 7 default */
-   /* 492 */ 0xFF, 0xFF, 0xFF, 0xFF, /* FSI_Next_Free  - Not known - Windows 7 default */
+   /* 488 */ 0xFF, 0xFF, 0xFF, 0xFF, /* FSI_Free_Count - Populated below */
+   /* 492 */ 0xFF, 0xFF, 0xFF, 0xFF, /* FSI_Next_Free  - Populated below */
    /* 496 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
              0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* Reserved space */
    /* 508 */ 0x00, 0x00, 0x55, 0xAA /* MBR Signature */
@@ -195,120 +333,62 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
 
     };
 
-    /* This is an empty FAT Table, with its 8 byte
-       magic number and an EOC to declare that it is
-       empty */
-
-    unsigned char fat32_fat[12] = {
-        0xF8,0xFF,0xFF,0x0F, /* Media Descriptor byte 0xF8 */
-        0xFF,0xFF,0xFF,0x0F, /* Root EOC */
-        0xFF,0xFF,0xFF,0x0F, /* Blank FAT EOC */
-    };
-
-    const uint16_t BPB_ResvdSecCnt = 32;
-
-    uint8_t BPB_SecPerClus;
-    uint64_t DskSize;
-
-    const uint8_t BPB_NumFATs = 2;
-
-    if (ioctl(*part_fd, BLKGETSIZE, &DskSize) < 0) {
-        perror("ioctl");
-        return -1;
-    }
-
-    if (DskSize > UINT32_MAX - 1) {
-        r_printf("Volume to big for FAT32!\n");
-        return -1;
-    }
-
-    switch (cluster_size) {
-      case BS_512B:
-        BPB_SecPerClus = 1;
-        break;
-      case BS_1024B:
-        BPB_SecPerClus = 2;
-        break;
-      case BS_2048B:
-        BPB_SecPerClus = 4;
-        break;
-      case BS_4096B:
-        BPB_SecPerClus = 8;
-        break;
-      case BS_8192B:
-        BPB_SecPerClus = 16;
-        break;
-      case BS_16384B:
-        BPB_SecPerClus = 32;
-        break;
-      case BS_32768B:
-        BPB_SecPerClus = 64;
-        break;
-      default:
-
-        r_printf("Autosetting cluster size.\n");
-
-        if (DskSize < 66600) {
-          r_printf("ERROR: Volume is too small!\n");
-          return -1;
-        } else if (DskSize < 532480) {
-          BPB_SecPerClus = 1;
-        } else if (DskSize < 16777216) {
-          BPB_SecPerClus = 8;
-        } else if (DskSize < 33554432) {
-          BPB_SecPerClus = 16;
-        } else if (DskSize < 67108864) {
-          BPB_SecPerClus = 32;
-        } else if (DskSize < 0xFFFFFFFF) {
-          BPB_SecPerClus = 64;
-        }
-
-    }
-
-    uint32_t BPB_TotSec32 = (uint32_t) DskSize; /* Transition to 32-bit */
-    uint32_t BPB_FATSz32;
-
-    /* This snippet of code is from the FAT32 specification */
-
-    uint32_t TmpVal1 = BPB_TotSec32 - BPB_ResvdSecCnt;
-    uint32_t TmpVal2 = (256 * BPB_SecPerClus) + BPB_NumFATs;
-    TmpVal2 = TmpVal2 / 2;
-    BPB_FATSz32 = (TmpVal1 + (TmpVal2 - 1)) / TmpVal2;
+    const uint8_t BPB_SecPerClus = geo->sec_per_clus;
+    const uint16_t BPB_ResvdSecCnt = geo->resvd;
+    const uint32_t BPB_HiddSec = geo->hidden;
+    const uint32_t BPB_TotSec32 = geo->tot_sec;
+    const uint32_t BPB_FATSz32 = geo->fat_sz;
+    const uint32_t FSI_Free_Count = geo->clusters - used;
+    const uint32_t FSI_Nxt_Free = 2 + used;
 
     /* Some debug informatio */
 
     r_printf("Device fd: %d\n", *part_fd);
     r_printf("Label: %s\n",label);
     r_printf("Sectors per cluter: %d\n", BPB_SecPerClus);
+    r_printf("Reserved sectors: %d\n", BPB_ResvdSecCnt);
+    r_printf("Hidden sectors: %u\n", BPB_HiddSec);
     r_printf("Total sectors: %d\n", BPB_TotSec32);
     r_printf("FAT32 FAT Size: %d\n", BPB_FATSz32);
     r_printf("BPB Size: %ld\n", sizeof(fat32_bpb));
     r_printf("FSI Size: %ld\n", sizeof(fat32_fsi));
-    r_printf("FAT Size: %ld\n", sizeof(fat32_fat));
 
-    /* STEP 1/4: Populate: PBP_SecPerClus */
+    /* STEP 1/5: Populate: PBP_SecPerClus */
 
     fat32_bpb[BPB_SEC_PER_CLUS_OFFSET] = BPB_SecPerClus;
 
+    /* STEP 2/5: Populate: BPB_RsvdSecCnt */
+
+    fat32_bpb[BPB_RSVD_SEC_CNT_OFFSET + 1] = (BPB_ResvdSecCnt >> 8) & 0xFF;
+    fat32_bpb[BPB_RSVD_SEC_CNT_OFFSET    ] = BPB_ResvdSecCnt & 0xFF;
+
     /* The following snippet dissects integers into bytes,
        and writes them into the BPB array whilst flipping
        their endianess to little endian on the fly */
 
-    /* STEP 2/4: Populate: BPB_TotSec32 */
+    /* Where the partition starts, Windows and some boot loaders
+       go by it rather than by the partition table */
+
+    fat32_bpb[BPB_HIDD_SEC_OFFSET + 3] = (BPB_HiddSec >> 24) & 0xFF;
+    fat32_bpb[BPB_HIDD_SEC_OFFSET + 2] = (BPB_HiddSec >> 16) & 0xFF;
+    fat32_bpb[BPB_HIDD_SEC_OFFSET + 1] = (BPB_HiddSec >> 8) & 0xFF;
+    fat32_bpb[BPB_HIDD_SEC_OFFSET    ] = BPB_HiddSec & 0xFF;
+
+    /* STEP 3/5: Populate: BPB_TotSec32 */
 
     fat32_bpb[BPB_TOT_SEC_32_OFFSET + 3] = (BPB_TotSec32 >> 24) & 0xFF;
     fat32_bpb[BPB_TOT_SEC_32_OFFSET + 2] = (BPB_TotSec32 >> 16) & 0xFF;
     fat32_bpb[BPB_TOT_SEC_32_OFFSET + 1] = (BPB_TotSec32 >> 8) & 0xFF;
     fat32_bpb[BPB_TOT_SEC_32_OFFSET    ] = BPB_TotSec32 & 0xFF;
 
-    /* STEP 3/4: Populate: BPB_FATSz32 */
+    /* STEP 4/5: Populate: BPB_FATSz32 */
 
     fat32_bpb[BPB_FAT_SZ_32_OFFSET + 3] = (BPB_FATSz32 >> 24) & 0xFF;
     fat32_bpb[BPB_FAT_SZ_32_OFFSET + 2] = (BPB_FATSz32 >> 16) & 0xFF;
     fat32_bpb[BPB_FAT_SZ_32_OFFSET + 1] = (BPB_FATSz32 >> 8) & 0xFF;
     fat32_bpb[BPB_FAT_SZ_32_OFFSET    ] = BPB_FATSz32 & 0xFF;
 
-    /* STEP 4/4: Populate: BS_VolLab */
+    /* STEP 5/5: Populate: BS_VolLab */
 
     if (strlen(label) > 11) {
         r_printf("WARNING: Label is larger than allowed 11 chars. Will truncate.");
@@ -323,6 +403,13 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
         }
     }
 
+    /* FSInfo: free cluster count and where to look for the next one */
+
+    for (int i = 0; i < 4; i++) {
+        fat32_fsi[FSI_FREE_COUNT_OFFSET + i] = (FSI_Free_Count >> (8 * i)) & 0xFF;
+        fat32_fsi[FSI_NXT_FREE_OFFSET + i] = (FSI_Nxt_Free >> (8 * i)) & 0xFF;
+    }
+
     r_printf("File descriptor: %d\n", *part_fd);
 
     /* See the macro on the beginning of the file */
@@ -331,10 +418,58 @@ int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label) {
     SEEKNWRITE(*part_fd, 512, fat32_fsi, 512);                                   /* Write first FSI */
     SEEKNWRITE(*part_fd, 3072, fat32_bpb, 512);                                  /* Write second BPB */
     SEEKNWRITE(*part_fd, 3584, fat32_fsi, 512);                                  /* Write second FSI */
+
+    return 0;
+}
+
+int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, uint64_t align, char *label) {
+
+    fat32_geometry_t geo;
+
+    if (fat32_geometry(part_fd, cluster_size, align, &geo) < 0) return -1;
+
+    /* Only the root directory cluster is in use */
+
+    if (fat32_write_boot(part_fd, &geo, label, 1) < 0) return -1;
+
+    /* This is an empty FAT Table, with its 8 byte
+       magic number and an EOC to declare that it is
+       empty */
+
+    unsigned char fat32_fat[12] = {
+        0xF8,0xFF,0xFF,0x0F, /* Media Descriptor byte 0xF8 */
+        0xFF,0xFF,0xFF,0x0F, /* Root EOC */
+        0xFF,0xFF,0xFF,0x0F, /* Blank FAT EOC */
+    };
+
+    const uint16_t BPB_ResvdSecCnt = geo.resvd;
+    const uint32_t BPB_FATSz32 = geo.fat_sz;
+
+    /* Whatever was on the device before must not show up as
+       allocated clusters or directory entries, so clear both
+       FATs and the root cluster. This is what makes a quick
+       format safe without a full wipe first. */
+
+    uint64_t FatStart = (uint64_t) BPB_ResvdSecCnt * 512;
+    uint64_t FatBytes = (uint64_t) geo.num_fats * BPB_FATSz32 * 512;
+    uint64_t RootBytes = (uint64_t) geo.sec_per_clus * 512;
+
+    if (blk_zero_range(*part_fd, FatStart, FatBytes) < 0 ||
+        blk_zero_range(*part_fd, FatStart + FatBytes, RootBytes) < 0) {
+        r_printf("Failed to clear the FAT: %s\n", strerror(errno));
+        return -1;
+    }
+
+    r_printf("Cleared %llu bytes of FAT and root directory\n",
+             (unsigned long long) (FatBytes + RootBytes));
+
     SEEKNWRITE(*part_fd, BPB_ResvdSecCnt * 512, fat32_fat, 12);                  /* Write first FAT */
     SEEKNWRITE(*part_fd, (BPB_ResvdSecCnt + BPB_FATSz32) * 512, fat32_fat, 12);  /* Write second FAT */
 
-    sync();
+    if (flush_device(*part_fd) < 0) {
+        r_printf("Failed to flush partition: %s\n", strerror(errno));
+        return -1;
+    }
 
     return 0;
 }
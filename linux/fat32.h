@@ -1,7 +1,29 @@
 #define BPB_SEC_PER_CLUS_OFFSET 13
+#define BPB_RSVD_SEC_CNT_OFFSET 14
+#define BPB_HIDD_SEC_OFFSET 28
 #define BPB_TOT_SEC_32_OFFSET 32
 #define BPB_FAT_SZ_32_OFFSET 36
 #define BPB_LABEL_OFFSET 71
+#define FSI_FREE_COUNT_OFFSET 488
+#define FSI_NXT_FREE_OFFSET 492
+
+#define FAT32_EOC 0x0FFFFFFF
+#define FAT32_MEDIA 0x0FFFFFF8
+
+/* BPB_ResvdSecCnt is 16 bits, so 16 MiB is the biggest power
+   of two erase block the reserved sectors can fill */
+
+#define FAT32_ALIGN_MAX 32768
+
+typedef struct fat32_geometry {
+    uint32_t tot_sec;
+    uint32_t fat_sz;
+    uint32_t clusters;
+    uint32_t hidden;
+    uint16_t resvd;
+    uint8_t num_fats;
+    uint8_t sec_per_clus;
+} fat32_geometry_t;
 
 #define SEEKNWRITE(fd, offset, array, max) \
     lseek(fd, offset, SEEK_SET); \
@@ -10,4 +32,14 @@
         return -1; \
     } \
 
-int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, char *label);
+/* align is the erase block the partition was laid out with,
+   so the FATs and the clusters line up with the same blocks.
+   The partition starts there too, which goes into BPB_HiddSec.
+   0 takes it from part_fd, which only guesses from its size,
+   and leaves the start at 0. */
+
+int fat32_geometry(const uint32_t *part_fd, uint8_t cluster_size, uint64_t align,
+                   fat32_geometry_t *geo);
+int fat32_write_boot(const uint32_t *part_fd, const fat32_geometry_t *geo, char *label,
+                     uint32_t used);
+int format_fat32(const uint32_t *part_fd, uint8_t cluster_size, uint64_t align, char *label);
@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../log.h"
+#include "blkdev.h"
+#include "definitions.h"
+#include "fanout.h"
+#include "fatcache.h"
+#include "fattree.h"
+#include "flush.h"
+#include "image.h"
+#include "mounting.h"
+#include "partition.h"
+#include "sparse.h"
+
+#define SECTOR_SIZE 512
+
+static const char info_magic[8] = {'R', 'U', 'F', 'F', 'A', 'T', '0', '1'};
+static const char stamp_magic[8] = {'R', 'U', 'F', 'I', 'S', 'O', '0', '1'};
+
+typedef struct fatcache_info {
+  char magic[8];
+  uint64_t image_size;
+  uint64_t part_start;
+  uint64_t part_len;
+  uint64_t meta_end;
+} fatcache_info_t;
+
+/* What an ISO hashed to, for the version of it that had this
+   size and mtime */
+
+typedef struct fatcache_stamp {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t crc32c;
+  uint32_t crc32;
+} fatcache_stamp_t;
+
+typedef struct fatcache_lru {
+  char name[NAME_MAX + 1];
+  struct timespec used;
+  uint64_t bytes;
+} fatcache_lru_t;
+
+static int load(const char *path, void *buf, size_t len) {
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) return -1;
+
+  int ret = read(fd, buf, len) == (ssize_t)len ? 0 : -1;
+
+  close(fd);
+
+  return ret;
+}
+
+/* Written to a temporary name and renamed over, so a crash
+   leaves either the old file or the new one */
+
+static int save(const char *path, const void *buf, size_t len) {
+  char tmp[PATH_MAX];
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) return -1;
+
+  if (write(fd, buf, len) != (ssize_t)len || fdatasync(fd) < 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+
+  close(fd);
+
+  if (rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* An entry goes by the name of its .info, the .img is
+   removed first so that a half removed entry is never taken
+   for a whole one */
+
+static void remove_entry(const char *name) {
+  char path[PATH_MAX];
+  size_t len = strlen(name);
+
+  if (len < 5) return;
+
+  snprintf(path, sizeof(path), FATCACHE_DIR "/%.*s.img", (int)(len - 5), name);
+  unlink(path);
+  snprintf(path, sizeof(path), FATCACHE_DIR "/%s", name);
+  unlink(path);
+}
+
+static int is_info(const char *name) {
+  size_t len = strlen(name);
+
+  return len > 5 && strcmp(name + len - 5, ".info") == 0;
+}
+
+static void drop_iso(const char *id) {
+  DIR *dir = opendir(FATCACHE_DIR);
+  struct dirent *ent;
+
+  if (dir == NULL) return;
+
+  while ((ent = readdir(dir)) != NULL) {
+    if (is_info(ent->d_name) && strncmp(ent->d_name, id, strlen(id)) == 0) {
+      r_printf("Dropping cached image %s, the ISO changed\n", ent->d_name);
+      remove_entry(ent->d_name);
+    }
+  }
+
+  closedir(dir);
+}
+
+/* ---- ISO identity ---- */
+
+static int hash_iso(int fd, uint64_t size, fatcache_stamp_t *stamp) {
+  uint8_t *buf = (uint8_t *)malloc(FATCACHE_HASH_BLOCK);
+  uint32_t c = 0;
+  uLong z = crc32(0L, Z_NULL, 0);
+  uint64_t off = 0;
+
+  if (buf == NULL) return -1;
+
+  r_printf("Hashing the ISO for the image cache...\n");
+
+  fadvise_stream(fd);
+
+  while (off < size) {
+    if (job_cancelled()) {
+      free(buf);
+      return -1;
+    }
+
+    ssize_t len = pread(fd, buf, FATCACHE_HASH_BLOCK, off);
+
+    if (len < 0 && errno == EINTR) continue;
+
+    if (len <= 0) {
+      r_printf("Reading the ISO failed: %s\n",
+               len < 0 ? strerror(errno) : "short read");
+      free(buf);
+      return -1;
+    }
+
+    c = crc32c(c, buf, len);
+    z = crc32(z, buf, len);
+    fadvise_drop(fd, off, len);
+    off += len;
+  }
+
+  free(buf);
+
+  stamp->crc32c = c;
+  stamp->crc32 = (uint32_t)z;
+
+  return 0;
+}
+
+/* The stamp is found by inode, so a renamed ISO is not hashed
+   again. A changed one is, and what was cached for its old
+   contents is dropped. */
+
+static int iso_id(const char *iso_path, char *id) {
+  char path[PATH_MAX];
+  fatcache_stamp_t want, have;
+  struct stat st;
+  int fd;
+
+  if ((fd = open(iso_path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    r_printf("Opening ISO failed: %s\n", strerror(errno));
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), FATCACHE_DIR "/iso-%llx-%llx",
+           (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+
+  memset(&want, 0, sizeof(want));
+  memcpy(want.magic, stamp_magic, sizeof(want.magic));
+  want.size = (uint64_t)st.st_size;
+  want.mtime_sec = st.st_mtim.tv_sec;
+  want.mtime_nsec = st.st_mtim.tv_nsec;
+
+  int known = load(path, &have, sizeof(have)) == 0 &&
+              memcmp(have.magic, stamp_magic, sizeof(have.magic)) == 0;
+
+  if (known && have.size == want.size && have.mtime_sec == want.mtime_sec &&
+      have.mtime_nsec == want.mtime_nsec) {
+    close(fd);
+    snprintf(id, FATCACHE_ID_SIZE, "%08x%08x", have.crc32c, have.crc32);
+    return 0;
+  }
+
+  int ret = hash_iso(fd, want.size, &want);
+
+  close(fd);
+
+  if (ret < 0) return -1;
+
+  snprintf(id, FATCACHE_ID_SIZE, "%08x%08x", want.crc32c, want.crc32);
+
+  if (known) {
+    char old[FATCACHE_ID_SIZE];
+
+    snprintf(old, sizeof(old), "%08x%08x", have.crc32c, have.crc32);
+
+    if (strcmp(old, id) != 0) drop_iso(old);
+  }
+
+  if (save(path, &want, sizeof(want)) < 0) {
+    r_log(LOG_LEVEL_VERBOSE, "Could not save ISO stamp %s: %s\n", path,
+          strerror(errno));
+  }
+
+  return 0;
+}
+
+/* ---- Eviction ---- */
+
+static int lru_cmp(const void *a, const void *b) {
+  const fatcache_lru_t *x = (const fatcache_lru_t *)a;
+  const fatcache_lru_t *y = (const fatcache_lru_t *)b;
+
+  if (x->used.tv_sec != y->used.tv_sec)
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+
+  return x->used.tv_nsec < y->used.tv_nsec ? -1 : x->used.tv_nsec > y->used.tv_nsec;
+}
+
+/* Sizes are what the sparse files take up on disk, not how
+   big they look */
+
+static void evict(const char *keep) {
+  fatcache_lru_t *lru = NULL;
+  uint32_t count = 0, capacity = 0;
+  uint64_t total = 0;
+  DIR *dir = opendir(FATCACHE_DIR);
+  struct dirent *ent;
+
+  if (dir == NULL) return;
+
+  while ((ent = readdir(dir)) != NULL) {
+    char path[PATH_MAX];
+    struct stat info_st, img_st;
+    size_t len = strlen(ent->d_name);
+
+    if (!is_info(ent->d_name)) continue;
+
+    snprintf(path, sizeof(path), FATCACHE_DIR "/%s", ent->d_name);
+    if (stat(path, &info_st) < 0) continue;
+
+    snprintf(path, sizeof(path), FATCACHE_DIR "/%.*s.img", (int)(len - 5),
+             ent->d_name);
+    if (stat(path, &img_st) < 0) img_st.st_blocks = 0;
+
+    if (count == capacity) {
+      uint32_t grown = capacity ? capacity * 2 : 16;
+      fatcache_lru_t *more =
+          (fatcache_lru_t *)realloc(lru, grown * sizeof(fatcache_lru_t));
+
+      if (more == NULL) break;
+
+      lru = more;
+      capacity = grown;
+    }
+
+    snprintf(lru[count].name, sizeof(lru[count].name), "%s", ent->d_name);
+    lru[count].used = info_st.st_mtim;
+    lru[count].bytes = (uint64_t)img_st.st_blocks * 512;
+    total += lru[count].bytes;
+    count++;
+  }
+
+  closedir(dir);
+
+  if (lru != NULL) qsort(lru, count, sizeof(fatcache_lru_t), lru_cmp);
+
+  uint32_t left = count;
+
+  for (uint32_t i = 0;
+       i < count && (left > FATCACHE_MAX_ENTRIES || total > FATCACHE_MAX_BYTES);
+       i++) {
+    if (keep != NULL && strcmp(lru[i].name, keep) == 0) continue;
+
+    r_printf("Evicting cached image %s (%llu MiB)\n", lru[i].name,
+             (unsigned long long)(lru[i].bytes >> 20));
+
+    remove_entry(lru[i].name);
+    total -= lru[i].bytes;
+    left--;
+  }
+
+  free(lru);
+}
+
+/* ---- Entries ---- */
+
+static void info_path(const fatcache_entry_t *e, char *path) {
+  size_t len = strlen(e->path);
+
+  snprintf(path, PATH_MAX, "%.*s.info", (int)(len - 4), e->path);
+}
+
+int fatcache_find(const char *iso_path, int table, uint8_t cluster_size,
+                  const uint32_t *device_fd, fatcache_entry_t *e) {
+  char id[FATCACHE_ID_SIZE];
+  char path[PATH_MAX];
+  fatcache_info_t info;
+  struct stat st;
+  uint64_t device_size;
+  int sector = SECTOR_SIZE;
+
+  memset(e, 0, sizeof(*e));
+
+  /* The image is laid out in 512 byte sectors, the same as
+     the FAT writer assumes */
+
+  ioctl(*device_fd, BLKSSZGET, &sector);
+
+  if (sector != SECTOR_SIZE) {
+    r_printf("Image cache skipped, the stick has %d byte sectors\n", sector);
+    return -1;
+  }
+
+  if (blk_size(*device_fd, &device_size) < 0) {
+    r_printf("Failed to get device size: %s\n", strerror(errno));
+    return -1;
+  }
+
+  e->table = table;
+  e->cluster_size = cluster_size;
+  e->align = blk_alignment(*device_fd);
+
+  if (table == TB_GPT) {
+    e->image_size = device_size & ~(uint64_t)(SECTOR_SIZE - 1);
+  } else {
+    e->image_size = device_size & ~(FATCACHE_CLASS_SIZE - 1);
+  }
+
+  if (e->image_size < FATCACHE_CLASS_SIZE) {
+    r_printf("Image cache skipped, the stick is too small\n");
+    return -1;
+  }
+
+  if (mkdir(FATCACHE_DIR, 0700) < 0 && errno != EEXIST) {
+    r_printf("Image cache unavailable, creating %s failed: %s\n", FATCACHE_DIR,
+             strerror(errno));
+    return -1;
+  }
+
+  if (iso_id(iso_path, id) < 0) return -1;
+
+  snprintf(e->path, sizeof(e->path),
+           FATCACHE_DIR "/%s-%s-c%u-s%llu-a%llu.img", id,
+           table == TB_GPT ? "gpt" : "mbr", (unsigned int)cluster_size,
+           (unsigned long long)(e->image_size / SECTOR_SIZE),
+           (unsigned long long)(e->align >> 10));
+
+  info_path(e, path);
+
+  if (load(path, &info, sizeof(info)) < 0 ||
+      memcmp(info.magic, info_magic, sizeof(info.magic)) != 0 ||
+      info.image_size != e->image_size || stat(e->path, &st) < 0 ||
+      (uint64_t)st.st_size != e->image_size) {
+    r_printf("No cached image for this ISO and stick yet\n");
+    return FATCACHE_MISS;
+  }
+
+  e->part_start = info.part_start;
+  e->part_len = info.part_len;
+  e->meta_end = info.meta_end;
+
+  /* The .info mtime is when the entry was last used */
+
+  utimensat(AT_FDCWD, path, NULL, 0);
+
+  r_printf("Using cached image %s\n", e->path);
+
+  return FATCACHE_HIT;
+}
+
+int fatcache_build(fatcache_entry_t *e, const copy_list_t *list, int image_fd,
+                   const char *root, char *label, unsigned int depth) {
+  char tmp[PATH_MAX];
+  char path[PATH_MAX];
+  fatcache_info_t info;
+  uint32_t loop_fd = -1;
+  uint64_t meta_end = 0;
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", e->path, (int)getpid());
+
+  r_printf("Building cached image %s\n", e->path);
+
+  if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0 ||
+      ftruncate(fd, e->image_size) < 0) {
+    r_printf("Creating %s failed: %s\n", tmp, strerror(errno));
+    if (fd >= 0) close(fd);
+    unlink(tmp);
+    return -1;
+  }
+
+  /* libparted works on plain files, the FAT writer wants a
+     block device the size of the partition */
+
+  if (nuke_and_partition_aligned(tmp, e->table, FS_FAT32, e->align) < 0 ||
+      partition_bounds(tmp, &e->part_start, &e->part_len) < 0 ||
+      make_loop_file(tmp, e->part_start, e->part_len, &loop_fd) < 0)
+    goto fail;
+
+  /* The loop device is only the partition, the FAT gets laid
+     out with the alignment picked for the whole stick */
+
+  int ret = fat32_write_tree(&loop_fd, e->cluster_size, e->align, label, list,
+                             image_fd, root, depth, NULL, &meta_end);
+
+  close(loop_fd);
+
+  if (ret < 0 || fdatasync(fd) < 0) goto fail;
+
+  close(fd);
+
+  e->meta_end = e->part_start + meta_end;
+
+  /* The .info goes first, an .img on its own is not an entry
+     and the .info is no use without the .img */
+
+  memset(&info, 0, sizeof(info));
+  memcpy(info.magic, info_magic, sizeof(info.magic));
+  info.image_size = e->image_size;
+  info.part_start = e->part_start;
+  info.part_len = e->part_len;
+  info.meta_end = e->meta_end;
+
+  info_path(e, path);
+
+  if (save(path, &info, sizeof(info)) < 0 || rename(tmp, e->path) < 0) {
+    r_printf("Saving cached image failed: %s\n", strerror(errno));
+    unlink(path);
+    unlink(tmp);
+    return -1;
+  }
+
+  evict(strrchr(path, '/') + 1);
+
+  return 0;
+
+fail:
+  close(fd);
+  unlink(tmp);
+
+  return -1;
+}
+
+/* Where the last data before limit ends, limit itself when
+   the file system can not tell */
+
+static uint64_t data_end(const fatcache_entry_t *e, uint64_t limit) {
+  uint64_t offset = 0, start, end = limit;
+  int fd = open(e->path, O_RDONLY);
+  int found;
+
+  if (fd < 0) return limit;
+
+  while ((found = sparse_next_data(fd, offset, limit, &start, &end)) == 0)
+    offset = end;
+
+  close(fd);
+
+  if (found < 0) return limit;
+
+  return offset;
+}
+
+/* How much of the entry goes out in one piece: up to the end
+   of its data. GPT keeps a copy of its headers in the last
+   sectors, those go out separately and the head stops at the
+   FAT data. */
+
+static uint64_t head_len(const fatcache_entry_t *e) {
+  uint64_t limit = e->image_size;
+
+  if (e->table == TB_GPT) limit -= FATCACHE_GPT_TAIL;
+
+  uint64_t len = data_end(e, limit);
+
+  if (len < e->meta_end) len = e->meta_end;
+
+  len = (len + SECTOR_SIZE - 1) & ~(uint64_t)(SECTOR_SIZE - 1);
+  if (len > limit) len = limit;
+
+  r_printf("* Writing %llu of %llu bytes, the rest is free clusters\n",
+           (unsigned long long)(len + e->image_size - limit),
+           (unsigned long long)e->image_size);
+
+  return len;
+}
+
+/* The backup GPT at the very end of the stick, read once and
+   hashed once however many sticks it goes to */
+
+static uint8_t *read_gpt_tail(const fatcache_entry_t *e, verify_t *verify) {
+  uint8_t *buf = (uint8_t *)malloc(FATCACHE_GPT_TAIL);
+  int fd = open(e->path, O_RDONLY);
+  uint64_t off = e->image_size - FATCACHE_GPT_TAIL;
+
+  if (buf == NULL || fd < 0 ||
+      pread(fd, buf, FATCACHE_GPT_TAIL, off) != FATCACHE_GPT_TAIL) {
+    r_printf("Reading the backup GPT of %s failed: %s\n", e->path,
+             strerror(errno));
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+  }
+
+  close(fd);
+
+  verify_add(verify, buf, FATCACHE_GPT_TAIL, off);
+
+  return buf;
+}
+
+static int write_gpt_tail(const fatcache_entry_t *e, const uint8_t *buf,
+                          int device_fd) {
+  uint64_t off = e->image_size - FATCACHE_GPT_TAIL;
+
+  if (pwrite(device_fd, buf, FATCACHE_GPT_TAIL, off) != FATCACHE_GPT_TAIL ||
+      fdatasync(device_fd) < 0) {
+    r_printf("Writing the backup GPT failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int fatcache_write(const fatcache_entry_t *e, const uint32_t *device_fd,
+                   int direct, unsigned int depth, verify_t *verify) {
+  if (e->table == TB_GPT) {
+    uint8_t *tail = read_gpt_tail(e, verify);
+    int ret = tail != NULL ? write_gpt_tail(e, tail, *device_fd) : -1;
+
+    free(tail);
+
+    if (ret < 0) return -1;
+  }
+
+  return write_image_head(e->path, head_len(e), device_fd, direct, depth,
+                          verify);
+}
+
+int fatcache_write_multi(const fatcache_entry_t *e, fanout_target_t *targets,
+                         int count, int direct, verify_t *verify) {
+  if (e->table == TB_GPT) {
+    uint8_t *tail = read_gpt_tail(e, verify);
+
+    if (tail == NULL) return -1;
+
+    for (int i = 0; i < count; i++) {
+      if (targets[i].failed || write_gpt_tail(e, tail, targets[i].fd) == 0)
+        continue;
+
+      r_printf("* %s: FAILED to write the backup GPT\n", targets[i].name);
+      targets[i].failed = 1;
+      targets[i].error = errno;
+    }
+
+    free(tail);
+  }
+
+  return write_image_multi_head(e->path, head_len(e), targets, count, direct,
+                                verify);
+}
+
+void fatcache_remove(const fatcache_entry_t *e) {
+  char path[PATH_MAX];
+
+  info_path(e, path);
+  remove_entry(strrchr(path, '/') + 1);
+}
@@ -0,0 +1,90 @@
+#ifndef FATCACHE_H
+#define FATCACHE_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "copy.h"
+#include "fanout.h"
+#include "verify.h"
+
+#define FATCACHE_DIR "/var/cache/rufusl"
+#define FATCACHE_CLASS_SIZE (256ULL << 20)
+#define FATCACHE_MAX_BYTES (64ULL << 30)
+#define FATCACHE_MAX_ENTRIES 8
+#define FATCACHE_HASH_BLOCK (4 << 20)
+#define FATCACHE_ID_SIZE 17
+#define FATCACHE_GPT_TAIL (33 * 512)
+
+#define FATCACHE_MISS 0
+#define FATCACHE_HIT 1
+
+/* Prebuilt images of a whole FAT32 stick, partition table
+   and all, so that writing the same ISO to stick after stick
+   is one sequential raw write instead of a partition, a format
+   and a file copy each time.
+
+   An entry is keyed by what is in the ISO, not by its name:
+   its size and two CRCs of all of it (CRC32C and zlib's CRC32),
+   taken once per version of the file and remembered by inode,
+   size and mtime. The partition scheme, the cluster size and
+   the size class of the stick come on top. With MBR the class
+   is the stick's size rounded down to FATCACHE_CLASS_SIZE and
+   whatever lies past it stays unused. GPT keeps the end of the
+   disk in its headers, so there the class is the exact size.
+
+   Entries live in FATCACHE_DIR as <key>.img, a sparse file,
+   next to <key>.info. The least recently used ones go once
+   there are more than FATCACHE_MAX_ENTRIES of them or they take
+   up more than FATCACHE_MAX_BYTES, and all entries of a file
+   that changed go as soon as that is noticed. */
+
+typedef struct fatcache_entry {
+  char path[PATH_MAX];
+  int table;
+  uint8_t cluster_size;
+  uint64_t align;
+  uint64_t image_size;
+  uint64_t part_start;
+  uint64_t part_len;
+  uint64_t meta_end;
+} fatcache_entry_t;
+
+/* Returns FATCACHE_HIT with e ready for fatcache_write(),
+   FATCACHE_MISS with e saying what fatcache_build() has to
+   make, and -1 when this stick can not use the cache */
+
+int fatcache_find(const char *iso_path, int table, uint8_t cluster_size,
+                  const uint32_t *device_fd, fatcache_entry_t *e);
+
+/* Partitions and formats a new entry through a loop device
+   and fills it like fat32_write_tree() would fill the stick */
+
+int fatcache_build(fatcache_entry_t *e, const copy_list_t *list, int image_fd,
+                   const char *root, char *label, unsigned int depth);
+
+/* The entry goes out up to the end of its last data, zero
+   blocks and holes included. Stale bytes left in the FATs and
+   directories by whatever was on the stick before would read as
+   garbage entries, and in a file as garbage data. Only the free
+   clusters after the data are not written. With GPT that
+   stops short of the backup headers in the last
+   FATCACHE_GPT_TAIL bytes, which go out on their own. */
+
+int fatcache_write(const fatcache_entry_t *e, const uint32_t *device_fd,
+                   int direct, unsigned int depth, verify_t *verify);
+
+/* The same to several sticks at once through
+   write_image_multi_head(), the entry is read once for all of
+   them. They all have to be at least image_size, and with GPT
+   exactly that. Returns how many sticks got all of it. */
+
+int fatcache_write_multi(const fatcache_entry_t *e, fanout_target_t *targets,
+                         int count, int direct, verify_t *verify);
+
+/* An entry that was only built for one job and is not to be
+   kept */
+
+void fatcache_remove(const fatcache_entry_t *e);
+
+#endif // FATCACHE_H
@@ -0,0 +1,765 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "fat32.h"
+#include "fattree.h"
+#include "ioqueue.h"
+#include "blkdev.h"
+#include "flush.h"
+#include "trace.h"
+
+#define DIRENT_SIZE 32
+#define LFN_CHARS 13
+#define LFN_MAX FATTREE_NAME_MAX
+#define SHORT_TAIL_MAX 999999
+#define PROGRESS_SLICE (64 << 20)
+
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define ATTR_LFN 0x0F
+
+#define CASE_LOWER_BASE 0x08
+#define CASE_LOWER_EXT 0x10
+
+#define NO_NODE UINT32_MAX
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+/* Node 0 is the root, node i + 1 is entry i of the list */
+
+typedef struct fat_node {
+  const copy_entry_t *entry;
+  uint32_t parent;
+  uint32_t first_child;
+  uint32_t last_child;
+  uint32_t next_sibling;
+  uint32_t cluster;
+  uint32_t clusters;
+  uint32_t slots;
+  uint8_t short_name[11];
+  uint8_t case_flags;
+  uint8_t lfn_slots;
+  uint8_t is_dir;
+} fat_node_t;
+
+typedef struct short_key {
+  uint32_t parent;
+  uint8_t name[11];
+} short_key_t;
+
+typedef struct fat_tree {
+  fat_node_t *nodes;
+  uint32_t count;
+  uint32_t cluster_bytes;
+  uint32_t *dirs;
+  short_key_t *shorts;
+  uint32_t mask;
+  uint16_t date;
+  uint16_t time;
+} fat_tree_t;
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v & 0xFFFF);
+  put16(p + 2, v >> 16);
+}
+
+static uint32_t fnv(const void *data, size_t len, uint32_t hash) {
+  const uint8_t *p = (const uint8_t *)data;
+
+  for (size_t i = 0; i < len; i++) hash = (hash ^ p[i]) * FNV_PRIME;
+
+  return hash;
+}
+
+static const char *base_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+
+  return slash ? slash + 1 : path;
+}
+
+/* ---- Directory lookup by path ---- */
+
+static const char *node_path(const fat_tree_t *t, uint32_t node) {
+  return node == 0 ? "" : t->nodes[node].entry->path;
+}
+
+static void dir_insert(fat_tree_t *t, uint32_t node) {
+  const char *path = node_path(t, node);
+  uint32_t slot = fnv(path, strlen(path), FNV_BASIS) & t->mask;
+
+  while (t->dirs[slot] != NO_NODE) slot = (slot + 1) & t->mask;
+
+  t->dirs[slot] = node;
+}
+
+static uint32_t dir_find(const fat_tree_t *t, const char *path, size_t len) {
+  uint32_t slot = fnv(path, len, FNV_BASIS) & t->mask;
+
+  for (; t->dirs[slot] != NO_NODE; slot = (slot + 1) & t->mask) {
+    const char *other = node_path(t, t->dirs[slot]);
+
+    if (strlen(other) == len && memcmp(other, path, len) == 0)
+      return t->dirs[slot];
+  }
+
+  return NO_NODE;
+}
+
+/* ---- Names ---- */
+
+/* UTF-8 to the UTF-16 long names are stored in, -1 when the
+   name does not fit in a long name */
+
+int fattree_utf16(const char *name, uint16_t *out) {
+  const uint8_t *p = (const uint8_t *)name;
+  int n = 0;
+
+  while (*p) {
+    uint32_t c = *p++;
+    int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+
+    if (extra) c &= 0x3F >> extra;
+
+    while (extra-- > 0 && (*p & 0xC0) == 0x80) c = (c << 6) | (*p++ & 0x3F);
+
+    if (c >= 0x10000) {
+      if (n + 2 > LFN_MAX) return -1;
+      c -= 0x10000;
+      out[n++] = 0xD800 | (c >> 10);
+      out[n++] = 0xDC00 | (c & 0x3FF);
+    } else {
+      if (n + 1 > LFN_MAX) return -1;
+      out[n++] = c;
+    }
+  }
+
+  return n;
+}
+
+static int short_char(uint8_t c) {
+  if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return 1;
+
+  return c != 0 && strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+static uint8_t upper(uint8_t c) {
+  return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+/* Whether name works as a plain 8.3 name. Each of the two
+   parts may be all lowercase, which the NT case bits record,
+   but mixed case needs a long name. */
+
+static int short_fits(const char *name, uint8_t out[11], uint8_t *case_flags) {
+  const char *dot = strrchr(name, '.');
+  size_t base = dot ? (size_t)(dot - name) : strlen(name);
+  size_t ext = dot ? strlen(dot + 1) : 0;
+
+  if (base == 0 || base > 8 || ext > 3 || (dot && ext == 0)) return 0;
+
+  memset(out, ' ', 11);
+  *case_flags = 0;
+
+  for (int part = 0; part < 2; part++) {
+    const char *src = part == 0 ? name : dot ? dot + 1 : "";
+    size_t len = part == 0 ? base : ext;
+    int lower = 0, up = 0;
+
+    for (size_t i = 0; i < len; i++) {
+      uint8_t c = src[i];
+
+      if (c >= 'a' && c <= 'z') lower = 1;
+      if (c >= 'A' && c <= 'Z') up = 1;
+      if (!short_char(upper(c))) return 0;
+
+      out[(part == 0 ? 0 : 8) + i] = upper(c);
+    }
+
+    if (lower && up) return 0;
+    if (lower) *case_flags |= part == 0 ? CASE_LOWER_BASE : CASE_LOWER_EXT;
+  }
+
+  return 1;
+}
+
+static int short_taken(const fat_tree_t *t, uint32_t parent,
+                       const uint8_t name[11], int claim) {
+  uint32_t slot = fnv(name, 11, fnv(&parent, sizeof(parent), FNV_BASIS)) &
+                  t->mask;
+
+  for (; t->shorts[slot].parent != NO_NODE; slot = (slot + 1) & t->mask) {
+    if (t->shorts[slot].parent == parent &&
+        memcmp(t->shorts[slot].name, name, 11) == 0)
+      return 1;
+  }
+
+  if (claim) {
+    t->shorts[slot].parent = parent;
+    memcpy(t->shorts[slot].name, name, 11);
+  }
+
+  return 0;
+}
+
+/* The usual BASIS~N.EXT alias for names that need a long
+   entry: invalid characters become '_', spaces and all but
+   the last dot are dropped */
+
+static int short_alias(fat_tree_t *t, uint32_t parent, const char *name,
+                       uint8_t out[11]) {
+  const char *dot = strrchr(name, '.');
+  uint8_t basis[8];
+  size_t basis_len = 0;
+  char tail[8];
+
+  if (dot == name) dot = NULL;
+
+  memset(out, ' ', 11);
+
+  for (const char *p = name; *p && (dot == NULL || p < dot); p++) {
+    uint8_t c = upper(*p);
+
+    if (c == ' ' || c == '.') continue;
+    if ((c & 0x80) && ((uint8_t)*p & 0xC0) == 0x80) continue;
+    if (basis_len < sizeof(basis)) basis[basis_len++] = short_char(c) ? c : '_';
+  }
+
+  if (basis_len == 0) basis[basis_len++] = '_';
+
+  for (size_t i = 0, j = 8; dot && dot[1 + i] && j < 11; i++) {
+    uint8_t c = upper(dot[1 + i]);
+
+    if (c == ' ') continue;
+    if ((c & 0x80) && ((uint8_t)dot[1 + i] & 0xC0) == 0x80) continue;
+    out[j++] = short_char(c) ? c : '_';
+  }
+
+  for (uint32_t n = 1; n <= SHORT_TAIL_MAX; n++) {
+    int tail_len = snprintf(tail, sizeof(tail), "~%u", n);
+    size_t keep = basis_len < (size_t)(8 - tail_len) ? basis_len
+                                                     : (size_t)(8 - tail_len);
+
+    memset(out, ' ', 8);
+    memcpy(out, basis, keep);
+    memcpy(out + keep, tail, tail_len);
+
+    if (!short_taken(t, parent, out, 1)) return 0;
+  }
+
+  r_printf("Ran out of short names for %s\n", name);
+  return -1;
+}
+
+static uint8_t lfn_checksum(const uint8_t name[11]) {
+  uint8_t sum = 0;
+
+  for (int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+
+  return sum;
+}
+
+/* ---- Layout ---- */
+
+static int name_node(fat_tree_t *t, uint32_t node) {
+  fat_node_t *n = &t->nodes[node];
+  const char *name = base_name(n->entry->path);
+  uint16_t units[LFN_MAX];
+  int len;
+
+  if (short_fits(name, n->short_name, &n->case_flags) &&
+      !short_taken(t, n->parent, n->short_name, 1)) {
+    n->lfn_slots = 0;
+    return 0;
+  }
+
+  if ((len = fattree_utf16(name, units)) < 0) {
+    r_printf("Name too long for FAT32: %s\n", n->entry->path);
+    return -1;
+  }
+
+  n->case_flags = 0;
+  n->lfn_slots = (len + LFN_CHARS - 1) / LFN_CHARS;
+
+  return short_alias(t, n->parent, name, n->short_name);
+}
+
+static int build_tree(fat_tree_t *t, const copy_list_t *list) {
+  t->nodes[0].entry = NULL;
+  t->nodes[0].parent = NO_NODE;
+  t->nodes[0].is_dir = 1;
+  t->nodes[0].first_child = t->nodes[0].last_child = NO_NODE;
+  t->nodes[0].slots = 1;
+
+  dir_insert(t, 0);
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    fat_node_t *n = &t->nodes[i + 1];
+    const char *path = list->entries[i].path;
+    const char *name = base_name(path);
+
+    n->entry = &list->entries[i];
+    n->is_dir = list->entries[i].is_dir;
+    n->first_child = n->last_child = n->next_sibling = NO_NODE;
+    n->parent = dir_find(t, path, name == path ? 0 : (size_t)(name - path - 1));
+    n->slots = n->is_dir ? 2 : 0;
+
+    /* Lists are pre-order, so the parent is always known */
+
+    if (n->parent == NO_NODE) {
+      r_printf("Parent of %s is not in the list\n", path);
+      return -1;
+    }
+
+    if (!n->is_dir && n->entry->size > UINT32_MAX) {
+      r_printf("%s is larger than FAT32 allows\n", path);
+      return -1;
+    }
+
+    if (name_node(t, i + 1) < 0) return -1;
+
+    fat_node_t *parent = &t->nodes[n->parent];
+
+    if (parent->last_child == NO_NODE) {
+      parent->first_child = i + 1;
+    } else {
+      t->nodes[parent->last_child].next_sibling = i + 1;
+    }
+
+    parent->last_child = i + 1;
+    parent->slots += 1 + n->lfn_slots;
+
+    if (parent->slots > FATTREE_DIR_MAX_ENTRIES) {
+      r_printf("Too many entries in %s\n", node_path(t, n->parent));
+      return -1;
+    }
+
+    if (n->is_dir) dir_insert(t, i + 1);
+  }
+
+  return 0;
+}
+
+/* Root first, then every other directory, then the files, each
+   in list order. Returns the number of clusters used. */
+
+static uint32_t allocate(fat_tree_t *t, uint32_t *dir_clusters) {
+  uint32_t next = 2;
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint32_t i = 0; i < t->count; i++) {
+      fat_node_t *n = &t->nodes[i];
+
+      if (n->is_dir != (pass == 0)) continue;
+
+      uint64_t bytes = n->is_dir ? (uint64_t)n->slots * DIRENT_SIZE
+                                 : n->entry->size;
+
+      n->clusters = (bytes + t->cluster_bytes - 1) / t->cluster_bytes;
+
+      if (n->is_dir && n->clusters == 0) n->clusters = 1;
+
+      n->cluster = n->clusters ? next : 0;
+      next += n->clusters;
+    }
+
+    if (pass == 0) *dir_clusters = next - 2;
+  }
+
+  return next - 2;
+}
+
+/* ---- Directory contents ---- */
+
+static uint8_t *put_entry(const fat_tree_t *t, uint8_t *p, const uint8_t name[11],
+                          uint8_t attr, uint8_t case_flags, uint32_t cluster,
+                          uint32_t size) {
+  memcpy(p, name, 11);
+  p[11] = attr;
+  p[12] = case_flags;
+  put16(p + 14, t->time);
+  put16(p + 16, t->date);
+  put16(p + 18, t->date);
+  put16(p + 20, cluster >> 16);
+  put16(p + 22, t->time);
+  put16(p + 24, t->date);
+  put16(p + 26, cluster & 0xFFFF);
+  put32(p + 28, size);
+
+  return p + DIRENT_SIZE;
+}
+
+static uint8_t *put_lfn(uint8_t *p, const char *name, uint8_t slots,
+                        uint8_t checksum) {
+  static const uint8_t offsets[LFN_CHARS] = {1,  3,  5,  7,  9,  14, 16,
+                                             18, 20, 22, 24, 28, 30};
+  uint16_t units[LFN_MAX];
+  int len = fattree_utf16(name, units);
+
+  /* Stored last part first, the first one flagged with 0x40 */
+
+  for (int seq = slots; seq >= 1; seq--) {
+    p[0] = seq | (seq == slots ? 0x40 : 0x00);
+    p[11] = ATTR_LFN;
+    p[12] = 0;
+    p[13] = checksum;
+    put16(p + 26, 0);
+
+    for (int i = 0; i < LFN_CHARS; i++) {
+      int at = (seq - 1) * LFN_CHARS + i;
+      uint16_t c = at < len ? units[at] : at == len ? 0x0000 : 0xFFFF;
+
+      put16(p + offsets[i], c);
+    }
+
+    p += DIRENT_SIZE;
+  }
+
+  return p;
+}
+
+static void fill_dir(const fat_tree_t *t, uint32_t dir, uint8_t *buf,
+                     const char *label) {
+  const fat_node_t *d = &t->nodes[dir];
+  uint8_t *p = buf;
+
+  if (dir == 0) {
+    uint8_t volume[11];
+
+    memset(volume, ' ', sizeof(volume));
+
+    for (int i = 0; i < 11 && label[i]; i++) volume[i] = upper(label[i]);
+
+    p = put_entry(t, p, volume, ATTR_VOLUME_ID, 0, 0, 0);
+  } else {
+    uint32_t up = d->parent == 0 ? 0 : t->nodes[d->parent].cluster;
+
+    p = put_entry(t, p, (const uint8_t *)".          ", ATTR_DIRECTORY, 0,
+                  d->cluster, 0);
+    p = put_entry(t, p, (const uint8_t *)"..         ", ATTR_DIRECTORY, 0, up,
+                  0);
+  }
+
+  for (uint32_t c = d->first_child; c != NO_NODE; c = t->nodes[c].next_sibling) {
+    const fat_node_t *n = &t->nodes[c];
+
+    if (n->lfn_slots) {
+      p = put_lfn(p, base_name(n->entry->path), n->lfn_slots,
+                  lfn_checksum(n->short_name));
+    }
+
+    p = put_entry(t, p, n->short_name, n->is_dir ? ATTR_DIRECTORY : ATTR_ARCHIVE,
+                  n->case_flags, n->cluster,
+                  n->is_dir ? 0 : (uint32_t)n->entry->size);
+  }
+}
+
+/* ---- Output ---- */
+
+static int write_full(int fd, const uint8_t *buf, uint64_t len, uint64_t off) {
+  while (len > 0) {
+    ssize_t ret = pwrite(fd, buf, len, off);
+
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    buf += ret;
+    len -= ret;
+    off += ret;
+  }
+
+  return 0;
+}
+
+static int write_fat(const fat_tree_t *t, int fd, const fat32_geometry_t *geo,
+                     verify_t *verify) {
+  uint64_t fat_bytes = (uint64_t)geo->fat_sz * 512;
+  uint8_t *fat = calloc(1, fat_bytes);
+  int ret = 0;
+
+  if (fat == NULL) return -1;
+
+  put32(fat, FAT32_MEDIA);
+  put32(fat + 4, FAT32_EOC);
+
+  for (uint32_t i = 0; i < t->count; i++) {
+    const fat_node_t *n = &t->nodes[i];
+
+    for (uint32_t k = 0; k < n->clusters; k++) {
+      uint32_t c = n->cluster + k;
+
+      put32(fat + (uint64_t)c * 4, k + 1 < n->clusters ? c + 1 : FAT32_EOC);
+    }
+  }
+
+  for (int i = 0; i < geo->num_fats && ret == 0; i++) {
+    uint64_t off = ((uint64_t)geo->resvd + (uint64_t)i * geo->fat_sz) * 512;
+
+    if ((ret = write_full(fd, fat, fat_bytes, off)) == 0) {
+      verify_add(verify, fat, fat_bytes, off);
+      verify_name(verify, off, fat_bytes, "the FAT");
+    }
+  }
+
+  free(fat);
+
+  return ret;
+}
+
+static int write_dirs(const fat_tree_t *t, int fd, uint64_t data_start,
+                      uint32_t dir_clusters, const char *label,
+                      verify_t *verify) {
+  uint64_t bytes = (uint64_t)dir_clusters * t->cluster_bytes;
+  uint8_t *buf = calloc(1, bytes);
+  int ret;
+
+  if (buf == NULL) return -1;
+
+  for (uint32_t i = 0; i < t->count; i++) {
+    if (!t->nodes[i].is_dir) continue;
+
+    fill_dir(t, i,
+             buf + (uint64_t)(t->nodes[i].cluster - 2) * t->cluster_bytes,
+             label);
+  }
+
+  if ((ret = write_full(fd, buf, bytes, data_start)) == 0) {
+    verify_add(verify, buf, bytes, data_start);
+    verify_name(verify, data_start, bytes, "the directories");
+  }
+
+  free(buf);
+
+  return ret;
+}
+
+int fattree_write_files(int fd, const copy_list_t *list, const uint64_t *out_at,
+                        uint64_t data_start, int image_fd, const char *root,
+                        unsigned int depth, verify_t *verify) {
+  uint64_t total = list->total_bytes;
+  char path[PATH_MAX];
+  uint64_t done = 0;
+  uint64_t prev_in = 0, prev_len = 0;
+  int ret = 0;
+  writeback_t wb;
+
+  ioqueue_t *queue = ioqueue_new(depth, blk_chunk(fd, FATTREE_BLOCK_SIZE));
+
+  if (queue == NULL) {
+    r_printf("Failed to set up I/O queue: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (verify != NULL) ioqueue_on_read(queue, verify_hook, verify);
+
+  /* The files go out in cluster order, so the data region is
+     one sequential write as far as write-behind is concerned */
+
+  writeback_init(&wb, fd, data_start);
+
+  if (image_fd >= 0) fadvise_stream(image_fd);
+
+  r_printf("Writing %llu bytes of file data from the %s (%s, depth %u)\n",
+           (unsigned long long)total, image_fd >= 0 ? "image" : "mount",
+           ioqueue_backend_name(queue), ioqueue_depth(queue));
+
+  for (uint32_t i = 0; i < list->count && ret == 0; i++) {
+    const copy_entry_t *e = &list->entries[i];
+
+    if (e->is_dir || e->size == 0) continue;
+
+    uint64_t out = out_at[i];
+    uint64_t in = e->offset;
+    int in_fd = image_fd;
+
+    if (image_fd < 0) {
+      snprintf(path, sizeof(path), "%s/%s", root, e->path);
+
+      if ((in_fd = open(path, O_RDONLY)) < 0) {
+        r_printf("Error: %s: %s\n", path, strerror(errno));
+        ret = -1;
+        break;
+      }
+
+      in = 0;
+    }
+
+    if (image_fd < 0) fadvise_stream(in_fd);
+
+    r_log(LOG_LEVEL_VERBOSE, "Extracting: %s\n", e->path);
+
+    verify_name(verify, out, e->size, e->path);
+
+    TRACE_NOW(traced);
+
+    for (uint64_t off = 0; off < e->size && ret == 0;) {
+      uint64_t len = e->size - off < PROGRESS_SLICE
+                         ? e->size - off
+                         : PROGRESS_SLICE;
+
+      if (job_cancelled()) {
+        errno = ECANCELED;
+        ret = -1;
+        break;
+      }
+
+      ret = ioqueue_copy_at(queue, in_fd, in + off, fd, out + off, len);
+      off += len;
+
+      progress_bytes(
+          writeback_advance(&wb, data_start + ioqueue_completed(queue)) -
+              data_start,
+          total);
+    }
+
+    /* Each file has its own fd when reading from the mount,
+       so it has to be done before that gets closed */
+
+    if (image_fd < 0) {
+      if (ioqueue_drain(queue) < 0) ret = -1;
+      fadvise_drop(in_fd, 0, 0);
+      close(in_fd);
+    } else if (prev_len > 0) {
+      /* The previous file is done reading by now, or close
+         to it, no need to keep it cached */
+
+      fadvise_drop(image_fd, prev_in, prev_len);
+    }
+
+    TRACE_SPAN(TRACE_FILE, e->path, traced);
+
+    prev_in = in;
+    prev_len = e->size;
+    done += e->size;
+  }
+
+  if (ioqueue_drain(queue) < 0) ret = -1;
+
+  if (image_fd >= 0) fadvise_drop(image_fd, 0, 0);
+
+  if (ret < 0 && job_cancelled()) {
+    r_printf("File data write cancelled after %llu bytes\n",
+             (unsigned long long)ioqueue_completed(queue));
+  } else if (ret < 0 || ioqueue_completed(queue) != done) {
+    r_printf("File data write failed after %llu bytes: %s\n",
+             (unsigned long long)ioqueue_completed(queue),
+             ret < 0 ? strerror(errno) : "short read");
+    ret = -1;
+  }
+
+  ioqueue_free(queue);
+
+  return ret;
+}
+
+int fat32_write_tree(const uint32_t *part_fd, uint8_t cluster_size,
+                     uint64_t align, char *label,
+                     const copy_list_t *list, int image_fd, const char *root,
+                     unsigned int depth, verify_t *verify, uint64_t *meta_end) {
+  fat32_geometry_t geo;
+  fat_tree_t t;
+  uint64_t *out_at = NULL;
+  uint32_t dir_clusters;
+  uint32_t slots = 1;
+  int ret = -1;
+
+  if (fat32_geometry(part_fd, cluster_size, align, &geo) < 0) return -1;
+
+  while (slots < 2 * (list->count + 1)) slots <<= 1;
+
+  memset(&t, 0, sizeof(t));
+  t.count = list->count + 1;
+  t.cluster_bytes = (uint32_t)geo.sec_per_clus * 512;
+  t.mask = slots - 1;
+  t.nodes = calloc(t.count, sizeof(fat_node_t));
+  t.dirs = malloc(slots * sizeof(uint32_t));
+  t.shorts = malloc(slots * sizeof(short_key_t));
+  out_at = malloc((list->count + 1) * sizeof(uint64_t));
+
+  if (t.nodes == NULL || t.dirs == NULL || t.shorts == NULL || out_at == NULL) {
+    r_printf("Out of memory building the FAT32 tree\n");
+    goto out;
+  }
+
+  for (uint32_t i = 0; i < slots; i++) {
+    t.dirs[i] = NO_NODE;
+    t.shorts[i].parent = NO_NODE;
+  }
+
+  time_t now = time(NULL);
+  struct tm tm;
+
+  localtime_r(&now, &tm);
+  t.date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+  t.time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+
+  if (build_tree(&t, list) < 0) goto out;
+
+  uint32_t used = allocate(&t, &dir_clusters);
+
+  if (used > geo.clusters) {
+    r_printf("Files need %u clusters but the partition only has %u\n", used,
+             geo.clusters);
+    goto out;
+  }
+
+  uint64_t data_start =
+      ((uint64_t)geo.resvd + (uint64_t)geo.num_fats * geo.fat_sz) * 512;
+
+  r_printf("FAT32 tree: %u entries, %u directory and %u file clusters of %u "
+           "bytes\n",
+           list->count, dir_clusters, used - dir_clusters, t.cluster_bytes);
+
+  if (fat32_write_boot(part_fd, &geo, label, used) < 0) goto out;
+
+  if (write_fat(&t, *part_fd, &geo, verify) < 0 ||
+      write_dirs(&t, *part_fd, data_start, dir_clusters, label, verify) < 0) {
+    r_printf("Failed to write FAT32 metadata: %s\n", strerror(errno));
+    goto out;
+  }
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    out_at[i] = data_start +
+                (uint64_t)(t.nodes[i + 1].cluster - 2) * t.cluster_bytes;
+  }
+
+  if (fattree_write_files(*part_fd, list, out_at, data_start, image_fd, root,
+                          depth, verify) < 0)
+    goto out;
+
+  if (flush_device(*part_fd) < 0) {
+    r_printf("Failed to flush partition: %s\n", strerror(errno));
+    goto out;
+  }
+
+  fadvise_drop(*part_fd, 0, 0);
+
+  if (meta_end != NULL)
+    *meta_end = data_start + (uint64_t)dir_clusters * t.cluster_bytes;
+
+  ret = 0;
+
+out:
+  free(out_at);
+  free(t.shorts);
+  free(t.dirs);
+  free(t.nodes);
+
+  return ret;
+}
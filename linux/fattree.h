@@ -0,0 +1,42 @@
+#ifndef FATTREE_H
+#define FATTREE_H
+
+#include <stdint.h>
+
+#include "copy.h"
+#include "verify.h"
+
+#define FATTREE_BLOCK_SIZE (4 << 20)
+#define FATTREE_DIR_MAX_ENTRIES 65536
+#define FATTREE_NAME_MAX 255
+
+/* Build a complete FAT32 file system holding everything in
+   list, without mounting anything. Every file gets one run of
+   clusters, laid out in list order right after the directories,
+   so both the metadata and the data go out as sequential
+   streams. File data is read from image_fd at each entry's
+   offset when image_fd is valid, and from the files under root
+   otherwise. With verify set, everything written is hashed on
+   the way out and named after the file it belongs to. With
+   meta_end set, it gets where the file data starts, everything
+   in front of it is boot sectors, FATs and directories. align
+   goes to fat32_geometry(). */
+
+int fat32_write_tree(const uint32_t *part_fd, uint8_t cluster_size,
+                     uint64_t align, char *label,
+                     const copy_list_t *list, int image_fd, const char *root,
+                     unsigned int depth, verify_t *verify, uint64_t *meta_end);
+
+/* Shared with exfat.c, which stores names and lays out data
+   the same way. fattree_utf16() converts a UTF-8 name into at
+   most FATTREE_NAME_MAX units, -1 when it does not fit.
+   fattree_write_files() copies every file in list to its
+   offset in out_at, one per entry, all of them in order from
+   data_start on. */
+
+int fattree_utf16(const char *name, uint16_t *out);
+int fattree_write_files(int fd, const copy_list_t *list, const uint64_t *out_at,
+                        uint64_t data_start, int image_fd, const char *root,
+                        unsigned int depth, verify_t *verify);
+
+#endif // FATTREE_H
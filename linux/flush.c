@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "flush.h"
+#include "trace.h"
+
+/* Data first, then whatever the block layer still buffers
+   for the device. BLKFLSBUF only works on block devices, so
+   it failing on anything else is fine. */
+
+int flush_device(int fd) {
+  if (fd < 0) return 0;
+
+  TRACE_NOW(traced);
+
+  if (fdatasync(fd) < 0) return -1;
+
+  TRACE_SPAN(TRACE_FSYNC, "fdatasync", traced);
+
+  ioctl(fd, BLKFLSBUF, 0);
+
+  return 0;
+}
+
+/* syncfs() on whatever is mounted at path. When nothing is,
+   path is just a directory on the host's own file system, which
+   is left alone. */
+
+int flush_fs(const char *path) {
+  char parent[PATH_MAX];
+  struct stat st, parent_st;
+  int fd, ret;
+
+  snprintf(parent, sizeof(parent), "%s/..", path);
+
+  if (stat(path, &st) < 0 || stat(parent, &parent_st) < 0) return -1;
+
+  if (st.st_dev == parent_st.st_dev) return 0;
+
+  if ((fd = open(path, O_RDONLY | O_DIRECTORY)) < 0) return -1;
+
+  TRACE_NOW(traced);
+
+  ret = syncfs(fd);
+  close(fd);
+
+  TRACE_SPAN(TRACE_FSYNC, "syncfs", traced);
+
+  return ret;
+}
+
+void writeback_init(writeback_t *wb, int fd, uint64_t base) {
+  wb->fd = fd;
+  wb->started = base;
+  wb->durable = base;
+
+  /* O_DIRECT writes do not go through the page cache, they
+     are on the device as soon as they complete */
+
+  int flags = fcntl(fd, F_GETFL);
+
+  wb->passthrough = flags >= 0 && (flags & O_DIRECT);
+}
+
+uint64_t writeback_advance(writeback_t *wb, uint64_t written) {
+  if (wb->passthrough) return wb->durable = written;
+
+  while (written - wb->started >= WRITEBACK_WINDOW) {
+    uint64_t start = wb->started;
+
+    if (sync_file_range(wb->fd, start, WRITEBACK_WINDOW,
+                        SYNC_FILE_RANGE_WRITE) < 0) {
+      /* Not something sync_file_range() works on, all that
+         is left is the flush at the end */
+
+      wb->passthrough = 1;
+      return wb->durable = written;
+    }
+
+    if (start - wb->durable >= WRITEBACK_WINDOW) {
+      TRACE_NOW(traced);
+
+      sync_file_range(wb->fd, start - WRITEBACK_WINDOW, WRITEBACK_WINDOW,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+      TRACE_SPAN(TRACE_FSYNC, "sync_file_range", traced);
+      fadvise_drop(wb->fd, start - WRITEBACK_WINDOW, WRITEBACK_WINDOW);
+      wb->durable = start;
+    }
+
+    wb->started = start + WRITEBACK_WINDOW;
+  }
+
+  return wb->durable;
+}
+
+void writeback_tail(writeback_t *wb, uint64_t written) {
+  if (wb->passthrough || written <= wb->started) return;
+
+  sync_file_range(wb->fd, wb->started, written - wb->started,
+                  SYNC_FILE_RANGE_WRITE);
+
+  wb->started = written;
+}
+
+/* Page cache hygiene. Nothing we stream is ever read again, so
+   sources are read ahead aggressively and dropped behind us,
+   and written ranges are dropped once they are clean. */
+
+void fadvise_stream(int fd) {
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+}
+
+void fadvise_drop(int fd, uint64_t offset, uint64_t len) {
+  posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
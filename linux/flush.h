@@ -0,0 +1,37 @@
+#ifndef FLUSH_H
+#define FLUSH_H
+
+#include <stdint.h>
+
+#define WRITEBACK_WINDOW (16 << 20)
+
+/* Flushing only what we wrote, never the whole system like
+   sync() does, and keeping the amount of dirty page cache a
+   bulk write can build up bounded. */
+
+int flush_device(int fd);
+int flush_fs(const char *path);
+
+/* Rolling write-behind for a sequential write starting at
+   base. Each full window gets its writeback started as soon as
+   it is written, and the window before it is waited on and
+   dropped from the cache, so at most two windows are dirty or
+   cached at any time. durable is how far the data is known to
+   be on the device. writeback_tail() starts writeback of the
+   last partial window without waiting for it. */
+
+typedef struct writeback {
+  int fd;
+  int passthrough;
+  uint64_t started;
+  uint64_t durable;
+} writeback_t;
+
+void writeback_init(writeback_t *wb, int fd, uint64_t base);
+uint64_t writeback_advance(writeback_t *wb, uint64_t written);
+void writeback_tail(writeback_t *wb, uint64_t written);
+
+void fadvise_stream(int fd);
+void fadvise_drop(int fd, uint64_t offset, uint64_t len);
+
+#endif // FLUSH_H
@@ -0,0 +1,1200 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "http.h"
+#include "trace.h"
+#include "verify.h"
+
+typedef struct http_url {
+  int tls;
+  char host[256];
+  char port[8];
+  char path[HTTP_URL_MAX];
+} http_url_t;
+
+typedef struct http_conn {
+  int fd;
+  SSL *ssl;
+  size_t pos;
+  size_t len;
+  char buf[HTTP_BUF_SIZE];
+} http_conn_t;
+
+typedef struct http_response {
+  int status;
+  int close;
+  int chunked;
+  int64_t length;
+  int has_range;
+  uint64_t range_start;
+  uint64_t range_end;
+  uint64_t range_total;
+  char etag[128];
+  char modified[64];
+  char location[HTTP_URL_MAX];
+} http_response_t;
+
+typedef struct http_block {
+  uint8_t *buf;
+  uint64_t offset;
+  uint32_t len;
+  uint64_t used;
+} http_block_t;
+
+typedef struct http_chunk {
+  uint64_t offset;
+  uint32_t len;
+} http_chunk_t;
+
+typedef struct http_worker {
+  struct http_source *source;
+  http_conn_t *conn;
+  pthread_t thread;
+} http_worker_t;
+
+/* Chunk n waits in slot n % HTTP_WINDOW, and is only fetched
+   once the reader is done with chunk n - HTTP_WINDOW */
+
+typedef struct http_stream {
+  http_chunk_t *chunks;
+  uint64_t count;
+  uint64_t total;
+  uint64_t next_fetch;
+  uint64_t next_read;
+  size_t read_pos;
+  uint64_t done;
+  int failed;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint8_t *slots[HTTP_WINDOW];
+  int ready[HTTP_WINDOW];
+  http_worker_t workers[HTTP_CONNECTIONS];
+  int started;
+} http_stream_t;
+
+struct http_source {
+  http_url_t url;
+  char location[HTTP_URL_MAX];
+  SSL_CTX *tls;
+  uint64_t size;
+  int ranges;
+  char etag[128];
+  char modified[64];
+
+  /* http_read(), one request at a time */
+
+  pthread_mutex_t read_lock;
+  http_conn_t *reader;
+  http_block_t blocks[HTTP_READ_BLOCKS];
+  uint64_t reads;
+
+  http_stream_t *stream;
+};
+
+int http_is_url(const char *path) {
+  return strncasecmp(path, "http://", 7) == 0 ||
+         strncasecmp(path, "https://", 8) == 0;
+}
+
+/* ---- URLs ---- */
+
+static int parse_url(const char *url, http_url_t *u) {
+  const char *p;
+
+  memset(u, 0, sizeof(*u));
+
+  if (strncasecmp(url, "http://", 7) == 0) {
+    p = url + 7;
+    strcpy(u->port, "80");
+  } else if (strncasecmp(url, "https://", 8) == 0) {
+    p = url + 8;
+    u->tls = 1;
+    strcpy(u->port, "443");
+  } else {
+    return -1;
+  }
+
+  size_t hostlen = strcspn(p, "/?#");
+  const char *rest = p + hostlen;
+  const char *at = memchr(p, '@', hostlen);
+
+  /* Credentials in the URL are not sent anywhere */
+
+  if (at != NULL) {
+    hostlen -= at + 1 - p;
+    p = at + 1;
+  }
+
+  const char *port = NULL;
+
+  if (*p == '[') {
+    const char *end = memchr(p, ']', hostlen);
+
+    if (end == NULL) return -1;
+    if (end + 1 < p + hostlen && end[1] == ':') port = end + 2;
+
+    snprintf(u->host, sizeof(u->host), "%.*s", (int)(end - p - 1), p + 1);
+  } else {
+    const char *colon = memchr(p, ':', hostlen);
+    size_t len = colon != NULL ? (size_t)(colon - p) : hostlen;
+
+    if (colon != NULL) port = colon + 1;
+    if (len >= sizeof(u->host)) return -1;
+
+    snprintf(u->host, sizeof(u->host), "%.*s", (int)len, p);
+  }
+
+  if (port != NULL) {
+    size_t len = p + hostlen - port;
+
+    if (len == 0 || len >= sizeof(u->port)) return -1;
+
+    snprintf(u->port, sizeof(u->port), "%.*s", (int)len, port);
+  }
+
+  if (u->host[0] == 0x00) return -1;
+
+  /* The fragment never goes to the server */
+
+  size_t pathlen = strcspn(rest, "#");
+
+  if (pathlen + 2 > sizeof(u->path)) return -1;
+
+  snprintf(u->path, sizeof(u->path), "%s%.*s", *rest == '/' ? "" : "/",
+           (int)pathlen, rest);
+
+  return 0;
+}
+
+/* A Location that is not a whole URL is taken relative to
+   the one it came from */
+
+static int resolve(const http_url_t *base, const char *location, char *out,
+                   size_t size) {
+  int len;
+
+  if (http_is_url(location)) {
+    len = snprintf(out, size, "%s", location);
+  } else if (location[0] == '/' && location[1] == '/') {
+    len = snprintf(out, size, "%s:%s", base->tls ? "https" : "http", location);
+  } else {
+    const char *host_open = strchr(base->host, ':') != NULL ? "[" : "";
+    const char *host_close = *host_open ? "]" : "";
+
+    if (location[0] == '/') {
+      len = snprintf(out, size, "%s://%s%s%s:%s%s", base->tls ? "https" : "http",
+                     host_open, base->host, host_close, base->port, location);
+    } else {
+      size_t dir = strcspn(base->path, "?");
+
+      while (dir > 0 && base->path[dir - 1] != '/') dir--;
+
+      len = snprintf(out, size, "%s://%s%s%s:%s%.*s%s",
+                     base->tls ? "https" : "http", host_open, base->host,
+                     host_close, base->port, (int)dir, base->path, location);
+    }
+  }
+
+  return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+/* ---- Connections ---- */
+
+static SSL_CTX *tls_context(http_source_t *s) {
+  if (s->tls != NULL) return s->tls;
+
+  if ((s->tls = SSL_CTX_new(TLS_client_method())) == NULL) return NULL;
+
+  SSL_CTX_set_min_proto_version(s->tls, TLS1_2_VERSION);
+  SSL_CTX_set_verify(s->tls, SSL_VERIFY_PEER, NULL);
+  SSL_CTX_set_default_verify_paths(s->tls);
+
+  return s->tls;
+}
+
+static http_conn_t *conn_new(void) {
+  http_conn_t *c = (http_conn_t *)malloc(sizeof(http_conn_t));
+
+  if (c == NULL) return NULL;
+
+  c->fd = -1;
+  c->ssl = NULL;
+  c->pos = c->len = 0;
+
+  return c;
+}
+
+static void conn_close(http_conn_t *c) {
+  if (c == NULL) return;
+
+  if (c->ssl != NULL) SSL_free(c->ssl);
+  if (c->fd >= 0) close(c->fd);
+
+  c->ssl = NULL;
+  c->fd = -1;
+  c->pos = c->len = 0;
+}
+
+static void conn_free(http_conn_t *c) {
+  conn_close(c);
+  free(c);
+}
+
+/* Linux times out connect() with SO_SNDTIMEO too */
+
+static int conn_open(http_source_t *s, http_conn_t *c) {
+  struct addrinfo hints, *res, *ai;
+  struct timeval tv = {HTTP_TIMEOUT_S, 0};
+  int one = 1;
+  int ret;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if ((ret = getaddrinfo(s->url.host, s->url.port, &hints, &res)) != 0) {
+    r_printf("Could not look up %s: %s\n", s->url.host, gai_strerror(ret));
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    c->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+
+    if (c->fd < 0) continue;
+
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+
+    int err = errno;
+
+    close(c->fd);
+    c->fd = -1;
+    errno = err;
+  }
+
+  freeaddrinfo(res);
+
+  if (c->fd < 0) return -1;
+
+  c->pos = c->len = 0;
+
+  if (!s->url.tls) return 0;
+
+  SSL_CTX *ctx = tls_context(s);
+
+  if (ctx == NULL || (c->ssl = SSL_new(ctx)) == NULL) {
+    conn_close(c);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  SSL_set_fd(c->ssl, c->fd);
+  SSL_set_tlsext_host_name(c->ssl, s->url.host);
+  SSL_set1_host(c->ssl, s->url.host);
+
+  if (SSL_connect(c->ssl) != 1) {
+    long verified = SSL_get_verify_result(c->ssl);
+
+    r_printf("TLS with %s failed: %s\n", s->url.host,
+             verified != X509_V_OK ? X509_verify_cert_error_string(verified)
+                                   : ERR_reason_error_string(ERR_get_error()));
+    ERR_clear_error();
+    conn_close(c);
+    errno = EPROTO;
+    return -1;
+  }
+
+  return 0;
+}
+
+static ssize_t conn_recv(http_conn_t *c, void *buf, size_t len) {
+  if (c->ssl != NULL) {
+    int ret = SSL_read(c->ssl, buf, len > INT32_MAX ? INT32_MAX : (int)len);
+
+    if (ret > 0) return ret;
+
+    int err = SSL_get_error(c->ssl, ret);
+
+    ERR_clear_error();
+
+    if (err == SSL_ERROR_ZERO_RETURN) return 0;
+    if (err != SSL_ERROR_SYSCALL || errno == 0) errno = EIO;
+
+    return -1;
+  }
+
+  ssize_t ret;
+
+  do {
+    ret = recv(c->fd, buf, len, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+static int conn_send(http_conn_t *c, const char *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t ret;
+
+    if (c->ssl != NULL) {
+      ret = SSL_write(c->ssl, buf + done, len - done);
+
+      if (ret <= 0) {
+        ERR_clear_error();
+        errno = EIO;
+        return -1;
+      }
+    } else if ((ret = send(c->fd, buf + done, len - done, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    done += ret;
+  }
+
+  return 0;
+}
+
+/* The body, whatever of it came in with the head first */
+
+static int conn_read_full(http_conn_t *c, void *buf, size_t len) {
+  uint8_t *out = (uint8_t *)buf;
+  size_t done = 0;
+
+  if (c->pos < c->len) {
+    done = c->len - c->pos < len ? c->len - c->pos : len;
+    memcpy(out, c->buf + c->pos, done);
+    c->pos += done;
+  }
+
+  while (done < len) {
+    ssize_t ret = conn_recv(c, out + done, len - done);
+
+    if (ret <= 0) {
+      if (ret == 0) errno = ECONNRESET;
+      return -1;
+    }
+
+    done += ret;
+  }
+
+  return 0;
+}
+
+/* Reads up to the end of the head, which is left in head.
+   What came after it stays in the buffer for the body. */
+
+static int read_head(http_conn_t *c, char *head, size_t size) {
+  memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+  c->len -= c->pos;
+  c->pos = 0;
+
+  for (;;) {
+    char *end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+
+    if (end != NULL) {
+      size_t len = end + 4 - c->buf;
+
+      if (len >= size) break;
+
+      memcpy(head, c->buf, len);
+      head[len] = 0x00;
+      c->pos = len;
+
+      return 0;
+    }
+
+    if (c->len >= HTTP_HEAD_MAX) break;
+
+    ssize_t ret = conn_recv(c, c->buf + c->len, HTTP_HEAD_MAX - c->len);
+
+    if (ret <= 0) {
+      if (ret == 0) errno = ECONNRESET;
+      return -1;
+    }
+
+    c->len += ret;
+  }
+
+  errno = EPROTO;
+  return -1;
+}
+
+static void copy_value(char *out, size_t size, const char *value, size_t len) {
+  snprintf(out, size, "%.*s", (int)(len < size ? len : size - 1), value);
+}
+
+static int parse_head(const char *head, http_response_t *r) {
+  int minor;
+
+  memset(r, 0, sizeof(*r));
+  r->length = -1;
+
+  if (sscanf(head, "HTTP/1.%d %d", &minor, &r->status) != 2) {
+    errno = EPROTO;
+    return -1;
+  }
+
+  r->close = minor == 0;
+
+  for (const char *line = strstr(head, "\r\n"); line != NULL;
+       line = strstr(line, "\r\n")) {
+    line += 2;
+
+    const char *colon = strchr(line, ':');
+    const char *eol = strstr(line, "\r\n");
+
+    if (colon == NULL || eol == NULL || colon > eol) continue;
+
+    size_t name = colon - line;
+    const char *value = colon + 1;
+
+    while (*value == ' ' || *value == '\t') value++;
+
+    size_t len = eol - value;
+
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) len--;
+
+    if (name == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+      r->length = strtoll(value, NULL, 10);
+    } else if (name == 13 && strncasecmp(line, "Content-Range", 13) == 0) {
+      unsigned long long start, end, total;
+
+      if (sscanf(value, "bytes %llu-%llu/%llu", &start, &end, &total) == 3) {
+        r->has_range = 1;
+        r->range_start = start;
+        r->range_end = end;
+        r->range_total = total;
+      }
+    } else if (name == 4 && strncasecmp(line, "ETag", 4) == 0) {
+      copy_value(r->etag, sizeof(r->etag), value, len);
+    } else if (name == 13 && strncasecmp(line, "Last-Modified", 13) == 0) {
+      copy_value(r->modified, sizeof(r->modified), value, len);
+    } else if (name == 8 && strncasecmp(line, "Location", 8) == 0) {
+      copy_value(r->location, sizeof(r->location), value, len);
+    } else if (name == 10 && strncasecmp(line, "Connection", 10) == 0) {
+      r->close = len == 5 && strncasecmp(value, "close", 5) == 0;
+    } else if (name == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+      r->chunked = len >= 7 && strncasecmp(value + len - 7, "chunked", 7) == 0;
+    }
+  }
+
+  return 0;
+}
+
+/* A weak ETag can not be asked for in If-Range, the date
+   can */
+
+static const char *if_range(const http_source_t *s) {
+  if (s->etag[0] && strncmp(s->etag, "W/", 2) != 0) return s->etag;
+  if (s->modified[0]) return s->modified;
+
+  return NULL;
+}
+
+static int send_get(http_source_t *s, http_conn_t *c, int ranged,
+                    uint64_t start, uint64_t end, int check) {
+  char request[HTTP_URL_MAX + 1024];
+  const char *version = check ? if_range(s) : NULL;
+  int bracket = strchr(s->url.host, ':') != NULL;
+  int port = strcmp(s->url.port, s->url.tls ? "443" : "80") != 0;
+  int len = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\n"
+                     "Host: %s%s%s%s%s\r\n"
+                     "User-Agent: rufusl\r\n"
+                     "Accept-Encoding: identity\r\n",
+                     s->url.path, bracket ? "[" : "", s->url.host,
+                     bracket ? "]" : "", port ? ":" : "", port ? s->url.port : "");
+
+  if (ranged) {
+    len += snprintf(request + len, sizeof(request) - len,
+                    "Range: bytes=%llu-%llu\r\n", (unsigned long long)start,
+                    (unsigned long long)end);
+  }
+
+  if (version != NULL) {
+    len += snprintf(request + len, sizeof(request) - len, "If-Range: %s\r\n",
+                    version);
+  }
+
+  len += snprintf(request + len, sizeof(request) - len, "\r\n");
+
+  if ((size_t)len >= sizeof(request)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return conn_send(c, request, len);
+}
+
+/* Sends the request on a connection that is kept between
+   requests, which the server may have dropped in the meantime,
+   and reads the head of the answer */
+
+static int exchange(http_source_t *s, http_conn_t *c, int ranged, uint64_t start,
+                    uint64_t end, int check, http_response_t *r) {
+  char head[HTTP_HEAD_MAX];
+  int reused = c->fd >= 0;
+
+  for (;;) {
+    if (c->fd < 0 && conn_open(s, c) < 0) return -1;
+
+    if (send_get(s, c, ranged, start, end, check) == 0 &&
+        read_head(c, head, sizeof(head)) == 0)
+      return parse_head(head, r);
+
+    conn_close(c);
+
+    if (!reused) return -1;
+
+    reused = 0;
+  }
+}
+
+/* One range into buf. Errors on the way get a few more
+   tries, an answer for another range or version does not. */
+
+static int fetch_range(http_source_t *s, http_conn_t *c, void *buf,
+                       uint64_t offset, uint64_t len) {
+  http_response_t r;
+
+  for (int attempt = 0; attempt < HTTP_RETRIES; attempt++) {
+    if (attempt > 0) {
+      r_log(LOG_LEVEL_VERBOSE, "Retrying the range at %llu\n",
+            (unsigned long long)offset);
+      sleep(attempt);
+    }
+
+    if (exchange(s, c, 1, offset, offset + len - 1, 1, &r) < 0) continue;
+
+    if (r.status == 206 && r.has_range && r.range_start == offset &&
+        r.range_end == offset + len - 1 && r.range_total == s->size &&
+        (r.length < 0 || (uint64_t)r.length == len) && !r.chunked) {
+      if (conn_read_full(c, buf, len) < 0) {
+        conn_close(c);
+        continue;
+      }
+
+      if (r.close) conn_close(c);
+
+      return 0;
+    }
+
+    conn_close(c);
+
+    if (r.status == 200 || r.status == 206) {
+      r_printf("The image changed on the server while it was read, or the "
+               "server sent the wrong range\n");
+      errno = ESTALE;
+      return -1;
+    }
+
+    if (r.status < 500 && r.status != 429) {
+      r_printf("Server answered %d for the range at %llu\n", r.status,
+               (unsigned long long)offset);
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  r_printf("Could not fetch the range at %llu: %s\n", (unsigned long long)offset,
+           strerror(errno));
+
+  return -1;
+}
+
+/* ---- Sources ---- */
+
+static void source_free(http_source_t *s);
+
+/* The first byte tells the size, whether ranges work and
+   which version is there, and the redirects end up in url */
+
+static int probe(http_source_t *s, const char *url) {
+  http_response_t r;
+  char next[HTTP_URL_MAX];
+
+  snprintf(next, sizeof(next), "%s", url);
+
+  for (int hops = 0; hops <= HTTP_REDIRECTS_MAX; hops++) {
+    if (parse_url(next, &s->url) < 0) {
+      r_printf("Not a URL rufusl can read: %s\n", next);
+      return -1;
+    }
+
+    snprintf(s->location, sizeof(s->location), "%s", next);
+    conn_close(s->reader);
+
+    if (exchange(s, s->reader, 1, 0, 0, 0, &r) < 0) {
+      r_printf("Could not reach %s: %s\n", s->location, strerror(errno));
+      return -1;
+    }
+
+    if (r.status >= 300 && r.status < 400 && r.location[0]) {
+      if (resolve(&s->url, r.location, next, sizeof(next)) < 0) break;
+
+      r_log(LOG_LEVEL_VERBOSE, "%d, going on to %s\n", r.status, next);
+      continue;
+    }
+
+    snprintf(s->etag, sizeof(s->etag), "%s", r.etag);
+    snprintf(s->modified, sizeof(s->modified), "%s", r.modified);
+
+    if (r.status == 206 && r.has_range && r.range_start == 0) {
+      char byte;
+
+      s->size = r.range_total;
+      s->ranges = 1;
+
+      if (!r.chunked && r.length == 1 && conn_read_full(s->reader, &byte, 1) == 0 &&
+          !r.close)
+        return 0;
+
+      conn_close(s->reader);
+      return 0;
+    }
+
+    conn_close(s->reader);
+
+    /* Without ranges the whole body is there, which only
+       tells the size */
+
+    if (r.status == 200 && r.length >= 0 && !r.chunked) {
+      s->size = r.length;
+      s->ranges = 0;
+      return 0;
+    }
+
+    if (r.status == 416) {
+      s->size = 0;
+      s->ranges = 1;
+      return 0;
+    }
+
+    r_printf("Server answered %d for %s\n", r.status, s->location);
+    return -1;
+  }
+
+  r_printf("Too many redirects for %s\n", url);
+  return -1;
+}
+
+http_source_t *http_open(const char *url) {
+  http_source_t *s = (http_source_t *)calloc(1, sizeof(http_source_t));
+
+  if (s == NULL) return NULL;
+
+  pthread_mutex_init(&s->read_lock, NULL);
+
+  if ((s->reader = conn_new()) == NULL || probe(s, url) < 0) {
+    source_free(s);
+    return NULL;
+  }
+
+  r_log(LOG_LEVEL_VERBOSE, "%s: %llu bytes%s%s%s\n", s->location,
+        (unsigned long long)s->size, s->ranges ? "" : ", no range requests",
+        s->etag[0] ? ", ETag " : "", s->etag);
+
+  return s;
+}
+
+uint64_t http_size(const http_source_t *s) { return s->size; }
+
+const char *http_url(const http_source_t *s) { return s->location; }
+
+const char *http_etag(const http_source_t *s) { return s->etag; }
+
+const char *http_modified(const http_source_t *s) { return s->modified; }
+
+int http_stat(const char *url, uint64_t *size, struct timespec *stamp) {
+  http_source_t *s = http_open(url);
+  struct tm tm;
+
+  if (s == NULL) return -1;
+
+  memset(&tm, 0, sizeof(tm));
+
+  *size = s->size;
+  stamp->tv_sec = s->modified[0] &&
+                          strptime(s->modified, "%a, %d %b %Y %H:%M:%S", &tm) != NULL
+                      ? timegm(&tm)
+                      : 0;
+  stamp->tv_nsec = crc32c(0, s->etag, strlen(s->etag)) % 1000000000;
+
+  http_close(s);
+
+  return 0;
+}
+
+/* ---- Random reads ---- */
+
+static http_block_t *read_block(http_source_t *s, uint64_t base) {
+  http_block_t *b = NULL;
+
+  for (int i = 0; i < HTTP_READ_BLOCKS; i++) {
+    http_block_t *at = &s->blocks[i];
+
+    if (at->buf != NULL && at->offset == base && at->len > 0) {
+      at->used = ++s->reads;
+      return at;
+    }
+
+    if (b == NULL || at->used < b->used) b = at;
+  }
+
+  if (b->buf == NULL && (b->buf = (uint8_t *)malloc(HTTP_READ_BLOCK)) == NULL)
+    return NULL;
+
+  uint64_t len = s->size - base < HTTP_READ_BLOCK ? s->size - base : HTTP_READ_BLOCK;
+
+  b->len = 0;
+
+  if (fetch_range(s, s->reader, b->buf, base, len) < 0) return NULL;
+
+  b->offset = base;
+  b->len = len;
+  b->used = ++s->reads;
+
+  return b;
+}
+
+int http_read(void *ctx, void *buf, size_t len, uint64_t offset) {
+  http_source_t *s = (http_source_t *)ctx;
+  uint8_t *out = (uint8_t *)buf;
+  int ret = 0;
+
+  if (!s->ranges) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  pthread_mutex_lock(&s->read_lock);
+
+  while (len > 0) {
+    if (offset >= s->size) {
+      errno = EIO;
+      ret = -1;
+      break;
+    }
+
+    uint64_t base = offset - offset % HTTP_READ_BLOCK;
+    http_block_t *b = read_block(s, base);
+
+    if (b == NULL) {
+      ret = -1;
+      break;
+    }
+
+    size_t n = b->len - (offset - base) < len ? b->len - (offset - base) : len;
+
+    memcpy(out, b->buf + (offset - base), n);
+    out += n;
+    offset += n;
+    len -= n;
+  }
+
+  pthread_mutex_unlock(&s->read_lock);
+
+  return ret;
+}
+
+/* ---- Streams ---- */
+
+/* Without ranges the one connection reads the body front to
+   back, one chunk after the other, and can not try again */
+
+static int fetch_next(http_source_t *s, http_conn_t *c, void *buf,
+                      const http_chunk_t *chunk) {
+  http_response_t r;
+
+  if (chunk->offset == 0) {
+    if (exchange(s, c, 0, 0, 0, 0, &r) < 0) return -1;
+
+    if (r.status != 200 || r.chunked || (uint64_t)r.length != s->size) {
+      r_printf("Server answered %d for %s\n", r.status, s->location);
+      conn_close(c);
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  if (conn_read_full(c, buf, chunk->len) < 0) {
+    r_printf("Download of %s broke off at %llu: %s\n", s->location,
+             (unsigned long long)chunk->offset, strerror(errno));
+    conn_close(c);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void *stream_worker(void *arg) {
+  http_source_t *s = ((http_worker_t *)arg)->source;
+  http_stream_t *st = s->stream;
+  http_conn_t *c = ((http_worker_t *)arg)->conn;
+
+  for (;;) {
+    pthread_mutex_lock(&st->lock);
+
+    while (!st->stop && !st->failed && st->next_fetch < st->count &&
+           st->next_fetch >= st->next_read + HTTP_WINDOW)
+      pthread_cond_wait(&st->cond, &st->lock);
+
+    if (st->stop || st->failed || st->next_fetch >= st->count) {
+      pthread_mutex_unlock(&st->lock);
+      break;
+    }
+
+    uint64_t seq = st->next_fetch++;
+
+    pthread_mutex_unlock(&st->lock);
+
+    const http_chunk_t *chunk = &st->chunks[seq];
+    uint8_t *buf = st->slots[seq % HTTP_WINDOW];
+
+    TRACE_NOW(traced);
+
+    int ret = s->ranges ? fetch_range(s, c, buf, chunk->offset, chunk->len)
+                        : fetch_next(s, c, buf, chunk);
+
+    TRACE_SPAN(TRACE_READ, "http range", traced);
+
+    pthread_mutex_lock(&st->lock);
+
+    if (ret < 0) {
+      st->failed = 1;
+    } else {
+      st->ready[seq % HTTP_WINDOW] = 1;
+    }
+
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+  }
+
+  conn_close(c);
+
+  return NULL;
+}
+
+static void stream_free(http_stream_t *st) {
+  if (st == NULL) return;
+
+  pthread_mutex_lock(&st->lock);
+  st->stop = 1;
+  pthread_cond_broadcast(&st->cond);
+  pthread_mutex_unlock(&st->lock);
+
+  for (int i = 0; i < st->started; i++) pthread_join(st->workers[i].thread, NULL);
+  for (int i = 0; i < HTTP_CONNECTIONS; i++) {
+    if (st->workers[i].conn != NULL) conn_free(st->workers[i].conn);
+  }
+  for (int i = 0; i < HTTP_WINDOW; i++) free(st->slots[i]);
+
+  pthread_mutex_destroy(&st->lock);
+  pthread_cond_destroy(&st->cond);
+  free(st->chunks);
+  free(st);
+}
+
+int http_stream_start(http_source_t *s, const http_extent_t *extents,
+                      uint32_t count) {
+  http_extent_t whole = {0, s->size};
+  http_stream_t *st = (http_stream_t *)calloc(1, sizeof(http_stream_t));
+
+  if (st == NULL) return -1;
+
+  if (extents == NULL) {
+    extents = &whole;
+    count = 1;
+  } else if (!s->ranges) {
+    r_printf("%s can only be read front to back, the server does not do "
+             "range requests\n", s->location);
+    free(st);
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+
+  stream_free(s->stream);
+  s->stream = st;
+
+  pthread_mutex_init(&st->lock, NULL);
+  pthread_cond_init(&st->cond, NULL);
+
+  for (uint32_t i = 0; i < count; i++) {
+    st->count += (extents[i].len + HTTP_CHUNK_SIZE - 1) / HTTP_CHUNK_SIZE;
+  }
+
+  if ((st->chunks = (http_chunk_t *)malloc((st->count + 1) * sizeof(http_chunk_t))) == NULL)
+    return -1;
+
+  uint64_t n = 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    for (uint64_t off = 0; off < extents[i].len; off += HTTP_CHUNK_SIZE) {
+      uint64_t len = extents[i].len - off;
+
+      st->chunks[n].offset = extents[i].offset + off;
+      st->chunks[n].len = len < HTTP_CHUNK_SIZE ? len : HTTP_CHUNK_SIZE;
+      st->total += st->chunks[n].len;
+      n++;
+    }
+  }
+
+  int threads = s->ranges ? HTTP_CONNECTIONS : 1;
+
+  if (!s->ranges) {
+    r_printf("%s does not do range requests, reading it on one connection\n",
+             s->location);
+  }
+
+  for (int i = 0; i < HTTP_WINDOW; i++) {
+    if ((st->slots[i] = (uint8_t *)malloc(HTTP_CHUNK_SIZE)) == NULL) return -1;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    st->workers[i].source = s;
+
+    if ((st->workers[i].conn = conn_new()) == NULL) return -1;
+  }
+
+  /* The connection of the probe is taken over, it saves a
+     handshake */
+
+  if (s->ranges && s->reader->fd >= 0) {
+    http_conn_t *probed = s->reader;
+
+    s->reader = st->workers[0].conn;
+    st->workers[0].conn = probed;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&st->workers[i].thread, NULL, stream_worker,
+                       &st->workers[i]) != 0)
+      break;
+
+    st->started++;
+  }
+
+  if (st->started == 0) return -1;
+
+  return 0;
+}
+
+ssize_t http_stream_read(http_source_t *s, void *buf, size_t len,
+                         uint64_t *offset) {
+  http_stream_t *st = s->stream;
+  uint8_t *out = (uint8_t *)buf;
+  size_t done = 0;
+
+  while (done < len && st->next_read < st->count) {
+    const http_chunk_t *chunk = &st->chunks[st->next_read];
+    int slot = st->next_read % HTTP_WINDOW;
+
+    /* Only what is in one piece goes out at once */
+
+    if (done > 0 && chunk->offset + st->read_pos != *offset + done) break;
+
+    pthread_mutex_lock(&st->lock);
+
+    while (!st->failed && !st->ready[slot]) pthread_cond_wait(&st->cond, &st->lock);
+
+    int failed = st->failed && !st->ready[slot];
+
+    pthread_mutex_unlock(&st->lock);
+
+    if (failed) return -1;
+
+    if (done == 0) *offset = chunk->offset + st->read_pos;
+
+    size_t n = chunk->len - st->read_pos < len - done ? chunk->len - st->read_pos
+                                                       : len - done;
+
+    memcpy(out + done, st->slots[slot] + st->read_pos, n);
+    done += n;
+    st->read_pos += n;
+    st->done += n;
+
+    if (st->read_pos == chunk->len) {
+      pthread_mutex_lock(&st->lock);
+      st->ready[slot] = 0;
+      st->next_read++;
+      st->read_pos = 0;
+      pthread_cond_broadcast(&st->cond);
+      pthread_mutex_unlock(&st->lock);
+    }
+  }
+
+  return done;
+}
+
+uint64_t http_stream_done(const http_source_t *s) {
+  return s->stream != NULL ? s->stream->done : 0;
+}
+
+uint64_t http_stream_total(const http_source_t *s) {
+  return s->stream != NULL ? s->stream->total : 0;
+}
+
+static void source_free(http_source_t *s) {
+  stream_free(s->stream);
+
+  if (s->reader != NULL) conn_free(s->reader);
+
+  for (int i = 0; i < HTTP_READ_BLOCKS; i++) free(s->blocks[i].buf);
+
+  if (s->tls != NULL) SSL_CTX_free(s->tls);
+
+  pthread_mutex_destroy(&s->read_lock);
+  free(s);
+}
+
+void http_close(http_source_t *s) {
+  if (s != NULL) source_free(s);
+}
+
+/* ---- Staging a copy ---- */
+
+static int extent_cmp(const void *a, const void *b) {
+  const http_extent_t *x = (const http_extent_t *)a;
+  const http_extent_t *y = (const http_extent_t *)b;
+
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* The files' data, sorted and with the small gaps closed */
+
+static uint32_t list_extents(const copy_list_t *list, uint64_t size,
+                             http_extent_t *out) {
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < list->count; i++) {
+    const copy_entry_t *e = &list->entries[i];
+
+    if (e->is_dir || e->size == 0 || e->offset >= size) continue;
+
+    out[count].offset = e->offset;
+    out[count].len = e->size < size - e->offset ? e->size : size - e->offset;
+    count++;
+  }
+
+  qsort(out, count, sizeof(http_extent_t), extent_cmp);
+
+  uint32_t merged = 0;
+
+  for (uint32_t i = 0; i < count; i++) {
+    http_extent_t *last = merged > 0 ? &out[merged - 1] : NULL;
+
+    if (last != NULL && out[i].offset <= last->offset + last->len + HTTP_MERGE_GAP) {
+      uint64_t end = out[i].offset + out[i].len;
+
+      if (end > last->offset + last->len) last->len = end - last->offset;
+    } else {
+      out[merged++] = out[i];
+    }
+  }
+
+  return merged;
+}
+
+static int scratch_file(void) {
+  char path[] = HTTP_SCRATCH_DIR "/rufusl-XXXXXX";
+  int fd = open(HTTP_SCRATCH_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+  if (fd >= 0) return fd;
+
+  if ((fd = mkstemp(path)) >= 0) unlink(path);
+
+  return fd;
+}
+
+int http_stage(const char *url, const copy_list_t *list) {
+  http_source_t *s = http_open(url);
+  http_extent_t *extents;
+  uint8_t *buf = NULL;
+  uint64_t offset;
+  ssize_t len;
+  int fd = -1;
+
+  if (s == NULL) return -1;
+
+  extents = (http_extent_t *)malloc((list->count + 1) * sizeof(http_extent_t));
+
+  if (extents == NULL) {
+    http_close(s);
+    return -1;
+  }
+
+  uint32_t count = list_extents(list, s->size, extents);
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if ((fd = scratch_file()) < 0 || ftruncate(fd, s->size) < 0) {
+    r_printf("No room for the image under %s: %s\n", HTTP_SCRATCH_DIR,
+             strerror(errno));
+    goto fail;
+  }
+
+  if ((buf = (uint8_t *)malloc(HTTP_CHUNK_SIZE)) == NULL ||
+      http_stream_start(s, extents, count) < 0)
+    goto fail;
+
+  r_printf("Fetching %llu of %llu bytes of %s in %u ranges\n",
+           (unsigned long long)http_stream_total(s), (unsigned long long)s->size,
+           s->location, count);
+
+  while ((len = http_stream_read(s, buf, HTTP_CHUNK_SIZE, &offset)) > 0) {
+    if (pwrite(fd, buf, len, offset) != len) {
+      r_printf("Writing the fetched image failed: %s\n", strerror(errno));
+      goto fail;
+    }
+  }
+
+  if (len < 0) goto fail;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  r_printf("Fetched the image in %.1lf s (%.1lf MB/s)\n", seconds,
+           seconds > 0 ? http_stream_done(s) / seconds / 1e6 : 0.0);
+
+  free(buf);
+  free(extents);
+  http_close(s);
+
+  return fd;
+
+fail:
+  if (fd >= 0) close(fd);
+  free(buf);
+  free(extents);
+  http_close(s);
+
+  return -1;
+}
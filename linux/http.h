@@ -0,0 +1,111 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "copy.h"
+
+#define HTTP_URL_MAX 2048
+#define HTTP_HEAD_MAX 16384
+#define HTTP_BUF_SIZE (64 << 10)
+#define HTTP_REDIRECTS_MAX 5
+#define HTTP_RETRIES 3
+#define HTTP_TIMEOUT_S 30
+
+/* Streams fetch HTTP_CHUNK_SIZE ranges on HTTP_CONNECTIONS
+   connections at a time and hand them on in order. Chunks
+   that came in early wait in a window of HTTP_WINDOW of them,
+   so a slow range holds up the fetches after it instead of
+   memory growing. */
+
+#define HTTP_CHUNK_SIZE (4 << 20)
+#define HTTP_CONNECTIONS 4
+#define HTTP_WINDOW 16
+
+/* Random reads, the ISO reader's, go through a few blocks of
+   HTTP_READ_BLOCK kept from the last requests */
+
+#define HTTP_READ_BLOCK (256 << 10)
+#define HTTP_READ_BLOCKS 16
+
+/* Files less than this apart in the image are fetched as one
+   range, the gap costs less than another request */
+
+#define HTTP_MERGE_GAP (256 << 10)
+
+#define HTTP_SCRATCH_DIR "/var/tmp"
+
+/* Images straight off an http:// or https:// URL, so a DD
+   write can start while the image is still downloading and an
+   ISO does not have to be on disk first. Redirects are followed
+   once, when the URL is opened, and every range asks for the
+   version seen then (If-Range), so an image replaced on the
+   server half way through fails the job instead of mixing the
+   two. https checks the server against the system's CAs, or
+   the ones in SSL_CERT_FILE. */
+
+typedef struct http_source http_source_t;
+
+typedef struct http_extent {
+  uint64_t offset;
+  uint64_t len;
+} http_extent_t;
+
+int http_is_url(const char *path);
+
+http_source_t *http_open(const char *url);
+void http_close(http_source_t *s);
+
+uint64_t http_size(const http_source_t *s);
+const char *http_url(const http_source_t *s);
+
+/* What the server says the version of the image is, either
+   may be empty */
+
+const char *http_etag(const http_source_t *s);
+const char *http_modified(const http_source_t *s);
+
+/* The size and a stamp for the version on the server, for
+   telling whether a scan is still current like stat() does for
+   a file. The stamp is Last-Modified with the ETag's CRC in
+   tv_nsec, so a change in either is noticed. */
+
+int http_stat(const char *url, uint64_t *size, struct timespec *stamp);
+
+/* Reads len bytes at offset into buf, returns 0 only if all
+   of them could be read. Has the shape of isofs_read_t, with
+   the source as ctx. */
+
+int http_read(void *ctx, void *buf, size_t len, uint64_t offset);
+
+/* Starts fetching the extents, which have to be in order and
+   apart. NULL extents is the whole image, which also works
+   with a server that does not do ranges. */
+
+int http_stream_start(http_source_t *s, const http_extent_t *extents,
+                      uint32_t count);
+
+/* The next bytes of the stream into buf, as many as are in
+   one piece up to len, with offset set to where they are in
+   the image. Returns 0 at the end and -1 when a range could
+   not be fetched. */
+
+ssize_t http_stream_read(http_source_t *s, void *buf, size_t len,
+                         uint64_t *offset);
+
+/* Bytes handed out so far and bytes in the stream */
+
+uint64_t http_stream_done(const http_source_t *s);
+uint64_t http_stream_total(const http_source_t *s);
+
+/* For a copy straight from the image without the image on
+   disk: only the data of the files in list is fetched, into a
+   sparse file of its own that is gone once the returned fd is
+   closed. The list has to come from the image. */
+
+int http_stage(const char *url, const copy_list_t *list);
+
+#endif // HTTP_H
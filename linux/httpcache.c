@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "../log.h"
+#include "httpcache.h"
+#include "verify.h"
+
+struct httpcache {
+  int fd;
+  int failed;
+  char ref[PATH_MAX];
+  char etag[128];
+  char modified[64];
+  uint64_t size;
+  uint64_t written;
+  uint32_t crc32c;
+  uLong crc32;
+};
+
+typedef struct httpcache_lru {
+  char name[HTTPCACHE_NAME_SIZE];
+  struct timespec used;
+  uint64_t bytes;
+} httpcache_lru_t;
+
+static void ref_path(const char *url, char *path) {
+  size_t len = strlen(url);
+
+  snprintf(path, PATH_MAX, HTTPCACHE_DIR "/url-%08x%08x.ref",
+           crc32c(0, url, len), (uint32_t)crc32(0L, (const Bytef *)url, len));
+}
+
+static int make_dirs(void) {
+  if ((mkdir(FATCACHE_DIR, 0700) < 0 && errno != EEXIST) ||
+      (mkdir(HTTPCACHE_DIR, 0700) < 0 && errno != EEXIST)) {
+    r_printf("Download cache unavailable, creating %s failed: %s\n",
+             HTTPCACHE_DIR, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Whatever the server says about its version has to match
+   what the .ref has */
+
+static int versioned(const http_source_t *s) {
+  return http_etag(s)[0] || http_modified(s)[0];
+}
+
+static void chomp(char *line) { line[strcspn(line, "\r\n")] = 0x00; }
+
+static int load_ref(const char *path, char *name, uint64_t *size, char *etag,
+                    size_t etag_size, char *modified, size_t modified_size) {
+  char line[256];
+  FILE *f = fopen(path, "r");
+  int ret = -1;
+
+  if (f == NULL) return -1;
+
+  if (fgets(line, sizeof(line), f) != NULL) {
+    chomp(line);
+    snprintf(name, HTTPCACHE_NAME_SIZE, "%s", line);
+
+    if (fgets(line, sizeof(line), f) != NULL) {
+      *size = strtoull(line, NULL, 10);
+
+      if (fgets(etag, etag_size, f) != NULL &&
+          fgets(modified, modified_size, f) != NULL) {
+        chomp(etag);
+        chomp(modified);
+        ret = 0;
+      }
+    }
+  }
+
+  fclose(f);
+
+  return ret;
+}
+
+static int save_ref(const char *path, const char *name, uint64_t size,
+                    const char *etag, const char *modified) {
+  char tmp[PATH_MAX + 8];
+  FILE *f;
+
+  snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+  if ((f = fopen(tmp, "w")) == NULL) return -1;
+
+  fprintf(f, "%s\n%llu\n%s\n%s\n", name, (unsigned long long)size, etag,
+          modified);
+
+  if (fclose(f) != 0 || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ---- Eviction ---- */
+
+static int lru_cmp(const void *a, const void *b) {
+  const httpcache_lru_t *x = (const httpcache_lru_t *)a;
+  const httpcache_lru_t *y = (const httpcache_lru_t *)b;
+
+  if (x->used.tv_sec != y->used.tv_sec)
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+
+  return x->used.tv_nsec < y->used.tv_nsec ? -1 : x->used.tv_nsec > y->used.tv_nsec;
+}
+
+static int is_entry(const char *name) {
+  size_t len = strlen(name);
+
+  return len > 4 && len < HTTPCACHE_NAME_SIZE && strcmp(name + len - 4, ".img") == 0;
+}
+
+/* Entries that got used are touched, so the mtime says when
+   they were last. The .refs of the ones that go are left, they
+   are misses from then on. */
+
+static void evict(const char *keep) {
+  httpcache_lru_t *lru = NULL;
+  uint32_t count = 0, capacity = 0;
+  uint64_t total = 0;
+  DIR *dir = opendir(HTTPCACHE_DIR);
+  struct dirent *ent;
+
+  if (dir == NULL) return;
+
+  while ((ent = readdir(dir)) != NULL) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!is_entry(ent->d_name)) continue;
+
+    snprintf(path, sizeof(path), HTTPCACHE_DIR "/%s", ent->d_name);
+    if (stat(path, &st) < 0) continue;
+
+    if (count == capacity) {
+      uint32_t grown = capacity ? capacity * 2 : 16;
+      httpcache_lru_t *more =
+          (httpcache_lru_t *)realloc(lru, grown * sizeof(httpcache_lru_t));
+
+      if (more == NULL) break;
+
+      lru = more;
+      capacity = grown;
+    }
+
+    snprintf(lru[count].name, sizeof(lru[count].name), "%s", ent->d_name);
+    lru[count].used = st.st_mtim;
+    lru[count].bytes = (uint64_t)st.st_blocks * 512;
+    total += lru[count].bytes;
+    count++;
+  }
+
+  closedir(dir);
+
+  if (lru != NULL) qsort(lru, count, sizeof(httpcache_lru_t), lru_cmp);
+
+  uint32_t left = count;
+
+  for (uint32_t i = 0;
+       i < count && (left > HTTPCACHE_MAX_ENTRIES || total > HTTPCACHE_MAX_BYTES);
+       i++) {
+    char path[PATH_MAX];
+
+    if (keep != NULL && strcmp(lru[i].name, keep) == 0) continue;
+
+    r_printf("Evicting cached download %s (%llu MiB)\n", lru[i].name,
+             (unsigned long long)(lru[i].bytes >> 20));
+
+    snprintf(path, sizeof(path), HTTPCACHE_DIR "/%s", lru[i].name);
+    unlink(path);
+    total -= lru[i].bytes;
+    left--;
+  }
+
+  free(lru);
+}
+
+/* ---- Entries ---- */
+
+int httpcache_find(const char *url, const http_source_t *s, char *path,
+                   size_t size) {
+  char ref[PATH_MAX];
+  char name[HTTPCACHE_NAME_SIZE];
+  char etag[128], modified[64];
+  uint64_t entry_size;
+  struct stat st;
+
+  if (!versioned(s)) {
+    r_printf("%s says nothing about its version, not caching it\n", http_url(s));
+    return -1;
+  }
+
+  ref_path(url, ref);
+
+  if (load_ref(ref, name, &entry_size, etag, sizeof(etag), modified,
+               sizeof(modified)) < 0)
+    return 0;
+
+  if (entry_size != http_size(s) || strcmp(etag, http_etag(s)) != 0 ||
+      strcmp(modified, http_modified(s)) != 0) {
+    r_printf("The image changed on the server since it was cached\n");
+    unlink(ref);
+    return 0;
+  }
+
+  snprintf(path, size, HTTPCACHE_DIR "/%s", name);
+
+  if (stat(path, &st) < 0 || (uint64_t)st.st_size != entry_size) {
+    unlink(ref);
+    return 0;
+  }
+
+  utimensat(AT_FDCWD, path, NULL, 0);
+
+  r_printf("Using the cached download %s\n", name);
+
+  return 1;
+}
+
+httpcache_t *httpcache_begin(const char *url, const http_source_t *s) {
+  struct statvfs vfs;
+  httpcache_t *c;
+
+  if (!versioned(s)) {
+    r_printf("%s says nothing about its version, not caching it\n", http_url(s));
+    return NULL;
+  }
+
+  if (make_dirs() < 0 || (c = (httpcache_t *)calloc(1, sizeof(httpcache_t))) == NULL)
+    return NULL;
+
+  /* Evicting only happens once there is a new entry, so the
+     room has to be there now */
+
+  if (statvfs(HTTPCACHE_DIR, &vfs) == 0 &&
+      (uint64_t)vfs.f_bavail * vfs.f_frsize < http_size(s)) {
+    r_printf("Not enough room in %s to keep the download\n", HTTPCACHE_DIR);
+    free(c);
+    return NULL;
+  }
+
+  /* Nameless until all of it is in, a broken download leaves
+     nothing behind */
+
+  if ((c->fd = open(HTTPCACHE_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0) {
+    r_printf("Download cache unavailable: %s\n", strerror(errno));
+    free(c);
+    return NULL;
+  }
+
+  ref_path(url, c->ref);
+  snprintf(c->etag, sizeof(c->etag), "%s", http_etag(s));
+  snprintf(c->modified, sizeof(c->modified), "%s", http_modified(s));
+  c->size = http_size(s);
+  c->crc32 = crc32(0L, Z_NULL, 0);
+
+  return c;
+}
+
+int httpcache_add(httpcache_t *c, const void *buf, size_t len) {
+  size_t done = 0;
+
+  if (c->failed) return -1;
+
+  while (done < len) {
+    ssize_t ret = pwrite(c->fd, (const char *)buf + done, len - done,
+                         c->written + done);
+
+    if (ret < 0 && errno == EINTR) continue;
+
+    if (ret <= 0) {
+      r_printf("Keeping the download failed: %s\n",
+               ret < 0 ? strerror(errno) : "short write");
+      c->failed = 1;
+      return -1;
+    }
+
+    done += ret;
+  }
+
+  c->crc32c = crc32c(c->crc32c, buf, len);
+  c->crc32 = crc32(c->crc32, (const Bytef *)buf, len);
+  c->written += len;
+
+  return 0;
+}
+
+int httpcache_commit(httpcache_t *c, char *path, size_t size) {
+  char name[HTTPCACHE_NAME_SIZE];
+  char entry[PATH_MAX];
+  char proc[64];
+  struct stat st;
+
+  if (c->failed || c->written != c->size || fdatasync(c->fd) < 0) {
+    httpcache_abort(c);
+    return -1;
+  }
+
+  snprintf(name, sizeof(name), "%llu-%08x-%08x.img", (unsigned long long)c->size,
+           c->crc32c, (uint32_t)c->crc32);
+  snprintf(entry, sizeof(entry), HTTPCACHE_DIR "/%s", name);
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", c->fd);
+
+  /* Already there under another URL, that one is kept */
+
+  if ((stat(entry, &st) < 0 || (uint64_t)st.st_size != c->size) &&
+      linkat(AT_FDCWD, proc, AT_FDCWD, entry, AT_SYMLINK_FOLLOW) < 0) {
+    r_printf("Could not keep the download as %s: %s\n", entry, strerror(errno));
+    httpcache_abort(c);
+    return -1;
+  }
+
+  if (save_ref(c->ref, name, c->size, c->etag, c->modified) < 0) {
+    r_log(LOG_LEVEL_VERBOSE, "Could not save %s: %s\n", c->ref, strerror(errno));
+  }
+
+  r_printf("Kept the download as %s\n", name);
+
+  close(c->fd);
+  free(c);
+
+  evict(name);
+
+  if (path != NULL) snprintf(path, size, "%s", entry);
+
+  return 0;
+}
+
+void httpcache_abort(httpcache_t *c) {
+  if (c == NULL) return;
+
+  close(c->fd);
+  free(c);
+}
+
+int httpcache_fetch(const char *url, char *path, size_t size) {
+  http_source_t *s = http_open(url);
+  httpcache_t *c = NULL;
+  uint8_t *buf = NULL;
+  uint64_t offset;
+  ssize_t len;
+  int ret;
+
+  if (s == NULL) return -1;
+
+  if ((ret = httpcache_find(url, s, path, size)) != 0) {
+    http_close(s);
+    return ret > 0 ? 0 : -1;
+  }
+
+  if ((c = httpcache_begin(url, s)) == NULL ||
+      (buf = (uint8_t *)malloc(HTTP_CHUNK_SIZE)) == NULL ||
+      http_stream_start(s, NULL, 0) < 0) {
+    httpcache_abort(c);
+    free(buf);
+    http_close(s);
+    return -1;
+  }
+
+  r_printf("Downloading %s (%llu bytes)\n", http_url(s),
+           (unsigned long long)http_size(s));
+
+  while ((len = http_stream_read(s, buf, HTTP_CHUNK_SIZE, &offset)) > 0) {
+    if (httpcache_add(c, buf, len) < 0) break;
+
+    progress_bytes(http_stream_done(s), http_size(s));
+
+    if (job_cancelled()) {
+      r_printf("Download cancelled\n");
+      break;
+    }
+  }
+
+  free(buf);
+  http_close(s);
+
+  if (len != 0) {
+    httpcache_abort(c);
+    return -1;
+  }
+
+  return httpcache_commit(c, path, size);
+}
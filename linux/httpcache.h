@@ -0,0 +1,54 @@
+#ifndef HTTPCACHE_H
+#define HTTPCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fatcache.h"
+#include "http.h"
+
+#define HTTPCACHE_DIR FATCACHE_DIR "/http"
+#define HTTPCACHE_MAX_BYTES (64ULL << 30)
+#define HTTPCACHE_MAX_ENTRIES 8
+#define HTTPCACHE_NAME_SIZE 48
+
+/* Downloaded images, kept so that the next job with the same
+   URL reads them from disk. An entry goes by what is in it, its
+   size and the same two CRCs the image cache takes of an ISO,
+   as <size>-<crc32c>-<crc32>.img in HTTPCACHE_DIR, so two URLs
+   of one image share it. Next to the entries, a .ref per URL
+   says which entry the URL had and under which ETag and
+   Last-Modified, the cache is only used while the server still
+   says the same. Servers that say neither are not cached. The
+   least recently used entries go once there are more than
+   HTTPCACHE_MAX_ENTRIES of them or they take up more than
+   HTTPCACHE_MAX_BYTES. */
+
+typedef struct httpcache httpcache_t;
+
+/* Returns 1 with path set to the entry for what the URL has
+   now, 0 when there is none and -1 when it can not be cached */
+
+int httpcache_find(const char *url, const http_source_t *s, char *path,
+                   size_t size);
+
+/* Takes in a download of the whole image as it goes by, front
+   to back. NULL when it can not be kept, the download still
+   goes on without it. */
+
+httpcache_t *httpcache_begin(const char *url, const http_source_t *s);
+int httpcache_add(httpcache_t *c, const void *buf, size_t len);
+
+/* Once all of it went by, the download becomes an entry and
+   path, when not NULL, is set to it. Otherwise, and always with
+   httpcache_abort(), it is dropped. */
+
+int httpcache_commit(httpcache_t *c, char *path, size_t size);
+void httpcache_abort(httpcache_t *c);
+
+/* The entry for the URL in path, downloaded first unless the
+   cache has it */
+
+int httpcache_fetch(const char *url, char *path, size_t size);
+
+#endif // HTTPCACHE_H
@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "image.h"
+#include "blkdev.h"
+#include "ioqueue.h"
+#include "flush.h"
+#include "decomp.h"
+#include "sparse.h"
+#include "http.h"
+#include "httpcache.h"
+
+#define SECTOR_SIZE 512
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reopen the device with O_DIRECT through /proc, so this
+   does not need to know which node the fd came from */
+
+static int reopen_direct(int fd) {
+  char path[64];
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+  return open(path, O_WRONLY | O_DIRECT);
+}
+
+/* Every block passes through here between reading and
+   writing. One that is all zeros is not written but left for
+   sparse_fill() to zero. */
+
+typedef struct image_hook {
+  verify_t *verify;
+  sparse_t *sparse;
+} image_hook_t;
+
+static int image_block(void *arg, const void *buf, size_t len, uint64_t off) {
+  image_hook_t *hook = (image_hook_t *)arg;
+
+  if (hook->sparse != NULL && sparse_is_zero(buf, len) &&
+      sparse_add(hook->sparse, off, len) == 0) {
+    verify_add(hook->verify, NULL, len, off);
+    return 1;
+  }
+
+  verify_add(hook->verify, buf, len, off);
+
+  return 0;
+}
+
+/* Feed the queue from the decoder instead of the image. The
+   decoder fills one queue buffer at a time while the ones
+   before it are being written, so memory stays at the queue
+   depth and the decoder's own window. Returns how much was
+   decoded, the last ragged bytes are left in tail. */
+
+static int64_t queue_decoded(ioqueue_t *queue, decomp_t *d, int out_fd,
+                             int aligned_only, uint64_t device_size,
+                             uint64_t file_size, image_hook_t *hook,
+                             char *tail, size_t *tail_len) {
+  size_t block = ioqueue_block_size(queue);
+  uint64_t offset = 0;
+  writeback_t wb;
+  char *buf = NULL;
+
+  writeback_init(&wb, out_fd, 0);
+
+  for (;;) {
+    /* A skipped block leaves its buffer for the next one */
+
+    if (buf == NULL && (buf = (char *)ioqueue_buffer(queue)) == NULL) return -1;
+
+    if (job_cancelled()) {
+      errno = ECANCELED;
+      return -1;
+    }
+
+    ssize_t len = decomp_read(d, buf, block);
+
+    if (len < 0) return -1;
+    if (len == 0) break;
+
+    /* The decoded size is only known at the end, so a too
+       large image is caught as it runs over */
+
+    if (offset + len > device_size) {
+      r_printf("The decoded image is larger than the device (%llu bytes)!\n",
+               (unsigned long long)device_size);
+      return -1;
+    }
+
+    size_t aligned = len;
+
+    if (aligned_only) {
+      *tail_len = len % SECTOR_SIZE;
+      aligned -= *tail_len;
+      memcpy(tail, buf + aligned, *tail_len);
+      verify_add(hook->verify, tail, *tail_len, offset + aligned);
+    }
+
+    if (aligned > 0 && !image_block(hook, buf, aligned, offset)) {
+      if (ioqueue_write(queue, out_fd, buf, aligned, offset) < 0) return -1;
+      buf = NULL;
+    }
+
+    offset += len;
+
+    writeback_advance(&wb, ioqueue_completed(queue));
+    progress_bytes(decomp_consumed(d), file_size);
+
+    /* Only the last block can be short */
+
+    if ((size_t)len < block) break;
+  }
+
+  return offset;
+}
+
+/* Everything is queued and written, make it stick and let
+   the kernel see the new partitions */
+
+static int finish(int device_fd, uint64_t image_size, double start) {
+  if (flush_device(device_fd) < 0) {
+    r_printf("Failed to flush device: %s\n", strerror(errno));
+    return -1;
+  }
+
+  fadvise_drop(device_fd, 0, image_size);
+
+  double elapsed = now() - start;
+
+  r_printf("Wrote %llu bytes in %.1lf s (%.1lf MB/s)\n",
+           (unsigned long long)image_size, elapsed,
+           elapsed > 0 ? image_size / elapsed / 1000000.0 : 0.0);
+
+  set_progress_bar(100);
+
+  /* Let the kernel pick up whatever partitions the image has */
+
+  if (ioctl(device_fd, BLKRRPART) < 0) {
+    r_printf("WARNING: Could not re-read partition table: %s\n",
+             strerror(errno));
+  }
+
+  return 0;
+}
+
+/* Writes the image from image_fd, or from the decoder when
+   there is one. Frees the decoder, image_fd is the caller's. */
+
+static int write_source(int image_fd, decomp_t *decoder, int compressed,
+                        uint64_t image_size, uint64_t device_size,
+                        const uint32_t *device_fd, int direct,
+                        unsigned int depth, verify_t *verify, int zeros) {
+  int out_fd = *device_fd;
+  image_hook_t hook;
+
+  if (direct) {
+    if ((out_fd = reopen_direct(*device_fd)) < 0) {
+      r_printf("O_DIRECT not available (%s), using buffered writes\n",
+               strerror(errno));
+      out_fd = *device_fd;
+    }
+  }
+
+  size_t block = blk_chunk(*device_fd, IMAGE_BLOCK_SIZE);
+  ioqueue_t *queue = ioqueue_new(depth, block);
+
+  if (queue == NULL) {
+    r_printf("Failed to set up I/O queue: %s\n", strerror(errno));
+    if (out_fd != *device_fd) close(out_fd);
+    decomp_free(decoder);
+    return -1;
+  }
+
+  /* With zeros set, or without the memory for the skipped
+     ranges, everything is simply written */
+
+  hook.verify = verify;
+  hook.sparse = zeros ? NULL : sparse_new(*device_fd);
+
+  ioqueue_on_read(queue, image_block, &hook);
+
+  r_printf("Writing %llu %sbytes (%s, %s, depth %u x %zu KiB)\n",
+           (unsigned long long)image_size, compressed ? "compressed " : "",
+           out_fd != *device_fd ? "O_DIRECT" : "buffered",
+           ioqueue_backend_name(queue), ioqueue_depth(queue), block >> 10);
+
+  double start = now();
+
+  if (decoder != NULL) {
+    char tail[SECTOR_SIZE];
+    size_t tail_len = 0;
+    int64_t decoded = queue_decoded(queue, decoder, out_fd, out_fd != *device_fd,
+                                    device_size, image_size, &hook, tail,
+                                    &tail_len);
+    int ret = ioqueue_drain(queue);
+    uint64_t skipped = hook.sparse != NULL ? sparse_bytes(hook.sparse) : 0;
+
+    if (decoded < 0 && job_cancelled()) {
+      r_printf("Image write cancelled after %llu bytes\n",
+               (unsigned long long)ioqueue_completed(queue));
+      ret = -1;
+    } else if (decoded < 0 || ret < 0 ||
+        ioqueue_completed(queue) + skipped != (uint64_t)decoded - tail_len) {
+      r_printf("Image write failed after %llu bytes%s%s\n",
+               (unsigned long long)ioqueue_completed(queue),
+               ret < 0 ? ": " : "", ret < 0 ? strerror(errno) : "");
+      ret = -1;
+    }
+
+    ioqueue_free(queue);
+
+    if (out_fd != *device_fd) close(out_fd);
+
+    if (ret == 0 && tail_len > 0 &&
+        pwrite(*device_fd, tail, tail_len, decoded - tail_len) != (ssize_t)tail_len) {
+      r_printf("Failed to write the last %zu bytes: %s\n", tail_len,
+               strerror(errno));
+      ret = -1;
+    }
+
+    if (ret == 0 && hook.sparse != NULL) ret = sparse_fill(hook.sparse);
+
+    sparse_free(hook.sparse);
+    decomp_free(decoder);
+
+    if (ret < 0) return -1;
+
+    return finish(*device_fd, decoded, start);
+  }
+
+  /* O_DIRECT wants every write to be a whole number of
+     sectors, so a ragged tail goes through the plain fd */
+
+  uint64_t aligned = image_size;
+
+  if (out_fd != *device_fd) aligned -= image_size % SECTOR_SIZE;
+
+  uint64_t offset = 0;
+  writeback_t wb;
+
+  /* Progress follows what is on the device, not what is
+     sitting in the page cache */
+
+  writeback_init(&wb, out_fd, 0);
+  fadvise_stream(image_fd);
+
+  uint64_t dropped = 0;
+  uint64_t holes = 0;
+  int seek = hook.sparse != NULL;
+  int cancelled = 0;
+  int ret = 0;
+
+  while (offset < aligned && ret == 0) {
+    uint64_t data = offset, end = aligned;
+
+    /* Holes in a sparse image file are not even read, they go
+       straight to the skipped ranges */
+
+    if (seek) {
+      int found = sparse_next_data(image_fd, offset, aligned, &data, &end);
+
+      if (found < 0) {
+        seek = 0;
+        data = offset;
+        end = aligned;
+      } else if (found == 1) {
+        data = end = aligned;
+      }
+
+      if (data > offset && sparse_add(hook.sparse, offset, data - offset) == 0) {
+        verify_add(verify, NULL, data - offset, offset);
+
+        holes += data - offset;
+        offset = data;
+      }
+    }
+
+    while (offset < end) {
+      uint64_t len = end - offset;
+
+      if (len > block) len = block;
+
+      if (job_cancelled()) {
+        cancelled = 1;
+        ret = -1;
+        break;
+      }
+
+      if (ioqueue_copy(queue, image_fd, out_fd, offset, len) < 0) {
+        ret = -1;
+        break;
+      }
+
+      offset += len;
+
+      uint64_t durable = writeback_advance(&wb, ioqueue_completed(queue) + holes);
+
+      /* What is on the device will not be read from the image
+         again */
+
+      if (durable > dropped) {
+        fadvise_drop(image_fd, dropped, durable - dropped);
+        dropped = durable;
+      }
+
+      progress_bytes(durable, image_size);
+    }
+  }
+
+  ret = ioqueue_drain(queue);
+
+  if (cancelled) {
+    r_printf("Image write cancelled after %llu bytes\n",
+             (unsigned long long)ioqueue_completed(queue));
+    errno = ECANCELED;
+    ret = -1;
+  } else if (ret < 0 || ioqueue_completed(queue) + holes != aligned) {
+    r_printf("Image write failed after %llu bytes: %s\n",
+             (unsigned long long)ioqueue_completed(queue),
+             ret < 0 ? strerror(errno) : "short read from image");
+    ret = -1;
+  }
+
+  ioqueue_free(queue);
+
+  if (out_fd != *device_fd) close(out_fd);
+
+  if (ret == 0 && hook.sparse != NULL) ret = sparse_fill(hook.sparse);
+
+  sparse_free(hook.sparse);
+
+  if (ret == 0 && aligned < image_size) {
+    char tail[SECTOR_SIZE];
+    ssize_t len = image_size - aligned;
+
+    if (pread(image_fd, tail, len, aligned) != len ||
+        pwrite(*device_fd, tail, len, aligned) != len) {
+      r_printf("Failed to write the last %ld bytes: %s\n", (long)len,
+               strerror(errno));
+      ret = -1;
+    } else {
+      verify_add(verify, tail, len, aligned);
+    }
+  }
+
+  fadvise_drop(image_fd, 0, 0);
+
+  if (ret < 0) return -1;
+
+  return finish(*device_fd, image_size, start);
+}
+
+static int device_size_of(const uint32_t *device_fd, uint64_t *size) {
+  if (ioctl(*device_fd, BLKGETSIZE64, size) < 0) {
+    r_printf("Failed to get device size: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int fits(uint64_t image_size, uint64_t device_size) {
+  if (image_size <= device_size) return 1;
+
+  r_printf("Image is %llu bytes but the device only holds %llu bytes!\n",
+           (unsigned long long)image_size, (unsigned long long)device_size);
+
+  return 0;
+}
+
+int write_image(const char *image_path, const uint32_t *device_fd, int direct,
+                unsigned int depth, verify_t *verify, int zeros) {
+  struct stat st;
+  uint64_t device_size;
+  int image_fd;
+  decomp_t *decoder = NULL;
+
+  r_printf("Using image: %s\n", image_path);
+
+  if ((image_fd = open(image_path, O_RDONLY)) < 0) {
+    r_printf("Opening image failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (fstat(image_fd, &st) < 0) {
+    r_printf("Failed to get image size: %s\n", strerror(errno));
+    close(image_fd);
+    return -1;
+  }
+
+  if (device_size_of(device_fd, &device_size) < 0) {
+    close(image_fd);
+    return -1;
+  }
+
+  uint64_t image_size = (uint64_t)st.st_size;
+  int format = decomp_probe(image_fd);
+
+  if (format != DECOMP_NONE) {
+    r_printf("Image is %s compressed, decoding it on the way\n",
+             decomp_name(format));
+
+    if ((decoder = decomp_new(image_fd, format)) == NULL) {
+      close(image_fd);
+      return -1;
+    }
+  } else if (!fits(image_size, device_size)) {
+    close(image_fd);
+    return -1;
+  }
+
+  int ret = write_source(image_fd, decoder, decoder != NULL, image_size,
+                         device_size, device_fd, direct, depth, verify, zeros);
+
+  close(image_fd);
+
+  return ret;
+}
+
+int write_image_head(const char *image_path, uint64_t len,
+                     const uint32_t *device_fd, int direct, unsigned int depth,
+                     verify_t *verify) {
+  struct stat st;
+  uint64_t device_size;
+  int image_fd;
+
+  r_printf("Using image: %s\n", image_path);
+
+  if ((image_fd = open(image_path, O_RDONLY)) < 0) {
+    r_printf("Opening image failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (fstat(image_fd, &st) < 0) {
+    r_printf("Failed to get image size: %s\n", strerror(errno));
+    close(image_fd);
+    return -1;
+  }
+
+  if (len > (uint64_t)st.st_size) len = st.st_size;
+
+  if (device_size_of(device_fd, &device_size) < 0 || !fits(len, device_size)) {
+    close(image_fd);
+    return -1;
+  }
+
+  int ret = write_source(image_fd, NULL, 0, len, device_size, device_fd, direct,
+                         depth, verify, 1);
+
+  close(image_fd);
+
+  return ret;
+}
+
+/* ---- Images off a URL ---- */
+
+/* The first bytes were taken to tell the format, they go out
+   again before the rest of the stream. What goes by is kept in
+   the cache when there is one. */
+
+typedef struct url_stream {
+  http_source_t *source;
+  httpcache_t *cache;
+  uint8_t head[8];
+  size_t head_len;
+  size_t head_pos;
+} url_stream_t;
+
+static ssize_t url_read(void *ctx, void *buf, size_t len, uint64_t offset) {
+  url_stream_t *u = (url_stream_t *)ctx;
+  uint64_t at;
+  ssize_t got;
+
+  (void)offset;
+
+  if (u->head_pos < u->head_len) {
+    got = u->head_len - u->head_pos < len ? u->head_len - u->head_pos : len;
+    memcpy(buf, u->head + u->head_pos, got);
+    u->head_pos += got;
+    return got;
+  }
+
+  if ((got = http_stream_read(u->source, buf, len, &at)) <= 0) return got;
+
+  if (u->cache != NULL && httpcache_add(u->cache, buf, got) < 0) {
+    httpcache_abort(u->cache);
+    u->cache = NULL;
+  }
+
+  return got;
+}
+
+int write_image_url(const char *url, const uint32_t *device_fd, int direct,
+                    unsigned int depth, verify_t *verify, int zeros, int cache) {
+  char path[PATH_MAX];
+  uint64_t device_size;
+  url_stream_t u;
+  ssize_t len;
+  int ret = -1;
+
+  r_printf("Using image: %s\n", url);
+
+  memset(&u, 0, sizeof(u));
+
+  if (device_size_of(device_fd, &device_size) < 0 ||
+      (u.source = http_open(url)) == NULL)
+    return -1;
+
+  if (cache && httpcache_find(url, u.source, path, sizeof(path)) == 1) {
+    http_close(u.source);
+    return write_image(path, device_fd, direct, depth, verify, zeros);
+  }
+
+  if (cache) u.cache = httpcache_begin(url, u.source);
+
+  uint64_t image_size = http_size(u.source);
+
+  if (http_stream_start(u.source, NULL, 0) < 0) goto out;
+
+  /* A short image has a short head, that is no error */
+
+  uint64_t at;
+
+  while (u.head_len < sizeof(u.head) &&
+         (len = http_stream_read(u.source, u.head + u.head_len,
+                                 sizeof(u.head) - u.head_len, &at)) > 0)
+    u.head_len += len;
+
+  if (u.cache != NULL) httpcache_add(u.cache, u.head, u.head_len);
+
+  int format = decomp_probe_buf(u.head, u.head_len);
+
+  if (format != DECOMP_NONE) {
+    r_printf("Image is %s compressed, decoding it on the way\n",
+             decomp_name(format));
+  } else if (!fits(image_size, device_size)) {
+    goto out;
+  }
+
+  decomp_t *decoder = decomp_new_reader(url_read, &u, format);
+
+  if (decoder == NULL) goto out;
+
+  r_printf("Streaming %llu bytes from %s\n", (unsigned long long)image_size,
+           http_url(u.source));
+
+  ret = write_source(-1, decoder, format != DECOMP_NONE, image_size, device_size,
+                     device_fd, direct, depth, verify, zeros);
+
+  /* A decoder can be done before the last bytes of the file,
+     the cache wants all of them */
+
+  if (ret == 0 && u.cache != NULL) {
+    uint8_t rest[SECTOR_SIZE];
+
+    while (u.cache != NULL && url_read(&u, rest, sizeof(rest), 0) > 0) {
+    }
+
+    if (u.cache != NULL) httpcache_commit(u.cache, NULL, 0);
+
+    u.cache = NULL;
+  }
+
+out:
+  httpcache_abort(u.cache);
+  http_close(u.source);
+
+  return ret;
+}
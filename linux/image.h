@@ -0,0 +1,34 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+
+#include "verify.h"
+
+#define IMAGE_BLOCK_SIZE (4 << 20)
+
+/* With verify set, every block is hashed on its way to the
+   device for verify_device() to check afterwards. Blocks of
+   nothing but zeros, and the holes of a sparse image file, are
+   not written but zeroed on the device afterwards, by the
+   device itself when it can. With zeros set they are written
+   like the rest. */
+
+int write_image(const char *image_path, const uint32_t *device_fd, int direct,
+                unsigned int depth, verify_t *verify, int zeros);
+
+/* Only the first len bytes of a plain image, zero blocks and
+   holes included */
+
+int write_image_head(const char *image_path, uint64_t len,
+                     const uint32_t *device_fd, int direct, unsigned int depth,
+                     verify_t *verify);
+
+/* The same for an image on a web server, written while it
+   downloads. With cache set a download that was kept before is
+   written from disk, and a new one is kept for the next time. */
+
+int write_image_url(const char *url, const uint32_t *device_fd, int direct,
+                    unsigned int depth, verify_t *verify, int zeros, int cache);
+
+#endif // IMAGE_H
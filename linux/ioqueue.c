@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../log.h"
+#include "ioqueue.h"
+#include "trace.h"
+
+#define IOQ_THREADS_MAX 16
+
+enum { SLOT_FREE, SLOT_RESERVED, SLOT_READ, SLOT_WRITE };
+
+typedef struct ioslot {
+  char *buf;
+  struct iovec iov;
+  int op;
+  int in_fd;
+  int out_fd;
+  uint64_t off;
+  uint64_t out_off;
+  size_t len;
+  size_t done;
+  struct ioslot *next;
+#ifdef RUFUSL_TRACE
+  uint64_t traced;
+#endif
+} ioslot_t;
+
+struct ioqueue {
+  int backend;
+  unsigned int depth;
+  size_t block_size;
+
+  char *pool;
+  ioslot_t *slots;
+  unsigned int in_flight;
+  int error;
+  uint64_t completed;
+  ioqueue_read_fn on_read;
+  void *on_read_arg;
+
+  /* io_uring */
+
+  int ring_fd;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_size;
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned int pending;
+
+  /* pread()/pwrite() threads */
+
+  pthread_t threads[IOQ_THREADS_MAX];
+  int thread_count;
+  int stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  ioslot_t *work_head;
+  ioslot_t *work_tail;
+};
+
+static const char *backend_names[] = {"io_uring", "threads"};
+
+/* ---- io_uring, driven through the raw syscalls ---- */
+
+static int uring_setup(ioqueue_t *q) {
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+
+  q->ring_fd = syscall(__NR_io_uring_setup, q->depth, &p);
+
+  if (q->ring_fd < 0) return -1;
+
+  q->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  q->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (q->cq_size > q->sq_size) q->sq_size = q->cq_size;
+    q->cq_size = q->sq_size;
+  }
+
+  q->sq_ptr = mmap(NULL, q->sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQ_RING);
+
+  if (q->sq_ptr == MAP_FAILED) goto fail_ring;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    q->cq_ptr = q->sq_ptr;
+  } else {
+    q->cq_ptr = mmap(NULL, q->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_CQ_RING);
+    if (q->cq_ptr == MAP_FAILED) goto fail_sq;
+  }
+
+  q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  q->sqes = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+
+  if (q->sqes == MAP_FAILED) goto fail_cq;
+
+  q->sq_tail = (unsigned int *)((char *)q->sq_ptr + p.sq_off.tail);
+  q->sq_mask = (unsigned int *)((char *)q->sq_ptr + p.sq_off.ring_mask);
+  q->sq_array = (unsigned int *)((char *)q->sq_ptr + p.sq_off.array);
+  q->cq_head = (unsigned int *)((char *)q->cq_ptr + p.cq_off.head);
+  q->cq_tail = (unsigned int *)((char *)q->cq_ptr + p.cq_off.tail);
+  q->cq_mask = (unsigned int *)((char *)q->cq_ptr + p.cq_off.ring_mask);
+  q->cqes = (struct io_uring_cqe *)((char *)q->cq_ptr + p.cq_off.cqes);
+
+  return 0;
+
+fail_cq:
+  if (q->cq_ptr != q->sq_ptr) munmap(q->cq_ptr, q->cq_size);
+fail_sq:
+  munmap(q->sq_ptr, q->sq_size);
+fail_ring:
+  close(q->ring_fd);
+  q->ring_fd = -1;
+  return -1;
+}
+
+static void uring_teardown(ioqueue_t *q) {
+  munmap(q->sqes, q->sqes_size);
+  if (q->cq_ptr != q->sq_ptr) munmap(q->cq_ptr, q->cq_size);
+  munmap(q->sq_ptr, q->sq_size);
+  close(q->ring_fd);
+}
+
+static void uring_push(ioqueue_t *q, ioslot_t *slot) {
+  unsigned int tail = *q->sq_tail;
+  unsigned int index = tail & *q->sq_mask;
+  struct io_uring_sqe *sqe = &q->sqes[index];
+
+  slot->iov.iov_base = slot->buf + slot->done;
+  slot->iov.iov_len = slot->len - slot->done;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = slot->op == SLOT_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+  sqe->fd = slot->op == SLOT_READ ? slot->in_fd : slot->out_fd;
+  sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+  sqe->len = 1;
+  sqe->off = (slot->op == SLOT_READ ? slot->off : slot->out_off) + slot->done;
+  sqe->user_data = slot - q->slots;
+
+  q->sq_array[index] = index;
+  __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  TRACE_MARK(slot->traced);
+
+  q->pending++;
+}
+
+static int uring_enter(ioqueue_t *q, unsigned int min_complete) {
+  for (;;) {
+    int ret = syscall(__NR_io_uring_enter, q->ring_fd, q->pending, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (ret >= 0) {
+      q->pending -= ret;
+      return 0;
+    }
+
+    if (errno != EINTR) return -1;
+  }
+}
+
+static void uring_complete(ioqueue_t *q, ioslot_t *slot, int res) {
+  TRACE_SPAN(slot->op == SLOT_READ ? TRACE_READ : TRACE_WRITE,
+             slot->op == SLOT_READ ? "io_uring read" : "io_uring write",
+             slot->traced);
+
+  if (res == -EINTR || res == -EAGAIN) {
+    uring_push(q, slot);
+    return;
+  }
+
+  if (res < 0) {
+    if (q->error == 0) q->error = -res;
+    slot->op = SLOT_FREE;
+    q->in_flight--;
+    return;
+  }
+
+  slot->done += res;
+
+  if (slot->op == SLOT_READ) {
+    /* A short read at the end of a file just shortens the block */
+
+    if (res == 0) slot->len = slot->done;
+
+    if (slot->done < slot->len) {
+      uring_push(q, slot);
+      return;
+    }
+
+    if (slot->len == 0) {
+      slot->op = SLOT_FREE;
+      q->in_flight--;
+      return;
+    }
+
+    if (q->on_read != NULL &&
+        q->on_read(q->on_read_arg, slot->buf, slot->len, slot->out_off) != 0) {
+      q->completed += slot->len;
+      slot->op = SLOT_FREE;
+      q->in_flight--;
+      return;
+    }
+
+    slot->op = SLOT_WRITE;
+    slot->done = 0;
+    uring_push(q, slot);
+    return;
+  }
+
+  if (res == 0) {
+    if (q->error == 0) q->error = EIO;
+    slot->op = SLOT_FREE;
+    q->in_flight--;
+    return;
+  }
+
+  if (slot->done < slot->len) {
+    uring_push(q, slot);
+    return;
+  }
+
+  q->completed += slot->len;
+  slot->op = SLOT_FREE;
+  q->in_flight--;
+}
+
+static int uring_reap(ioqueue_t *q, unsigned int wait) {
+  if (uring_enter(q, wait) < 0) {
+    if (q->error == 0) q->error = errno;
+    return -1;
+  }
+
+  unsigned int head = *q->cq_head;
+  unsigned int tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+
+    uring_complete(q, &q->slots[cqe->user_data], cqe->res);
+    head++;
+  }
+
+  __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+
+  /* Completions may have queued follow-up reads and writes */
+
+  if (q->pending > 0 && uring_enter(q, 0) < 0) {
+    if (q->error == 0) q->error = errno;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ---- pread()/pwrite() thread fallback ---- */
+
+static int full_io(int write_op, int fd, char *buf, size_t *len,
+                   uint64_t off) {
+  size_t done = 0;
+
+  while (done < *len) {
+    ssize_t ret = write_op ? pwrite(fd, buf + done, *len - done, off + done)
+                           : pread(fd, buf + done, *len - done, off + done);
+
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    if (ret == 0) {
+      if (write_op) {
+        errno = EIO;
+        return -1;
+      }
+      *len = done;
+      break;
+    }
+
+    done += ret;
+  }
+
+  return 0;
+}
+
+static void *io_thread(void *arg) {
+  ioqueue_t *q = (ioqueue_t *)arg;
+
+  pthread_mutex_lock(&q->lock);
+
+  for (;;) {
+    while (q->work_head == NULL && !q->stopping) {
+      pthread_cond_wait(&q->work_cond, &q->lock);
+    }
+
+    if (q->work_head == NULL) break;
+
+    ioslot_t *slot = q->work_head;
+
+    q->work_head = slot->next;
+    if (q->work_head == NULL) q->work_tail = NULL;
+
+    pthread_mutex_unlock(&q->lock);
+
+    int ret = 0;
+    int err = 0;
+
+    int skip = 0;
+
+    if (slot->op == SLOT_READ) {
+      TRACE_NOW(traced);
+
+      ret = full_io(0, slot->in_fd, slot->buf, &slot->len, slot->off);
+
+      TRACE_SPAN(TRACE_READ, "pread", traced);
+
+      if (ret == 0 && slot->len > 0 && q->on_read != NULL)
+        skip = q->on_read(q->on_read_arg, slot->buf, slot->len, slot->out_off);
+    }
+
+    if (ret == 0 && slot->len > 0 && !skip) {
+      TRACE_NOW(traced);
+
+      ret = full_io(1, slot->out_fd, slot->buf, &slot->len, slot->out_off);
+
+      TRACE_SPAN(TRACE_WRITE, "pwrite", traced);
+    }
+
+    if (ret < 0) err = errno;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (err != 0 && q->error == 0) q->error = err;
+    if (err == 0) q->completed += slot->len;
+
+    slot->op = SLOT_FREE;
+    q->in_flight--;
+
+    pthread_cond_broadcast(&q->done_cond);
+  }
+
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
+}
+
+static int threads_setup(ioqueue_t *q) {
+  int count = q->depth > IOQ_THREADS_MAX ? IOQ_THREADS_MAX : q->depth;
+
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->work_cond, NULL);
+  pthread_cond_init(&q->done_cond, NULL);
+
+  for (int i = 0; i < count; i++) {
+    if (pthread_create(&q->threads[i], NULL, io_thread, q) != 0) break;
+    q->thread_count++;
+  }
+
+  return q->thread_count > 0 ? 0 : -1;
+}
+
+static void threads_teardown(ioqueue_t *q) {
+  pthread_mutex_lock(&q->lock);
+  q->stopping = 1;
+  pthread_cond_broadcast(&q->work_cond);
+  pthread_mutex_unlock(&q->lock);
+
+  for (int i = 0; i < q->thread_count; i++) {
+    pthread_join(q->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&q->done_cond);
+  pthread_cond_destroy(&q->work_cond);
+  pthread_mutex_destroy(&q->lock);
+}
+
+/* ---- Common front end ---- */
+
+void ioqueue_on_read(ioqueue_t *q, ioqueue_read_fn fn, void *arg) {
+  q->on_read = fn;
+  q->on_read_arg = arg;
+}
+
+ioqueue_t *ioqueue_new(unsigned int depth, size_t block_size) {
+  ioqueue_t *q = calloc(1, sizeof(ioqueue_t));
+
+  if (q == NULL) return NULL;
+
+  if (depth < 1) depth = 1;
+  if (depth > IOQ_DEPTH_MAX) depth = IOQ_DEPTH_MAX;
+
+  q->depth = depth;
+  q->block_size = block_size;
+  q->ring_fd = -1;
+
+  if (posix_memalign((void **)&q->pool, 4096, depth * block_size) != 0) {
+    free(q);
+    return NULL;
+  }
+
+  memset(q->pool, 0, depth * block_size);
+
+  if ((q->slots = calloc(depth, sizeof(ioslot_t))) == NULL) {
+    free(q->pool);
+    free(q);
+    return NULL;
+  }
+
+  for (unsigned int i = 0; i < depth; i++) {
+    q->slots[i].buf = q->pool + i * block_size;
+  }
+
+  if (uring_setup(q) == 0) {
+    q->backend = IOQ_BACKEND_URING;
+    return q;
+  }
+
+  q->backend = IOQ_BACKEND_THREADS;
+
+  if (threads_setup(q) < 0) {
+    r_printf("Failed to start I/O threads\n");
+    free(q->slots);
+    free(q->pool);
+    free(q);
+    return NULL;
+  }
+
+  return q;
+}
+
+void ioqueue_free(ioqueue_t *q) {
+  if (q == NULL) return;
+
+  ioqueue_drain(q);
+
+  if (q->backend == IOQ_BACKEND_URING) {
+    uring_teardown(q);
+  } else {
+    threads_teardown(q);
+  }
+
+  free(q->slots);
+  free(q->pool);
+  free(q);
+}
+
+int ioqueue_backend(const ioqueue_t *q) { return q->backend; }
+
+const char *ioqueue_backend_name(const ioqueue_t *q) {
+  return backend_names[q->backend];
+}
+
+unsigned int ioqueue_depth(const ioqueue_t *q) { return q->depth; }
+
+size_t ioqueue_block_size(const ioqueue_t *q) { return q->block_size; }
+
+static ioslot_t *find_free(ioqueue_t *q) {
+  for (unsigned int i = 0; i < q->depth; i++) {
+    if (q->slots[i].op == SLOT_FREE) return &q->slots[i];
+  }
+
+  return NULL;
+}
+
+void *ioqueue_buffer(ioqueue_t *q) {
+  ioslot_t *slot;
+
+  if (q->backend == IOQ_BACKEND_URING) {
+    while ((slot = find_free(q)) == NULL) {
+      if (q->error != 0 || uring_reap(q, 1) < 0) break;
+    }
+
+    if (slot == NULL || q->error != 0) {
+      errno = q->error;
+      return NULL;
+    }
+
+    slot->op = SLOT_RESERVED;
+    return slot->buf;
+  }
+
+  pthread_mutex_lock(&q->lock);
+
+  while ((slot = find_free(q)) == NULL && q->error == 0) {
+    pthread_cond_wait(&q->done_cond, &q->lock);
+  }
+
+  if (q->error != 0) {
+    errno = q->error;
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+  }
+
+  slot->op = SLOT_RESERVED;
+
+  pthread_mutex_unlock(&q->lock);
+
+  return slot->buf;
+}
+
+static int submit(ioqueue_t *q, ioslot_t *slot) {
+  if (q->backend == IOQ_BACKEND_URING) {
+    q->in_flight++;
+    uring_push(q, slot);
+
+    if (uring_enter(q, 0) < 0) {
+      if (q->error == 0) q->error = errno;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  pthread_mutex_lock(&q->lock);
+
+  slot->next = NULL;
+
+  if (q->work_tail == NULL) {
+    q->work_head = slot;
+  } else {
+    q->work_tail->next = slot;
+  }
+
+  q->work_tail = slot;
+  q->in_flight++;
+
+  pthread_cond_signal(&q->work_cond);
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+int ioqueue_write(ioqueue_t *q, int fd, void *buf, size_t len, uint64_t off) {
+  ioslot_t *slot = &q->slots[((char *)buf - q->pool) / q->block_size];
+
+  if (len > q->block_size) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  slot->op = SLOT_WRITE;
+  slot->in_fd = -1;
+  slot->out_fd = fd;
+  slot->off = off;
+  slot->out_off = off;
+  slot->len = len;
+  slot->done = 0;
+
+  return submit(q, slot);
+}
+
+int ioqueue_copy(ioqueue_t *q, int in_fd, int out_fd, uint64_t off,
+                 uint64_t len) {
+  return ioqueue_copy_at(q, in_fd, off, out_fd, off, len);
+}
+
+int ioqueue_copy_at(ioqueue_t *q, int in_fd, uint64_t in_off, int out_fd,
+                    uint64_t out_off, uint64_t len) {
+  uint64_t end = in_off + len;
+
+  while (in_off < end) {
+    char *buf = (char *)ioqueue_buffer(q);
+
+    if (buf == NULL) return -1;
+
+    ioslot_t *slot = &q->slots[(buf - q->pool) / q->block_size];
+    size_t chunk = end - in_off < q->block_size ? end - in_off : q->block_size;
+
+    /* The slot belongs to the queue again once it is submitted */
+
+    slot->op = SLOT_READ;
+    slot->in_fd = in_fd;
+    slot->out_fd = out_fd;
+    slot->off = in_off;
+    slot->out_off = out_off;
+    slot->len = chunk;
+    slot->done = 0;
+
+    if (submit(q, slot) < 0) return -1;
+
+    in_off += chunk;
+    out_off += chunk;
+  }
+
+  return 0;
+}
+
+int ioqueue_drain(ioqueue_t *q) {
+  if (q->backend == IOQ_BACKEND_URING) {
+    while (q->in_flight > 0) {
+      if (uring_reap(q, 1) < 0) break;
+    }
+  } else {
+    pthread_mutex_lock(&q->lock);
+    while (q->in_flight > 0) pthread_cond_wait(&q->done_cond, &q->lock);
+    pthread_mutex_unlock(&q->lock);
+  }
+
+  if (q->error != 0) {
+    errno = q->error;
+    return -1;
+  }
+
+  return 0;
+}
+
+uint64_t ioqueue_completed(const ioqueue_t *q) {
+  return __atomic_load_n(&q->completed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,51 @@
+#ifndef IOQUEUE_H
+#define IOQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IOQ_DEPTH_DEFAULT 8
+#define IOQ_DEPTH_MAX 64
+#define IOQ_BLOCK_DEFAULT (1 << 20)
+
+#define IOQ_BACKEND_URING 0
+#define IOQ_BACKEND_THREADS 1
+
+/* A fixed pool of block_size buffers with up to depth of
+   them in flight at once. It runs on io_uring when the kernel
+   lets us set one up, and on a small pool of pread()/pwrite()
+   threads when it does not. Buffers are page aligned and start
+   out zeroed, so they can be used with O_DIRECT and for wipes
+   without any extra preparation. */
+
+typedef struct ioqueue ioqueue_t;
+
+/* Called with each block of a copy once it has been read and
+   before it gets written, with where it is going to. On the
+   thread backend that happens on several threads at once.
+   Returning nonzero drops the write, the block still counts
+   as completed. */
+
+typedef int (*ioqueue_read_fn)(void *arg, const void *buf, size_t len,
+                               uint64_t out_off);
+
+ioqueue_t *ioqueue_new(unsigned int depth, size_t block_size);
+void ioqueue_free(ioqueue_t *q);
+
+void ioqueue_on_read(ioqueue_t *q, ioqueue_read_fn fn, void *arg);
+
+int ioqueue_backend(const ioqueue_t *q);
+const char *ioqueue_backend_name(const ioqueue_t *q);
+unsigned int ioqueue_depth(const ioqueue_t *q);
+size_t ioqueue_block_size(const ioqueue_t *q);
+
+void *ioqueue_buffer(ioqueue_t *q);
+int ioqueue_write(ioqueue_t *q, int fd, void *buf, size_t len, uint64_t off);
+int ioqueue_copy(ioqueue_t *q, int in_fd, int out_fd, uint64_t off,
+                 uint64_t len);
+int ioqueue_copy_at(ioqueue_t *q, int in_fd, uint64_t in_off, int out_fd,
+                    uint64_t out_off, uint64_t len);
+int ioqueue_drain(ioqueue_t *q);
+uint64_t ioqueue_completed(const ioqueue_t *q);
+
+#endif // IOQUEUE_H
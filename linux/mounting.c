@@ -17,17 +17,37 @@
 #include "../log.h"
 #include "definitions.h"
 #include "mounting.h"
+#include "copy.h"
+#include "flush.h"
+
+temp_paths_t temp_paths = {
+  "/dev/rufus_device",
+  "/dev/rufus_device_%d",
+  "/dev/rufus_loop",
+  "/dev/rufus_device_partition",
+  "/mnt/rufus_rootfs/",
+  "/mnt/rufus_isofs"
+};
+
+void temp_paths_tag(const char *tag) {
+  snprintf(temp_paths.device, TEMP_PATH_MAX, "/dev/rufus_device-%s", tag);
+  snprintf(temp_paths.device_n, TEMP_PATH_MAX, "/dev/rufus_device-%s_%%d", tag);
+  snprintf(temp_paths.loop, TEMP_PATH_MAX, "/dev/rufus_loop-%s", tag);
+  snprintf(temp_paths.part, TEMP_PATH_MAX, "/dev/rufus_device_partition-%s", tag);
+  snprintf(temp_paths.dir, TEMP_PATH_MAX, "/mnt/rufus_rootfs-%s/", tag);
+  snprintf(temp_paths.dir_iso, TEMP_PATH_MAX, "/mnt/rufus_isofs-%s", tag);
+}
 
-#define BUF_SIZE 4096
-
-static char *source;
-static char *dest;
-static long file_count = 0;
-static long files_copied = 0;
+int make_temp_device(uint8_t major, uint8_t minor, uint32_t *device_fd) {
+  return make_temp_device_at(TEMP_DEVICE, major, minor, device_fd);
+}
 
+/* Same, but with a node of its own, so that several devices
+   can be open at once */
 
-int make_temp_device(uint8_t major, uint8_t minor, uint32_t *device_fd) {
-  remove(TEMP_DEVICE);
+int make_temp_device_at(const char *node, uint8_t major, uint8_t minor,
+                        uint32_t *device_fd) {
+  remove(node);
 
   r_printf("Creating temporary node for Rufusl: major: %d minor %d\n", major,
            minor);
@@ -36,14 +56,14 @@ int make_temp_device(uint8_t major, uint8_t minor, uint32_t *device_fd) {
 
   if (temp_dev < 0) return -1;
 
-  if (mknod(TEMP_DEVICE, S_IFBLK, temp_dev) < 0) {
+  if (mknod(node, S_IFBLK, temp_dev) < 0) {
     r_printf("Creating temporaray device node failed: %s\n", strerror(errno));
     return -1;
   }
 
   r_printf("Opening device for writing ... ");
 
-  *device_fd = open(TEMP_DEVICE, O_RDWR);
+  *device_fd = open(node, O_RDWR);
 
   if (*device_fd < 0) {
       r_printf("Error opening device: %s\n", strerror(errno));
@@ -51,6 +71,8 @@ int make_temp_device(uint8_t major, uint8_t minor, uint32_t *device_fd) {
   }
 
   r_printf(" OK! fd: %d\n", *device_fd);
+
+  return 0;
 }
 
 int make_temp_partition(uint8_t major, uint8_t minor, uint32_t *part_fd) {
@@ -76,6 +98,8 @@ int make_temp_partition(uint8_t major, uint8_t minor, uint32_t *part_fd) {
   }
 
   r_printf(" OK! fd: %d\n", *part_fd);
+
+  return 0;
 }
 
 int make_temp_dir(const char *path) {
@@ -117,124 +141,44 @@ int make_temp_dir(const char *path) {
     }
 
     closedir(dir);
-
-    return 0;
-  }
-}
-
-int callback(const char *fpath, const struct stat *sb, int typeflag,
-             struct FTW *ftwbuf) {
-  /* Allocate new array and copy fpath into it because
-     nftw() has an assertion if fpath has been changed. */
-
-  char buf[strlen(fpath) + 1];
-  memcpy(buf, fpath, strlen(fpath) + 1);
-
-  /* Get length of path where the loop device is mounted */
-
-  uint32_t a_len = strlen(source);
-
-  /* Trim soure path. Write each char from (buf + a_len + 1) to buf. */
-
-  uint32_t i = a_len + 1;
-  uint32_t j = 0;
-
-  for (; j < sizeof(buf) - a_len; i++) {
-    buf[j] = *(buf + i);
-    j++;
   }
 
-  buf[j] = 0x00; /* Null-terminate the string. Now we have a relative path */
-
-  /* Allocate new buffer with size of destination path, and the relative path +
-   * a null terminator */
-
-  char dest_path[strlen(dest) + strlen(buf) + 1];
-
-  /* Concate destination and relative path */
-
-  snprintf(dest_path, strlen(dest) + strlen(buf) + 1, "%s%s", dest, buf);
+  return 0;
+}
 
-  /* Now we have an absolute source and destination path. :) */
+/* list is the manifest from the scan when there is a good
+   one, otherwise the tree gets walked here */
 
-  files_copied++;
+int recursive_copy(char *src, char *dest, const copy_list_t *list, int threads,
+                   int depth) {
+  copy_list_t walked;
+  int ret;
 
-  if (typeflag == FTW_D) {
-    mkdir(dest_path, 0700);
-    return 0;
+  if (list != NULL) {
+    r_printf("Using scan manifest: %u files in %u entries, %llu bytes total\n",
+             list->file_count, list->count,
+             (unsigned long long)list->total_bytes);
+    return copy_files(src, dest, list, threads, depth);
   }
 
-  int inputFd, outputFd, openFlags;
-  mode_t filePerms;
-  ssize_t numRead;
-
-  r_printf("Extracting: %s\n", dest_path);
-  set_progress_bar(
-      (int)((((float)file_count - ((float)file_count - (float)files_copied)) /
-             (float)file_count) *
-            100.0f));
+  copy_list_init(&walked);
 
-  // set_progress_bar(  (file_count - (file_count - files_copied) / file_count)
-  // * 100.0f  );
+  r_printf("Building file list...\n");
 
-  char buf1[BUF_SIZE];
-
-  inputFd = open(fpath, O_RDONLY);
-
-  if (inputFd == -1) {
-    r_printf("Error: %s\n", strerror(errno));
+  if (build_copy_list(src, &walked) < 0) {
+    copy_list_free(&walked);
     return -1;
   }
 
-  openFlags = O_CREAT | O_WRONLY;
-  filePerms = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
-
-  outputFd = open(dest_path, openFlags, filePerms);
+  r_printf("Found %u files in %u entries, %llu bytes total\n",
+           walked.file_count, walked.count,
+           (unsigned long long)walked.total_bytes);
 
-  if (outputFd == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
+  ret = copy_files(src, dest, &walked, threads, depth);
 
-  while ((numRead = read(inputFd, buf1, BUF_SIZE)) > 0) {
-    if (write(outputFd, buf1, numRead) != numRead) {
-      r_printf("Error: %s\n", strerror(errno));
-      break;
-    }
-  }
+  copy_list_free(&walked);
 
-  if (numRead == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
-  if (close(outputFd) == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
-  if (close(inputFd) == -1) {
-    r_printf("Error: %s\n", strerror(errno));
-    return -1;
-  }
-
-  return 0;
-}
-
-int count_files(const char *fpath, const struct stat *sb, int typeflag,
-                struct FTW *ftwbuf) {
-  file_count++;
-  return 0;
-}
-
-int recursive_copy(char *src, char *dest_) {
-  source = src;
-  dest = dest_;
-
-  files_copied = 0;
-  file_count = 0;
-
-  r_printf("Counting files...\n");
-  nftw(source, count_files, 4, 0);
-  nftw(source, callback, 4, 0);
+  return ret;
 }
 
 void clean_up(const uint32_t *dev_fd, const uint32_t *part_fd,
@@ -242,7 +186,12 @@ void clean_up(const uint32_t *dev_fd, const uint32_t *part_fd,
               const uint32_t *iso_fd) {
   r_printf("Cleaning up...\n");
 
-  sync();
+  /* Flush only what this job wrote, the rest of the system
+     can keep its dirty pages */
+
+  flush_fs(TEMP_DIR);
+  flush_device((int32_t) *part_fd);
+  flush_device((int32_t) *dev_fd);
 
   umount(TEMP_DIR_ISO);
   ioctl(*loop_fd, LOOP_CLR_FD);
@@ -313,6 +262,74 @@ int make_loop_device(uint32_t *loop_fd) {
   return 0;
 }
 
+/* A loop device of its own on part of a file, taken from
+   loop-control so it stays clear of TEMP_LOOP and of whatever
+   else is using loop devices. It detaches itself on the last
+   close. */
+
+int make_loop_file(const char *path, uint64_t offset, uint64_t size,
+                   uint32_t *loop_fd) {
+  char node[32];
+  struct loop_info64 info;
+  int ctl, file_fd, dev_fd = -1;
+
+  if ((file_fd = open(path, O_RDWR)) < 0) {
+    r_printf("Opening %s failed: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if ((ctl = open("/dev/loop-control", O_RDWR)) < 0) {
+    r_printf("Opening loop control failed: %s\n", strerror(errno));
+    close(file_fd);
+    return -1;
+  }
+
+  /* Someone else can grab the free device in between */
+
+  for (int tries = 0; tries < 8 && dev_fd < 0; tries++) {
+    int n = ioctl(ctl, LOOP_CTL_GET_FREE);
+
+    if (n < 0) break;
+
+    snprintf(node, sizeof(node), "/dev/loop%d", n);
+
+    if ((dev_fd = open(node, O_RDWR)) < 0) break;
+
+    if (ioctl(dev_fd, LOOP_SET_FD, file_fd) < 0) {
+      close(dev_fd);
+      dev_fd = -1;
+      if (errno != EBUSY) break;
+    }
+  }
+
+  close(ctl);
+  close(file_fd);
+
+  if (dev_fd < 0) {
+    r_printf("Setting up a loop device failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  memset(&info, 0, sizeof(info));
+  info.lo_offset = offset;
+  info.lo_sizelimit = size;
+  info.lo_flags = LO_FLAGS_AUTOCLEAR;
+
+  if (ioctl(dev_fd, LOOP_SET_STATUS64, &info) < 0) {
+    r_printf("Loop setup on %s failed: %s\n", path, strerror(errno));
+    ioctl(dev_fd, LOOP_CLR_FD);
+    close(dev_fd);
+    return -1;
+  }
+
+  r_printf("Loop %s on %s at byte %llu\n", node, path,
+           (unsigned long long)offset);
+
+  *loop_fd = dev_fd;
+
+  return 0;
+}
+
 int mount_device_to_temp(const int32_t *file_system) {
   switch (*file_system) {
     case FS_FAT32:
@@ -329,7 +346,16 @@ int mount_device_to_temp(const int32_t *file_system) {
       }
       r_printf("Mount OK\n");
       break;
+    case FS_EXFAT:
+      if (mount(TEMP_PART, TEMP_DIR, MOUNT_EXFAT, MS_MGC_VAL, NULL) < 0) {
+        r_printf("Device mount error: %s\n", strerror(errno));
+        return -1;
+      }
+      r_printf("Mount OK\n");
+      break;
   }
+
+  return 0;
 }
 
 int mount_iso_to_loop(const char *isopath, int isopath_len,
@@ -359,6 +385,18 @@ int mount_iso_to_loop(const char *isopath, int isopath_len,
     return -1;
   }
 
+  /* Have the loop device read the image with O_DIRECT, so
+     the image does not end up in the page cache a second time
+     under the loop device */
+
+  if (ioctl(*loop_fd, LOOP_SET_DIRECT_IO, 1) < 0) {
+    r_printf(" * Loop direct I/O unavailable: %s\n", strerror(errno));
+  } else {
+    r_printf(" * Loop direct I/O enabled\n");
+  }
+
+  fadvise_stream(*iso_fd);
+
   struct loop_info64 info;
 
   info.lo_offset = 0;
@@ -1,16 +1,49 @@
-#define TEMP_DEVICE "/dev/rufus_device"
-#define TEMP_LOOP "/dev/rufus_loop"
-#define TEMP_PART "/dev/rufus_device_partition"
+#ifndef MOUNTING_H
+#define MOUNTING_H
 
-#define TEMP_DIR "/mnt/rufus_rootfs/"
-#define TEMP_DIR_ISO "/mnt/rufus_isofs"
+#include "copy.h"
+
+#define TEMP_PATH_MAX 64
+
+/* The nodes and mount points a job goes through. Every job
+   gets the same ones unless temp_paths_tag() gives the process
+   names of its own, which the daemon does for each job it runs
+   so that jobs on different sticks do not trip over each other. */
+
+typedef struct temp_paths {
+  char device[TEMP_PATH_MAX];
+  char device_n[TEMP_PATH_MAX];
+  char loop[TEMP_PATH_MAX];
+  char part[TEMP_PATH_MAX];
+  char dir[TEMP_PATH_MAX];
+  char dir_iso[TEMP_PATH_MAX];
+} temp_paths_t;
+
+extern temp_paths_t temp_paths;
+
+#define TEMP_DEVICE temp_paths.device
+#define TEMP_DEVICE_N temp_paths.device_n
+#define TEMP_LOOP temp_paths.loop
+#define TEMP_PART temp_paths.part
+
+#define TEMP_DIR temp_paths.dir
+#define TEMP_DIR_ISO temp_paths.dir_iso
+
+void temp_paths_tag(const char *tag);
 
 int make_temp_device(uint8_t major, uint8_t minor, uint32_t *device_fd);
+int make_temp_device_at(const char *node, uint8_t major, uint8_t minor,
+                        uint32_t *device_fd);
 int make_temp_partition(uint8_t major, uint8_t minor, uint32_t *part_fd);
 int make_temp_dir(const char *path);
-int recursive_copy( char *src,  char *dest);
+int recursive_copy(char *src, char *dest, const copy_list_t *list, int threads,
+                   int depth);
 void clean_up(const uint32_t *dev_fd, const uint32_t *part_fd, const uint32_t *loop_fd,
               const uint32_t *iso_fd);
 int make_loop_device(uint32_t *loop_fd);
+int make_loop_file(const char *path, uint64_t offset, uint64_t size,
+                   uint32_t *loop_fd);
 int mount_device_to_temp(const int32_t *file_system);
 int mount_iso_to_loop(const char *isopath, int isopath_len, const uint32_t *loop_fd,  uint32_t *iso_fd);
+
+#endif // MOUNTING_H
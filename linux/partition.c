@@ -6,9 +6,15 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
 
 #include "log.h"
 #include "partition.h"
+#include "ioqueue.h"
+#include "blkdev.h"
+#include "flush.h"
+#include "trace.h"
 #include "definitions.h"
 
 #define ASSERT(x, y)  \
@@ -22,10 +28,18 @@
     return -1;        \
   }
 
+#define WIPE_BLOCK_SIZE (4 << 20)
+#define WIPE_ZEROOUT_CHUNK (256ULL << 20)
+
 /* WARNING: GNU chose the integer 0 to indicate an error, the code
    below is OK! Why they did that is beyond me. */
 
 int nuke_and_partition(const char *path_dev, const int table, const int fs) {
+  return nuke_and_partition_aligned(path_dev, table, fs, 0);
+}
+
+int nuke_and_partition_aligned(const char *path_dev, const int table,
+                               const int fs, uint64_t align) {
   r_printf("Using device: %s\n", path_dev);
 
   PedDevice *device;
@@ -47,6 +61,12 @@ int nuke_and_partition(const char *path_dev, const int table, const int fs) {
       fstype = ped_file_system_type_get(FAT32);
       r_printf("* Marking partition type as FAT32\n");
       break;
+    case FS_EXFAT:
+      /* libparted has no exFAT type, but exFAT uses the same
+         0x07 and basic data types as NTFS */
+      fstype = ped_file_system_type_get(NTFS);
+      r_printf("* Marking partition type as exFAT\n");
+      break;
     default:
       r_printf("Internal error: unknown fs type.\n");
       return -1;
@@ -84,8 +104,28 @@ int nuke_and_partition(const char *path_dev, const int table, const int fs) {
   disk = ped_disk_new_fresh(device, type);
   set_progress_bar(50);
   ASSERT(disk, "Failed to nuke the USB. Full RAM?\n");
-  part =
-      ped_partition_new(disk, PED_PARTITION_NORMAL, fstype, 1, device->length);
+
+  /* Start the partition on an erase block boundary, the FAT
+     layout inside of it is aligned relative to that */
+
+  int dev_fd;
+
+  if (align == 0) {
+    align = BLK_ALIGN_MIN;
+
+    if ((dev_fd = open(path_dev, O_RDONLY)) >= 0) {
+      align = blk_alignment(dev_fd);
+      close(dev_fd);
+    }
+  }
+
+  PedSector start = align / device->sector_size;
+
+  r_printf("* Aligning partition to %llu KiB, starting at sector %lld\n",
+           (unsigned long long) (align >> 10), (long long) start);
+
+  part = ped_partition_new(disk, PED_PARTITION_NORMAL, fstype, start,
+                           device->length);
   ASSERT(part, "Failed to construct partition Full RAM?\n");
 
   set_progress_bar(60);
@@ -113,48 +153,199 @@ int nuke_and_partition(const char *path_dev, const int table, const int fs) {
   set_progress_bar(100);
   ped_device_free_all();
 
-  sync();
+  /* Only the new table has to reach the device */
+
+  if ((dev_fd = open(path_dev, O_RDONLY)) >= 0) {
+    flush_device(dev_fd);
+    close(dev_fd);
+  }
 
   return 0;
 }
 
-int full_wipe(const uint32_t *device_fd) {
+/* Where the first partition of a table written above sits,
+   in bytes. Works on a device as well as on an image file. */
+
+int partition_bounds(const char *path_dev, uint64_t *start, uint64_t *len) {
+  PedDevice *device;
+  PedDisk *disk;
+  PedPartition *part;
+
+  device = ped_device_get(path_dev);
+  ASSERT(device, "Opening device failed.\n");
 
-  set_progress_bar(0);
+  disk = ped_disk_new(device);
+  ASSERT(disk, "No partition table found.\n");
 
-  size_t file_size;
+  part = ped_disk_get_partition(disk, 1);
 
-  if (ioctl(*device_fd, BLKGETSIZE, &file_size) < 0) {
-    perror("ioctl");
+  if (part == NULL) {
+    r_printf("The partition table holds no partition.\n");
+    ped_disk_destroy(disk);
+    ped_device_free_all();
     return -1;
   }
 
-  file_size += file_size * 512;
-  r_printf("Fully wiping %ld bytes on fd %d\n", file_size, *device_fd);
+  *start = (uint64_t)part->geom.start * device->sector_size;
+  *len = (uint64_t)part->geom.length * device->sector_size;
+
+  ped_disk_destroy(disk);
+  ped_device_free_all();
+
+  return 0;
+}
+
+/* Full wipe is a chain of strategies, cheapest first. Discard
+   lets the flash controller drop its mappings but does not promise
+   that the blocks read back as zeros afterwards, so it is always
+   followed by one of the zeroing steps. */
+
+static void wipe_discard(int fd, uint64_t size) {
+
+  if (!blk_discard_supported(fd)) {
+    r_printf("* Device does not support discard, skipping\n");
+    return;
+  }
+
+  if (blk_discard(fd, 0, size, 1) == 0) {
+    r_printf("* Secure discard OK\n");
+    return;
+  }
+
+  if (blk_discard(fd, 0, size, 0) == 0) {
+    r_printf("* Discard OK\n");
+    return;
+  }
+
+  r_printf("* Discard refused: %s\n", strerror(errno));
+}
+
+/* Returns how far BLKZEROOUT got, which is the whole device
+   unless the kernel refuses it part way */
+
+static uint64_t wipe_zeroout(int fd, uint64_t size) {
+  uint64_t offset = 0;
+
+  while (offset < size) {
+
+    uint64_t len = WIPE_ZEROOUT_CHUNK;
+
+    if (size - offset < len) len = size - offset;
+
+    /* The write below stops at once */
+
+    if (job_cancelled()) break;
+
+    TRACE_NOW(traced);
+
+    if (blk_zeroout(fd, offset, len) < 0) {
+      r_printf("* BLKZEROOUT stopped at byte %llu: %s\n",
+               (unsigned long long) offset, strerror(errno));
+      break;
+    }
+
+    TRACE_SPAN(TRACE_WRITE, "BLKZEROOUT", traced);
+
+    offset += len;
+    progress_bytes(offset, size);
+  }
+
+  return offset;
+}
+
+static int wipe_write(int fd, uint64_t offset, uint64_t size,
+                      unsigned int depth) {
 
-  char buffer[4096];
+  /* The queue hands out zeroed buffers and nothing ever
+     writes into them, so they can be reused as-is */
 
-  for (uint64_t i = 0; i < sizeof(buffer); i++) {
-    buffer[i] = 0x00;
+  size_t block = blk_chunk(fd, WIPE_BLOCK_SIZE);
+  ioqueue_t *queue = ioqueue_new(depth, block);
+
+  if (queue == NULL) {
+    r_printf("Failed to set up I/O queue: %s\n", strerror(errno));
+    return -1;
   }
 
-  ssize_t temp;
-  size_t temp2 = 0;
-  double copied = 0;
+  r_printf("* Writing zeros from byte %llu (%s, depth %u x %zu KiB)\n",
+           (unsigned long long) offset, ioqueue_backend_name(queue),
+           ioqueue_depth(queue), block >> 10);
+
+  uint64_t start = offset;
+  writeback_t wb;
 
-  while ((temp = write(*device_fd, buffer, 4096)) > 0) {
+  writeback_init(&wb, fd, start);
 
-    copied += temp;
-    temp2 += temp;
+  while (offset < size) {
 
-    if (temp2 > 50000000) {
-      set_progress_bar((int)(((file_size - (file_size - copied)) / file_size) * 100.0f));
-      temp2 = 0;
+    size_t len = block;
+    void *buffer;
+
+    if (size - offset < len) len = size - offset;
+
+    if (job_cancelled()) {
+      r_printf("Wipe cancelled at byte %llu\n", (unsigned long long) offset);
+      ioqueue_drain(queue);
+      ioqueue_free(queue);
+      errno = ECANCELED;
+      return -1;
     }
 
+    if ((buffer = ioqueue_buffer(queue)) == NULL ||
+        ioqueue_write(queue, fd, buffer, len, offset) < 0) {
+      r_printf("Wipe failed near byte %llu: %s\n",
+               (unsigned long long) offset, strerror(errno));
+      ioqueue_free(queue);
+      return -1;
+    }
+
+    offset += len;
+    progress_bytes(writeback_advance(&wb, start + ioqueue_completed(queue)), size);
+  }
+
+  if (ioqueue_drain(queue) < 0) {
+    r_printf("Wipe failed: %s\n", strerror(errno));
+    ioqueue_free(queue);
+    return -1;
+  }
+
+  ioqueue_free(queue);
+
+  return 0;
+}
+
+int full_wipe(const uint32_t *device_fd, unsigned int depth) {
+
+  uint64_t file_size;
+
+  if (blk_size(*device_fd, &file_size) < 0 || file_size == 0) {
+    r_printf("Failed to get device size: %s\n", strerror(errno));
+    return -1;
+  }
+
+  r_printf("Fully wiping %llu bytes on fd %d\n",
+           (unsigned long long) file_size, *device_fd);
+
+  TRACE_NOW(traced);
+
+  wipe_discard(*device_fd, file_size);
+
+  TRACE_SPAN(TRACE_WRITE, "discard", traced);
+
+  uint64_t zeroed = wipe_zeroout(*device_fd, file_size);
+
+  if (zeroed == file_size) {
+    r_printf("* BLKZEROOUT OK\n");
+  } else if (wipe_write(*device_fd, zeroed, file_size, depth) < 0) {
+    return -1;
   }
 
-  sync();
+  if (flush_device(*device_fd) < 0) {
+    r_printf("Failed to flush device: %s\n", strerror(errno));
+    return -1;
+  }
+
+  set_progress_bar(100);
 
   return 0;
 }
@@ -5,4 +5,11 @@
 #define NTFS "ntfs"
 
 int nuke_and_partition(const char *path_dev, const int table, const int fs);
-int full_wipe(const uint32_t *device_fd);
+
+/* Same, with the partition start given instead of taken from
+   the device, for image files that are written to one later */
+
+int nuke_and_partition_aligned(const char *path_dev, const int table,
+                               const int fs, uint64_t align);
+int partition_bounds(const char *path_dev, uint64_t *start, uint64_t *len);
+int full_wipe(const uint32_t *device_fd, unsigned int depth);
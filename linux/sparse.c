@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "../log.h"
+#include "blkdev.h"
+#include "sparse.h"
+
+/* ---- Zero detection ---- */
+
+static int (*zero_impl)(const uint8_t *p, size_t len);
+static pthread_once_t zero_once = PTHREAD_ONCE_INIT;
+
+static int is_zero_sw(const uint8_t *p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    if (*p++ != 0) return 0;
+    len--;
+  }
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t w;
+
+    memcpy(&w, p, sizeof(w));
+    if (w != 0) return 0;
+  }
+
+  while (len-- > 0) {
+    if (*p++ != 0) return 0;
+  }
+
+  return 1;
+}
+
+/* Vector paths OR 4 vectors together and test once per
+   round, which is as fast as memory can feed them */
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2"))) static int is_zero_avx2(const uint8_t *p,
+                                                        size_t len) {
+  for (; len >= 128; p += 128, len -= 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *)(p + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(p + 96));
+    __m256i acc = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+
+    if (!_mm256_testz_si256(acc, acc)) return 0;
+  }
+
+  return is_zero_sw(p, len);
+}
+
+static int is_zero_sse2(const uint8_t *p, size_t len) {
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; len >= 64; p += 64, len -= 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(p + 48));
+    __m128i acc = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) return 0;
+  }
+
+  return is_zero_sw(p, len);
+}
+
+#elif defined(__aarch64__)
+
+static int is_zero_neon(const uint8_t *p, size_t len) {
+  for (; len >= 64; p += 64, len -= 64) {
+    uint8x16_t acc = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+                              vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+
+    if (vmaxvq_u8(acc) != 0) return 0;
+  }
+
+  return is_zero_sw(p, len);
+}
+
+#endif
+
+static void zero_init(void) {
+#if defined(__x86_64__)
+  zero_impl = __builtin_cpu_supports("avx2") ? is_zero_avx2 : is_zero_sse2;
+#elif defined(__aarch64__)
+  zero_impl = is_zero_neon;
+#else
+  zero_impl = is_zero_sw;
+#endif
+}
+
+int sparse_is_zero(const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+
+  pthread_once(&zero_once, zero_init);
+
+  /* Most blocks with data give themselves away in the first
+     few bytes, check those before setting up the vectors */
+
+  if (len >= 16 && !is_zero_sw(p, 16)) return 0;
+
+  return zero_impl(p, len);
+}
+
+/* ---- Holes ---- */
+
+int sparse_next_data(int fd, uint64_t offset, uint64_t size, uint64_t *start,
+                     uint64_t *end) {
+  off_t data = lseek(fd, offset, SEEK_DATA);
+
+  if (data < 0) return errno == ENXIO ? 1 : -1;
+  if ((uint64_t)data >= size) return 1;
+
+  off_t hole = lseek(fd, data, SEEK_HOLE);
+
+  if (hole < 0) return -1;
+
+  *start = data;
+  *end = (uint64_t)hole < size ? (uint64_t)hole : size;
+
+  return 0;
+}
+
+/* ---- Skipped ranges ---- */
+
+typedef struct sparse_range {
+  uint64_t offset;
+  uint64_t len;
+} sparse_range_t;
+
+struct sparse {
+  pthread_mutex_t lock;
+  sparse_range_t *ranges;
+  uint32_t count;
+  uint32_t capacity;
+  uint64_t bytes;
+  int fd;
+};
+
+sparse_t *sparse_new(int fd) {
+  sparse_t *s = (sparse_t *)calloc(1, sizeof(sparse_t));
+
+  if (s == NULL) return NULL;
+
+  pthread_mutex_init(&s->lock, NULL);
+  s->fd = fd;
+
+  return s;
+}
+
+void sparse_free(sparse_t *s) {
+  if (s == NULL) return;
+
+  pthread_mutex_destroy(&s->lock);
+  free(s->ranges);
+  free(s);
+}
+
+int sparse_add(sparse_t *s, uint64_t offset, uint64_t len) {
+  if (len == 0) return 0;
+
+  pthread_mutex_lock(&s->lock);
+
+  /* Blocks mostly come in order, so the last range usually
+     just grows */
+
+  sparse_range_t *last = s->count > 0 ? &s->ranges[s->count - 1] : NULL;
+
+  if (last != NULL && last->offset + last->len == offset) {
+    last->len += len;
+  } else {
+    if (s->count == s->capacity) {
+      uint32_t capacity = s->capacity ? s->capacity * 2 : SPARSE_RANGES_INITIAL;
+      sparse_range_t *ranges =
+          (sparse_range_t *)realloc(s->ranges, capacity * sizeof(sparse_range_t));
+
+      if (ranges == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+      }
+
+      s->ranges = ranges;
+      s->capacity = capacity;
+    }
+
+    s->ranges[s->count].offset = offset;
+    s->ranges[s->count].len = len;
+    s->count++;
+  }
+
+  s->bytes += len;
+
+  pthread_mutex_unlock(&s->lock);
+
+  return 0;
+}
+
+uint64_t sparse_bytes(sparse_t *s) {
+  pthread_mutex_lock(&s->lock);
+  uint64_t bytes = s->bytes;
+  pthread_mutex_unlock(&s->lock);
+
+  return bytes;
+}
+
+static int range_cmp(const void *a, const void *b) {
+  const sparse_range_t *x = (const sparse_range_t *)a;
+  const sparse_range_t *y = (const sparse_range_t *)b;
+
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+int sparse_fill(sparse_t *s) {
+  uint32_t merged = 0;
+
+  if (s->count == 0) return 0;
+
+  qsort(s->ranges, s->count, sizeof(sparse_range_t), range_cmp);
+
+  for (uint32_t i = 1; i < s->count; i++) {
+    sparse_range_t *last = &s->ranges[merged];
+
+    if (s->ranges[i].offset <= last->offset + last->len) {
+      uint64_t end = s->ranges[i].offset + s->ranges[i].len;
+
+      if (end > last->offset + last->len) last->len = end - last->offset;
+    } else {
+      s->ranges[++merged] = s->ranges[i];
+    }
+  }
+
+  s->count = merged + 1;
+
+  r_printf("Skipped %llu zero bytes in %u ranges, %s\n",
+           (unsigned long long)s->bytes, s->count,
+           blk_write_zeroes_supported(s->fd) ? "the device zeroes them"
+                                             : "writing zeros there");
+
+  for (uint32_t i = 0; i < s->count; i++) {
+    sparse_range_t *r = &s->ranges[i];
+
+    if (blk_zero_range(s->fd, r->offset, r->len) < 0) {
+      r_printf("Failed to zero bytes %llu-%llu: %s\n",
+               (unsigned long long)r->offset,
+               (unsigned long long)(r->offset + r->len - 1), strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
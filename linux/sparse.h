@@ -0,0 +1,39 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPARSE_RANGES_INITIAL 64
+
+/* All zero, on SSE2/AVX2 or NEON, bailing out at the first
+   byte that is not */
+
+int sparse_is_zero(const void *buf, size_t len);
+
+/* The next run of data in a file at or after offset, found
+   with SEEK_DATA/SEEK_HOLE without reading anything. Returns 0
+   with the run in start and end, 1 when the rest of the file
+   is a hole and -1 when the file system can not tell, then
+   the whole file counts as data. */
+
+int sparse_next_data(int fd, uint64_t offset, uint64_t size, uint64_t *start,
+                     uint64_t *end);
+
+/* The ranges of a raw write to fd that were not written
+   because they hold nothing but zeros. Adding is safe from
+   several threads. sparse_fill() runs once everything else is
+   on the device and zeroes them, by WRITE ZEROES where the
+   device has it and by writing zeros where it does not. A
+   discard would be cheaper but does not promise zeros, and
+   what the stick held before must not show through. */
+
+typedef struct sparse sparse_t;
+
+sparse_t *sparse_new(int fd);
+void sparse_free(sparse_t *s);
+int sparse_add(sparse_t *s, uint64_t offset, uint64_t len);
+uint64_t sparse_bytes(sparse_t *s);
+int sparse_fill(sparse_t *s);
+
+#endif // SPARSE_H
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <time.h>
+
+#include "../log.h"
+#include "taskgraph.h"
+#include "trace.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void taskgraph_init(taskgraph_t *g) {
+  memset(g, 0, sizeof(*g));
+  g->failed = -1;
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->cond, NULL);
+}
+
+int taskgraph_add(taskgraph_t *g, const char *name, task_run_fn run,
+                  task_cleanup_fn cleanup, void *arg, uint32_t deps) {
+  if (g->count == TASKGRAPH_MAX || (deps >> g->count) != 0) {
+    r_printf("Internal error: can not add task %s\n", name);
+    return -1;
+  }
+
+  task_t *t = &g->tasks[g->count];
+
+  t->name = name;
+  t->run = run;
+  t->cleanup = cleanup;
+  t->arg = arg;
+  t->deps = deps;
+  t->state = TASK_WAITING;
+
+  return g->count++;
+}
+
+/* Called with the lock held */
+
+static int next_ready(taskgraph_t *g) {
+  uint32_t done = 0;
+
+  for (int i = 0; i < g->done; i++) done |= TASK_DEP(g->order[i]);
+
+  for (int i = 0; i < g->count; i++) {
+    task_t *t = &g->tasks[i];
+
+    if (t->state == TASK_WAITING && (t->deps & done) == t->deps) return i;
+  }
+
+  return -1;
+}
+
+/* Every thread takes whatever is ready. With nothing ready
+   and nothing running either, no task can become ready any
+   more and the thread is done. */
+
+static void *runner(void *arg) {
+  taskgraph_t *g = (taskgraph_t *)arg;
+
+  pthread_mutex_lock(&g->lock);
+
+  for (;;) {
+    int i = g->failed < 0 ? next_ready(g) : -1;
+
+    if (i < 0) {
+      if (g->running == 0) break;
+
+      pthread_cond_wait(&g->cond, &g->lock);
+      continue;
+    }
+
+    task_t *t = &g->tasks[i];
+
+    t->state = TASK_RUNNING;
+    g->running++;
+    pthread_mutex_unlock(&g->lock);
+
+    double start = now();
+    TRACE_NOW(traced);
+    int ret = t->run(t->arg);
+
+    TRACE_SPAN(TRACE_TASK, t->name, traced);
+
+    r_log(LOG_LEVEL_VERBOSE, "Task %s %s after %.2f s\n", t->name,
+          ret < 0 ? "failed" : "done", now() - start);
+
+    pthread_mutex_lock(&g->lock);
+    g->running--;
+
+    if (ret < 0) {
+      t->state = TASK_FAILED;
+      if (g->failed < 0) g->failed = i;
+    } else {
+      t->state = TASK_DONE;
+      g->order[g->done++] = i;
+    }
+
+    pthread_cond_broadcast(&g->cond);
+  }
+
+  pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+
+  return NULL;
+}
+
+int taskgraph_run(taskgraph_t *g, int threads) {
+  pthread_t helpers[TASKGRAPH_MAX];
+  int started = 0;
+
+  if (threads > g->count) threads = g->count;
+
+  /* The calling thread is one of them */
+
+  for (int i = 1; i < threads; i++) {
+    if (pthread_create(&helpers[started], NULL, runner, g) != 0) break;
+    started++;
+  }
+
+  runner(g);
+
+  for (int i = 0; i < started; i++) pthread_join(helpers[i], NULL);
+
+  if (g->failed >= 0) {
+    r_printf("%s failed, %d of %d steps done\n", g->tasks[g->failed].name,
+             g->done, g->count);
+    return -1;
+  }
+
+  return g->done == g->count ? 0 : -1;
+}
+
+const char *taskgraph_failed(const taskgraph_t *g) {
+  return g->failed >= 0 ? g->tasks[g->failed].name : NULL;
+}
+
+void taskgraph_finish(taskgraph_t *g) {
+  for (int i = g->done - 1; i >= 0; i--) {
+    task_t *t = &g->tasks[g->order[i]];
+
+    if (t->cleanup != NULL) t->cleanup(t->arg);
+  }
+
+  pthread_cond_destroy(&g->cond);
+  pthread_mutex_destroy(&g->lock);
+}
@@ -0,0 +1,66 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define TASKGRAPH_MAX 32
+#define TASKGRAPH_THREADS 4
+
+#define TASK_DEP(id) (1u << (id))
+
+#define TASK_WAITING 0
+#define TASK_RUNNING 1
+#define TASK_DONE 2
+#define TASK_FAILED 3
+
+/* A job split into tasks that each wait for the ones they
+   depend on, the rest run at the same time on a few threads.
+   When a task fails nothing new is started, the ones already
+   running finish, and everything that never got to run is
+   left alone.
+
+   A task can come with a cleanup for what it set up. After
+   the run, taskgraph_finish() calls the cleanups of the tasks
+   that did their work, the last one done first, so a task is
+   always cleaned up before whatever it depended on. A task
+   that fails has to undo its own half done work. */
+
+typedef int (*task_run_fn)(void *arg);
+typedef void (*task_cleanup_fn)(void *arg);
+
+typedef struct task {
+  const char *name;
+  task_run_fn run;
+  task_cleanup_fn cleanup;
+  void *arg;
+  uint32_t deps;
+  int state;
+} task_t;
+
+typedef struct taskgraph {
+  task_t tasks[TASKGRAPH_MAX];
+  uint8_t order[TASKGRAPH_MAX];
+  int count;
+  int done;
+  int running;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} taskgraph_t;
+
+void taskgraph_init(taskgraph_t *g);
+
+/* Returns the task's id for TASK_DEP(), tasks can only depend
+   on ones added before them */
+
+int taskgraph_add(taskgraph_t *g, const char *name, task_run_fn run,
+                  task_cleanup_fn cleanup, void *arg, uint32_t deps);
+
+/* Returns 0 once every task is done, -1 when one failed */
+
+int taskgraph_run(taskgraph_t *g, int threads);
+const char *taskgraph_failed(const taskgraph_t *g);
+void taskgraph_finish(taskgraph_t *g);
+
+#endif // TASKGRAPH_H
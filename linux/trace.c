@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#ifdef RUFUSL_TRACE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+
+typedef struct trace_event {
+  uint64_t start;
+  uint64_t dur;
+  uint32_t tid;
+  uint8_t cls;
+  char name[TRACE_NAME_MAX];
+} trace_event_t;
+
+/* Log-linear buckets: the top TRACE_SUB_BITS + 1 bits of the
+   latency in ns pick the bucket, so every bucket is within
+   12.5% of what landed in it */
+
+typedef struct trace_hist {
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint32_t buckets[TRACE_BUCKETS];
+} trace_hist_t;
+
+/* One per thread. A thread that exits gives its buffer back
+   for the next one, with the events it recorded still in it. */
+
+typedef struct trace_buf {
+  struct trace_buf *next;
+  int in_use;
+  uint32_t used;
+  uint64_t dropped;
+  trace_hist_t hist[TRACE_CLASSES];
+  trace_event_t events[TRACE_EVENTS_MAX];
+} trace_buf_t;
+
+static const char *class_names[TRACE_CLASSES] = {
+    "phase", "task", "open", "read", "write", "fsync", "mkdir", "file"};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static trace_buf_t *buffers = NULL;
+static __thread trace_buf_t *mine = NULL;
+static uint64_t job_start = 0;
+static unsigned int job_seq = 0;
+static char job_name[32];
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void buf_reset(trace_buf_t *b) {
+  b->used = 0;
+  b->dropped = 0;
+  memset(b->hist, 0, sizeof(b->hist));
+}
+
+static void buf_release(void *arg) {
+  pthread_mutex_lock(&trace_lock);
+  ((trace_buf_t *)arg)->in_use = 0;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static void make_key(void) { pthread_key_create(&trace_key, buf_release); }
+
+static trace_buf_t *buf_get(void) {
+  trace_buf_t *b;
+
+  if (mine != NULL) return mine;
+
+  pthread_once(&trace_once, make_key);
+  pthread_mutex_lock(&trace_lock);
+
+  for (b = buffers; b != NULL && b->in_use; b = b->next) {
+  }
+
+  if (b == NULL && (b = malloc(sizeof(*b))) != NULL) {
+    buf_reset(b);
+    b->next = buffers;
+    buffers = b;
+  }
+
+  if (b != NULL) b->in_use = 1;
+
+  pthread_mutex_unlock(&trace_lock);
+
+  if (b != NULL) pthread_setspecific(trace_key, b);
+
+  return mine = b;
+}
+
+static unsigned int bucket_of(uint64_t ns) {
+  if (ns < (1u << TRACE_SUB_BITS)) return ns;
+
+  unsigned int msb = 63 - __builtin_clzll(ns);
+  unsigned int sub =
+      (ns >> (msb - TRACE_SUB_BITS)) & ((1u << TRACE_SUB_BITS) - 1);
+
+  return ((msb - TRACE_SUB_BITS + 1) << TRACE_SUB_BITS) + sub;
+}
+
+/* The largest latency that lands in bucket i */
+
+static uint64_t bucket_top(unsigned int i) {
+  if (i < (1u << TRACE_SUB_BITS)) return i;
+
+  unsigned int msb = (i >> TRACE_SUB_BITS) + TRACE_SUB_BITS - 1;
+  uint64_t sub = i & ((1u << TRACE_SUB_BITS) - 1);
+
+  return (((1ULL << TRACE_SUB_BITS) + sub + 1) << (msb - TRACE_SUB_BITS)) - 1;
+}
+
+void trace_span(int cls, const char *name, uint64_t start) {
+  uint64_t end = trace_now();
+  uint64_t dur = end - start;
+  trace_buf_t *b = buf_get();
+
+  if (b == NULL) return;
+
+  trace_hist_t *h = &b->hist[cls];
+
+  h->count++;
+  h->total += dur;
+  if (dur > h->max) h->max = dur;
+  h->buckets[bucket_of(dur)]++;
+
+  if (b->used == TRACE_EVENTS_MAX) {
+    b->dropped++;
+    return;
+  }
+
+  trace_event_t *e = &b->events[b->used++];
+  size_t len = strlen(name);
+
+  /* Long paths keep their end, that is where the file name is */
+
+  if (len >= TRACE_NAME_MAX) name += len - (TRACE_NAME_MAX - 1);
+
+  e->start = start;
+  e->dur = dur;
+  e->tid = syscall(SYS_gettid);
+  e->cls = cls;
+  snprintf(e->name, sizeof(e->name), "%s", name);
+}
+
+void trace_job_begin(const char *job) {
+  pthread_mutex_lock(&trace_lock);
+
+  for (trace_buf_t *b = buffers; b != NULL; b = b->next) buf_reset(b);
+
+  snprintf(job_name, sizeof(job_name), "%s", job);
+  job_start = trace_now();
+  job_seq++;
+
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static void put_json_string(FILE *f, const char *s) {
+  fputc('"', f);
+
+  for (; *s; s++) {
+    unsigned char c = *s;
+
+    if (c == '"' || c == '\\') {
+      fprintf(f, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(f, "\\u%04x", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+
+  fputc('"', f);
+}
+
+static int write_json(const char *path, uint64_t *events) {
+  FILE *f = fopen(path, "w");
+  int first = 1;
+  int pid = getpid();
+
+  if (f == NULL) return -1;
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  for (trace_buf_t *b = buffers; b != NULL; b = b->next) {
+    for (uint32_t i = 0; i < b->used; i++) {
+      const trace_event_t *e = &b->events[i];
+      uint64_t ts = e->start > job_start ? e->start - job_start : 0;
+
+      fprintf(f, "%s{\"name\":", first ? "" : ",\n");
+      put_json_string(f, e->name);
+      fprintf(f, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"pid\":%d,\"tid\":%u}",
+              class_names[e->cls], ts / 1000.0, e->dur / 1000.0, pid, e->tid);
+
+      first = 0;
+      (*events)++;
+    }
+  }
+
+  fprintf(f, "\n]}\n");
+
+  return fclose(f);
+}
+
+static void format_ns(char *buf, size_t size, uint64_t ns) {
+  if (ns < 1000000ULL) {
+    snprintf(buf, size, "%.1f us", ns / 1e3);
+  } else if (ns < 1000000000ULL) {
+    snprintf(buf, size, "%.1f ms", ns / 1e6);
+  } else {
+    snprintf(buf, size, "%.2f s", ns / 1e9);
+  }
+}
+
+static uint64_t percentile(const trace_hist_t *h, unsigned int percent) {
+  uint64_t want = (h->count * percent + 99) / 100;
+  uint64_t seen = 0;
+
+  for (unsigned int i = 0; i < TRACE_BUCKETS; i++) {
+    seen += h->buckets[i];
+
+    if (seen >= want) return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+  }
+
+  return h->max;
+}
+
+void trace_job_end(void) {
+  trace_hist_t sum[TRACE_CLASSES];
+  char path[256];
+  const char *dir = getenv("RUFUSL_TRACE_DIR");
+  uint64_t events = 0, dropped = 0;
+
+  if (dir == NULL) dir = TRACE_DIR_DEFAULT;
+
+  pthread_mutex_lock(&trace_lock);
+
+  if (job_start == 0) {
+    pthread_mutex_unlock(&trace_lock);
+    return;
+  }
+
+  memset(sum, 0, sizeof(sum));
+
+  for (trace_buf_t *b = buffers; b != NULL; b = b->next) {
+    dropped += b->dropped;
+
+    for (int c = 0; c < TRACE_CLASSES; c++) {
+      sum[c].count += b->hist[c].count;
+      sum[c].total += b->hist[c].total;
+      if (b->hist[c].max > sum[c].max) sum[c].max = b->hist[c].max;
+
+      for (int i = 0; i < TRACE_BUCKETS; i++) {
+        sum[c].buckets[i] += b->hist[c].buckets[i];
+      }
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/rufusl-trace-%s-%d-%u.json", dir, job_name,
+           (int)getpid(), job_seq);
+
+  if (write_json(path, &events) < 0) {
+    r_printf("Failed to write the trace to %s: %s\n", path, strerror(errno));
+  } else {
+    r_printf("Trace of the %s job: %llu events, %llu dropped, in %s\n", job_name,
+             (unsigned long long)events, (unsigned long long)dropped, path);
+  }
+
+  r_printf("  %-6s %8s %10s %10s %10s %10s\n", "class", "count", "p50", "p99",
+           "max", "total");
+
+  for (int c = 0; c < TRACE_CLASSES; c++) {
+    char p50[16], p99[16], max[16], total[16];
+
+    if (sum[c].count == 0) continue;
+
+    format_ns(p50, sizeof(p50), percentile(&sum[c], 50));
+    format_ns(p99, sizeof(p99), percentile(&sum[c], 99));
+    format_ns(max, sizeof(max), sum[c].max);
+    format_ns(total, sizeof(total), sum[c].total);
+
+    r_printf("  %-6s %8llu %10s %10s %10s %10s\n", class_names[c],
+             (unsigned long long)sum[c].count, p50, p99, max, total);
+  }
+
+  job_start = 0;
+
+  pthread_mutex_unlock(&trace_lock);
+}
+
+#endif
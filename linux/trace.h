@@ -0,0 +1,62 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/* Where the time of a job goes. Built in with RUFUSL_TRACE
+   only ("qmake CONFIG+=trace"), otherwise every TRACE_ macro
+   below is nothing at all.
+
+   Spans are timed with TRACE_NOW() at the start and
+   TRACE_SPAN() at the end. Every thread keeps its own events
+   and a latency histogram per class, so the hot paths never
+   take a lock. At the end of a job the events go out as a
+   Chrome trace JSON file, which Perfetto and chrome://tracing
+   open, and the log gets p50, p99 and max per class. */
+
+#define TRACE_EVENTS_MAX 16384
+#define TRACE_NAME_MAX 48
+#define TRACE_SUB_BITS 3
+#define TRACE_BUCKETS (64 << TRACE_SUB_BITS)
+#define TRACE_DIR_DEFAULT "/tmp"
+
+enum {
+  TRACE_PHASE,
+  TRACE_TASK,
+  TRACE_OPEN,
+  TRACE_READ,
+  TRACE_WRITE,
+  TRACE_FSYNC,
+  TRACE_MKDIR,
+  TRACE_FILE,
+  TRACE_CLASSES
+};
+
+#ifdef RUFUSL_TRACE
+
+uint64_t trace_now(void);
+void trace_span(int cls, const char *name, uint64_t start);
+
+/* Everything between the two is one job, the file goes to
+   RUFUSL_TRACE_DIR or TRACE_DIR_DEFAULT */
+
+void trace_job_begin(const char *job);
+void trace_job_end(void);
+
+#define TRACE_NOW(t) uint64_t t = trace_now()
+#define TRACE_MARK(v) ((v) = trace_now())
+#define TRACE_SPAN(cls, name, start) trace_span(cls, name, start)
+#define TRACE_JOB_BEGIN(job) trace_job_begin(job)
+#define TRACE_JOB_END() trace_job_end()
+
+#else
+
+#define TRACE_NOW(t) do { } while (0)
+#define TRACE_MARK(v) do { } while (0)
+#define TRACE_SPAN(cls, name, start) do { } while (0)
+#define TRACE_JOB_BEGIN(job) do { } while (0)
+#define TRACE_JOB_END() do { } while (0)
+
+#endif
+
+#endif // TRACE_H
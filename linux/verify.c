@@ -0,0 +1,720 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "../log.h"
+#include "blkdev.h"
+#include "flush.h"
+#include "verify.h"
+
+#define CRC32C_POLY 0x82F63B78
+#define PROGRESS_INTERVAL_MS 100
+#define SECTOR_SIZE 512
+
+/* ---- CRC32C ---- */
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_impl)(uint32_t crc, const uint8_t *p, size_t len);
+
+/* Slicing by 8, for CPUs without an instruction for it */
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len >= 8) {
+    uint64_t w;
+
+    memcpy(&w, p, sizeof(w));
+    w ^= crc;
+
+    crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff] ^
+          crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff] ^
+          crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff] ^
+          crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+
+    p += 8;
+    len -= 8;
+  }
+#endif
+
+  while (len-- > 0) crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+  return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc,
+                                                            const uint8_t *p,
+                                                            size_t len) {
+  uint64_t c = crc;
+
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+    len--;
+  }
+
+  while (len >= 8) {
+    uint64_t w;
+
+    memcpy(&w, p, sizeof(w));
+    c = _mm_crc32_u64(c, w);
+    p += 8;
+    len -= 8;
+  }
+
+  while (len-- > 0) c = _mm_crc32_u8((uint32_t)c, *p++);
+
+  return (uint32_t)c;
+}
+
+static int crc32c_hw_supported(void) { return __builtin_cpu_supports("sse4.2"); }
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc"))) static uint32_t crc32c_hw(uint32_t crc,
+                                                          const uint8_t *p,
+                                                          size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = __crc32cb(crc, *p++);
+    len--;
+  }
+
+  while (len >= 8) {
+    uint64_t w;
+
+    memcpy(&w, p, sizeof(w));
+    crc = __crc32cd(crc, w);
+    p += 8;
+    len -= 8;
+  }
+
+  while (len-- > 0) crc = __crc32cb(crc, *p++);
+
+  return crc;
+}
+
+static int crc32c_hw_supported(void) {
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#endif
+
+static void crc_init(void) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t crc = n;
+
+    for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+
+    crc_table[0][n] = crc;
+  }
+
+  for (uint32_t n = 0; n < 256; n++) {
+    for (int k = 1; k < 8; k++) {
+      uint32_t prev = crc_table[k - 1][n];
+      crc_table[k][n] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+    }
+  }
+
+  crc_impl = crc32c_sw;
+
+#if defined(__x86_64__) || defined(__aarch64__)
+  if (crc32c_hw_supported()) crc_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+  pthread_once(&crc_once, crc_init);
+
+  return ~crc_impl(~crc, (const uint8_t *)buf, len);
+}
+
+/* ---- Records of what was written ---- */
+
+typedef struct verify_record {
+  uint64_t offset;
+  uint32_t len;
+  uint32_t crc;
+} verify_record_t;
+
+typedef struct verify_range {
+  uint64_t offset;
+  uint64_t len;
+  char *name;
+} verify_range_t;
+
+struct verify {
+  pthread_mutex_t lock;
+  verify_record_t *records;
+  uint32_t count;
+  uint32_t capacity;
+  verify_range_t *names;
+  uint32_t name_count;
+  uint32_t name_capacity;
+  int incomplete;
+};
+
+verify_t *verify_new(void) {
+  verify_t *v = calloc(1, sizeof(verify_t));
+
+  if (v == NULL) return NULL;
+
+  pthread_mutex_init(&v->lock, NULL);
+
+  return v;
+}
+
+void verify_free(verify_t *v) {
+  if (v == NULL) return;
+
+  for (uint32_t i = 0; i < v->name_count; i++) free(v->names[i].name);
+
+  free(v->names);
+  free(v->records);
+  pthread_mutex_destroy(&v->lock);
+  free(v);
+}
+
+static uint32_t crc32c_zeros(uint32_t len) {
+  static const uint8_t zeros[4096];
+  uint32_t crc = 0;
+
+  while (len > 0) {
+    uint32_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+
+    crc = crc32c(crc, zeros, n);
+    len -= n;
+  }
+
+  return crc;
+}
+
+/* A piece of at most VERIFY_BLOCK_SIZE whose hash is known
+   already, the incremental write has them for every chunk */
+
+int verify_add_crc(verify_t *v, uint32_t crc, uint32_t len, uint64_t offset) {
+  int ret = 0;
+
+  if (v == NULL) return 0;
+
+  pthread_mutex_lock(&v->lock);
+
+  if (v->count == v->capacity) {
+    uint32_t capacity = v->capacity ? v->capacity * 2 : 1024;
+    verify_record_t *grown =
+        realloc(v->records, capacity * sizeof(verify_record_t));
+
+    if (grown == NULL) {
+      v->incomplete = 1;
+      ret = -1;
+    } else {
+      v->records = grown;
+      v->capacity = capacity;
+    }
+  }
+
+  if (ret == 0) {
+    v->records[v->count].offset = offset;
+    v->records[v->count].len = len;
+    v->records[v->count].crc = crc;
+    v->count++;
+  }
+
+  pthread_mutex_unlock(&v->lock);
+
+  return ret;
+}
+
+/* Hash outside of the lock, several threads of the queue can
+   be in here at once */
+
+int verify_add(verify_t *v, const void *buf, size_t len, uint64_t offset) {
+  const uint8_t *p = (const uint8_t *)buf;
+
+  if (v == NULL) return 0;
+
+  while (len > 0) {
+    uint32_t piece = len < VERIFY_BLOCK_SIZE ? len : VERIFY_BLOCK_SIZE;
+    uint32_t crc = p != NULL ? crc32c(0, p, piece) : crc32c_zeros(piece);
+
+    if (verify_add_crc(v, crc, piece, offset) < 0) return -1;
+
+    if (p != NULL) p += piece;
+    offset += piece;
+    len -= piece;
+  }
+
+  return 0;
+}
+
+int verify_hook(void *arg, const void *buf, size_t len, uint64_t offset) {
+  verify_add((verify_t *)arg, buf, len, offset);
+
+  return 0;
+}
+
+int verify_name(verify_t *v, uint64_t offset, uint64_t len, const char *name) {
+  if (v == NULL) return 0;
+
+  if (v->name_count == v->name_capacity) {
+    uint32_t capacity = v->name_capacity ? v->name_capacity * 2 : 256;
+    verify_range_t *grown = realloc(v->names, capacity * sizeof(verify_range_t));
+
+    if (grown == NULL) return -1;
+
+    v->names = grown;
+    v->name_capacity = capacity;
+  }
+
+  if ((v->names[v->name_count].name = strdup(name)) == NULL) return -1;
+
+  v->names[v->name_count].offset = offset;
+  v->names[v->name_count].len = len;
+  v->name_count++;
+
+  return 0;
+}
+
+static int record_compare(const void *a, const void *b) {
+  const verify_record_t *x = (const verify_record_t *)a;
+  const verify_record_t *y = (const verify_record_t *)b;
+
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int range_compare(const void *a, const void *b) {
+  const verify_range_t *x = (const verify_range_t *)a;
+  const verify_range_t *y = (const verify_range_t *)b;
+
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static const char *name_at(const verify_t *v, uint64_t offset) {
+  uint32_t lo = 0, hi = v->name_count;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (v->names[mid].offset <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo == 0) return NULL;
+
+  const verify_range_t *r = &v->names[lo - 1];
+
+  return offset < r->offset + r->len ? r->name : NULL;
+}
+
+/* ---- Reading it back ---- */
+
+typedef struct readback {
+  verify_t *v;
+  int fd;
+  int direct_fd;
+  uint32_t block_size;
+  uint64_t device_size;
+  uint8_t *bad;
+  atomic_uint next;
+  atomic_ullong bytes_done;
+  atomic_int running;
+} readback_t;
+
+/* O_DIRECT wants whole logical blocks in memory, on disk and
+   in length. A piece that does not line up, or would run past
+   the end of the device once rounded, goes through the page
+   cache, which the flush before emptied. */
+
+static void *readback_worker(void *arg) {
+  readback_t *r = (readback_t *)arg;
+  void *buf;
+
+  if (posix_memalign(&buf, 4096, VERIFY_BLOCK_SIZE + r->block_size) != 0) {
+    atomic_fetch_sub(&r->running, 1);
+    return NULL;
+  }
+
+  for (;;) {
+    uint32_t i = atomic_fetch_add(&r->next, 1);
+
+    if (i >= r->v->count || job_cancelled()) break;
+
+    const verify_record_t *rec = &r->v->records[i];
+    uint64_t want = (rec->len + r->block_size - 1) / r->block_size * r->block_size;
+    int fd = r->direct_fd;
+
+    if (fd < 0 || rec->offset % r->block_size != 0 ||
+        rec->offset + want > r->device_size)
+      fd = r->fd;
+
+    size_t done = 0;
+
+    if (fd == r->fd) want = rec->len;
+
+    while (done < rec->len) {
+      ssize_t ret = pread(fd, (uint8_t *)buf + done, want - done,
+                          rec->offset + done);
+
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret <= 0) break;
+
+      done += ret;
+    }
+
+    if (done < rec->len || crc32c(0, buf, rec->len) != rec->crc) r->bad[i] = 1;
+
+    atomic_fetch_add(&r->bytes_done, rec->len);
+  }
+
+  free(buf);
+  atomic_fetch_sub(&r->running, 1);
+
+  return NULL;
+}
+
+int verify_device(int fd, verify_t *v) {
+  pthread_t threads[VERIFY_THREADS];
+  struct timespec interval = {0, PROGRESS_INTERVAL_MS * 1000000L};
+  char path[64];
+  readback_t r;
+  int block_size = SECTOR_SIZE;
+  int started = 0;
+  int ranges = 0;
+
+  if (v == NULL || v->count == 0) return 0;
+
+  if (v->incomplete) {
+    r_printf("Ran out of memory while hashing, not everything can be checked\n");
+  }
+
+  /* Everything has to be on the device and out of the cache
+     before it is read back */
+
+  if (flush_device(fd) < 0) {
+    r_printf("Failed to flush device: %s\n", strerror(errno));
+    return -1;
+  }
+
+  qsort(v->records, v->count, sizeof(verify_record_t), record_compare);
+  qsort(v->names, v->name_count, sizeof(verify_range_t), range_compare);
+
+  memset(&r, 0, sizeof(r));
+  r.v = v;
+  r.fd = fd;
+
+  if (ioctl(fd, BLKSSZGET, &block_size) < 0 || block_size < SECTOR_SIZE)
+    block_size = SECTOR_SIZE;
+
+  r.block_size = block_size;
+
+  if (blk_size(fd, &r.device_size) < 0 ||
+      (r.bad = calloc(v->count, 1)) == NULL) {
+    r_printf("Failed to set up verification: %s\n", strerror(errno));
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+  if ((r.direct_fd = open(path, O_RDONLY | O_DIRECT)) < 0) {
+    r_printf("O_DIRECT not available (%s), reading back through the cache\n",
+             strerror(errno));
+  }
+
+  uint64_t total = 0;
+
+  for (uint32_t i = 0; i < v->count; i++) total += v->records[i].len;
+
+  r_printf("Verifying %llu bytes in %u pieces (%s, %d threads)\n",
+           (unsigned long long)total, v->count,
+           r.direct_fd >= 0 ? "O_DIRECT" : "buffered", VERIFY_THREADS);
+
+  atomic_init(&r.next, 0);
+  atomic_init(&r.bytes_done, 0);
+  atomic_init(&r.running, VERIFY_THREADS);
+
+  for (int i = 0; i < VERIFY_THREADS; i++) {
+    if (pthread_create(&threads[i], NULL, readback_worker, &r) != 0) {
+      atomic_fetch_sub(&r.running, VERIFY_THREADS - i);
+      break;
+    }
+
+    started++;
+  }
+
+  if (started == 0) {
+    r_printf("Could not start verification threads\n");
+    if (r.direct_fd >= 0) close(r.direct_fd);
+    free(r.bad);
+    return -1;
+  }
+
+  while (atomic_load(&r.running) > 0) {
+    progress_bytes(atomic_load(&r.bytes_done), total);
+    nanosleep(&interval, NULL);
+  }
+
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  if (job_cancelled()) {
+    r_printf("Verification cancelled\n");
+    if (r.direct_fd >= 0) close(r.direct_fd);
+    free(r.bad);
+    return -1;
+  }
+
+  progress_bytes(total, total);
+
+  /* Neighbouring bad pieces are one range, most of the time
+     a fake stick fails everything past its real size */
+
+  for (uint32_t i = 0; i < v->count; i++) {
+    if (!r.bad[i]) continue;
+
+    uint64_t start = v->records[i].offset;
+    uint64_t end = start + v->records[i].len;
+
+    while (i + 1 < v->count && r.bad[i + 1] && v->records[i + 1].offset <= end) {
+      i++;
+      if (v->records[i].offset + v->records[i].len > end)
+        end = v->records[i].offset + v->records[i].len;
+    }
+
+    if (ranges++ < VERIFY_REPORT_MAX) {
+      const char *name = name_at(v, start);
+
+      r_printf("Mismatch at bytes %llu-%llu (LBA %llu-%llu)%s%s\n",
+               (unsigned long long)start, (unsigned long long)end - 1,
+               (unsigned long long)start / SECTOR_SIZE,
+               (unsigned long long)(end - 1) / SECTOR_SIZE,
+               name != NULL ? " in " : "", name != NULL ? name : "");
+    }
+  }
+
+  if (ranges > VERIFY_REPORT_MAX) {
+    r_printf("... and %d more mismatching ranges\n", ranges - VERIFY_REPORT_MAX);
+  }
+
+  r_printf(ranges == 0 ? "Verification OK\n" : "Verification FAILED\n");
+
+  if (r.direct_fd >= 0) close(r.direct_fd);
+  free(r.bad);
+
+  return ranges;
+}
+
+/* ---- Files on a mounted copy ---- */
+
+typedef struct filecheck {
+  const char *src;
+  const char *dest;
+  const copy_list_t *list;
+  atomic_uint next;
+  atomic_uint bad;
+  atomic_ullong bytes_done;
+  atomic_int running;
+} filecheck_t;
+
+/* A short read of a regular file is its end, and asking for
+   the rest would leave the blocks that O_DIRECT needs */
+
+static ssize_t read_full(int fd, uint8_t *buf, size_t len, uint64_t off) {
+  for (;;) {
+    ssize_t ret = pread(fd, buf, len, off);
+
+    if (ret < 0 && errno == EINTR) continue;
+
+    return ret;
+  }
+}
+
+/* Returns the byte the copy first differs at, or UINT64_MAX
+   when the two are the same */
+
+static uint64_t compare_file(filecheck_t *c, const copy_entry_t *entry,
+                             uint8_t *a, uint8_t *b) {
+  char src_path[PATH_MAX];
+  char dest_path[PATH_MAX];
+  int in, out;
+  uint64_t bad = 0;
+
+  snprintf(src_path, sizeof(src_path), "%s/%s", c->src, entry->path);
+  snprintf(dest_path, sizeof(dest_path), "%s/%s", c->dest, entry->path);
+
+  if ((in = open(src_path, O_RDONLY)) < 0) return 0;
+
+  if ((out = open(dest_path, O_RDONLY | O_DIRECT)) < 0) {
+    /* Not every file system does O_DIRECT, drop what is
+       cached instead */
+
+    if ((out = open(dest_path, O_RDONLY)) < 0) {
+      close(in);
+      return 0;
+    }
+
+    fadvise_drop(out, 0, 0);
+  }
+
+  fadvise_stream(in);
+
+  uint64_t off = 0;
+
+  for (;;) {
+    ssize_t got_a = read_full(in, a, VERIFY_BLOCK_SIZE, off);
+    ssize_t got_b = read_full(out, b, VERIFY_BLOCK_SIZE, off);
+
+    if (got_a < 0 || got_b < 0 || got_a != got_b) {
+      bad = off;
+      break;
+    }
+
+    if (got_a == 0) {
+      bad = UINT64_MAX;
+      break;
+    }
+
+    /* Both sides are in hand here, comparing them says
+       exactly where they part */
+
+    if (memcmp(a, b, got_a) != 0) {
+      ssize_t at = 0;
+
+      while (a[at] == b[at]) at++;
+
+      bad = off + at;
+      break;
+    }
+
+    fadvise_drop(in, off, got_a);
+    atomic_fetch_add(&c->bytes_done, got_a);
+    off += got_a;
+  }
+
+  close(out);
+  close(in);
+
+  return bad;
+}
+
+static void *filecheck_worker(void *arg) {
+  filecheck_t *c = (filecheck_t *)arg;
+  void *a = NULL, *b = NULL;
+
+  if (posix_memalign(&a, 4096, VERIFY_BLOCK_SIZE) != 0 ||
+      posix_memalign(&b, 4096, VERIFY_BLOCK_SIZE) != 0) {
+    atomic_fetch_add(&c->bad, 1);
+    free(a);
+    atomic_fetch_sub(&c->running, 1);
+    return NULL;
+  }
+
+  for (;;) {
+    uint32_t i = atomic_fetch_add(&c->next, 1);
+
+    if (i >= c->list->count || job_cancelled()) break;
+
+    const copy_entry_t *entry = &c->list->entries[i];
+
+    if (entry->is_dir) continue;
+
+    uint64_t bad = compare_file(c, entry, (uint8_t *)a, (uint8_t *)b);
+
+    if (bad != UINT64_MAX) {
+      if (atomic_fetch_add(&c->bad, 1) < VERIFY_REPORT_MAX) {
+        r_printf("Mismatch in %s at byte %llu\n", entry->path,
+                 (unsigned long long)bad);
+      }
+    }
+  }
+
+  free(b);
+  free(a);
+  atomic_fetch_sub(&c->running, 1);
+
+  return NULL;
+}
+
+int verify_files(const char *src, const char *dest, const copy_list_t *list,
+                 int threads) {
+  pthread_t workers[COPY_THREADS_MAX];
+  struct timespec interval = {0, PROGRESS_INTERVAL_MS * 1000000L};
+  filecheck_t c;
+  int started = 0;
+
+  if (threads < 1) threads = 1;
+  if (threads > COPY_THREADS_MAX) threads = COPY_THREADS_MAX;
+
+  c.src = src;
+  c.dest = dest;
+  c.list = list;
+  atomic_init(&c.next, 0);
+  atomic_init(&c.bad, 0);
+  atomic_init(&c.bytes_done, 0);
+  atomic_init(&c.running, threads);
+
+  r_printf("Verifying %u files, %llu bytes (%d threads)\n", list->file_count,
+           (unsigned long long)list->total_bytes, threads);
+
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], NULL, filecheck_worker, &c) != 0) {
+      atomic_fetch_sub(&c.running, threads - i);
+      break;
+    }
+
+    started++;
+  }
+
+  if (started == 0) {
+    r_printf("Could not start verification threads\n");
+    return -1;
+  }
+
+  while (atomic_load(&c.running) > 0) {
+    progress_bytes(atomic_load(&c.bytes_done), list->total_bytes);
+    nanosleep(&interval, NULL);
+  }
+
+  for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+  if (job_cancelled()) {
+    r_printf("Verification cancelled\n");
+    return -1;
+  }
+
+  unsigned int bad = atomic_load(&c.bad);
+
+  if (bad > VERIFY_REPORT_MAX) {
+    r_printf("... and %u more mismatching files\n", bad - VERIFY_REPORT_MAX);
+  }
+
+  r_printf(bad == 0 ? "Verification OK\n" : "Verification FAILED\n");
+
+  return bad;
+}
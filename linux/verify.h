@@ -0,0 +1,49 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "copy.h"
+
+#define VERIFY_BLOCK_SIZE (1 << 20)
+#define VERIFY_THREADS 4
+#define VERIFY_REPORT_MAX 16
+
+/* CRC32C (Castagnoli), on the CPU's own instruction when it
+   has one: SSE4.2 on x86, the CRC extension on ARMv8 */
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Hashes of what went to the device, taken from the buffers
+   on their way out so that the source is only read once. Every
+   record is one piece at a device offset, verify_device() reads
+   the same pieces back with O_DIRECT and compares. A NULL buf
+   stands for len zeros that never went through a buffer.
+   Ranges can be given a name, so that a mismatch can say which
+   file it hit. All of these take a NULL verify_t and do
+   nothing. */
+
+typedef struct verify verify_t;
+
+verify_t *verify_new(void);
+void verify_free(verify_t *v);
+int verify_add(verify_t *v, const void *buf, size_t len, uint64_t offset);
+int verify_add_crc(verify_t *v, uint32_t crc, uint32_t len, uint64_t offset);
+int verify_hook(void *arg, const void *buf, size_t len, uint64_t offset);
+int verify_name(verify_t *v, uint64_t offset, uint64_t len, const char *name);
+
+/* Returns how many ranges did not match, 0 when everything
+   read back the way it was written, -1 when nothing could be
+   checked at all */
+
+int verify_device(int fd, verify_t *v);
+
+/* The file copy path never sees the data, the kernel moves it,
+   so there both sides are read again: the source as usual and
+   the copy with O_DIRECT. Returns how many files differ. */
+
+int verify_files(const char *src, const char *dest, const copy_list_t *list,
+                 int threads);
+
+#endif // VERIFY_H
@@ -0,0 +1,361 @@
+#include "log.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+extern "C" {
+#include "linux/trace.h"
+}
+
+/* The engine side of logging, with no Qt in it so that the
+   command line and the daemon can link it too. Whatever the
+   engines report goes to the sink that the front end set. */
+
+/* Lines go through a fixed ring that the worker threads append
+   to without allocating or locking, and the front end drains
+   it on a timer. Each slot's sequence number says whose turn it
+   is: 2 * lap while free, 2 * lap + 1 once a line is in it. */
+
+#define LOG_RING_SLOTS 4096
+#define LOG_LINE_MAX 512
+#define LOG_FULL_WAIT_MS 200
+
+struct log_slot {
+    std::atomic<uint64_t> seq;
+    char text[LOG_LINE_MAX];
+};
+
+static log_slot ring[LOG_RING_SLOTS];
+static std::atomic<uint64_t> ring_head(0);
+static uint64_t ring_tail = 0;
+static std::atomic<uint32_t> ring_dropped(0);
+static std::atomic<int> log_level(LOG_LEVEL_INFO);
+static std::atomic<int> cancel_asked(0);
+
+static log_sink_t sink;
+
+#define RATE_INTERVAL_MS 500
+#define RATE_EMA_ALPHA 0.3
+
+/* State of the running job's progress, written from the worker
+   thread and handed on to the sink */
+
+struct progress_state {
+    std::mutex lock;
+    bool active;
+    int total_weight;
+    int phase_start;
+    int phase_weight;
+    char phase_name[64];
+    int value;
+    int added;
+    std::chrono::steady_clock::time_point started;
+    int64_t sample_ms;
+    uint64_t sample_bytes;
+    uint64_t bytes;
+    double avg;
+#ifdef RUFUSL_TRACE
+    uint64_t phase_traced;
+#endif
+};
+
+static progress_state progress;
+
+static int64_t progress_elapsed() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - progress.started).count();
+}
+
+static void sink_progress(int value) {
+    if (sink.progress != NULL) sink.progress(sink.ctx, value);
+}
+
+static void sink_rate(double now, double avg, int eta) {
+    if (sink.rate != NULL) sink.rate(sink.ctx, now, avg, eta);
+}
+
+/* Set once by the front end, before any job runs */
+
+EXPORT_C void log_set_sink(const log_sink_t *with) {
+
+    const char *level = getenv("RUFUSL_LOG_LEVEL");
+
+    if (level != NULL) set_log_level(atoi(level));
+
+    sink = *with;
+}
+
+/*
+   r_printf(char *format, ...) can be called from either C or C++
+   and from any thread. It formats straight into a free slot of
+   the ring, and log_drain() picks up whatever piled up since
+   the last tick on the thread of the front end, so the log
+   window gets one insert and one scroll per batch instead of
+   per line.
+*/
+
+EXPORT_C void log_drain(void) {
+
+    char note[64];
+    uint32_t dropped;
+
+    for (;;) {
+        log_slot *slot = &ring[ring_tail % LOG_RING_SLOTS];
+        uint64_t lap = ring_tail / LOG_RING_SLOTS;
+
+        if (slot->seq.load(std::memory_order_acquire) != 2 * lap + 1) break;
+
+        if (sink.line != NULL) sink.line(sink.ctx, slot->text);
+        slot->seq.store(2 * lap + 2, std::memory_order_release);
+        ring_tail++;
+    }
+
+    if ((dropped = ring_dropped.exchange(0)) > 0 && sink.line != NULL) {
+        snprintf(note, sizeof(note), "[%u log lines dropped]\n", dropped);
+        sink.line(sink.ctx, note);
+    }
+}
+
+/* Claim the next slot. When the front end is a whole ring
+   behind, verbose lines are dropped right away and counted,
+   anything more important waits a bit for log_drain() to
+   catch up. */
+
+static log_slot *ring_claim(uint64_t *lap, int level) {
+
+    uint64_t pos = ring_head.load(std::memory_order_relaxed);
+    int waited = 0;
+
+    for (;;) {
+        log_slot *slot = &ring[pos % LOG_RING_SLOTS];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+
+        *lap = pos / LOG_RING_SLOTS;
+
+        if (seq == 2 * *lap) {
+            if (ring_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return slot;
+        } else if (seq < 2 * *lap) {
+            if (level >= LOG_LEVEL_VERBOSE || waited++ >= LOG_FULL_WAIT_MS) {
+                ring_dropped.fetch_add(1, std::memory_order_relaxed);
+                return NULL;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            pos = ring_head.load(std::memory_order_relaxed);
+        } else {
+            pos = ring_head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static void ring_vprintf(int level, const char *format, va_list args) {
+
+    uint64_t lap;
+    log_slot *slot = ring_claim(&lap, level);
+
+    if (slot == NULL) return;
+
+    vsnprintf(slot->text, LOG_LINE_MAX, format, args);
+    slot->seq.store(2 * lap + 1, std::memory_order_release);
+}
+
+EXPORT_C void r_printf(const char *format, ...) {
+
+    va_list argList;
+    va_start(argList, format);
+    ring_vprintf(LOG_LEVEL_INFO, format, argList);
+    va_end(argList);
+
+}
+
+EXPORT_C void r_log(int level, const char *format, ...) {
+
+    if (level > log_level.load(std::memory_order_relaxed)) return;
+
+    va_list argList;
+    va_start(argList, format);
+    ring_vprintf(level, format, argList);
+    va_end(argList);
+}
+
+EXPORT_C void set_log_level(int level) {
+    log_level.store(level, std::memory_order_relaxed);
+}
+
+EXPORT_C int log_enabled(int level) {
+    return level <= log_level.load(std::memory_order_relaxed);
+}
+
+EXPORT_C void add_progress_bar(int va) {
+
+    progress.lock.lock();
+    va = progress.added += va;
+    progress.lock.unlock();
+
+    sink_progress(va);
+}
+
+/* Where percent of the current phase lands on the whole bar,
+   -1 if that is where the bar already is */
+
+static int progress_map(int percent) {
+
+    if (percent < 0) percent = 0;
+    if (percent > 100) percent = 100;
+
+    int value = (progress.phase_start * 100 + progress.phase_weight * percent) / progress.total_weight;
+
+    if (value == progress.value) return -1;
+
+    progress.value = value;
+
+    return value;
+}
+
+EXPORT_C void set_progress_bar(int va) {
+
+    progress.lock.lock();
+
+    if (progress.active) va = progress_map(va);
+
+    progress.lock.unlock();
+
+    if (va >= 0) sink_progress(va);
+}
+
+EXPORT_C void set_ticker(const char *text) {
+    if (sink.ticker != NULL) sink.ticker(sink.ctx, text);
+}
+
+/* Log how the phase that just ended went, the caller holds
+   the lock and logs the returned line after dropping it */
+
+static bool progress_close(char *line, size_t size) {
+
+    double seconds = progress_elapsed() / 1000.0;
+
+    if (progress.phase_weight == 0 || progress.bytes == 0 || seconds <= 0) return false;
+
+    snprintf(line, size, " * %s: %.1lf MB in %.1lf s (%.1lf MB/s)\n", progress.phase_name,
+             progress.bytes / 1e6, seconds, progress.bytes / 1e6 / seconds);
+
+    return true;
+}
+
+EXPORT_C void progress_begin(int total_weight) {
+
+    progress.lock.lock();
+    progress.active = total_weight > 0;
+    progress.total_weight = total_weight;
+    progress.phase_start = 0;
+    progress.phase_weight = 0;
+    progress.phase_name[0] = 0x00;
+    progress.value = -1;
+    progress.added = 0;
+    progress.bytes = 0;
+    progress.lock.unlock();
+
+    sink_progress(0);
+}
+
+EXPORT_C void progress_phase(const char *name, int weight) {
+
+    char line[128];
+    bool closed;
+    int value;
+
+    progress.lock.lock();
+    closed = progress_close(line, sizeof(line));
+    if (progress.phase_name[0]) TRACE_SPAN(TRACE_PHASE, progress.phase_name, progress.phase_traced);
+    TRACE_MARK(progress.phase_traced);
+    progress.phase_start += progress.phase_weight;
+    progress.phase_weight = weight;
+    snprintf(progress.phase_name, sizeof(progress.phase_name), "%s", name);
+    progress.bytes = 0;
+    progress.sample_bytes = 0;
+    progress.sample_ms = 0;
+    progress.avg = 0;
+    progress.started = std::chrono::steady_clock::now();
+    value = progress.active ? progress_map(0) : -1;
+    progress.lock.unlock();
+
+    if (closed) r_printf("%s", line);
+    if (value >= 0) sink_progress(value);
+
+    sink_rate(0, 0, -1);
+}
+
+EXPORT_C void progress_bytes(uint64_t done, uint64_t total) {
+
+    double now = 0, avg = 0;
+    int eta = -1;
+    bool sampled = false;
+    int value;
+
+    if (total == 0) return;
+
+    progress.lock.lock();
+
+    if (!progress.active) {
+        progress.lock.unlock();
+        set_progress_bar((int) (done * 100 / total));
+        return;
+    }
+
+    progress.bytes = done;
+    value = progress_map((int) (done * 100 / total));
+
+    /* Rates get sampled at a fixed interval, however often
+       this is called. The average is an exponential one, so
+       a stick that slows down shows up within seconds. */
+
+    int64_t elapsed = progress_elapsed();
+
+    if (elapsed - progress.sample_ms >= RATE_INTERVAL_MS && done >= progress.sample_bytes) {
+        now = (done - progress.sample_bytes) / 1e6 / ((elapsed - progress.sample_ms) / 1000.0);
+        progress.avg = progress.avg == 0 ? now : RATE_EMA_ALPHA * now + (1 - RATE_EMA_ALPHA) * progress.avg;
+        progress.sample_ms = elapsed;
+        progress.sample_bytes = done;
+
+        avg = progress.avg;
+
+        if (avg > 0) eta = (int) ((total - done) / 1e6 / avg);
+
+        sampled = true;
+    }
+
+    progress.lock.unlock();
+
+    if (value >= 0) sink_progress(value);
+    if (sampled) sink_rate(now, avg, eta);
+}
+
+EXPORT_C void progress_end(void) {
+
+    char line[128];
+    bool closed;
+
+    progress.lock.lock();
+    closed = progress_close(line, sizeof(line));
+    if (progress.phase_name[0]) TRACE_SPAN(TRACE_PHASE, progress.phase_name, progress.phase_traced);
+    progress.active = false;
+    progress.phase_weight = 0;
+    progress.phase_name[0] = 0x00;
+    progress.lock.unlock();
+
+    if (closed) r_printf("%s", line);
+
+    sink_rate(0, 0, -1);
+}
+
+EXPORT_C void job_cancel(int on) {
+    cancel_asked.store(on, std::memory_order_relaxed);
+}
+
+EXPORT_C int job_cancelled(void) {
+    return cancel_asked.load(std::memory_order_relaxed);
+}
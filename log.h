@@ -2,52 +2,7 @@
 #define LOG_H
 
 #include <stdarg.h>
-
-#ifdef __cplusplus
-
-#include <QDialog>
-#include <QString>
-#include <QScrollBar>
-#include <QProgressBar>
-#include <QLineEdit>
-
-namespace Ui {
-class Log;
-}
-
-class Log : public QDialog
-{
-    Q_OBJECT
-
-private:
-    void reject();
-
-public:
-    static bool logOpen;
-    explicit Log(QWidget *parent = 0);
-    void set_up(QProgressBar *bar, QLineEdit *edit);
-    ~Log();
-    Ui::Log *ui;
-    QString *text;
-    QScrollBar *bar;
-    int progressed;
-
-private slots:
-    void on_buttonClose_clicked();
-    void on_buttonClear_clicked();
-    void write(char *msg);
-
-signals:
-    void call_write(char *msg);
-    void progress_set(int va);
-    void ticker_set(QString text);
-};
-
-#else
-
-typedef struct Log Log;
-
-#endif // __cplusplus
+#include <stdint.h>
 
 #ifdef __cplusplus
 #define EXPORT_C extern "C"
@@ -55,15 +10,56 @@ typedef struct Log Log;
 #define EXPORT_C
 #endif
 
-extern Log *logptr;
+/* r_printf() logs at LOG_LEVEL_INFO. Per-file chatter on the
+   hot path goes through r_log() with LOG_LEVEL_VERBOSE, which
+   costs one load and a compare while it is turned off. */
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_VERBOSE 2
 
-EXPORT_C void write_c(Log *ptr, char *msg);
 EXPORT_C void r_printf(const char *format, ...);
-EXPORT_C void set_progress_bar_(Log *ptr, int va);
+EXPORT_C void r_log(int level, const char *format, ...);
+EXPORT_C void set_log_level(int level);
+EXPORT_C int log_enabled(int level);
 EXPORT_C void set_progress_bar(int va);
-EXPORT_C void add_progress_bar_(Log *ptr, int va);
 EXPORT_C void add_progress_bar(int va);
-EXPORT_C void set_ticker_(Log *ptr, const char *text);
 EXPORT_C void set_ticker(const char *text);
 
+/* A job is split into phases that each own a share of the
+   bar. While a job runs, set_progress_bar() takes a percentage
+   of the current phase, and progress_bytes() does the same
+   from a byte count and also tracks the transfer rate. */
+
+EXPORT_C void progress_begin(int total_weight);
+EXPORT_C void progress_phase(const char *name, int weight);
+EXPORT_C void progress_bytes(uint64_t done, uint64_t total);
+EXPORT_C void progress_end(void);
+
+/* Asking the running job to stop. The write, copy and wipe
+   loops check job_cancelled() between blocks and give up with
+   ECANCELED, leaving the stick half written. The front end
+   sets it and clears it again before the next job. */
+
+EXPORT_C void job_cancel(int on);
+EXPORT_C int job_cancelled(void);
+
+/* Where all of the above ends up. The log window, the command
+   line and the daemon each install one before a job starts.
+   Progress, ticker and rate calls are passed on right away, on
+   whatever thread the job runs on. Lines are queued and handed
+   to line() by log_drain(), on the thread that calls it, so the
+   front end picks when. Any of the calls may be NULL. */
+
+typedef struct log_sink {
+  void (*line)(void *ctx, const char *text);
+  void (*progress)(void *ctx, int value);
+  void (*ticker)(void *ctx, const char *text);
+  void (*rate)(void *ctx, double now, double avg, int eta);
+  void *ctx;
+} log_sink_t;
+
+EXPORT_C void log_set_sink(const log_sink_t *sink);
+EXPORT_C void log_drain(void);
+
 #endif // LOG_H
@@ -1,4 +1,12 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/loop.h>
 #include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <unistd.h>
 
 #include "rufusworker.h"
 #include "log.h"
@@ -8,18 +16,91 @@ extern "C" {
 #include "linux/mounting.h"
 #include "linux/partition.h"
 #include "linux/fat32.h"
+#include "linux/fattree.h"
+#include "linux/exfat.h"
+#include "linux/copy.h"
+#include "linux/ioqueue.h"
+#include "linux/image.h"
+#include "linux/fanout.h"
+#include "linux/blkdev.h"
+#include "linux/verify.h"
+#include "linux/delta.h"
+#include "linux/fatcache.h"
+#include "linux/flush.h"
+#include "linux/taskgraph.h"
+#include "linux/trace.h"
+#include "linux/http.h"
+#include "linux/httpcache.h"
 #include "iso.h"
+#include "isofs.h"
 }
 
+/* Share of the bar each phase gets. Wiping and copying move
+   the most bytes, partitioning and formatting are quick. */
+
+#define WEIGHT_WIPE 50
+#define WEIGHT_PARTITION 2
+#define WEIGHT_FORMAT 3
+#define WEIGHT_COPY 45
+#define WEIGHT_IMAGE 100
+#define WEIGHT_VERIFY 30
+
 #define ASSERT(x)\
-    set_progress_bar(0); \
     if (x < 0) { \
-        set_ticker("FAILED"); \
+        set_ticker(job_cancelled() ? "CANCELLED" : "FAILED"); \
+        this->failed = 1; \
+        progress_end(); \
         set_progress_bar(0); \
         clean_up(&device_fd, &part_fd, &loop_fd, &iso_fd); \
+        verify_free(verify); \
         return; \
     }
 
+#ifdef RUFUSL_TRACE
+
+/* The trace covers all of run(), whichever return it takes */
+
+struct job_trace {
+    job_trace(int job_type) {
+        TRACE_JOB_BEGIN(job_type == JOB_COPY ? "copy" : job_type == JOB_DD ? "dd" : "scan");
+    }
+    ~job_trace() { TRACE_JOB_END(); }
+};
+
+#endif
+
+/* An io_depth left at 0 comes from the device's profile.
+   The in-place probe rewrites 8 MiB of the stick, so it only
+   runs when asked for and only goes to the log, next to what
+   the link promised. */
+
+static void tune_io(uint32_t device_fd, int *depth, int probe) {
+
+    blk_profile_t profile;
+
+    if (blk_profile(device_fd, &profile) < 0) {
+        if (*depth == 0) *depth = IOQ_DEPTH_DEFAULT;
+        return;
+    }
+
+    if (*depth == 0) *depth = profile.depth;
+
+    r_printf("Device: %u/%u byte sectors, max request %u KiB, %s%s, USB %u Mbit/s\n",
+             profile.logical_block, profile.physical_block, profile.max_sectors_kb,
+             profile.rotational ? "rotational" : "solid state",
+             profile.discard ? ", discard" : "", profile.usb_speed);
+    r_printf("Using %u KiB requests, depth %d\n", profile.chunk >> 10, *depth);
+
+    if (!probe) return;
+
+    uint64_t speed = blk_probe_speed(device_fd);
+
+    if (speed > 0) {
+        r_printf("Measured write speed: %.1f MB/s (link estimate %u MB/s)\n",
+                 speed / 1e6, profile.est_speed);
+    }
+}
+
 RufusWorker::RufusWorker(Device *chosen,
                          int partition_scheme,
                          int file_system,
@@ -28,56 +109,605 @@ RufusWorker::RufusWorker(Device *chosen,
                          const QString *isopath_,
                          uint8_t job_type_) : QThread() {
 
-    this->theOne = chosen;
+    this->theOne = NULL;
+
+    if (chosen != NULL) {
+        this->chosen = *chosen;
+        this->theOne = &this->chosen;
+    }
+
     this->cluster_size = cluster_size;
     this->partition_scheme = partition_scheme;
     this->file_system = file_system;
     this->full_format = full_format;
     this->isopath = isopath_;
     this->job_type = job_type_;
+    this->copy_threads = COPY_THREADS_DEFAULT;
+    this->io_depth = 0;
+    this->direct_io = 1;
+    this->verify = 0;
+    this->zeros = 0;
+    this->incremental = 0;
+    this->fat_cache = 0;
+    this->http_cache = 0;
+    this->probe_speed = 0;
+    this->cancelled = 0;
+
+    /* One job at a time, a cancel of the one before is over */
+
+    job_cancel(0);
+    this->failed = 0;
+    this->manifest = NULL;
+    this->targets = NULL;
+    this->target_count = 0;
 
 }
 
-void RufusWorker::run() {
+void RufusWorker::set_targets(const Device *devices, int count) {
+    this->target_list.assign(devices, devices + count);
+    this->targets = this->target_list.data();
+    this->target_count = count;
+}
 
+/* Called from the window while run() is going, the jobs that
+   can stop check it between chunks */
 
+void RufusWorker::cancel() {
+    __atomic_store_n(&this->cancelled, 1, __ATOMIC_RELAXED);
+    job_cancel(1);
+}
+
+/* An image off a URL is written as it downloads where that
+   works. With the download cache, everything else reads it
+   from there, after it is downloaded if it is not yet. */
+
+static int local_image(const RufusWorker *w, std::string *path) {
+    char local[PATH_MAX];
+
+    if (!http_is_url(path->c_str()) || !w->http_cache) return 0;
+
+    set_ticker("Downloading image...");
+
+    if (httpcache_fetch(path->c_str(), local, sizeof(local)) < 0) return -1;
+
+    *path = local;
+
+    return 0;
+}
+
+/* ---- The copy job as a task graph ----
+
+   The image side and the stick side do not wait for each
+   other: the ISO gets opened or mounted while the stick is
+   looked up, wiped and partitioned, and only the copy needs
+   both. Every task undoes its own setup, a failed one right
+   away and a finished one when the job ends. */
+
+typedef struct copy_job {
+    RufusWorker *worker;
+    Device *device;
+    std::string isopath;
+    int partition_scheme;
+    int file_system;
+    int cluster_size;
+    int full_format;
+    int direct;
+    int cached;
+    uint64_t align;
+    fatcache_entry_t entry;
+    verify_t *verify;
     uint32_t device_fd;
     uint32_t part_fd;
     uint32_t loop_fd;
     uint32_t iso_fd;
+} copy_job_t;
+
+/* Only the list from a scan lets FAT32 or exFAT be written
+   directly */
+
+static int job_tree(const copy_job_t *job) {
+    return (job->file_system == FS_FAT32 || job->file_system == FS_EXFAT) &&
+           job->worker->manifest != NULL && job->worker->manifest->valid;
+}
+
+static void cleanup_dirs(void *arg) {
+    (void) arg;
+
+    remove(TEMP_DIR_ISO);
+    remove(TEMP_DIR);
+}
+
+static int task_dirs(void *arg) {
+    if (make_temp_dir(TEMP_DIR) < 0 || make_temp_dir(TEMP_DIR_ISO) < 0) {
+        cleanup_dirs(arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void cleanup_device(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    flush_device((int32_t) job->device_fd);
+    close(job->device_fd);
+    remove(TEMP_DEVICE);
+}
+
+static int task_device(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    if (make_temp_device(job->device->major, job->device->minor, &job->device_fd) < 0) {
+        cleanup_device(arg);
+        return -1;
+    }
+
+    tune_io(job->device_fd, &job->worker->io_depth, job->worker->probe_speed);
+
+    return 0;
+}
+
+static void cleanup_source(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    umount(TEMP_DIR_ISO);
+
+    if ((int32_t) job->loop_fd >= 0) {
+        ioctl(job->loop_fd, LOOP_CLR_FD);
+        close(job->loop_fd);
+    }
+
+    close(job->iso_fd);
+    remove(TEMP_LOOP);
+}
+
+/* The tree writers read the files straight from the ISO when
+   every one of them is in one piece, everything else goes
+   through a loop mount. Off a URL, only the files get fetched
+   for that, which a mount could not do with. */
+
+static int task_source(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    job->direct = job_tree(job) && iso_manifest_direct(job->worker->manifest);
+
+    if (http_is_url(job->isopath.c_str())) {
+        if (!job->direct) {
+            r_printf("This image can only be copied from disk, turn on the download cache\n");
+            return -1;
+        }
+
+        job->iso_fd = http_stage(job->isopath.c_str(), &job->worker->manifest->list);
+
+        return (int32_t) job->iso_fd < 0 ? -1 : 0;
+    }
+
+    if (job->direct) {
+        job->iso_fd = open(job->isopath.c_str(), O_RDONLY);
+
+        if ((int32_t) job->iso_fd < 0) {
+            r_printf("Failed to open image: %s\n", strerror(errno));
+            return -1;
+        }
+
+        return 0;
+    }
+
+    if (make_loop_device(&job->loop_fd) < 0 ||
+        mount_iso_to_loop(job->isopath.c_str(), job->isopath.size(), &job->loop_fd, &job->iso_fd) < 0) {
+        cleanup_source(arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* With the stick open the cache can be asked, and that
+   decides what the rest of the bar is made of */
+
+static int task_plan(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+    int verify_weight = job->verify != NULL ? WEIGHT_VERIFY : 0;
+
+    if (job->worker->fat_cache && job->file_system == FS_FAT32 && job_tree(job) &&
+        !http_is_url(job->isopath.c_str())) {
+        set_ticker("Looking up cached image...");
+        job->cached = fatcache_find(job->isopath.c_str(), job->partition_scheme, job->cluster_size,
+                                    &job->device_fd, &job->entry);
+    }
+
+    progress_begin((!job->full_format ? WEIGHT_WIPE : 0) + (job->cached == FATCACHE_MISS ? WEIGHT_COPY : 0) +
+                   WEIGHT_PARTITION + WEIGHT_FORMAT + WEIGHT_COPY + verify_weight);
+
+    return 0;
+}
+
+static int task_wipe(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    set_ticker("Running full format...");
+    progress_phase("Wiping", WEIGHT_WIPE);
+
+    return full_wipe(&job->device_fd, job->worker->io_depth);
+}
+
+/* A cache entry that could not be built is not the end of
+   the job, the stick is written directly instead */
+
+static int task_build(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    if (job->cached != FATCACHE_MISS) return 0;
+
+    set_ticker("Building cached image...");
+    progress_phase("Building", WEIGHT_COPY);
+
+    if (fatcache_build(&job->entry, &job->worker->manifest->list, job->direct ? (int32_t) job->iso_fd : -1,
+                       TEMP_DIR_ISO, (char*) "GALA", job->worker->io_depth) < 0) {
+        r_printf("Could not build the cached image, writing the stick directly\n");
+        job->cached = -1;
+    }
+
+    return 0;
+}
+
+static void cleanup_partition(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    flush_device((int32_t) job->part_fd);
+    close(job->part_fd);
+    remove(TEMP_PART);
+}
+
+static int task_partition(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    if (job->cached >= 0) return 0;
+
+    set_ticker("Partitioning drive...");
+    progress_phase("Partitioning", WEIGHT_PARTITION);
+
+    /* Picked once from the stick, the partition node alone
+       could guess a different one for the file system */
+
+    job->align = blk_alignment((int32_t) job->device_fd);
+
+    if (nuke_and_partition_aligned(TEMP_DEVICE, job->partition_scheme, job->file_system, job->align) < 0 ||
+        make_temp_partition(job->device->major, job->device->minor, &job->part_fd) < 0) {
+        cleanup_partition(arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void cleanup_format(void *arg) {
+    (void) arg;
+
+    flush_fs(TEMP_DIR);
+    umount(TEMP_DIR);
+}
+
+/* The tree writers format as they go, only the mounted copy
+   needs a file system up front */
+
+static int task_format(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+
+    if (job->cached >= 0) return 0;
+
+    progress_phase("Formatting", WEIGHT_FORMAT);
+
+    if (job_tree(job)) return 0;
+
+    int formatted = job->file_system == FS_EXFAT
+                        ? format_exfat(&job->part_fd, job->cluster_size, job->align, (char*) "GALA")
+                        : format_fat32(&job->part_fd, job->cluster_size, job->align, (char*) "GALA");
+
+    if (formatted < 0 || mount_device_to_temp(&job->file_system) < 0) {
+        cleanup_format(arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int task_copy(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+    RufusWorker *w = job->worker;
+
+    if (job->cached >= 0) {
+        set_ticker("Writing cached image to USB...");
+        progress_phase("Copying", WEIGHT_PARTITION + WEIGHT_FORMAT + WEIGHT_COPY);
+
+        return fatcache_write(&job->entry, &job->device_fd, w->direct_io, w->io_depth, job->verify);
+    }
+
+    set_ticker("Copying data to USB...");
+    progress_phase("Copying", WEIGHT_COPY);
+
+    if (job_tree(job) && job->file_system == FS_EXFAT) {
+        return exfat_write_tree(&job->part_fd, job->cluster_size, job->align, (char*) "GALA", &w->manifest->list,
+                                job->direct ? (int32_t) job->iso_fd : -1, TEMP_DIR_ISO, w->io_depth,
+                                job->verify, NULL);
+    }
+
+    if (job_tree(job)) {
+        return fat32_write_tree(&job->part_fd, job->cluster_size, job->align, (char*) "GALA", &w->manifest->list,
+                                job->direct ? (int32_t) job->iso_fd : -1, TEMP_DIR_ISO, w->io_depth,
+                                job->verify, NULL);
+    }
+
+    return recursive_copy((char*) TEMP_DIR_ISO, (char*) TEMP_DIR,
+                          w->manifest != NULL && w->manifest->valid ? &w->manifest->list : NULL,
+                          w->copy_threads, w->io_depth);
+}
+
+/* The written image and tree were hashed on the way out. The
+   mounted copy never had the data in hand, so both sides are
+   read again, and without a scan the list comes from the
+   mounted image. */
+
+static int task_verify(void *arg) {
+    copy_job_t *job = (copy_job_t *) arg;
+    RufusWorker *w = job->worker;
+    copy_list_t list;
+    int bad;
+
+    set_ticker("Verifying...");
+    progress_phase("Verifying", WEIGHT_VERIFY);
+
+    if (job->cached >= 0) {
+        bad = verify_device(job->device_fd, job->verify);
+    } else if (job_tree(job)) {
+        bad = verify_device(job->part_fd, job->verify);
+    } else if (w->manifest != NULL && w->manifest->valid) {
+        bad = verify_files(TEMP_DIR_ISO, TEMP_DIR, &w->manifest->list, w->copy_threads);
+    } else if (build_copy_list(TEMP_DIR_ISO, &list) == 0) {
+        bad = verify_files(TEMP_DIR_ISO, TEMP_DIR, &list, w->copy_threads);
+        copy_list_free(&list);
+    } else {
+        bad = -1;
+    }
+
+    return bad != 0 ? -1 : 0;
+}
+
+/* ---- One ISO to several sticks ----
+
+   The FAT32 tree is built once, into an image of the whole
+   stick the way the image cache builds one, and that image is
+   written to every stick at once like a DD image. The ISO is
+   read once for all of them, and each stick only has its own
+   node. The image is laid out for the smallest stick, the
+   bigger ones get the same MBR partition and keep the rest.
+   GPT keeps the end of the disk in its headers, so there only
+   sticks of that exact size can take it. */
+
+static int copy_multi(copy_job_t *job, fanout_target_t *fan, int count) {
+    RufusWorker *w = job->worker;
+    fatcache_entry_t entry;
+    uint64_t sizes[FANOUT_TARGETS_MAX];
+    char node[64];
+    int opened = 0;
+    int ref = -1;
+    int ok = -1;
+
+    if (job->file_system != FS_FAT32 || !job_tree(job)) {
+        r_printf("Several sticks at once need a scanned image that fits on FAT32\n");
+        return -1;
+    }
+
+    if (!job->full_format) r_printf("Several sticks at once are not wiped, only what the image holds is written\n");
+
+    for (int i = 0; i < count; i++) {
+        uint32_t fd = -1;
+
+        snprintf(node, sizeof(node), TEMP_DEVICE_N, i);
+
+        r_printf("Using %s\n major: %d\n minor: %d\n", w->targets[i].device, w->targets[i].major, w->targets[i].minor);
+
+        if (make_temp_device_at(node, w->targets[i].major, w->targets[i].minor, &fd) < 0 ||
+            blk_size((int32_t) fd, &sizes[opened]) < 0) {
+            r_printf("* %s: FAILED to open, skipping\n", w->targets[i].device);
+            if ((int32_t) fd >= 0) close(fd);
+            continue;
+        }
+
+        snprintf(fan[opened].name, sizeof(fan[opened].name), "%s", w->targets[i].device);
+        fan[opened].fd = fd;
+        fan[opened].failed = 0;
+        fan[opened].error = 0;
+
+        if (ref < 0 || sizes[opened] < sizes[ref]) ref = opened;
+
+        opened++;
+    }
+
+    for (int i = 0; i < opened; i++) {
+        if (job->partition_scheme == TB_GPT && sizes[i] != sizes[ref]) {
+            r_printf("* %s: GPT needs sticks of the same size, skipping\n", fan[i].name);
+            fan[i].failed = 1;
+            fan[i].error = EINVAL;
+        }
+    }
+
+    uint32_t ref_fd = ref >= 0 ? fan[ref].fd : -1;
+    int found = -1;
+
+    if (ref >= 0) {
+        tune_io(ref_fd, &w->io_depth, w->probe_speed);
+
+        set_ticker("Building the stick image...");
+        progress_phase("Building", WEIGHT_COPY);
+    }
+
+    if (ref >= 0 && task_dirs(job) == 0) {
+        if (task_source(job) == 0) {
+            found = fatcache_find(job->isopath.c_str(), job->partition_scheme, job->cluster_size, &ref_fd, &entry);
+
+            if (found == FATCACHE_MISS &&
+                fatcache_build(&entry, &w->manifest->list, job->direct ? (int32_t) job->iso_fd : -1,
+                               TEMP_DIR_ISO, (char*) "GALA", w->io_depth) < 0) {
+                found = -1;
+            }
+        }
+
+        cleanup_source(job);
+        cleanup_dirs(job);
+    }
+
+    if (found >= 0) {
+        set_ticker("Writing image to USB...");
+        progress_phase("Writing", WEIGHT_IMAGE);
+
+        ok = fatcache_write_multi(&entry, fan, opened, w->direct_io, job->verify);
+
+        /* Built only for this job, unless the cache was asked for */
+
+        if (found == FATCACHE_MISS && !w->fat_cache) fatcache_remove(&entry);
+    } else if (ref >= 0) {
+        r_printf("Could not build the image for the sticks\n");
+    }
+
+    for (int i = 0; i < opened; i++) close(fan[i].fd);
+
+    for (int i = 0; i < count; i++) {
+        snprintf(node, sizeof(node), TEMP_DEVICE_N, i);
+        remove(node);
+    }
+
+    return ok;
+}
+
+void RufusWorker::run() {
+
+#ifdef RUFUSL_TRACE
+    job_trace traced(job_type);
+#endif
+
+    uint32_t device_fd = -1;
+    uint32_t part_fd = -1;
+    uint32_t loop_fd = -1;
+    uint32_t iso_fd = -1;
+
+    /* Read back is only weighed in when it was asked for */
+
+    verify_t *verify = this->verify ? verify_new() : NULL;
+    int verify_weight = this->verify ? WEIGHT_VERIFY : 0;
 
  switch(job_type) {
- case JOB_COPY:
+ case JOB_COPY: {
 
      r_printf("Using %s\n major: %d\n minor: %d\n", theOne->device, theOne->major, theOne->minor);
 
      set_ticker("Warming up...");
 
-     ASSERT(make_temp_dir(TEMP_DIR));
-     ASSERT(make_temp_dir(TEMP_DIR_ISO));
-     ASSERT(make_loop_device(&loop_fd));
-     ASSERT(make_temp_device(theOne->major, theOne->minor, &device_fd));
+     std::string image = this->isopath->toStdString(); /* QString is garbage. */
+
+     ASSERT(local_image(this, &image));
+
+     /* The scan already walked the image, reuse its list
+        unless the file changed since then */
+
+     if (this->manifest != NULL && !iso_manifest_valid(this->manifest, image.c_str())) {
+         r_printf("Image changed since it was scanned, walking it again\n");
+         iso_manifest_free(this->manifest);
+     }
+
+     copy_job_t job;
+
+     job.worker = this;
+     job.device = theOne;
+     job.isopath = image;
+     job.partition_scheme = this->partition_scheme;
+     job.file_system = this->file_system;
+     job.cluster_size = this->cluster_size;
+     job.full_format = this->full_format;
+     job.direct = 0;
+     job.cached = -1;
+     job.align = 0;
+     job.verify = verify;
+     job.device_fd = -1;
+     job.part_fd = -1;
+     job.loop_fd = -1;
+     job.iso_fd = -1;
+
+     /* FAT32 cannot hold a file of 4 GiB or more, exFAT can, with
+        clusters picked for the stick rather than the FAT32 ones */
+
+     if (job.file_system == FS_FAT32 && this->manifest != NULL && this->manifest->valid &&
+         this->manifest->has_4gb) {
+         r_printf("Image has a file of 4 GiB or more, formatting as exFAT\n");
+         job.file_system = FS_EXFAT;
+         job.cluster_size = EXFAT_CLUSTER_AUTO;
+     }
 
-     if (!full_format) {
-        set_ticker("Running full format...");
-        ASSERT(full_wipe(&device_fd));
+     /* Several sticks at once: every one gets a node of its own
+        and the ISO is only read once for all of them */
+
+     if (this->targets != NULL && this->target_count > 1) {
+         fanout_target_t fan[FANOUT_TARGETS_MAX];
+         int count = this->target_count < FANOUT_TARGETS_MAX ? this->target_count : FANOUT_TARGETS_MAX;
+
+         progress_begin(WEIGHT_COPY + WEIGHT_IMAGE);
+
+         int ok = copy_multi(&job, fan, count);
+
+         progress_end();
+         verify_free(verify);
+
+         if (ok <= 0) {
+             set_progress_bar(0);
+             set_ticker(job_cancelled() ? "CANCELLED" : "FAILED");
+         } else {
+             set_ticker(ok == count ? "DONE" : "DONE, SOME DEVICES FAILED");
+         }
+
+         this->failed = ok != count;
+
+         this->theOne = NULL;
+         this->targets = NULL;
+         this->target_count = 0;
+         this->isopath  = NULL;
+
+         break;
      }
 
-     set_ticker("Partitioning drive...");
+     taskgraph_t graph;
+
+     taskgraph_init(&graph);
 
-     ASSERT(nuke_and_partition(TEMP_DEVICE, this->partition_scheme, this->file_system));
-     ASSERT(make_temp_partition(theOne->major, theOne->minor, &part_fd));
-     ASSERT(format_fat32(&part_fd, this->cluster_size, (char*) "GALA"));
-     ASSERT(mount_device_to_temp(&file_system));
-     ASSERT(mount_iso_to_loop(this->isopath->toStdString().c_str(), this->isopath->size(), &loop_fd, &iso_fd)); /* QString is garbage. */
+     int dirs = taskgraph_add(&graph, "Preparing directories", task_dirs, cleanup_dirs, &job, 0);
+     int device = taskgraph_add(&graph, "Opening the device", task_device, cleanup_device, &job, 0);
+     int source = taskgraph_add(&graph, "Opening the image", task_source, cleanup_source, &job, TASK_DEP(dirs));
+     int last = taskgraph_add(&graph, "Planning", task_plan, NULL, &job, TASK_DEP(device));
 
-     set_ticker("Copying data to USB...");
+     if (!full_format) last = taskgraph_add(&graph, "Wiping", task_wipe, NULL, &job, TASK_DEP(last));
 
-     ASSERT(recursive_copy( (char*) TEMP_DIR_ISO, (char*) TEMP_DIR));
+     last = taskgraph_add(&graph, "Building the cached image", task_build, NULL, &job, TASK_DEP(last) | TASK_DEP(source));
+     last = taskgraph_add(&graph, "Partitioning", task_partition, cleanup_partition, &job, TASK_DEP(last));
+     last = taskgraph_add(&graph, "Formatting", task_format, cleanup_format, &job, TASK_DEP(last) | TASK_DEP(dirs));
+     last = taskgraph_add(&graph, "Copying", task_copy, NULL, &job, TASK_DEP(last) | TASK_DEP(source));
+
+     if (verify != NULL) taskgraph_add(&graph, "Verifying", task_verify, NULL, &job, TASK_DEP(last));
+
+     if (taskgraph_run(&graph, TASKGRAPH_THREADS) < 0) {
+         set_ticker(job_cancelled() ? "CANCELLED" : "FAILED");
+         this->failed = 1;
+         progress_end();
+         set_progress_bar(0);
+         taskgraph_finish(&graph);
+         verify_free(verify);
+         return;
+     }
+
+     progress_end();
 
      set_ticker("Cleaning up...");
 
-     clean_up(&device_fd, &part_fd, &loop_fd, &iso_fd);
+     taskgraph_finish(&graph);
+     verify_free(verify);
 
      set_ticker("DONE");
 
@@ -89,24 +719,199 @@ void RufusWorker::run() {
      this->isopath  = NULL;
 
      break;
+ }
 
  case JOB_SCAN:
 
      set_ticker("Analyzing ISO Image...");
-     r_printf("Analyzing ISO Image");
+     r_printf("Analyzing ISO Image\n");
+
+     {
+         std::string image = this->isopath->toStdString(); /* QString is garbage. */
+
+         ASSERT(local_image(this, &image));
 
-     ASSERT(make_temp_dir(TEMP_DIR_ISO));
-     ASSERT(make_loop_device(&loop_fd));
-     ASSERT(mount_iso_to_loop(this->isopath->toStdString().c_str(), this->isopath->size(), &loop_fd, &iso_fd)); /* QString is garbage. */
-     ASSERT(recursive_iso_scan(&loop_fd));
+         /* Reading the image directly needs no loop device or
+            mount, only fall back to those if it does not work */
+
+         if (iso_scan_image(image.c_str(), this->manifest) == 0) {
+             verify_free(verify);
+             break;
+         }
+
+         ASSERT((http_is_url(image.c_str()) ? -1 : 0));
+
+         r_printf("Falling back to mounting the image\n");
+
+         ASSERT(make_temp_dir(TEMP_DIR_ISO));
+         ASSERT(make_loop_device(&loop_fd));
+         ASSERT(mount_iso_to_loop(image.c_str(), image.size(), &loop_fd, &iso_fd));
+         ASSERT(recursive_iso_scan(image.c_str(), &loop_fd, this->manifest));
+     }
 
      clean_up(&device_fd, &part_fd, &loop_fd, &iso_fd);
+     verify_free(verify);
 
      break;
+
+ case JOB_DD: {
+
+     std::string image = this->isopath->toStdString(); /* QString is garbage. */
+
+     /* Only a single plain write streams off a URL, the others
+        read the image more than once or out of order */
+
+     if (http_is_url(image.c_str()) && ((this->targets != NULL && this->target_count > 1) || this->incremental)) {
+         if (!this->http_cache) r_printf("Several sticks or only the changes need the image on disk, turn on the download cache\n");
+
+         ASSERT((this->http_cache ? local_image(this, &image) : -1));
+     }
+
+     /* Several sticks at once: every one gets a node of its own
+        and the image is only read once for all of them */
+
+     if (this->targets != NULL && this->target_count > 1) {
+         fanout_target_t fan[FANOUT_TARGETS_MAX];
+         char node[64];
+         int count = this->target_count < FANOUT_TARGETS_MAX ? this->target_count : FANOUT_TARGETS_MAX;
+         int opened = 0;
+
+         set_ticker("Warming up...");
+
+         for (int i = 0; i < count; i++) {
+             uint32_t fd = -1;
+
+             snprintf(node, sizeof(node), TEMP_DEVICE_N, i);
+
+             r_printf("Using %s\n major: %d\n minor: %d\n", targets[i].device, targets[i].major, targets[i].minor);
+
+             if (make_temp_device_at(node, targets[i].major, targets[i].minor, &fd) < 0) {
+                 r_printf("* %s: FAILED to open, skipping\n", targets[i].device);
+                 continue;
+             }
+
+             snprintf(fan[opened].name, sizeof(fan[opened].name), "%s", targets[i].device);
+             fan[opened].fd = fd;
+             fan[opened].failed = 0;
+             fan[opened].error = 0;
+             opened++;
+         }
+
+         set_ticker("Writing image to USB...");
+
+         progress_begin(WEIGHT_IMAGE);
+         progress_phase("Writing", WEIGHT_IMAGE);
+
+         int ok = opened > 0 ? write_image_multi(image.c_str(), fan, opened, this->direct_io, verify) : -1;
+
+         progress_end();
+         verify_free(verify);
+
+         set_ticker("Cleaning up...");
+
+         for (int i = 0; i < opened; i++) close(fan[i].fd);
+
+         for (int i = 0; i < count; i++) {
+             snprintf(node, sizeof(node), TEMP_DEVICE_N, i);
+             remove(node);
+         }
+
+         if (ok <= 0) {
+             set_progress_bar(0);
+             set_ticker(job_cancelled() ? "CANCELLED" : "FAILED");
+         } else {
+             set_ticker(ok == count ? "DONE" : "DONE, SOME DEVICES FAILED");
+         }
+
+         this->failed = ok != count;
+
+         this->theOne = NULL;
+         this->targets = NULL;
+         this->target_count = 0;
+         this->isopath  = NULL;
+
+         break;
+     }
+
+     r_printf("Using %s\n major: %d\n minor: %d\n", theOne->device, theOne->major, theOne->minor);
+
+     set_ticker("Warming up...");
+
+     ASSERT(make_temp_device(theOne->major, theOne->minor, &device_fd));
+
+     tune_io(device_fd, &this->io_depth, this->probe_speed);
+
+     set_ticker("Writing image to USB...");
+
+     progress_begin(WEIGHT_IMAGE + verify_weight);
+     progress_phase("Writing", WEIGHT_IMAGE);
+
+     /* The same stick gets a newer build of the same image, only
+        the chunks that changed are written. A stopped run leaves
+        a checkpoint and the next one picks up from there. */
+
+     if (this->incremental) {
+         char id[DELTA_ID_SIZE];
+
+         /* A checkpoint only holds for the stick it was written
+            from, vendor and model are the same for a whole batch */
+
+         int unique = blk_usb_serial(theOne->major, theOne->minor, id, sizeof(id)) == 0;
+
+         int delta = write_image_delta(image.c_str(), &device_fd, unique ? id : NULL, this->io_depth, verify, &this->cancelled);
+
+         ASSERT(delta);
+
+         if (delta == DELTA_CANCELLED) {
+             progress_end();
+             clean_up(&device_fd, &part_fd, &loop_fd, &iso_fd);
+             verify_free(verify);
+             set_ticker(unique ? "CANCELLED, start again to resume" : "CANCELLED");
+
+             this->theOne = NULL;
+             this->isopath  = NULL;
+
+             return;
+         }
+     } else if (http_is_url(image.c_str())) {
+         ASSERT(write_image_url(image.c_str(), &device_fd, this->direct_io, this->io_depth, verify, this->zeros, this->http_cache));
+     } else {
+         ASSERT(write_image(image.c_str(), &device_fd, this->direct_io, this->io_depth, verify, this->zeros));
+     }
+
+     if (verify != NULL) {
+         set_ticker("Verifying...");
+         progress_phase("Verifying", WEIGHT_VERIFY);
+
+         ASSERT((verify_device(device_fd, verify) != 0 ? -1 : 0));
+     }
+
+     progress_end();
+
+     set_ticker("Cleaning up...");
+
+     clean_up(&device_fd, &part_fd, &loop_fd, &iso_fd);
+     verify_free(verify);
+
+     set_ticker("DONE");
+
+     this->theOne = NULL;
+     this->isopath  = NULL;
+
+     break;
+ }
+
  default:
      r_printf("Invalid job type!");
+     this->failed = 1;
+     verify_free(verify);
  }
 
+ /* A cancel that came after the last block was written did not
+    stop anything, the job counts as done */
+
+ if (!this->failed) this->cancelled = 0;
+
 }
 
 
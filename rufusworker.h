@@ -1,9 +1,15 @@
 #ifndef RUFUSWORKER_H
 #define RUFUSWORKER_H
 
+#include <vector>
+
 #include "QThread"
 #include "log.h"
+
+extern "C" {
 #include "linux/devices.h"
+#include "iso.h"
+}
 
 class RufusWorker : public QThread
 {
@@ -18,6 +24,12 @@ private:
     const QString *isopath;
     uint8_t job_type;
 
+    /* Copies, the window's list changes with every uevent and
+       the job itself causes some */
+
+    Device chosen;
+    std::vector<Device> target_list;
+
 public:
 
     RufusWorker(Device *chosen,
@@ -29,7 +41,23 @@ public:
                 uint8_t job_type);
 
     Device *theOne;
+    Device *targets;
+    int target_count;
+    void set_targets(const Device *devices, int count);
+    int copy_threads;
+    int io_depth;
+    int direct_io;
+    int verify;
+    int zeros;
+    int incremental;
+    int fat_cache;
+    int http_cache;
+    int probe_speed;
+    volatile int cancelled;
+    int failed;
+    iso_manifest_t *manifest;
     void run();
+    void cancel();
 };
 
 #endif // RUFUSWORKER_H
@@ -6,6 +6,6 @@ DeviceComboBox::DeviceComboBox(QWidget *& w, RufusWindow *window) : QComboBox(w)
 }
 
 void DeviceComboBox::showPopup() {
-    this->main->scan();
+    if (!this->main->monitored()) this->main->scan();
     QComboBox::showPopup();
 }
@@ -2,8 +2,29 @@
 #include "ui_log.h"
 
 #include <QDebug>
-#include <QMutex>
+#include <QTimer>
 
+#define LOG_DRAIN_MS 50
+
+/* The log window is the GUI's sink. Progress, ticker and
+   rate come in on the worker thread and go on as queued
+   signals, lines are picked up by drain() on the GUI thread. */
+
+static void gui_line(void *ctx, const char *text) {
+    ((Log *) ctx)->batch += QString::fromUtf8(text);
+}
+
+static void gui_progress(void *ctx, int value) {
+    emit ((Log *) ctx)->progress_set(value);
+}
+
+static void gui_ticker(void *ctx, const char *text) {
+    emit ((Log *) ctx)->ticker_set(QString(text));
+}
+
+static void gui_rate(void *ctx, double now, double avg, int eta) {
+    emit ((Log *) ctx)->rate_set(now, avg, eta);
+}
 
 bool Log::logOpen = false;
 
@@ -21,8 +42,17 @@ Log::~Log()
 }
 
 void Log::set_up(QProgressBar *bar, QLineEdit *edit) {
-    this->progressed = 0;
-    connect(this, SIGNAL(call_write(char*)), this, SLOT(write(char*)), Qt::QueuedConnection);
+    this->progress = bar;
+
+    log_sink_t sink = { gui_line, gui_progress, gui_ticker, gui_rate, this };
+
+    log_set_sink(&sink);
+
+    this->drain_timer = new QTimer(this);
+    connect(this->drain_timer, SIGNAL(timeout()), this, SLOT(drain()));
+    this->drain_timer->start(LOG_DRAIN_MS);
+
+    connect(this, SIGNAL(rate_set(double,double,int)), this, SLOT(show_rate(double,double,int)));
     connect(this, SIGNAL(progress_set(int)), bar, SLOT(setValue(int)));
     connect(this, SIGNAL(ticker_set(QString)), edit, SLOT(setText(QString)));
 }
@@ -40,71 +70,40 @@ void Log::on_buttonClear_clicked()
 }
 
 
-/*
-   This is, by far, THE most complicated piece of code I have
-   ever written. This is how it works:
-
-   r_printf(char *format, ...) can be called from either C or C++,
-   it takes the format and va_list arguments, and formats them. Then,
-   it calls write_c, which sends a signal the Logger, which is connected
-   to itself, so the Qt scheduler schedules an update to the window by calling write(),
-   so that Qt does not freak out. Crazy, right?
+/* Whatever log_drain() hands over since the last tick goes
+   into the text box as one insert and one scroll */
 
-*/
+void Log::drain()
+{
+    log_drain();
 
+    if (this->batch.isEmpty()) return;
 
-void Log::write(char *msg)
-{
-    this->ui->logText->insertPlainText(msg);
+    this->ui->logText->insertPlainText(this->batch);
     this->bar->setValue(bar->maximum());
-    free(msg);
+    this->batch.clear();
 }
 
-void Log::reject()
+void Log::show_rate(double now, double avg, int eta)
 {
+    if (avg <= 0) {
+        this->progress->setFormat("%p%");
+        return;
+    }
 
-    Log::logOpen = false;
-    QDialog::reject();
-
-}
-
-void write_c(Log *ptr, char *msg) {
-    emit ptr->call_write(msg);
-}
-
-void r_printf(const char *format, ...) {
-
-    char *buf = (char*) malloc(4096);
-    va_list argList;
-    va_start(argList, format);
-    vsnprintf(buf, 4096,format, argList);
-    va_end(argList);
-    write_c(logptr, buf);
-
-}
-
-EXPORT_C void add_progress_bar_(Log *ptr, int va) {
-    ptr->progressed += va;
-    emit ptr->progress_set(ptr->progressed);
-}
+    QString format = QString("%p% - %1 MB/s (avg %2)").arg(now, 0, 'f', 1).arg(avg, 0, 'f', 1);
 
-EXPORT_C void add_progress_bar(int va) {
-    add_progress_bar_(logptr, va);
-}
+    if (eta >= 0) {
+        format += QString(" - ETA %1:%2").arg(eta / 60).arg(eta % 60, 2, 10, QChar('0'));
+    }
 
-EXPORT_C void set_progress_bar_(Log *ptr, int va) {
-    emit ptr->progress_set(va);
+    this->progress->setFormat(format);
 }
 
-EXPORT_C void set_progress_bar(int va) {
-    set_progress_bar_(logptr, va);
-}
+void Log::reject()
+{
 
-EXPORT_C void set_ticker_(Log *ptr,const char *text) {
-    QString string(text);
-    emit ptr->ticker_set(string);
-}
+    Log::logOpen = false;
+    QDialog::reject();
 
-EXPORT_C void set_ticker(const char *text) {
-    set_ticker_(logptr, text);
 }
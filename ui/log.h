@@ -0,0 +1,48 @@
+#ifndef UI_LOG_H
+#define UI_LOG_H
+
+#include <QDialog>
+#include <QString>
+#include <QScrollBar>
+#include <QProgressBar>
+#include <QLineEdit>
+#include <QTimer>
+
+#include "../log.h"
+
+namespace Ui {
+class Log;
+}
+
+class Log : public QDialog
+{
+    Q_OBJECT
+
+private:
+    void reject();
+
+public:
+    static bool logOpen;
+    explicit Log(QWidget *parent = 0);
+    void set_up(QProgressBar *bar, QLineEdit *edit);
+    ~Log();
+    Ui::Log *ui;
+    QString *text;
+    QString batch;
+    QScrollBar *bar;
+    QProgressBar *progress;
+    QTimer *drain_timer;
+
+private slots:
+    void on_buttonClose_clicked();
+    void on_buttonClear_clicked();
+    void drain();
+    void show_rate(double now, double avg, int eta);
+
+signals:
+    void progress_set(int va);
+    void ticker_set(QString text);
+    void rate_set(double now, double avg, int eta);
+};
+
+#endif // UI_LOG_H
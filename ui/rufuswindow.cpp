@@ -1,4 +1,7 @@
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <unistd.h>
 
 #include <QDebug>
 
@@ -16,14 +19,15 @@ extern "C" {
 #define RUFUSL_VERSION "0.1.20 Alpha"
 #define MKFS_VERSION "4.0"
 
-Log *logptr; /* Forward declaration */
-
 RufusWindow::RufusWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::RufusWindow) {
 
   ui->setupUi(this);
 
+  iso_manifest_init(&this->manifest);
+
   this->setupUi();
   this->scan();
+  this->startMonitor();
   this->show();
 
 #ifndef SKIP_ROOT_CHECK
@@ -39,6 +43,16 @@ RufusWindow::RufusWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::Rufu
 }
 
 void RufusWindow::on_buttonClose_clicked() {
+
+  /* Closing in the middle of a write asks the job to stop
+     first, an incremental write can resume later */
+
+  if (this->worker != NULL && this->worker->isRunning()) {
+    this->worker->cancel();
+    set_ticker("Cancelling...");
+    return;
+  }
+
   if (Log::logOpen) {
     this->log->close();
   }
@@ -85,13 +99,28 @@ void RufusWindow::on_buttonStart_clicked() {
     }
 
     int index = this->box->currentIndex();
+    int job = ui->sourceCombo->currentIndex() == SRC_DD ? JOB_DD : JOB_COPY;
+
     this->worker = new RufusWorker(&devices[index],
                                    ui->partitionCombo->currentIndex(),
                                    ui->fsCombo->currentIndex(),
                                    ui->clusterCombo->currentIndex(),
                                    ui->formatCheck->isChecked(),
                                    this->iso_path,
-                                   JOB_COPY);
+                                   job);
+    this->worker->manifest = &this->manifest;
+    this->worker->verify = ui->verifyCheck->isChecked();
+    this->worker->zeros = ui->zerosCheck->isChecked();
+    this->worker->incremental = ui->incrementalCheck->isChecked();
+    this->worker->fat_cache = ui->fatCacheCheck->isChecked();
+
+    /* Raw images and scanned ISOs can go to every listed stick
+       in one go */
+
+    if (ui->allDevicesCheck->isChecked() && this->discovered > 1) {
+        this->worker->set_targets(this->devices, this->discovered);
+    }
+
     this->worker->start();
 
 }
@@ -114,12 +143,6 @@ void RufusWindow::setupUi()
     this->box->setObjectName(QStringLiteral("deviceCombo"));
     this->ui->horizontalLayout->addWidget(box);
 
-    /* Set up logptr in log.h so that
-     * we can access the logger from C
-     * source files */
-
-    logptr = this->log;
-
     r_printf("*** Rufus version %s\n*** mkfs.fat version %s\n", RUFUSL_VERSION, MKFS_VERSION);
 
     /* Add items to 'Cluster size' field */
@@ -138,6 +161,7 @@ void RufusWindow::setupUi()
 
     this->ui->fsCombo->addItem(FS_FAT32_LABEL);
     this->ui->fsCombo->addItem(FS_NTFS_LABEL);
+    this->ui->fsCombo->addItem(FS_EXFAT_LABEL);
     this->ui->fsCombo->setEnabled(false);
 
     /* Add items to partition table items */
@@ -183,23 +207,121 @@ void RufusWindow::scan() {
 
   /* Format device names and add to combo box */
 
+  for (int i = 0; i < this->discovered; i++) {
+
+    r_printf("Found %s, major: %d, minor: %d\n", describe(&devices[i]).toUtf8().constData(),
+             devices[i].major, devices[i].minor);
+
+    this->box->addItem(describe(&devices[i]));
+
+  }
+}
+
+QString RufusWindow::describe(const Device *dev) {
+
   char buf[255];
 
+  int len = snprintf(buf, sizeof(buf), "%s %s (%s) [%.1lf GB]", dev->vendor,
+                     dev->model, dev->device, dev->capacity * 512 / 1000000000.0f);
+
+  /* What the USB link gives in practice, the stick itself
+     may well be slower */
+
+  if (dev->profile.est_speed > 0 && len > 0 && len < (int) sizeof(buf)) {
+    snprintf(buf + len, sizeof(buf) - len, " ~%u MB/s", dev->profile.est_speed);
+  }
+
+  return QString(buf);
+}
+
+/* After the one scan at startup the device list is kept up to
+   date from kernel uevents, so opening the dropdown costs
+   nothing. Without the socket it goes back to scanning on every
+   popup. */
+
+void RufusWindow::startMonitor() {
+
+  if ((this->uevent_fd = uevent_open()) < 0) {
+    r_printf("Device monitor unavailable (%s), rescanning on every popup\n", strerror(errno));
+    return;
+  }
+
+  this->device_monitor = new QSocketNotifier(this->uevent_fd, QSocketNotifier::Read, this);
+  connect(this->device_monitor, SIGNAL(activated(int)), this, SLOT(on_uevent()));
+}
+
+bool RufusWindow::monitored() const {
+  return this->device_monitor != NULL;
+}
+
+int RufusWindow::findDevice(const char *name) {
+
   for (int i = 0; i < this->discovered; i++) {
+    if (strcmp(this->devices[i].device, name) == 0) return i;
+  }
+
+  return -1;
+}
+
+void RufusWindow::removeDevice(int index) {
+
+  r_printf("Removed %s\n", this->devices[index].device);
+
+  memmove(&this->devices[index], &this->devices[index + 1],
+          (this->discovered - index - 1) * sizeof(Device));
+
+  this->discovered--;
+  this->box->removeItem(index);
+}
 
-    snprintf(buf, sizeof(buf), "%s %s (%s) [%.1lf GB]", devices[i].vendor,
-             devices[i].model, devices[i].device, devices[i].capacity * 512 / 1000000000.0f);
+void RufusWindow::on_uevent() {
 
-    r_printf("Found %s, major: %d, minor: %d\n", buf, devices[i].major, devices[i].minor);
+  uevent_t ev;
+  Device dev;
+  int ret;
 
-    this->box->addItem(buf);
+  while ((ret = uevent_read(this->uevent_fd, &ev)) >= 0) {
 
-    if (memset(buf, 0, sizeof(buf)) == NULL) return;
+    if (ret == 0) continue;
 
+    int index = findDevice(ev.name);
+
+    if (ev.action == UEVENT_REMOVE) {
+      if (index >= 0) removeDevice(index);
+      continue;
+    }
+
+    /* Added or changed, a card reader that got a card for
+       instance. Probe it again, it may have stopped being
+       something we can write to. */
+
+    memset(&dev, 0, sizeof(dev));
+
+    if (probe_device(ev.name, &dev) != 1) {
+      if (index >= 0) removeDevice(index);
+      continue;
+    }
+
+    if (index >= 0) {
+      this->devices[index] = dev;
+      this->box->setItemText(index, describe(&dev));
+    } else if (this->discovered < MAX_DEVICES) {
+      this->devices[this->discovered++] = dev;
+      this->box->addItem(describe(&dev));
+      r_printf("Found %s, major: %d, minor: %d\n", describe(&dev).toUtf8().constData(),
+               dev.major, dev.minor);
+    }
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    r_printf("Device monitor failed: %s\n", strerror(errno));
   }
 }
 
 RufusWindow::~RufusWindow() {
+  delete device_monitor;
+  if (uevent_fd >= 0) close(uevent_fd);
+  iso_manifest_free(&this->manifest);
   delete box;
   delete log;
   delete ui;
@@ -211,7 +333,17 @@ void RufusWindow::on_usingSearch_clicked()
     this->iso_path = new QString(file_dialog->getOpenFileName());
     file_dialog->close();
     if (this->iso_path->size() == 0) return;
+
+    /* Raw images get written as-is, there is nothing to scan */
+
+    if (ui->sourceCombo->currentIndex() == SRC_DD) return;
+
     this->worker = new RufusWorker(NULL, 0xFF, 0xFF, 0xFF, 0xFF, this->iso_path, JOB_SCAN);
+    this->worker->manifest = &this->manifest;
+    this->worker->verify = ui->verifyCheck->isChecked();
+    this->worker->zeros = ui->zerosCheck->isChecked();
+    this->worker->incremental = ui->incrementalCheck->isChecked();
+    this->worker->fat_cache = ui->fatCacheCheck->isChecked();
     this->worker->start();
 
     // RufusWorker scan_iso() ...
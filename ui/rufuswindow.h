@@ -3,6 +3,7 @@
 
 #include <QMainWindow>
 #include <QFileDialog>
+#include <QSocketNotifier>
 
 extern "C" {
 
@@ -34,6 +35,7 @@ public:
     explicit RufusWindow(QWidget *parent = 0);
     QString *iso_path;
     void scan();
+    bool monitored() const;
     ~RufusWindow();
 
 
@@ -46,6 +48,7 @@ private slots:
     void setProgress(int);
 
     void on_usingSearch_clicked();
+    void on_uevent();
 
 private:
 
@@ -55,11 +58,18 @@ private:
     Device devices[MAX_DEVICES];
     uint8_t discovered = 0;
     DeviceComboBox *box;
-    RufusWorker *worker;
+    RufusWorker *worker = NULL;
     ErrorDialog *dialog;
     QFileDialog *file_dialog;
+    iso_manifest_t manifest;
+    int uevent_fd = -1;
+    QSocketNotifier *device_monitor = NULL;
 
     void setupUi();
+    void startMonitor();
+    int findDevice(const char *name);
+    void removeDevice(int index);
+    QString describe(const Device *dev);
 
     signals:
         void log_write(char *);